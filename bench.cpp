@@ -0,0 +1,835 @@
+#include "bench.h"
+#include "ring_buffer.h"
+#include "converter_standard.h"
+#include "converter_abr.h"
+#include "converter_hls.h"
+#include "media_probe.h"
+#include "resource_usage.h"
+#include "trace.h"
+#include "logger.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct QueueResult {
+    double ns_per_item = 0;
+    uint64_t stalls = 0;
+    bool intact = true;         // every item arrived exactly once
+};
+
+// Producers push disjoint ranges of values; the checksum of what the
+// consumers pop proves nothing was lost or duplicated
+template <typename Queue>
+QueueResult measure(Queue& queue, size_t items, size_t producers, size_t consumers) {
+    size_t per_producer = items / producers;
+    size_t total = per_producer * producers;
+    std::atomic<uint64_t> sum{0};
+
+    auto begin = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> producer_threads;
+    for (size_t p = 0; p < producers; p++) {
+        producer_threads.emplace_back([&queue, p, per_producer] {
+            for (size_t i = 0; i < per_producer; i++) {
+                uintptr_t value = p * per_producer + i;
+                queue.push(value);
+            }
+        });
+    }
+    std::vector<std::thread> consumer_threads;
+    for (size_t c = 0; c < consumers; c++) {
+        consumer_threads.emplace_back([&queue, &sum] {
+            uint64_t local = 0;
+            uintptr_t value;
+            while (queue.pop(value)) {
+                local += value;
+            }
+            sum += local;
+        });
+    }
+
+    for (std::thread& thread : producer_threads) {
+        thread.join();
+    }
+    queue.close();
+    for (std::thread& thread : consumer_threads) {
+        thread.join();
+    }
+
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin);
+
+    QueueResult result;
+    result.ns_per_item = elapsed.count() / total;
+    result.stalls = queue.producerStalls();
+    result.intact = sum.load() == static_cast<uint64_t>(total) * (total - 1) / 2;
+    return result;
+}
+
+// What the rings replace: a deque behind one mutex and two condition variables
+class LockedQueue {
+public:
+    explicit LockedQueue(size_t capacity) : limit(capacity) {}
+
+    bool push(uintptr_t value) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (items.size() >= limit) {
+            stalls++;
+            not_full.wait(lock, [this] { return items.size() < limit || closed; });
+        }
+        if (closed) {
+            return false;
+        }
+        items.push_back(value);
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(uintptr_t& value) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        value = items.front();
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    uint64_t producerStalls() const { return stalls; }
+
+private:
+    std::deque<uintptr_t> items;
+    size_t limit;
+    uint64_t stalls = 0;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+void printResult(const std::string& queue, size_t producers, size_t consumers, const char* policy,
+                 const QueueResult& result) {
+    std::cout << "  " << std::left << std::setw(8) << queue
+              << std::setw(6) << (std::to_string(producers) + "x" + std::to_string(consumers))
+              << std::setw(7) << policy
+              << std::right << std::fixed << std::setprecision(1) << std::setw(9) << result.ns_per_item
+              << " ns/item  " << result.stalls << " stalls"
+              << (result.intact ? "" : "  ITEMS LOST") << "\n";
+}
+
+} // namespace
+
+int runQueueBenchmark(size_t items, size_t capacity) {
+    size_t cores = std::max(2u, std::thread::hardware_concurrency());
+    size_t fan = std::min<size_t>(4, cores / 2);
+    bool intact = true;
+
+    std::cout << "Queue hand-off: " << items << " items, capacity " << ringCapacity(capacity)
+              << ", " << cores << " cores\n";
+
+    for (WaitPolicy policy : {WaitPolicy::Block, WaitPolicy::Spin}) {
+        const char* name = policy == WaitPolicy::Block ? "block" : "spin";
+        {
+            SpscRing<uintptr_t> ring(capacity, policy);
+            QueueResult result = measure(ring, items, 1, 1);
+            printResult("spsc", 1, 1, name, result);
+            intact = intact && result.intact;
+        }
+        if (fan > 1) {
+            // Fan-in, as several rungs feeding one stage
+            MpmcRing<uintptr_t> ring(capacity, policy);
+            QueueResult result = measure(ring, items, fan, 1);
+            printResult("mpmc", fan, 1, name, result);
+            intact = intact && result.intact;
+        }
+        {
+            MpmcRing<uintptr_t> ring(capacity, policy);
+            QueueResult result = measure(ring, items, fan, fan);
+            printResult("mpmc", fan, fan, name, result);
+            intact = intact && result.intact;
+        }
+    }
+
+    LockedQueue locked(ringCapacity(capacity));
+    QueueResult result = measure(locked, items, 1, 1);
+    printResult("mutex", 1, 1, "block", result);
+    intact = intact && result.intact;
+
+    return intact ? 0 : 1;
+}
+
+// ---------------------------------------------------------------------------
+// Pipelines
+
+namespace {
+
+// Stages that took less than this in the baseline are reported but never
+// fail the gate; their relative noise is too large
+const double STAGE_GATE_SECONDS = 0.05;
+
+// Samples of one pipeline by metric, one per run. Stages have wall and
+// thread CPU seconds only: they share one process, so peak RSS is a
+// property of the whole run.
+struct PipelineSamples {
+    std::map<std::string, std::vector<double>> metrics;
+    std::map<std::string, std::vector<double>> stages;
+    std::map<std::string, std::vector<double>> stage_cpu;
+};
+
+struct BenchResults {
+    std::string input;
+    int cores = 0;
+    int runs = 0;
+    std::map<std::string, PipelineSamples> pipelines;
+};
+
+struct MetricInfo {
+    const char* key;
+    const char* label;
+    double scale;               // stored value to shown value
+    bool higher_is_better;
+};
+
+const MetricInfo PIPELINE_METRICS[] = {
+    {"fps", "fps", 1, true},
+    {"wall_seconds", "wall seconds", 1, false},
+    {"cpu_seconds", "CPU seconds", 1, false},
+    {"peak_rss_bytes", "peak RSS MB", 1.0 / 1048576, false},
+};
+
+// Just enough JSON to read back the baselines written below
+struct JsonValue {
+    enum Type { Null, Number, String, Array, Object } type = Null;
+    double number = 0;
+    std::string text;
+    std::vector<JsonValue> items;
+    std::map<std::string, JsonValue> members;
+};
+
+class JsonReader {
+public:
+    explicit JsonReader(const std::string& text) : text(text) {}
+
+    bool parse(JsonValue& value) {
+        if (!parseValue(value)) {
+            return false;
+        }
+        skipSpace();
+        return pos == text.size();
+    }
+
+private:
+    const std::string& text;
+    size_t pos = 0;
+
+    void skipSpace() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+    }
+
+    bool expect(char c) {
+        skipSpace();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseString(std::string& out) {
+        if (!expect('"')) {
+            return false;
+        }
+        while (pos < text.size()) {
+            char c = text[pos++];
+            if (c == '"') {
+                return true;
+            }
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size()) {
+                return false;
+            }
+            char escaped = text[pos++];
+            switch (escaped) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'u':
+                    // Only control characters are written escaped
+                    if (pos + 4 > text.size()) {
+                        return false;
+                    }
+                    out += static_cast<char>(std::strtol(text.substr(pos, 4).c_str(), nullptr, 16) & 0x7f);
+                    pos += 4;
+                    break;
+                default: out += escaped; break;
+            }
+        }
+        return false;
+    }
+
+    bool parseValue(JsonValue& value) {
+        skipSpace();
+        if (pos >= text.size()) {
+            return false;
+        }
+        char c = text[pos];
+        if (c == '{') {
+            pos++;
+            value.type = JsonValue::Object;
+            if (expect('}')) {
+                return true;
+            }
+            do {
+                std::string key;
+                if (!parseString(key) || !expect(':') || !parseValue(value.members[key])) {
+                    return false;
+                }
+            } while (expect(','));
+            return expect('}');
+        }
+        if (c == '[') {
+            pos++;
+            value.type = JsonValue::Array;
+            if (expect(']')) {
+                return true;
+            }
+            do {
+                value.items.emplace_back();
+                if (!parseValue(value.items.back())) {
+                    return false;
+                }
+            } while (expect(','));
+            return expect(']');
+        }
+        if (c == '"') {
+            value.type = JsonValue::String;
+            return parseString(value.text);
+        }
+        if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+            return true;
+        }
+        const char* start = text.c_str() + pos;
+        char* end = nullptr;
+        value.number = std::strtod(start, &end);
+        if (end == start) {
+            return false;
+        }
+        value.type = JsonValue::Number;
+        pos += end - start;
+        return true;
+    }
+};
+
+void appendSamples(std::string& out, const std::map<std::string, std::vector<double>>& samples,
+                   const char* indent) {
+    bool first = true;
+    for (const auto& metric : samples) {
+        out += first ? "\n" : ",\n";
+        first = false;
+        out += indent;
+        appendJsonString(out, metric.first);
+        out += ": [";
+        for (size_t i = 0; i < metric.second.size(); i++) {
+            char number[32];
+            snprintf(number, sizeof(number), "%s%.9g", i ? ", " : "", metric.second[i]);
+            out += number;
+        }
+        out += "]";
+    }
+}
+
+bool saveResults(const std::string& path, const BenchResults& results, std::string& error) {
+    std::string out = "{\n  \"input\": ";
+    appendJsonString(out, results.input);
+    out += ",\n  \"cores\": " + std::to_string(results.cores);
+    out += ",\n  \"runs\": " + std::to_string(results.runs);
+    out += ",\n  \"pipelines\": {";
+    bool first = true;
+    for (const auto& pipeline : results.pipelines) {
+        out += first ? "\n    " : ",\n    ";
+        first = false;
+        appendJsonString(out, pipeline.first);
+        out += ": {\n      \"metrics\": {";
+        appendSamples(out, pipeline.second.metrics, "        ");
+        out += "\n      },\n      \"stages\": {";
+        appendSamples(out, pipeline.second.stages, "        ");
+        out += "\n      },\n      \"stage_cpu\": {";
+        appendSamples(out, pipeline.second.stage_cpu, "        ");
+        out += "\n      }\n    }";
+    }
+    out += "\n  }\n}\n";
+
+    std::ofstream file(path, std::ios::trunc);
+    file << out;
+    file.close();
+    if (!file) {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+void readSamples(const JsonValue& object, std::map<std::string, std::vector<double>>& samples) {
+    for (const auto& metric : object.members) {
+        for (const auto& item : metric.second.items) {
+            if (item.type == JsonValue::Number) {
+                samples[metric.first].push_back(item.number);
+            }
+        }
+    }
+}
+
+bool loadResults(const std::string& path, BenchResults& results, std::string& error) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        error = "cannot open " + path;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    JsonValue root;
+    if (!JsonReader(text).parse(root) || root.type != JsonValue::Object) {
+        error = path + " is not a benchmark baseline";
+        return false;
+    }
+
+    results.input = root.members["input"].text;
+    results.cores = static_cast<int>(root.members["cores"].number);
+    results.runs = static_cast<int>(root.members["runs"].number);
+    for (const auto& pipeline : root.members["pipelines"].members) {
+        PipelineSamples& samples = results.pipelines[pipeline.first];
+        auto metrics = pipeline.second.members.find("metrics");
+        if (metrics != pipeline.second.members.end()) {
+            readSamples(metrics->second, samples.metrics);
+        }
+        auto stages = pipeline.second.members.find("stages");
+        if (stages != pipeline.second.members.end()) {
+            readSamples(stages->second, samples.stages);
+        }
+        auto stage_cpu = pipeline.second.members.find("stage_cpu");
+        if (stage_cpu != pipeline.second.members.end()) {
+            readSamples(stage_cpu->second, samples.stage_cpu);
+        }
+    }
+    return true;
+}
+
+struct Summary {
+    double mean = 0;
+    double variance = 0;        // of the samples, n - 1 in the denominator
+    size_t n = 0;
+};
+
+Summary summarize(const std::vector<double>& samples) {
+    Summary summary;
+    summary.n = samples.size();
+    for (double sample : samples) {
+        summary.mean += sample;
+    }
+    if (summary.n > 0) {
+        summary.mean /= summary.n;
+    }
+    if (summary.n > 1) {
+        for (double sample : samples) {
+            summary.variance += (sample - summary.mean) * (sample - summary.mean);
+        }
+        summary.variance /= summary.n - 1;
+    }
+    return summary;
+}
+
+// Two-sided 95% quantile of Student's t. Fractional degrees of freedom
+// round down, which widens the interval.
+double tCritical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (df < 1) {
+        df = 1;
+    }
+    if (df <= 30) {
+        return table[static_cast<int>(df) - 1];
+    }
+    return 1.96 + 2.4 / df;
+}
+
+// Half width of the 95% interval of the mean
+double meanInterval(const Summary& summary) {
+    if (summary.n < 2) {
+        return 0;
+    }
+    return tCritical(summary.n - 1) * std::sqrt(summary.variance / summary.n);
+}
+
+// Change of the mean in percent of the baseline, with Welch's 95% interval
+struct Change {
+    double percent = 0;
+    double low = 0;
+    double high = 0;
+};
+
+Change compareMeans(const Summary& base, const Summary& now) {
+    double base_error = base.variance / std::max<size_t>(base.n, 1);
+    double now_error = now.variance / std::max<size_t>(now.n, 1);
+    double standard_error = std::sqrt(base_error + now_error);
+
+    double half = 0;
+    if (standard_error > 0) {
+        double denominator = (base.n > 1 ? base_error * base_error / (base.n - 1) : 0) +
+                             (now.n > 1 ? now_error * now_error / (now.n - 1) : 0);
+        double df = denominator > 0 ? std::pow(base_error + now_error, 2) / denominator : 1;
+        half = tCritical(df) * standard_error;
+    }
+
+    double difference = now.mean - base.mean;
+    Change change;
+    change.percent = difference / base.mean * 100;
+    change.low = (difference - half) / base.mean * 100;
+    change.high = (difference + half) / base.mean * 100;
+    return change;
+}
+
+std::string formatMean(const Summary& summary, double scale) {
+    std::ostringstream text;
+    double mean = summary.mean * scale;
+    int precision = mean >= 100 ? 0 : mean >= 10 ? 1 : mean >= 1 ? 2 : 3;
+    text << std::fixed << std::setprecision(precision) << mean;
+    if (summary.n > 1) {
+        text << " ± " << meanInterval(summary) * scale;
+    }
+    return text.str();
+}
+
+// One report line; true when the metric regressed beyond the threshold
+bool reportMetric(const std::string& label, const std::vector<double>& samples, const std::vector<double>* baseline,
+                  double scale, bool higher_is_better, bool gated, double threshold) {
+    Summary now = summarize(samples);
+    std::cout << "  " << std::left << std::setw(26) << label << std::right;
+    if (!baseline || baseline->empty()) {
+        std::cout << std::setw(18) << formatMean(now, scale) << "\n";
+        return false;
+    }
+
+    Summary base = summarize(*baseline);
+    std::cout << std::setw(18) << formatMean(base, scale) << std::setw(18) << formatMean(now, scale);
+    if (base.mean <= 0) {
+        std::cout << "\n";
+        return false;
+    }
+
+    Change change = compareMeans(base, now);
+    char text[64];
+    if (base.n < 2 || now.n < 2) {
+        // One run has no spread, so any noise would pass for a change
+        snprintf(text, sizeof(text), "  %+6.1f%% (too few runs, not gated)", change.percent);
+        std::cout << text << "\n";
+        return false;
+    }
+    snprintf(text, sizeof(text), "  %+6.1f%% [%+.1f, %+.1f]", change.percent, change.low, change.high);
+    std::cout << text;
+
+    // Regressed only when even the most favourable end of the interval is
+    // worse than the threshold
+    double best_case = higher_is_better ? -change.high : change.low;
+    bool regressed = gated && best_case > threshold;
+    std::cout << (regressed ? "  REGRESSION" : "") << "\n";
+    return regressed;
+}
+
+int convertPipeline(const std::string& pipeline, const std::string& input, const fs::path& output,
+                    const ConvertOptions& options) {
+    if (pipeline == "standard") {
+        return convert_standard(input, (output / "standard.mp4").string(), options);
+    }
+    if (pipeline == "abr") {
+        return convert_abr(input, (output / "abr.mp4").string(), "all", options);
+    }
+    return convert_hls(input, (output / "hls").string(), options);
+}
+
+// One conversion in a child process of its own, so CPU time and peak RSS
+// from wait4() belong to this run alone, ffmpeg children included. Only
+// stage spans are traced, a few per run, so the hot path runs as in
+// production. The child sends the wall and CPU seconds of each stage back
+// through a pipe.
+bool runPipelineOnce(const std::string& pipeline, const std::string& input, const fs::path& output, bool verbose,
+                     PipelineSamples& samples, double frames, std::string& error) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        error = "cannot create a pipe";
+        return false;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    pid_t child = fork();
+    if (child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        error = "cannot fork";
+        return false;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        TraceSession trace(pipeline, TRACE_STAGES);
+        ConvertOptions options;
+        options.trace = &trace;
+        int result = convertPipeline(pipeline, input, output, options);
+
+        // "name <tab> wall <tab> cpu", cpu empty when not measured
+        std::map<std::string, double> cpu = trace.stageCpuSeconds();
+        std::string stages;
+        for (const auto& stage : trace.stageSeconds()) {
+            auto measured = cpu.find(stage.first);
+            stages += stage.first + "\t" + std::to_string(stage.second) + "\t" +
+                      (measured != cpu.end() ? std::to_string(measured->second) : "") + "\n";
+        }
+        for (size_t sent = 0; sent < stages.size();) {
+            ssize_t wrote = write(fds[1], stages.data() + sent, stages.size() - sent);
+            if (wrote <= 0) {
+                break;
+            }
+            sent += wrote;
+        }
+        std::cout.flush();
+        _exit(result == 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    std::string stages;
+    char buffer[4096];
+    while (true) {
+        ssize_t got = read(fds[0], buffer, sizeof(buffer));
+        if (got > 0) {
+            stages.append(buffer, got);
+        } else if (got == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage resources;
+    while (wait4(child, &status, 0, &resources) < 0 && errno == EINTR) {
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        error = pipeline + " conversion failed";
+        return false;
+    }
+
+    ResourceUsage usage = childUsage(resources);
+    samples.metrics["wall_seconds"].push_back(wall);
+    samples.metrics["cpu_seconds"].push_back(usage.cpuSeconds());
+    samples.metrics["peak_rss_bytes"].push_back(static_cast<double>(usage.peak_rss));
+    if (frames > 0) {
+        samples.metrics["fps"].push_back(frames / wall);
+    }
+
+    std::istringstream lines(stages);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t tab = line.find('\t');
+        size_t cpu_tab = line.find('\t', tab + 1);
+        if (tab == std::string::npos || cpu_tab == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, tab);
+        samples.stages[name].push_back(std::atof(line.c_str() + tab + 1));
+        if (cpu_tab + 1 < line.size()) {
+            samples.stage_cpu[name].push_back(std::atof(line.c_str() + cpu_tab + 1));
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int runPipelineBenchmark(const PipelineBenchOptions& options) {
+    for (const auto& pipeline : options.pipelines) {
+        if (pipeline != "standard" && pipeline != "abr" && pipeline != "hls") {
+            std::cerr << "Error: Unknown pipeline '" << pipeline << "' (standard, abr, hls)\n";
+            return 1;
+        }
+    }
+
+    BenchResults baseline;
+    if (!options.baseline.empty()) {
+        std::string error;
+        if (!loadResults(options.baseline, baseline, error)) {
+            std::cerr << "Error: " << error << "\n";
+            return 1;
+        }
+    }
+
+    fs::path work = fs::temp_directory_path() / ("radiumvod-bench-" + std::to_string(getpid()));
+    std::error_code ec;
+    fs::create_directories(work, ec);
+    if (ec) {
+        std::cerr << "Error: Cannot create " << work << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    BenchResults results;
+    results.cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    results.runs = options.runs;
+    std::string input = options.input;
+    if (input.empty()) {
+        // The same seed every time, so baselines stay comparable
+        input = (work / "clip.mp4").string();
+        std::string error;
+        if (!synthesizeClip(input, options.clip, error)) {
+            std::cerr << "Error: Cannot synthesize the input: " << error << "\n";
+            fs::remove_all(work, ec);
+            return 1;
+        }
+        results.input = "synthetic " + std::to_string(options.clip.width) + "x" + std::to_string(options.clip.height) +
+                        " " + std::to_string(static_cast<int>(options.clip.seconds)) + " s";
+    } else {
+        results.input = fs::path(input).filename().string();
+    }
+
+    MediaInfo info;
+    std::string probe_error;
+    double frames = 0;
+    if (probeMedia(input, info, probe_error)) {
+        frames = info.duration * info.frame_rate;
+    } else {
+        std::cerr << "Warning: Cannot probe the input (" << probe_error << "), fps is not reported\n";
+    }
+
+    if (!options.baseline.empty() && (options.runs < 2 || baseline.runs < 2)) {
+        std::cout << "Warning: Comparing needs at least 2 runs on both sides; changes are shown but not gated\n";
+    }
+    std::cout << "Pipelines: " << options.runs << " runs each on " << results.input << ", " << results.cores
+              << " cores\n";
+    if (!options.baseline.empty() && (baseline.input != results.input || baseline.cores != results.cores)) {
+        std::cout << "Warning: The baseline ran on " << baseline.input << " with " << baseline.cores
+                  << " cores; the comparison may not be meaningful\n";
+    }
+
+    // Pipelines take turns, so drift in machine load spreads over all of them
+    for (int run = 1; run <= options.runs; run++) {
+        for (const auto& pipeline : options.pipelines) {
+            std::cout << "  run " << run << "/" << options.runs << " " << pipeline << "..." << std::flush;
+            fs::path output = work / "output";
+            fs::create_directories(output, ec);
+            std::string error;
+            PipelineSamples& samples = results.pipelines[pipeline];
+            bool ran = runPipelineOnce(pipeline, input, output, options.verbose, samples, frames, error);
+            fs::remove_all(output, ec);
+            if (!ran) {
+                std::cout << "\n";
+                std::cerr << "Error: " << error << "\n";
+                fs::remove_all(work, ec);
+                return 1;
+            }
+            std::cout << " " << std::fixed << std::setprecision(1) << samples.metrics["wall_seconds"].back()
+                      << " s\n";
+        }
+    }
+    fs::remove_all(work, ec);
+
+    bool regressed = false;
+    for (const auto& pipeline : options.pipelines) {
+        const PipelineSamples& samples = results.pipelines[pipeline];
+        const PipelineSamples* base = nullptr;
+        auto found = baseline.pipelines.find(pipeline);
+        if (found != baseline.pipelines.end()) {
+            base = &found->second;
+        }
+
+        std::cout << "\n" << pipeline;
+        if (base) {
+            std::cout << std::string(pipeline.size() < 28 ? 28 - pipeline.size() : 1, ' ') << std::setw(18)
+                      << "baseline" << std::setw(18) << "current" << "  change [95% interval]";
+        }
+        std::cout << "\n";
+
+        for (const MetricInfo& metric : PIPELINE_METRICS) {
+            auto now = samples.metrics.find(metric.key);
+            if (now == samples.metrics.end()) {
+                continue;
+            }
+            const std::vector<double>* before = nullptr;
+            if (base && base->metrics.count(metric.key)) {
+                before = &base->metrics.at(metric.key);
+            }
+            regressed |= reportMetric(metric.label, now->second, before, metric.scale, metric.higher_is_better,
+                                      true, options.threshold);
+        }
+        auto reportStages = [&](const std::map<std::string, std::vector<double>>& stages,
+                                std::map<std::string, std::vector<double>> PipelineSamples::*field, const char* unit) {
+            for (const auto& stage : stages) {
+                const std::vector<double>* before = nullptr;
+                if (base && (base->*field).count(stage.first)) {
+                    before = &(base->*field).at(stage.first);
+                }
+                bool gated = before && summarize(*before).mean >= STAGE_GATE_SECONDS;
+                regressed |= reportMetric(stage.first + unit, stage.second, before, 1, false, gated,
+                                          options.threshold);
+            }
+        };
+        reportStages(samples.stages, &PipelineSamples::stages, " s");
+        reportStages(samples.stage_cpu, &PipelineSamples::stage_cpu, " CPU s");
+    }
+
+    if (!options.save.empty()) {
+        std::string error;
+        if (saveResults(options.save, results, error)) {
+            std::cout << "\nBaseline written: " << options.save << "\n";
+        } else {
+            std::cerr << "Error: " << error << "\n";
+            return 1;
+        }
+    }
+
+    if (regressed) {
+        std::cout << "\nRegression beyond " << options.threshold << "% against " << options.baseline << "\n";
+        return 2;
+    }
+    return 0;
+}
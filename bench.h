@@ -0,0 +1,34 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "synthetic_clip.h"
+
+// Measures the cost of handing one item from a producer thread to a
+// consumer through SpscRing and MpmcRing, under both wait policies, next to
+// a mutex-guarded deque. Prints nanoseconds per hand-off; returns the
+// process exit code.
+int runQueueBenchmark(size_t items, size_t capacity);
+
+struct PipelineBenchOptions {
+    std::vector<std::string> pipelines = {"standard", "abr", "hls"};
+    std::string input;          // a synthetic clip when empty
+    ClipSpec clip;
+    int runs = 5;
+    std::string baseline;       // compared against when set
+    std::string save;           // the samples are written here as a new baseline
+    double threshold = 5;       // percent a metric may get worse
+    bool verbose = false;       // show the converters' output
+};
+
+// Runs the standard converter, the ABR ladder and the HLS packager on the
+// same input several times, each run in a child process of its own, and
+// reports fps, CPU seconds, peak RSS and the seconds spent in each traced
+// stage. Against a baseline, a metric regresses when the 95% confidence
+// interval of its change lies entirely beyond the threshold. Returns 0, 1
+// when a run failed and 2 on a regression.
+int runPipelineBenchmark(const PipelineBenchOptions& options);
+
+#endif // BENCH_H
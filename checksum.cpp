@@ -0,0 +1,656 @@
+#include "checksum.h"
+#include "executor.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <iterator>
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/md5.h>
+#include <libavutil/sha.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+}
+
+namespace fs = std::filesystem;
+
+// Large enough that the size fields muxers patch after a fragment stay in
+// the buffer instead of reaching the hashed stream twice
+const int HASHED_IO_BUFFER_SIZE = 256 * 1024;
+
+const size_t HASH_FILE_CHUNK = 1 << 20;
+
+const std::chrono::milliseconds SEGMENT_POLL_INTERVAL(500);
+
+// ---------------------------------------------------------------------------
+// XXH3-64
+
+static const uint64_t PRIME32_1 = 0x9E3779B1U;
+static const uint64_t PRIME32_2 = 0x85EBCA77U;
+static const uint64_t PRIME32_3 = 0xC2B2AE3DU;
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static const uint64_t PRIME_MX1 = 0x165667919E3779F9ULL;
+static const uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+static const size_t SECRET_SIZE = 192;
+static const size_t STRIPE_LEN = 64;
+static const int STRIPES_PER_BLOCK = (SECRET_SIZE - STRIPE_LEN) / 8;
+
+alignas(64) static const uint8_t XXH3_SECRET[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+static inline uint64_t readLE64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t readLE32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+static inline uint64_t mul128Fold64(uint64_t a, uint64_t b) {
+    uint128_t product = static_cast<uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+static inline uint64_t xxh64Avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3Avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline uint64_t mix16(const uint8_t* input, const uint8_t* secret) {
+    return mul128Fold64(readLE64(input) ^ readLE64(secret),
+                        readLE64(input + 8) ^ readLE64(secret + 8));
+}
+
+// Inputs up to 240 bytes are hashed in one go from the stream buffer
+static uint64_t xxh3Short(const uint8_t* input, size_t len) {
+    const uint8_t* secret = XXH3_SECRET;
+
+    if (len == 0) {
+        return xxh64Avalanche(readLE64(secret + 56) ^ readLE64(secret + 64));
+    }
+    if (len <= 3) {
+        uint32_t combined = (static_cast<uint32_t>(input[0]) << 16) |
+                            (static_cast<uint32_t>(input[len >> 1]) << 24) |
+                            static_cast<uint32_t>(input[len - 1]) |
+                            (static_cast<uint32_t>(len) << 8);
+        uint64_t bitflip = readLE32(secret) ^ readLE32(secret + 4);
+        return xxh64Avalanche(combined ^ bitflip);
+    }
+    if (len <= 8) {
+        uint64_t bitflip = readLE64(secret + 8) ^ readLE64(secret + 16);
+        uint64_t input64 = readLE32(input + len - 4) + (static_cast<uint64_t>(readLE32(input)) << 32);
+        return rrmxmx(input64 ^ bitflip, len);
+    }
+    if (len <= 16) {
+        uint64_t low = readLE64(input) ^ (readLE64(secret + 24) ^ readLE64(secret + 32));
+        uint64_t high = readLE64(input + len - 8) ^ (readLE64(secret + 40) ^ readLE64(secret + 48));
+        uint64_t acc = len + __builtin_bswap64(low) + high + mul128Fold64(low, high);
+        return xxh3Avalanche(acc);
+    }
+    if (len <= 128) {
+        uint64_t acc = len * PRIME64_1;
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += mix16(input + 48, secret + 96);
+                    acc += mix16(input + len - 64, secret + 112);
+                }
+                acc += mix16(input + 32, secret + 64);
+                acc += mix16(input + len - 48, secret + 80);
+            }
+            acc += mix16(input + 16, secret + 32);
+            acc += mix16(input + len - 32, secret + 48);
+        }
+        acc += mix16(input, secret);
+        acc += mix16(input + len - 16, secret + 16);
+        return xxh3Avalanche(acc);
+    }
+
+    uint64_t acc = len * PRIME64_1;
+    size_t rounds = len / 16;
+    for (size_t i = 0; i < 8; i++) {
+        acc += mix16(input + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3Avalanche(acc);
+    for (size_t i = 8; i < rounds; i++) {
+        acc += mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += mix16(input + len - 16, secret + 136 - 17);
+    return xxh3Avalanche(acc);
+}
+
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+
+static inline v2u64 loadV2(const uint8_t* p) {
+    v2u64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// One 64-byte stripe: acc[i ^ 1] += data[i], acc[i] += lo32(key) * hi32(key)
+static inline void accumulateStripe(v2u64* acc, const uint8_t* input, const uint8_t* secret) {
+    const v2u64 low_mask = {0xFFFFFFFFULL, 0xFFFFFFFFULL};
+    const v2u64 swap = {1, 0};
+    for (int i = 0; i < 4; i++) {
+        v2u64 data = loadV2(input + 16 * i);
+        v2u64 key = data ^ loadV2(secret + 16 * i);
+        acc[i] += __builtin_shuffle(data, swap) + (key & low_mask) * (key >> 32);
+    }
+}
+
+static inline void scrambleAcc(v2u64* acc, const uint8_t* secret) {
+    const v2u64 prime = {PRIME32_1, PRIME32_1};
+    for (int i = 0; i < 4; i++) {
+        v2u64 a = acc[i];
+        a ^= a >> 47;
+        a ^= loadV2(secret + 16 * i);
+        acc[i] = a * prime;
+    }
+}
+
+void XXH3Hasher::reset() {
+    acc[0] = v2u64{PRIME32_3, PRIME64_1};
+    acc[1] = v2u64{PRIME64_2, PRIME64_3};
+    acc[2] = v2u64{PRIME64_4, PRIME32_2};
+    acc[3] = v2u64{PRIME64_5, PRIME32_1};
+    buffered = 0;
+    total_len = 0;
+    stripes_in_block = 0;
+}
+
+void XXH3Hasher::accumulate(v2u64* acc, int& stripes_in_block, const uint8_t* data, size_t stripes) {
+    for (size_t s = 0; s < stripes; s++) {
+        accumulateStripe(acc, data + s * STRIPE_LEN, XXH3_SECRET + 8 * stripes_in_block);
+        if (++stripes_in_block == STRIPES_PER_BLOCK) {
+            scrambleAcc(acc, XXH3_SECRET + SECRET_SIZE - STRIPE_LEN);
+            stripes_in_block = 0;
+        }
+    }
+}
+
+// Input is only consumed once more follows it, so the final stripe is
+// always still available to digest()
+void XXH3Hasher::update(const uint8_t* data, size_t len) {
+    total_len += len;
+
+    if (buffered + len <= sizeof(buffer)) {
+        memcpy(buffer + buffered, data, len);
+        buffered += len;
+        return;
+    }
+
+    if (buffered > 0) {
+        size_t fill = sizeof(buffer) - buffered;
+        memcpy(buffer + buffered, data, fill);
+        data += fill;
+        len -= fill;
+        accumulate(acc, stripes_in_block, buffer, sizeof(buffer) / STRIPE_LEN);
+        memcpy(last_stripe, buffer + sizeof(buffer) - STRIPE_LEN, STRIPE_LEN);
+        buffered = 0;
+    }
+
+    if (len > sizeof(buffer)) {
+        size_t stripes = (len - 1) / STRIPE_LEN;
+        accumulate(acc, stripes_in_block, data, stripes);
+        memcpy(last_stripe, data + (stripes - 1) * STRIPE_LEN, STRIPE_LEN);
+        data += stripes * STRIPE_LEN;
+        len -= stripes * STRIPE_LEN;
+    }
+
+    memcpy(buffer, data, len);
+    buffered = len;
+}
+
+uint64_t XXH3Hasher::digest() const {
+    if (total_len <= 240) {
+        return xxh3Short(buffer, total_len);
+    }
+
+    v2u64 final_acc[4] = {acc[0], acc[1], acc[2], acc[3]};
+    int stripes = stripes_in_block;
+    const uint8_t* last;
+    uint8_t joined[STRIPE_LEN];
+
+    if (buffered >= STRIPE_LEN) {
+        accumulate(final_acc, stripes, buffer, (buffered - 1) / STRIPE_LEN);
+        last = buffer + buffered - STRIPE_LEN;
+    } else {
+        size_t catchup = STRIPE_LEN - buffered;
+        memcpy(joined, last_stripe + STRIPE_LEN - catchup, catchup);
+        memcpy(joined + catchup, buffer, buffered);
+        last = joined;
+    }
+    accumulateStripe(final_acc, last, XXH3_SECRET + SECRET_SIZE - STRIPE_LEN - 7);
+
+    uint64_t lanes[8];
+    memcpy(lanes, final_acc, sizeof(lanes));
+    uint64_t result = total_len * PRIME64_1;
+    for (int i = 0; i < 4; i++) {
+        result += mul128Fold64(lanes[2 * i] ^ readLE64(XXH3_SECRET + 11 + 16 * i),
+                               lanes[2 * i + 1] ^ readLE64(XXH3_SECRET + 11 + 16 * i + 8));
+    }
+    return xxh3Avalanche(result);
+}
+
+// ---------------------------------------------------------------------------
+// StreamHasher
+
+static std::string toHex(const uint8_t* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0x0F];
+    }
+    return hex;
+}
+
+StreamHasher::StreamHasher() : md5(av_md5_alloc()), sha(av_sha_alloc()) {
+    reset();
+}
+
+StreamHasher::~StreamHasher() {
+    av_free(md5);
+    av_free(sha);
+}
+
+void StreamHasher::reset() {
+    av_md5_init(md5);
+    av_sha_init(sha, 256);
+    xxh3.reset();
+    size = 0;
+}
+
+void StreamHasher::update(const uint8_t* data, size_t len) {
+    av_md5_update(md5, data, len);
+    av_sha_update(sha, data, len);
+    xxh3.update(data, len);
+    size += len;
+}
+
+void StreamHasher::finish(FileChecksum& checksum) {
+    uint8_t digest[32];
+
+    av_md5_final(md5, digest);
+    checksum.md5 = toHex(digest, 16);
+
+    av_sha_final(sha, digest);
+    checksum.sha256 = toHex(digest, 32);
+
+    char xxh3_hex[17];
+    snprintf(xxh3_hex, sizeof(xxh3_hex), "%016llx", static_cast<unsigned long long>(xxh3.digest()));
+    checksum.xxh3 = xxh3_hex;
+
+    checksum.size = size;
+    reset();
+}
+
+// ---------------------------------------------------------------------------
+// Hashing output AVIOContext
+
+struct HashedOutput {
+    AVIOContext* file = nullptr;
+    StreamHasher hasher;
+    std::string path;
+    int64_t position = 0;   // where the muxer writes next
+    int64_t hashed = 0;     // bytes fed to the hasher, always a prefix of the file
+    bool rewritten = false;
+};
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+static int writeHashed(void* opaque, uint8_t* buf, int size) {
+#else
+static int writeHashed(void* opaque, const uint8_t* buf, int size) {
+#endif
+    HashedOutput* out = static_cast<HashedOutput*>(opaque);
+
+    if (out->position == out->hashed) {
+        out->hasher.update(buf, size);
+        out->hashed += size;
+    } else {
+        out->rewritten = true;
+    }
+
+    avio_write(out->file, buf, size);
+    out->position += size;
+    return out->file->error < 0 ? out->file->error : size;
+}
+
+static int64_t seekHashed(void* opaque, int64_t offset, int whence) {
+    HashedOutput* out = static_cast<HashedOutput*>(opaque);
+
+    if (whence & AVSEEK_SIZE) {
+        return avio_size(out->file);
+    }
+
+    int64_t position = avio_seek(out->file, offset, whence & ~AVSEEK_FORCE);
+    if (position >= 0) {
+        out->position = position;
+    }
+    return position;
+}
+
+int openHashedOutput(AVIOContext** pb, const std::string& path) {
+    HashedOutput* out = new HashedOutput;
+    out->path = path;
+
+    int ret = avio_open(&out->file, path.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        delete out;
+        return ret;
+    }
+
+    uint8_t* buffer = static_cast<uint8_t*>(av_malloc(HASHED_IO_BUFFER_SIZE));
+    *pb = buffer ? avio_alloc_context(buffer, HASHED_IO_BUFFER_SIZE, 1, out,
+                                      nullptr, writeHashed, seekHashed) : nullptr;
+    if (!*pb) {
+        av_free(buffer);
+        avio_closep(&out->file);
+        delete out;
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
+}
+
+bool closeHashedOutput(AVIOContext** pb, FileChecksum* checksum) {
+    if (!*pb) {
+        return true;
+    }
+    if ((*pb)->write_packet != writeHashed) {
+        return avio_closep(pb) >= 0;
+    }
+
+    avio_flush(*pb);
+    HashedOutput* out = static_cast<HashedOutput*>((*pb)->opaque);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+
+    bool success = avio_closep(&out->file) >= 0;
+    if (success && checksum) {
+        if (out->rewritten) {
+            success = hashFile(out->path, *checksum);
+        } else {
+            out->hasher.finish(*checksum);
+            checksum->path = out->path;
+        }
+    }
+
+    delete out;
+    return success;
+}
+
+// ---------------------------------------------------------------------------
+// Files and manifests
+
+bool hashFile(const std::string& path, FileChecksum& checksum) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Cannot open file for hashing: " << path << "\n";
+        return false;
+    }
+
+    StreamHasher hasher;
+    std::vector<char> chunk(HASH_FILE_CHUNK);
+    while (file) {
+        file.read(chunk.data(), chunk.size());
+        if (file.gcount() > 0) {
+            hasher.update(reinterpret_cast<const uint8_t*>(chunk.data()), file.gcount());
+        }
+    }
+    if (file.bad()) {
+        std::cerr << "Read error while hashing: " << path << "\n";
+        return false;
+    }
+
+    hasher.finish(checksum);
+    checksum.path = path;
+    return true;
+}
+
+bool hashBuffer(const std::string& data, FileChecksum& checksum) {
+    StreamHasher hasher;
+    hasher.update(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    hasher.finish(checksum);
+    return true;
+}
+
+bool writeManifest(const std::string& manifest_path, const std::vector<FileChecksum>& files) {
+    fs::path base = fs::path(manifest_path).parent_path();
+    if (base.empty()) {
+        base = ".";
+    }
+
+    std::ofstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        std::cerr << "Cannot write manifest: " << manifest_path << "\n";
+        return false;
+    }
+
+    manifest << "# size xxh3 md5 sha256 path\n";
+    for (const auto& file : files) {
+        std::error_code ec;
+        fs::path relative = fs::proximate(file.path, base, ec);
+        manifest << file.size << " " << file.xxh3 << " " << file.md5 << " " << file.sha256 << " "
+                 << (ec ? file.path : relative.generic_string()) << "\n";
+    }
+
+    return manifest.good();
+}
+
+bool readManifest(const std::string& manifest_path, std::vector<FileChecksum>& files) {
+    std::ifstream manifest(manifest_path);
+    if (!manifest.is_open()) {
+        return false;
+    }
+
+    std::string text((std::istreambuf_iterator<char>(manifest)), std::istreambuf_iterator<char>());
+    return parseManifest(text, files);
+}
+
+bool parseManifest(const std::string& text, std::vector<FileChecksum>& files) {
+    std::istringstream manifest(text);
+    std::string line;
+    while (std::getline(manifest, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        // The path is last and may contain spaces
+        std::istringstream fields(line);
+        FileChecksum file;
+        if (!(fields >> file.size >> file.xxh3 >> file.md5 >> file.sha256)) {
+            std::cerr << "Malformed manifest line: " << line << "\n";
+            return false;
+        }
+        std::getline(fields >> std::ws, file.path);
+        if (file.path.empty()) {
+            return false;
+        }
+        files.push_back(file);
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// SegmentHasher
+
+SegmentHasher::SegmentHasher(const std::string& root_dir, Executor* executor) : root(root_dir), executor(executor) {}
+
+SegmentHasher::~SegmentHasher() {
+    running = false;
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void SegmentHasher::addPlaylist(const std::string& relative_path) {
+    playlists.push_back(relative_path);
+}
+
+void SegmentHasher::start() {
+    running = true;
+    worker = std::thread([this]() {
+        while (running) {
+            poll(false);
+            auto wake = std::chrono::steady_clock::now() + SEGMENT_POLL_INTERVAL;
+            while (running && std::chrono::steady_clock::now() < wake) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
+    });
+}
+
+void SegmentHasher::stop() {
+    running = false;
+    if (worker.joinable()) {
+        worker.join();
+        early_segments = hashed.size();
+    }
+}
+
+std::vector<FileChecksum> SegmentHasher::finish() {
+    stop();
+    poll(true);
+    late_segments = hashed.size() - early_segments;
+    for (const auto& playlist : playlists) {
+        if (hashed.count((fs::path(root) / playlist).string())) {
+            late_segments--;
+        }
+    }
+
+    std::vector<FileChecksum> files;
+    files.reserve(hashed.size());
+    for (const auto& entry : hashed) {
+        files.push_back(entry.second);
+    }
+    return files;
+}
+
+ResourceUsage SegmentHasher::usage() {
+    std::lock_guard<std::mutex> lock(usage_mutex);
+    return hash_usage;
+}
+
+// Wall time is left out, as the poller and the tasks overlap
+void SegmentHasher::account(const ResourceUsage& usage) {
+    std::lock_guard<std::mutex> lock(usage_mutex);
+    ResourceUsage cost = usage;
+    cost.wall_seconds = 0;
+    hash_usage.add(cost);
+}
+
+// A segment is complete once a playlist lists it; playlists themselves are
+// rewritten after every segment and are only hashed in the final pass
+void SegmentHasher::poll(bool final_pass) {
+    ThreadMeter meter;
+    std::vector<std::string> files;
+    for (const auto& playlist : playlists) {
+        fs::path playlist_path = fs::path(root) / playlist;
+        std::ifstream file(playlist_path);
+        if (!file.is_open()) {
+            continue;
+        }
+
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+
+            std::string segment = (playlist_path.parent_path() / line).string();
+            if (!hashed.count(segment)) {
+                files.push_back(segment);
+            }
+        }
+
+        if (final_pass) {
+            files.push_back(playlist_path.string());
+        }
+    }
+
+    // Segments of different rungs finish together; they are hashed side by
+    // side. Each task meters itself, as the waiting thread may run some.
+    if (executor && files.size() > 1) {
+        account(meter.stop());
+        std::vector<std::future<FileChecksum>> pending;
+        for (const auto& path : files) {
+            pending.push_back(executor->submit([this, path] {
+                // The path stays empty when the file cannot be read
+                ThreadMeter meter;
+                FileChecksum checksum;
+                hashFile(path, checksum);
+                account(meter.stop());
+                return checksum;
+            }));
+        }
+        for (size_t i = 0; i < files.size(); i++) {
+            FileChecksum checksum = executor->wait(pending[i]);
+            if (!checksum.path.empty()) {
+                hashed[files[i]] = checksum;
+            }
+        }
+        return;
+    }
+
+    for (const auto& path : files) {
+        FileChecksum checksum;
+        if (hashFile(path, checksum)) {
+            hashed[path] = checksum;
+        }
+    }
+    account(meter.stop());
+}
@@ -0,0 +1,128 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include "resource_usage.h"
+
+struct AVIOContext;
+struct AVMD5;
+struct AVSHA;
+class Executor;
+
+struct FileChecksum {
+    std::string path;       // stored relative to the manifest directory
+    uint64_t size = 0;
+    std::string xxh3;       // XXH3-64, internal dedup and integrity
+    std::string md5;        // ADI Content_CheckSum
+    std::string sha256;
+};
+
+// Streaming XXH3-64 (seed 0, default secret). The stripe accumulator runs
+// two 64-bit lanes per vector.
+class XXH3Hasher {
+public:
+    XXH3Hasher() { reset(); }
+    void reset();
+    void update(const uint8_t* data, size_t len);
+    uint64_t digest() const;
+
+private:
+    typedef uint64_t v2u64 __attribute__((vector_size(16)));
+
+    v2u64 acc[4];
+    uint8_t buffer[256];
+    uint8_t last_stripe[64];    // tail of the previously consumed input
+    size_t buffered = 0;
+    uint64_t total_len = 0;
+    int stripes_in_block = 0;
+
+    static void accumulate(v2u64* acc, int& stripes_in_block, const uint8_t* data, size_t stripes);
+};
+
+// MD5, SHA-256 and XXH3 of one byte stream, fed in write order
+class StreamHasher {
+public:
+    StreamHasher();
+    ~StreamHasher();
+    StreamHasher(const StreamHasher&) = delete;
+    StreamHasher& operator=(const StreamHasher&) = delete;
+
+    void reset();
+    void update(const uint8_t* data, size_t len);
+    void finish(FileChecksum& checksum);
+
+private:
+    AVMD5* md5;
+    AVSHA* sha;
+    XXH3Hasher xxh3;
+    uint64_t size = 0;
+};
+
+// avio_open replacement whose output is hashed as the muxer writes it.
+// closeHashedOutput fills the checksum; if the muxer rewrote bytes that were
+// already hashed, the file is hashed again from disk. It also closes plain
+// avio_open contexts, leaving the checksum untouched.
+int openHashedOutput(AVIOContext** pb, const std::string& path);
+bool closeHashedOutput(AVIOContext** pb, FileChecksum* checksum);
+
+bool hashFile(const std::string& path, FileChecksum& checksum);
+bool hashBuffer(const std::string& data, FileChecksum& checksum);
+
+// One "size xxh3 md5 sha256 path" line per file
+bool writeManifest(const std::string& manifest_path, const std::vector<FileChecksum>& files);
+
+// Paths are returned as stored, relative to the manifest
+bool readManifest(const std::string& manifest_path, std::vector<FileChecksum>& files);
+bool parseManifest(const std::string& text, std::vector<FileChecksum>& files);
+
+// Hashes HLS segments written by an external ffmpeg as soon as a media
+// playlist lists them, while the encoder is still running and the data is
+// still in the page cache
+class SegmentHasher {
+public:
+    // Without an executor every file is hashed on the polling thread
+    explicit SegmentHasher(const std::string& root_dir, Executor* executor = nullptr);
+    ~SegmentHasher();
+
+    void addPlaylist(const std::string& relative_path);
+    void start();
+
+    // Stops polling once the encoder has exited. Optional; finish() stops
+    // it too, but whatever is hashed until then counts as early.
+    void stop();
+
+    // Stops polling and hashes everything left, including the playlists
+    std::vector<FileChecksum> finish();
+
+    // CPU time and I/O spent hashing, summed over the poller and the
+    // executor's workers
+    ResourceUsage usage();
+
+    // After finish(): segments hashed before stop(), while the encoder was
+    // running, and those the final pass had to read back from disk
+    size_t hashedEarly() const { return early_segments; }
+    size_t hashedLate() const { return late_segments; }
+
+private:
+    std::string root;
+    std::vector<std::string> playlists;
+    std::map<std::string, FileChecksum> hashed;
+    Executor* executor;
+    std::thread worker;
+    std::atomic<bool> running{false};
+    std::mutex usage_mutex;
+    ResourceUsage hash_usage;
+    size_t early_segments = 0;
+    size_t late_segments = 0;
+
+    void poll(bool final_pass);
+    void account(const ResourceUsage& usage);
+};
+
+#endif // CHECKSUM_H
@@ -0,0 +1,110 @@
+#include "child_process.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+ChildProcess::~ChildProcess() {
+    if (pid > 0) {
+        terminate();
+        std::string ignored;
+        wait(ignored);
+    }
+}
+
+bool ChildProcess::start(const std::string& command) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cancelled || pid > 0) {
+        return false;
+    }
+
+    // Close-on-exec, so children forked by other threads do not hold our
+    // pipe open and delay EOF
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return false;
+    }
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    pid_t child = fork();
+    if (child == 0) {
+        // Only async-signal-safe calls until exec
+        setpgid(0, 0);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+        }
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    close(fds[1]);
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    if (child < 0) {
+        close(fds[0]);
+        return false;
+    }
+
+    // Also from the parent, so terminate() cannot race the child's setpgid
+    setpgid(child, child);
+    pid = child;
+    started = std::chrono::steady_clock::now();
+    output_fd = fds[0];
+    return true;
+}
+
+int ChildProcess::wait(std::string& output) {
+    if (output_fd >= 0) {
+        char buffer[4096];
+        while (true) {
+            ssize_t got = read(output_fd, buffer, sizeof(buffer));
+            if (got > 0) {
+                output.append(buffer, got);
+            } else if (got == 0 || errno != EINTR) {
+                break;
+            }
+        }
+        close(output_fd);
+        output_fd = -1;
+    }
+
+    // Reaped under the lock so terminate() never signals a recycled pid
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pid <= 0) {
+        return -1;
+    }
+    // Waited for without reaping first, so the I/O counters of the exited
+    // child can still be read from /proc
+    siginfo_t info;
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {
+    }
+    uint64_t bytes_read = 0, bytes_written = 0;
+    processIo(pid, bytes_read, bytes_written);
+
+    int status = 0;
+    struct rusage reported;
+    pid_t reaped;
+    while ((reaped = wait4(pid, &status, 0, &reported)) < 0 && errno == EINTR) {
+    }
+    if (reaped > 0) {
+        resources = childUsage(reported);
+        resources.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        resources.bytes_read = bytes_read;
+        resources.bytes_written = bytes_written;
+    }
+    pid = -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void ChildProcess::terminate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    if (pid > 0) {
+        kill(-pid, SIGTERM);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef CHILD_PROCESS_H
+#define CHILD_PROCESS_H
+
+#include <string>
+#include <mutex>
+#include <sys/types.h>
+#include "resource_usage.h"
+
+// Shell command run in its own process group with stdin from /dev/null and
+// stdout/stderr captured, so several encoders can run side by side without
+// interleaving on the terminal or fighting over keyboard input.
+class ChildProcess {
+public:
+    ChildProcess() {}
+    ~ChildProcess();
+    ChildProcess(const ChildProcess&) = delete;
+    ChildProcess& operator=(const ChildProcess&) = delete;
+
+    // Fails if fork fails or terminate() was already called
+    bool start(const std::string& command);
+
+    // Collects all output, then reaps the child. Returns the exit code, or
+    // -1 if it was killed by a signal or never started.
+    int wait(std::string& output);
+
+    // What the command and everything it ran used, once wait() returned
+    ResourceUsage usage() const { return resources; }
+
+    // SIGTERM to the whole process group; callable from any thread, also
+    // before start(), which then refuses to run
+    void terminate();
+
+private:
+    std::mutex mutex;
+    pid_t pid = -1;
+    int output_fd = -1;
+    bool cancelled = false;
+    ResourceUsage resources;
+    std::chrono::steady_clock::time_point started;
+};
+
+#endif // CHILD_PROCESS_H
@@ -0,0 +1,61 @@
+#ifndef CONVERT_OPTIONS_H
+#define CONVERT_OPTIONS_H
+
+#include "executor.h"
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <memory>
+
+class TraceSession;
+
+// Options shared by the in-process converters
+struct ConvertOptions {
+    // Loudness normalization: "off", "prescan" (measure first, gain in the
+    // transcode pass) or "twopass" (measure while transcoding, then rewrite audio)
+    std::string loudness_mode = "off";
+    double target_lufs = -23.0;     // EBU R128 programme loudness
+    double max_true_peak = -1.0;    // dBTP ceiling after gain
+    
+    // Encoder threads for the whole job, 0 uses every core
+    int threads = 0;
+    
+    int threadCount() const {
+        return threads > 0 ? threads : std::max<int>(std::thread::hardware_concurrency(), 1);
+    }
+    
+    // Workers for the frame bands of the scalers and tone mapper. A
+    // converter that splits frames gets a private pool of --threads
+    // workers, so a job stays within its thread budget and its bands never
+    // queue behind other jobs' work. Background work that runs alongside
+    // the job (segment hashing, posters) goes to Executor::shared().
+    std::unique_ptr<Executor> framePool() const {
+        return std::make_unique<Executor>(threadCount());
+    }
+    
+    // Detect black bars and leave them out of every rung
+    bool crop_detect = true;
+    
+    // Cut black, silent slates off the head and tail (HLS)
+    bool trim_edges = true;
+    
+    // Tone map HDR10 and HLG sources to SDR BT.709
+    bool tone_map = true;
+    
+    // Keep an HDR10 HEVC rung next to the SDR ladder for PQ sources (abr)
+    bool hdr10_rung = false;
+    
+    // Packets queued for each output's mux thread before the encoder waits,
+    // and how far apart in seconds libavformat lets streams drift while
+    // interleaving before it writes anyway
+    int mux_queue_packets = 256;
+    double mux_interleave_window = 2.0;
+    
+    // When set, outputs are hashed while they are muxed and listed here
+    std::string manifest_file;
+    
+    // When set, decode, encode and mux spans are recorded here (--trace)
+    TraceSession* trace = nullptr;
+};
+
+#endif // CONVERT_OPTIONS_H
@@ -1,9 +1,20 @@
 #include "converter_abr.h"
+#include "loudness.h"
+#include "checksum.h"
+#include "geometry.h"
+#include "crop_detect.h"
+#include "slice_scaler.h"
+#include "tone_map.h"
+#include "pixel_format.h"
+#include "executor.h"
+#include "mux_thread.h"
+#include "trace.h"
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <filesystem>
 #include <cstdint>
+#include <cmath>
 #include <map>
 #include <vector>
 
@@ -26,10 +37,11 @@ struct ABRProfile {
     int height;
     int video_bitrate;
     int audio_bitrate;
-    std::string h264_profile;
+    std::string h264_profile;         // profile and level, HEVC ones for the HDR10 rung
     std::string h264_level;
     int keyframe_interval;
     std::string preset;
+    bool hdr10 = false;               // x265 Main 10 with the source's PQ signal
 };
 
 // Define 3 ABR profiles based on specifications
@@ -68,12 +80,42 @@ std::vector<ABRProfile> ABR_PROFILES = {
     }
 };
 
+// Added for PQ sources when the HDR10 rung is asked for
+const ABRProfile HDR10_PROFILE = {
+    "hdr10",
+    3840, 2160,               // Resolution: UHD
+    16000000,                 // Video: 16 Mbps
+    128000,                   // Audio: 128 kbps
+    "main10", "5.1",          // HEVC Main 10, Level 5.1
+    120,                      // Keyframe interval
+    "medium",
+    true
+};
+
+// Source audio is stream-copied when its bitrate is within this fraction of the rung's target
+const double AUDIO_PASSTHROUGH_BITRATE_TOLERANCE = 0.15;
+
+// Smaller loudness corrections are not worth re-encoding audio for
+const double LOUDNESS_GAIN_THRESHOLD_DB = 0.5;
+
+#ifndef AV_PROFILE_AAC_LOW
+#define AV_PROFILE_AAC_LOW FF_PROFILE_AAC_LOW
+#endif
+
 class VideoConverterABR {
 private:
     std::string input_file;
     std::string output_base;
     std::vector<ABRProfile> profiles_to_encode;
+    ConvertOptions options;
+    SourceGeometry source_geometry;
+    HdrInfo hdr_info;
+    bool tone_mapping = false;             // SDR rungs are fed tone mapped frames
+    std::unique_ptr<Executor> scale_pool;  // bands of the tone mapper and every rung's scaler; outlives them
+    ToneMapper tone_mapper;
     AVFormatContext* input_ctx = nullptr;
+    std::unique_ptr<LoudnessMeter> loudness_meter;
+    double audio_gain_db = 0.0;
     
     struct StreamContext {
         AVCodecContext* decoder_ctx = nullptr;
@@ -83,16 +125,20 @@ private:
     
     struct EncoderContext {
         AVFormatContext* output_ctx = nullptr;
+        MuxThread* muxer = nullptr;            // writes output_ctx on its own thread
         AVCodecContext* video_encoder_ctx = nullptr;
         AVCodecContext* audio_encoder_ctx = nullptr;
         AVStream* video_stream = nullptr;
         AVStream* audio_stream = nullptr;
-        SwsContext* sws_ctx = nullptr;
+        SliceScaler scaler;
+        bool frames_by_reference = false;   // decoded frames are already encoder-ready
         SwrContext* swr_ctx = nullptr;
         int64_t video_next_pts = 0;
         int64_t audio_next_pts = 0;
+        bool audio_passthrough = false;
         ABRProfile profile;
         std::string output_file;
+        FileChecksum checksum;
     };
     
     StreamContext video_decoder;
@@ -100,8 +146,9 @@ private:
     std::vector<EncoderContext*> encoders;
     
 public:
-    VideoConverterABR(const std::string& in, const std::string& out_base, const std::string& profile_arg) 
-        : input_file(in), output_base(out_base) {
+    VideoConverterABR(const std::string& in, const std::string& out_base, const std::string& profile_arg,
+                      const ConvertOptions& opts) 
+        : input_file(in), output_base(out_base), options(opts) {
         
         // Parse profile argument
         if (profile_arg == "all") {
@@ -132,6 +179,20 @@ public:
             std::cerr << "Failed to open input file\n";
             return false;
         }
+        planProfiles();
+        
+        if (tone_mapping) {
+            scale_pool = options.framePool();
+            if (!tone_mapper.init(source_geometry.visibleWidth(), source_geometry.visibleHeight(),
+                                  video_decoder.decoder_ctx->pix_fmt, hdr_info, scale_pool.get())) {
+                std::cerr << "Failed to set up tone mapping\n";
+                return false;
+            }
+        }
+        
+        if (audio_decoder.stream_index >= 0) {
+            setupLoudness();
+        }
         
         // Setup encoders for each profile
         for (const auto& profile : profiles_to_encode) {
@@ -162,15 +223,145 @@ public:
         
         // Write trailers for all outputs
         for (auto* encoder : encoders) {
+            bool muxed = encoder->muxer->finish();
+            MuxStats stats = encoder->muxer->stats();
+            std::cout << "  " << encoder->profile.name << " mux queue: peak " << stats.peak_depth << "/"
+                      << stats.capacity << " packets, " << stats.producer_stalls << " encoder stalls\n";
+            if (!muxed) {
+                std::cerr << "Failed to write " << stats.write_errors << " packets to: " << encoder->output_file << "\n";
+                return false;
+            }
             av_write_trailer(encoder->output_ctx);
+            if (!(encoder->output_ctx->oformat->flags & AVFMT_NOFILE) &&
+                !closeHashedOutput(&encoder->output_ctx->pb, &encoder->checksum)) {
+                std::cerr << "Failed to close output: " << encoder->output_file << "\n";
+                return false;
+            }
             std::cout << "Completed: " << encoder->output_file << "\n";
         }
         
+        if (loudness_meter && !normalizeOutputs()) {
+            return false;
+        }
+        
+        if (!options.manifest_file.empty()) {
+            std::vector<FileChecksum> checksums;
+            for (auto* encoder : encoders) {
+                checksums.push_back(encoder->checksum);
+            }
+            if (!writeManifest(options.manifest_file, checksums)) {
+                return false;
+            }
+            std::cout << "Manifest: " << options.manifest_file << "\n";
+        }
+        
         return true;
     }
     
 private:
+    // Fits every rung to the source: no upscaling, display aspect kept,
+    // bitrates follow the pixels actually encoded
+    void planProfiles() {
+        source_geometry = sourceGeometry(input_ctx, video_decoder.input_stream);
+        if (options.crop_detect) {
+            TRACE_SCOPE(options.trace, "detectCrop", "input");
+            std::string error;
+            if (!detectCrop(input_file, source_geometry, error)) {
+                std::cerr << "Warning: Crop detection failed (" << error << "), encoding the full frame\n";
+            }
+            std::cout << "Crop: " << describeCrop(source_geometry) << "\n";
+        }
+        const SourceGeometry& source = source_geometry;
+        std::vector<RungBox> boxes;
+        for (const auto& profile : profiles_to_encode) {
+            boxes.push_back({profile.width, profile.height, profile.video_bitrate});
+        }
+        
+        std::vector<ABRProfile> planned;
+        for (const RungGeometry& rung : planLadder(source, boxes)) {
+            ABRProfile profile = profiles_to_encode[rung.index];
+            profile.width = rung.width;
+            profile.height = rung.height;
+            profile.video_bitrate = rung.video_bitrate;
+            planned.push_back(profile);
+        }
+        
+        if (planned.size() < profiles_to_encode.size()) {
+            std::cout << "Picture is " << source.visibleWidth() << "x" << source.visibleHeight() << ", encoding "
+                      << planned.size() << " of " << profiles_to_encode.size() << " profiles\n";
+        }
+        
+        if (options.tone_map || options.hdr10_rung) {
+            TRACE_SCOPE(options.trace, "probeHdr", "input");
+            std::string error;
+            if (!probeHdr(input_file, hdr_info, error)) {
+                std::cerr << "Warning: HDR probe failed (" << error << "), treating the source as SDR\n";
+            }
+            std::cout << "Transfer: " << describeTransfer(hdr_info.transfer) << "\n";
+        }
+        tone_mapping = options.tone_map && hdr_info.hdr();
+        
+        // The HDR10 rung is planned on its own, it never replaces an SDR one
+        if (options.hdr10_rung && hdr_info.transfer == HDR_PQ) {
+            RungGeometry rung = planRung(source, {HDR10_PROFILE.width, HDR10_PROFILE.height,
+                                                  HDR10_PROFILE.video_bitrate});
+            ABRProfile profile = HDR10_PROFILE;
+            profile.width = rung.width;
+            profile.height = rung.height;
+            profile.video_bitrate = rung.video_bitrate;
+            planned.push_back(profile);
+        } else if (options.hdr10_rung) {
+            std::cout << "Source is not HDR10, no HDR10 rung\n";
+        }
+        profiles_to_encode = planned;
+    }
+    
+    void setupLoudness() {
+        if (options.loudness_mode == "prescan") {
+            std::cout << "Measuring loudness (audio-only pre-scan)...\n";
+            LoudnessResult measured;
+            if (!measureLoudness(input_file, measured)) {
+                std::cerr << "Warning: Loudness pre-scan failed, audio left unchanged\n";
+                return;
+            }
+            audio_gain_db = loudnessGain(measured, options.target_lufs, options.max_true_peak);
+            std::cout << "  Integrated: " << measured.integrated_lufs << " LUFS, true peak: "
+                      << measured.true_peak_dbtp << " dBTP, gain: " << audio_gain_db << " dB\n";
+        } else if (options.loudness_mode == "twopass") {
+            loudness_meter = std::make_unique<LoudnessMeter>(audio_decoder.decoder_ctx->sample_rate,
+                                                             &audio_decoder.decoder_ctx->ch_layout);
+        }
+    }
+    
+    // Second, audio-only pass for loudness measured during the transcode
+    bool normalizeOutputs() {
+        LoudnessResult measured = loudness_meter->result();
+        double gain = loudnessGain(measured, options.target_lufs, options.max_true_peak);
+        std::cout << "\nLoudness: " << measured.integrated_lufs << " LUFS, true peak: "
+                  << measured.true_peak_dbtp << " dBTP, gain: " << gain << " dB\n";
+        
+        if (std::abs(gain) < LOUDNESS_GAIN_THRESHOLD_DB) {
+            std::cout << "Loudness within tolerance, no second pass needed\n";
+            return true;
+        }
+        
+        for (auto* encoder : encoders) {
+            if (!encoder->audio_stream) {
+                continue;
+            }
+            std::cout << "Rewriting audio: " << encoder->output_file << "\n";
+            FileChecksum* checksum = options.manifest_file.empty() ? nullptr : &encoder->checksum;
+            if (!remuxWithAudioGain(input_file, encoder->output_file, gain,
+                                    encoder->profile.audio_bitrate, checksum)) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
     bool openInputFile() {
+        TRACE_SCOPE(options.trace, "openInputFile", "input");
         int ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
         if (ret < 0) {
             char errbuf[256];
@@ -264,10 +455,21 @@ private:
             return false;
         }
         
-        // Setup audio encoder if audio stream exists
-        if (audio_decoder.stream_index >= 0) {
+        // Copy the source audio if it already matches the rung, otherwise
+        // re-encode. The audio stream exists by the time either can fail, so
+        // the rung fails rather than being written with an empty track.
+        if (audio_decoder.stream_index >= 0 && canPassthroughAudio(profile)) {
+            if (!setupAudioPassthrough(encoder)) {
+                std::cerr << "Failed to setup audio passthrough for " << profile.name << "\n";
+                delete encoder;
+                return false;
+            }
+            std::cout << "  Audio: stream copy (source matches profile)\n";
+        } else if (audio_decoder.stream_index >= 0) {
             if (!setupAudioEncoder(encoder)) {
-                std::cerr << "Warning: Failed to setup audio encoder for " << profile.name << "\n";
+                std::cerr << "Failed to setup audio encoder for " << profile.name << "\n";
+                delete encoder;
+                return false;
             }
         }
         
@@ -276,9 +478,10 @@ private:
     }
     
     bool setupVideoEncoder(EncoderContext* encoder) {
-        const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+        const char* codec_name = encoder->profile.hdr10 ? "libx265" : "libx264";
+        const AVCodec* codec = avcodec_find_encoder_by_name(codec_name);
         if (!codec) {
-            std::cerr << "x264 encoder not found\n";
+            std::cerr << codec_name << " encoder not found\n";
             return false;
         }
         
@@ -294,10 +497,31 @@ private:
             return false;
         }
         
+        // SDR rungs take the tone mapped picture, the HDR10 rung the decoded
+        // one. At the source size, frames the scaler would only copy are
+        // handed to the encoder as they are.
+        int source_format = tone_mapping && !encoder->profile.hdr10 ? AV_PIX_FMT_YUV420P
+                                                                    : video_decoder.decoder_ctx->pix_fmt;
+        int direct_format = AV_PIX_FMT_NONE;
+        if (source_geometry.visibleWidth() == encoder->profile.width &&
+            source_geometry.visibleHeight() == encoder->profile.height) {
+            direct_format = negotiatePixelFormat(codec, source_format,
+                                                 encoder->profile.hdr10 ? hdr10RungFormats() : sdrRungFormats());
+        }
+        encoder->frames_by_reference = direct_format != AV_PIX_FMT_NONE;
+        
         // Set encoding parameters from profile
         encoder->video_encoder_ctx->width = encoder->profile.width;
         encoder->video_encoder_ctx->height = encoder->profile.height;
-        encoder->video_encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder->video_encoder_ctx->sample_aspect_ratio = AVRational{1, 1};
+        if (encoder->frames_by_reference) {
+            encoder->video_encoder_ctx->pix_fmt = static_cast<AVPixelFormat>(direct_format);
+            if (source_format == AV_PIX_FMT_YUVJ420P) {
+                encoder->video_encoder_ctx->color_range = AVCOL_RANGE_JPEG;
+            }
+        } else {
+            encoder->video_encoder_ctx->pix_fmt = encoder->profile.hdr10 ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+        }
         encoder->video_encoder_ctx->bit_rate = encoder->profile.video_bitrate;
         encoder->video_encoder_ctx->gop_size = encoder->profile.keyframe_interval;
         encoder->video_encoder_ctx->max_b_frames = 2;
@@ -312,6 +536,56 @@ private:
         encoder->video_encoder_ctx->time_base = av_inv_q(input_framerate);
         encoder->video_stream->time_base = encoder->video_encoder_ctx->time_base;
         
+        if (encoder->profile.hdr10) {
+            setupHdr10Options(encoder);
+        } else {
+            setupX264Options(encoder);
+        }
+        
+        if (encoder->output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+            encoder->video_encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+        
+        if (avcodec_open2(encoder->video_encoder_ctx, codec, nullptr) < 0) {
+            std::cerr << "Failed to open video encoder\n";
+            return false;
+        }
+        
+        if (avcodec_parameters_from_context(encoder->video_stream->codecpar, 
+                                           encoder->video_encoder_ctx) < 0) {
+            std::cerr << "Failed to copy video codec parameters\n";
+            return false;
+        }
+        if (encoder->profile.hdr10) {
+            // Apple players only take HEVC in MP4 tagged hvc1
+            encoder->video_stream->codecpar->codec_tag = MKTAG('h', 'v', 'c', '1');
+        }
+        
+        // Setup scaler, banded across the job's threads. With frames passed
+        // by reference it only takes frames whose format or size changed
+        // mid-stream.
+        if (!scale_pool) {
+            scale_pool = options.framePool();
+        }
+        if (!encoder->scaler.init(source_geometry.visibleWidth(), source_geometry.visibleHeight(),
+                                  source_format, encoder->profile.width, encoder->profile.height,
+                                  encoder->video_encoder_ctx->pix_fmt, SWS_BICUBIC, scale_pool.get())) {
+            std::cerr << "Failed to create scaler context\n";
+            return false;
+        }
+        
+        return true;
+    }
+    
+    void setupX264Options(EncoderContext* encoder) {
+        if (tone_mapping) {
+            // Tone mapped pictures are BT.709 whatever the source was
+            encoder->video_encoder_ctx->color_primaries = AVCOL_PRI_BT709;
+            encoder->video_encoder_ctx->color_trc = AVCOL_TRC_BT709;
+            encoder->video_encoder_ctx->colorspace = AVCOL_SPC_BT709;
+            encoder->video_encoder_ctx->color_range = AVCOL_RANGE_MPEG;
+        }
+        
         // x264 specific options
         av_opt_set(encoder->video_encoder_ctx->priv_data, "preset", encoder->profile.preset.c_str(), 0);
         av_opt_set(encoder->video_encoder_ctx->priv_data, "profile", encoder->profile.h264_profile.c_str(), 0);
@@ -324,35 +598,70 @@ private:
                               ":min-keyint=" + std::to_string(encoder->profile.keyframe_interval/2) + 
                               ":no-scenecut";
         av_opt_set(encoder->video_encoder_ctx->priv_data, "x264opts", x264opts.c_str(), 0);
+    }
+    
+    // HEVC Main 10 carrying the source's PQ signal and HDR10 static metadata
+    void setupHdr10Options(EncoderContext* encoder) {
+        encoder->video_encoder_ctx->color_primaries = AVCOL_PRI_BT2020;
+        encoder->video_encoder_ctx->color_trc = AVCOL_TRC_SMPTE2084;
+        encoder->video_encoder_ctx->colorspace = AVCOL_SPC_BT2020_NCL;
+        encoder->video_encoder_ctx->color_range = AVCOL_RANGE_MPEG;
         
-        if (encoder->output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
-            encoder->video_encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        av_opt_set(encoder->video_encoder_ctx->priv_data, "preset", encoder->profile.preset.c_str(), 0);
+        av_opt_set(encoder->video_encoder_ctx->priv_data, "profile", encoder->profile.h264_profile.c_str(), 0);
+        
+        std::string params = "keyint=" + std::to_string(encoder->profile.keyframe_interval) +
+                             ":min-keyint=" + std::to_string(encoder->profile.keyframe_interval/2) +
+                             ":scenecut=0:level-idc=" + encoder->profile.h264_level +
+                             ":hdr10=1:hdr10-opt=1:repeat-headers=1" +
+                             ":colorprim=bt2020:transfer=smpte2084:colormatrix=bt2020nc";
+        if (!hdr_info.master_display.empty()) {
+            params += ":master-display=" + hdr_info.master_display;
+        }
+        if (hdr_info.max_cll > 0) {
+            params += ":max-cll=" + std::to_string(hdr_info.max_cll) + "," + std::to_string(hdr_info.max_fall);
         }
+        av_opt_set(encoder->video_encoder_ctx->priv_data, "x265-params", params.c_str(), 0);
+    }
+    
+    bool canPassthroughAudio(const ABRProfile& profile) {
+        const AVCodecParameters* par = audio_decoder.input_stream->codecpar;
+        AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
         
-        if (avcodec_open2(encoder->video_encoder_ctx, codec, nullptr) < 0) {
-            std::cerr << "Failed to open video encoder\n";
+        // A pre-scanned loudness gain has to be applied to decoded samples
+        if (std::abs(audio_gain_db) >= LOUDNESS_GAIN_THRESHOLD_DB) {
             return false;
         }
-        
-        if (avcodec_parameters_from_context(encoder->video_stream->codecpar, 
-                                           encoder->video_encoder_ctx) < 0) {
-            std::cerr << "Failed to copy video codec parameters\n";
+        if (par->codec_id != AV_CODEC_ID_AAC || par->profile != AV_PROFILE_AAC_LOW) {
+            return false;
+        }
+        if (av_channel_layout_compare(&par->ch_layout, &stereo) != 0) {
             return false;
         }
         
-        // Setup scaler
-        encoder->sws_ctx = sws_getContext(
-            video_decoder.decoder_ctx->width, video_decoder.decoder_ctx->height,
-            video_decoder.decoder_ctx->pix_fmt,
-            encoder->profile.width, encoder->profile.height, AV_PIX_FMT_YUV420P,
-            SWS_BICUBIC, nullptr, nullptr, nullptr
-        );
+        // Unknown source bitrate cannot be checked against the rung
+        if (par->bit_rate <= 0) {
+            return false;
+        }
+        double deviation = std::abs(static_cast<double>(par->bit_rate) - profile.audio_bitrate) / profile.audio_bitrate;
+        return deviation <= AUDIO_PASSTHROUGH_BITRATE_TOLERANCE;
+    }
+    
+    bool setupAudioPassthrough(EncoderContext* encoder) {
+        encoder->audio_stream = avformat_new_stream(encoder->output_ctx, nullptr);
+        if (!encoder->audio_stream) {
+            return false;
+        }
         
-        if (!encoder->sws_ctx) {
-            std::cerr << "Failed to create scaler context\n";
+        if (avcodec_parameters_copy(encoder->audio_stream->codecpar, audio_decoder.input_stream->codecpar) < 0) {
             return false;
         }
         
+        // Let the muxer pick the tag for the output container
+        encoder->audio_stream->codecpar->codec_tag = 0;
+        encoder->audio_stream->time_base = audio_decoder.input_stream->time_base;
+        encoder->audio_passthrough = true;
+        
         return true;
     }
     
@@ -424,7 +733,10 @@ private:
     
     bool writeHeader(EncoderContext* encoder) {
         if (!(encoder->output_ctx->oformat->flags & AVFMT_NOFILE)) {
-            if (avio_open(&encoder->output_ctx->pb, encoder->output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            int ret = options.manifest_file.empty()
+                      ? avio_open(&encoder->output_ctx->pb, encoder->output_file.c_str(), AVIO_FLAG_WRITE)
+                      : openHashedOutput(&encoder->output_ctx->pb, encoder->output_file);
+            if (ret < 0) {
                 std::cerr << "Could not open output file: " << encoder->output_file << "\n";
                 return false;
             }
@@ -443,10 +755,14 @@ private:
             return false;
         }
         
+        encoder->muxer = new MuxThread(encoder->output_ctx, options.mux_queue_packets,
+                                       options.mux_interleave_window, options.trace, encoder->profile.name);
+        encoder->muxer->start();
         return true;
     }
     
     bool transcodeAllProfiles() {
+        TRACE_SCOPE(options.trace, "transcode", "job");
         AVPacket* packet = av_packet_alloc();
         AVFrame* frame = av_frame_alloc();
         
@@ -456,7 +772,7 @@ private:
         
         for (auto* encoder : encoders) {
             AVFrame* scaled = av_frame_alloc();
-            scaled->format = AV_PIX_FMT_YUV420P;
+            scaled->format = encoder->video_encoder_ctx->pix_fmt;
             scaled->width = encoder->profile.width;
             scaled->height = encoder->profile.height;
             av_frame_get_buffer(scaled, 0);
@@ -470,12 +786,32 @@ private:
             }
         }
         
-        while (av_read_frame(input_ctx, packet) >= 0) {
+        // Audio only needs decoding if at least one profile re-encodes it
+        // or loudness is being measured
+        bool decode_audio = loudness_meter != nullptr;
+        for (auto* encoder : encoders) {
+            if (encoder->audio_encoder_ctx) {
+                decode_audio = true;
+            }
+        }
+        
+        bool copied = true;
+        while (copied && av_read_frame(input_ctx, packet) >= 0) {
             StreamContext* decoder = nullptr;
             
             if (packet->stream_index == video_decoder.stream_index) {
                 decoder = &video_decoder;
             } else if (packet->stream_index == audio_decoder.stream_index) {
+                for (auto* encoder : encoders) {
+                    if (encoder->audio_passthrough && !writePassthroughPacket(encoder, packet)) {
+                        std::cerr << "Failed to copy audio to: " << encoder->output_file << "\n";
+                        copied = false;
+                    }
+                }
+                if (!copied || !decode_audio) {
+                    av_packet_unref(packet);
+                    continue;
+                }
                 decoder = &audio_decoder;
             } else {
                 av_packet_unref(packet);
@@ -483,7 +819,11 @@ private:
             }
             
             // Send packet to decoder
-            int ret = avcodec_send_packet(decoder->decoder_ctx, packet);
+            int ret;
+            {
+                TRACE_SCOPE(options.trace, "decode", "decode");
+                ret = avcodec_send_packet(decoder->decoder_ctx, packet);
+            }
             if (ret < 0) {
                 av_packet_unref(packet);
                 continue;
@@ -491,17 +831,38 @@ private:
             
             // Receive frames from decoder
             while (ret >= 0) {
-                ret = avcodec_receive_frame(decoder->decoder_ctx, frame);
+                {
+                    TRACE_SCOPE(options.trace, "receive frame", "decode");
+                    ret = avcodec_receive_frame(decoder->decoder_ctx, frame);
+                }
                 if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                     break;
                 } else if (ret < 0) {
                     break;
                 }
                 
+                const AVFrame* sdr_frame = frame;
+                if (packet->stream_index == audio_decoder.stream_index) {
+                    if (loudness_meter) {
+                        loudness_meter->addFrame(frame);
+                    }
+                    if (std::abs(audio_gain_db) >= LOUDNESS_GAIN_THRESHOLD_DB &&
+                        av_frame_make_writable(frame) >= 0) {
+                        applyAudioGain(frame, audio_gain_db);
+                    }
+                } else {
+                    // Bars are cut off once, by moving the plane pointers, and HDR tone mapped once for every SDR rung
+                    cropFrame(frame, source_geometry);
+                    if (tone_mapping) {
+                        TRACE_SCOPE(options.trace, "toneMap", "video");
+                        sdr_frame = tone_mapper.process(frame);
+                    }
+                }
+                
                 // Process frame for each encoder
                 for (size_t i = 0; i < encoders.size(); i++) {
                     if (packet->stream_index == video_decoder.stream_index) {
-                        processVideoFrame(encoders[i], frame, scaled_frames[i]);
+                        processVideoFrame(encoders[i], encoders[i]->profile.hdr10 ? frame : sdr_frame, scaled_frames[i]);
                     } else if (packet->stream_index == audio_decoder.stream_index && encoders[i]->audio_encoder_ctx) {
                         processAudioFrame(encoders[i], frame, resampled_frames[i]);
                     }
@@ -526,19 +887,37 @@ private:
         }
         av_packet_free(&packet);
         
-        return true;
+        return copied;
     }
     
-    void processVideoFrame(EncoderContext* encoder, AVFrame* input_frame, AVFrame* scaled_frame) {
-        // Scale the frame
-        sws_scale(encoder->sws_ctx, input_frame->data, input_frame->linesize, 0,
-                 input_frame->height, scaled_frame->data, scaled_frame->linesize);
+    void processVideoFrame(EncoderContext* encoder, const AVFrame* input_frame, AVFrame* scaled_frame) {
+        if (!input_frame) {
+            return;
+        }
+        TRACE_SCOPE(options.trace, "processVideoFrame", "video", encoder->profile.name);
+        
+        AVFrame* reference = nullptr;
+        AVFrame* frame_to_encode = scaled_frame;
+        if (encoder->frames_by_reference && input_frame->width == encoder->profile.width &&
+            input_frame->height == encoder->profile.height &&
+            plainPixelFormat(input_frame->format) == encoder->video_encoder_ctx->pix_fmt) {
+            // Encoder-ready as decoded: the encoder takes its own reference, nothing is copied
+            reference = av_frame_clone(input_frame);
+            if (!reference) {
+                return;
+            }
+            retagFullRange(reference);
+            frame_to_encode = reference;
+        } else {
+            encoder->scaler.scale(input_frame, scaled_frame);
+        }
         
         // Set PTS
-        scaled_frame->pts = encoder->video_next_pts++;
+        frame_to_encode->pts = encoder->video_next_pts++;
         
         // Send frame to encoder
-        int ret = avcodec_send_frame(encoder->video_encoder_ctx, scaled_frame);
+        int ret = avcodec_send_frame(encoder->video_encoder_ctx, frame_to_encode);
+        av_frame_free(&reference);
         if (ret < 0) {
             return;
         }
@@ -548,6 +927,7 @@ private:
     }
     
     void processAudioFrame(EncoderContext* encoder, AVFrame* input_frame, AVFrame* resampled_frame) {
+        TRACE_SCOPE(options.trace, "processAudioFrame", "audio", encoder->profile.name);
         AVFrame* frame_to_encode = input_frame;
         
         // Resample if needed
@@ -592,6 +972,30 @@ private:
         receiveAndWritePackets(encoder, encoder->audio_encoder_ctx, encoder->audio_stream);
     }
     
+    // Failed writes are counted by the muxer and fail the rung in its
+    // finish(), as for encoded packets
+    bool writePassthroughPacket(EncoderContext* encoder, const AVPacket* input_packet) {
+        AVPacket* packet = av_packet_clone(input_packet);
+        if (!packet) {
+            return false;
+        }
+        
+        // Re-encoded audio starts at zero, so copied audio does the same
+        int64_t start_time = audio_decoder.input_stream->start_time;
+        if (start_time != AV_NOPTS_VALUE) {
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts -= start_time;
+            if (packet->dts != AV_NOPTS_VALUE) packet->dts -= start_time;
+        }
+        
+        packet->stream_index = encoder->audio_stream->index;
+        packet->pos = -1;
+        av_packet_rescale_ts(packet, audio_decoder.input_stream->time_base, encoder->audio_stream->time_base);
+        
+        encoder->muxer->push(packet);
+        av_packet_free(&packet);
+        return true;
+    }
+    
     void receiveAndWritePackets(EncoderContext* encoder, AVCodecContext* codec_ctx, AVStream* stream) {
         AVPacket* packet = av_packet_alloc();
         int ret;
@@ -607,14 +1011,14 @@ private:
             packet->stream_index = stream->index;
             av_packet_rescale_ts(packet, codec_ctx->time_base, stream->time_base);
             
-            av_interleaved_write_frame(encoder->output_ctx, packet);
-            av_packet_unref(packet);
+            encoder->muxer->push(packet);
         }
         
         av_packet_free(&packet);
     }
     
     void flushEncoder(EncoderContext* encoder) {
+        TRACE_SCOPE(options.trace, "flushEncoder", "encode", encoder->profile.name);
         if (encoder->video_encoder_ctx) {
             avcodec_send_frame(encoder->video_encoder_ctx, nullptr);
             receiveAndWritePackets(encoder, encoder->video_encoder_ctx, encoder->video_stream);
@@ -633,15 +1037,14 @@ private:
             if (encoder->audio_encoder_ctx) {
                 avcodec_free_context(&encoder->audio_encoder_ctx);
             }
-            if (encoder->sws_ctx) {
-                sws_freeContext(encoder->sws_ctx);
-            }
             if (encoder->swr_ctx) {
                 swr_free(&encoder->swr_ctx);
             }
+            // The writer still uses the output context until it is joined
+            delete encoder->muxer;
             if (encoder->output_ctx) {
                 if (!(encoder->output_ctx->oformat->flags & AVFMT_NOFILE)) {
-                    avio_closep(&encoder->output_ctx->pb);
+                    closeHashedOutput(&encoder->output_ctx->pb, nullptr);
                 }
                 avformat_free_context(encoder->output_ctx);
             }
@@ -660,7 +1063,8 @@ private:
     }
 };
 
-int convert_abr(const std::string& input_file, const std::string& output_base, const std::string& profile) {
+int convert_abr(const std::string& input_file, const std::string& output_base, const std::string& profile,
+                const ConvertOptions& options) {
     // Check if input file exists
     if (!fs::exists(input_file)) {
         std::cerr << "Error: Input file does not exist: " << input_file << "\n";
@@ -670,9 +1074,13 @@ int convert_abr(const std::string& input_file, const std::string& output_base, c
     std::cout << "ABR Video Converter\n";
     std::cout << "==================\n";
     std::cout << "Input: " << input_file << "\n";
-    std::cout << "Profile: " << profile << "\n\n";
+    std::cout << "Profile: " << profile << "\n";
+    if (options.loudness_mode != "off") {
+        std::cout << "Loudness: " << options.loudness_mode << " (target " << options.target_lufs << " LUFS)\n";
+    }
+    std::cout << "\n";
     
-    VideoConverterABR converter(input_file, output_base, profile);
+    VideoConverterABR converter(input_file, output_base, profile, options);
     
     if (converter.convert()) {
         std::cout << "\nConversion successful!\n";
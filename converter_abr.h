@@ -2,7 +2,9 @@
 #define CONVERTER_ABR_H
 
 #include <string>
+#include "convert_options.h"
 
-int convert_abr(const std::string& input_file, const std::string& output_base, const std::string& profile);
+int convert_abr(const std::string& input_file, const std::string& output_base, const std::string& profile,
+                const ConvertOptions& options = ConvertOptions());
 
 #endif // CONVERTER_ABR_H
\ No newline at end of file
@@ -1,4 +1,14 @@
 #include "converter_hls.h"
+#include "media_tracks.h"
+#include "media_probe.h"
+#include "geometry.h"
+#include "crop_detect.h"
+#include "edge_trim.h"
+#include "tone_map.h"
+#include "checksum.h"
+#include "executor.h"
+#include "child_process.h"
+#include "trace.h"
 #include <iostream>
 #include <string>
 #include <cstdlib>
@@ -6,6 +16,9 @@
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 
 namespace fs = std::filesystem;
 
@@ -53,11 +66,16 @@ private:
     std::string input_file;
     std::string output_dir;
     std::vector<HLSProfile> profiles;
+    ConvertOptions options;
+    MediaTracks tracks;
+    SourceGeometry geometry;
+    HdrInfo hdr;
+    EdgeTrim trim;
     int segment_duration = 10;  // 10 second segments
     
 public:
-    VideoConverterHLS(const std::string& in, const std::string& out_dir) 
-        : input_file(in), output_dir(out_dir), profiles(HLS_PROFILES) {
+    VideoConverterHLS(const std::string& in, const std::string& out_dir, const ConvertOptions& opts) 
+        : input_file(in), output_dir(out_dir), profiles(HLS_PROFILES), options(opts) {
         // Remove trailing slash if present
         if (output_dir.back() == '/' || output_dir.back() == '\\') {
             output_dir.pop_back();
@@ -65,8 +83,51 @@ public:
     }
     
     bool convert() {
+        MediaInfo info;
+        std::string error;
+        bool probed;
+        {
+            TRACE_SCOPE(options.trace, "probeMedia", "input");
+            probed = probeMedia(input_file, info, error);
+        }
+        if (!probed) {
+            std::cerr << "Failed to read input: " << error << "\n";
+            return false;
+        }
+        tracks = info.tracks;
+        geometry = info.geometry;
+        if (options.crop_detect) {
+            TRACE_SCOPE(options.trace, "detectCrop", "input");
+            if (!detectCrop(input_file, geometry, error)) {
+                std::cerr << "Warning: Crop detection failed (" << error << "), encoding the full frame\n";
+            }
+        }
+        planProfiles(geometry);
+        // The peak comes from the first frame's side data
+        if (options.tone_map && info.transfer != HDR_NONE) {
+            TRACE_SCOPE(options.trace, "probeHdr", "input");
+            if (!probeHdr(input_file, hdr, error)) {
+                std::cerr << "Warning: HDR probe failed (" << error << "), tone mapping for a 1000 nit peak\n";
+                hdr.transfer = info.transfer;
+            }
+        }
+        if (options.trim_edges) {
+            TRACE_SCOPE(options.trace, "detectEdgeTrim", "input");
+            if (!detectEdgeTrim(input_file, info.duration, trim, error)) {
+                std::cerr << "Warning: Edge trim detection failed (" << error << "), keeping the full length\n";
+            }
+        }
+        
         std::cout << "Starting HLS conversion with " << profiles.size() << " profiles\n";
         std::cout << "Output directory: " << output_dir << "\n\n";
+        std::cout << "Source: " << describeMedia(info) << "\n";
+        std::cout << "Crop: " << describeCrop(geometry) << "\n";
+        std::cout << "Trim: " << describeTrim(trim) << "\n";
+        if (hdr.hdr()) {
+            std::cout << "Tone mapping: " << describeTransfer(hdr.transfer) << " peak " << hdr.peak_nits << " nits to SDR\n";
+        }
+        std::cout << "Audio tracks: " << tracks.audio.size()
+                  << ", subtitle tracks: " << tracks.subtitles.size() << "\n";
         
         // Create output directory structure
         if (!createDirectoryStructure()) {
@@ -74,18 +135,95 @@ public:
             return false;
         }
         
-        // Process each profile
-        bool all_success = true;
-        for (const auto& profile : profiles) {
-            std::cout << "\nProcessing " << profile.name << " profile:\n";
-            std::cout << "  Resolution: " << profile.width << "x" << profile.height << "\n";
-            std::cout << "  Video bitrate: " << (profile.video_bitrate/1000) << " kbps\n";
-            std::cout << "  Audio bitrate: " << (profile.audio_bitrate/1000) << " kbps\n";
-            std::cout << "  Total bandwidth: " << (profile.bandwidth/1000) << " kbps\n";
+        // Segments are hashed as ffmpeg lists them, while encoding continues
+        SegmentHasher segment_hasher(output_dir, &Executor::shared());
+        if (!options.manifest_file.empty()) {
+            for (const auto& profile : profiles) {
+                segment_hasher.addPlaylist(profile.folder_name + "/index.m3u8");
+            }
+            for (const auto& track : tracks.audio) {
+                segment_hasher.addPlaylist(track.folder_name + "/index.m3u8");
+            }
+            for (const auto& track : tracks.subtitles) {
+                segment_hasher.addPlaylist(track.folder_name + "/index.m3u8");
+            }
+            segment_hasher.start();
+        }
+        
+        // Every rung and the audio/subtitle renditions encode at the same
+        // time, each ffmpeg in its own process; the first failure stops the rest
+        std::vector<int> threads = splitThreads(options.threadCount());
+        size_t task_count = profiles.size() + 1;
+        std::vector<ChildProcess> processes(task_count);
+        std::atomic<bool> failed{false};
+        std::mutex output_mutex;
+        
+        // Reports are printed whole, in completion order
+        auto finish = [&](size_t index, bool success, const std::string& report) {
+            {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << report << std::flush;
+            }
+            if (!success && !failed.exchange(true)) {
+                for (size_t i = 0; i < processes.size(); i++) {
+                    if (i != index) {
+                        processes[i].terminate();
+                    }
+                }
+            }
+        };
+        
+        std::vector<std::future<bool>> results;
+        {
+            // Every task waits on an ffmpeg process for the whole encode, so
+            // they get workers of their own instead of the shared executor
+            Executor pool(task_count);
+            for (size_t i = 0; i < profiles.size(); i++) {
+                results.push_back(pool.submit([&, i] {
+                    std::string report;
+                    bool success = processProfile(profiles[i], threads[i], processes[i], report);
+                    finish(i, success, report);
+                    return success;
+                }));
+            }
             
-            if (!processProfile(profile)) {
-                std::cerr << "Failed to process profile: " << profile.name << "\n";
-                all_success = false;
+            // Audio and subtitle renditions are shared by all video profiles
+            results.push_back(pool.submit([&] {
+                std::string report;
+                bool success = processRenditions(processes.back(), report);
+                finish(processes.size() - 1, success, report);
+                return success;
+            }));
+        }
+        
+        bool all_success = true;
+        for (auto& result : results) {
+            all_success = result.get() && all_success;
+        }
+        if (failed) {
+            std::cerr << "HLS conversion stopped after the first failed encode\n";
+        }
+        segment_hasher.stop();
+        
+        // ffmpeg wrote the playlists after every segment, so they are marked
+        // VOD only now. Subtitles are cut at the first rung's segment boundaries.
+        if (all_success) {
+            std::vector<std::string> media_playlists;
+            for (const auto& profile : profiles) {
+                media_playlists.push_back(output_dir + "/" + profile.folder_name + "/index.m3u8");
+            }
+            for (const auto& track : tracks.audio) {
+                media_playlists.push_back(output_dir + "/" + track.folder_name + "/index.m3u8");
+            }
+            std::string error;
+            for (const auto& playlist : media_playlists) {
+                all_success = all_success && markVodPlaylist(playlist, error);
+            }
+            if (all_success) {
+                all_success = segmentSubtitles(tracks, output_dir, profiles.front().folder_name + "/index.m3u8", error);
+            }
+            if (!all_success) {
+                std::cerr << "Cannot finish the playlists: " << error << "\n";
             }
         }
         
@@ -99,10 +237,53 @@ public:
             std::cout << "Master playlist: " << output_dir << "/playlist.m3u8\n";
         }
         
+        if (!options.manifest_file.empty()) {
+            TRACE_SCOPE(options.trace, "segment hashing", "output");
+            std::vector<FileChecksum> checksums = segment_hasher.finish();
+            std::cout << "Segments hashed while encoding: " << segment_hasher.hashedEarly()
+                      << ", read back afterwards: " << segment_hasher.hashedLate() << "\n";
+            FileChecksum master;
+            if (all_success && hashFile(output_dir + "/playlist.m3u8", master)) {
+                checksums.push_back(master);
+            }
+            if (all_success && !writeManifest(options.manifest_file, checksums)) {
+                return false;
+            }
+        }
+        
         return all_success;
     }
     
 private:
+    // Fits every rung to the source: no upscaling, display aspect kept,
+    // bitrates follow the pixels actually encoded
+    void planProfiles(const SourceGeometry& source) {
+        std::vector<RungBox> boxes;
+        for (const auto& profile : profiles) {
+            boxes.push_back({profile.width, profile.height, profile.video_bitrate});
+        }
+        
+        std::vector<HLSProfile> planned;
+        for (const RungGeometry& rung : planLadder(source, boxes)) {
+            HLSProfile profile = profiles[rung.index];
+            profile.bandwidth -= profile.video_bitrate - rung.video_bitrate;
+            profile.width = rung.width;
+            profile.height = rung.height;
+            profile.video_bitrate = rung.video_bitrate;
+            planned.push_back(profile);
+        }
+        
+        for (const auto& profile : profiles) {
+            bool kept = std::any_of(planned.begin(), planned.end(),
+                                    [&](const HLSProfile& p) { return p.name == profile.name; });
+            if (!kept) {
+                std::cout << "Skipping " << profile.name << " profile: picture is only "
+                          << source.visibleWidth() << "x" << source.visibleHeight() << "\n";
+            }
+        }
+        profiles = planned;
+    }
+    
     bool createDirectoryStructure() {
         try {
             // Create main output directory
@@ -112,6 +293,12 @@ private:
             for (const auto& profile : profiles) {
                 fs::create_directories(output_dir + "/" + profile.folder_name);
             }
+            for (const auto& track : tracks.audio) {
+                fs::create_directories(output_dir + "/" + track.folder_name);
+            }
+            for (const auto& track : tracks.subtitles) {
+                fs::create_directories(output_dir + "/" + track.folder_name);
+            }
             
             return true;
         } catch (const std::exception& e) {
@@ -120,19 +307,59 @@ private:
         }
     }
     
-    bool processProfile(const HLSProfile& profile) {
+    // x264 threads per rung in proportion to its pixel rate. All rungs share
+    // the source frame rate, so that is width * height. At least one each.
+    std::vector<int> splitThreads(int total) const {
+        double total_pixels = 0;
+        for (const auto& profile : profiles) {
+            total_pixels += pixelRate(profile);
+        }
+        
+        std::vector<int> threads(profiles.size(), 1);
+        std::vector<std::pair<double, size_t>> remainders;
+        int assigned = 0;
+        for (size_t i = 0; i < profiles.size(); i++) {
+            double share = total * pixelRate(profiles[i]) / total_pixels;
+            threads[i] = std::max(1, static_cast<int>(share));
+            assigned += threads[i];
+            remainders.push_back({share - static_cast<int>(share), i});
+        }
+        
+        // Largest remainders take what rounding down left over
+        std::sort(remainders.rbegin(), remainders.rend());
+        for (size_t i = 0; assigned < total && i < remainders.size(); i++, assigned++) {
+            threads[remainders[i].second]++;
+        }
+        return threads;
+    }
+    
+    static double pixelRate(const HLSProfile& profile) {
+        return static_cast<double>(profile.width) * profile.height;
+    }
+    
+    bool processProfile(const HLSProfile& profile, int threads, ChildProcess& process, std::string& report) {
         std::string profile_dir = output_dir + "/" + profile.folder_name;
+        std::stringstream out;
+        out << "\nProcessing " << profile.name << " profile:\n";
+        out << "  Resolution: " << profile.width << "x" << profile.height << "\n";
+        out << "  Video bitrate: " << (profile.video_bitrate/1000) << " kbps\n";
+        out << "  Audio bitrate: " << (profile.audio_bitrate/1000) << " kbps\n";
+        out << "  Total bandwidth: " << (profile.bandwidth/1000) << " kbps\n";
+        out << "  Encoder threads: " << threads << "\n";
         
-        // Build FFmpeg command for HLS segmentation
+        // Build FFmpeg command for HLS segmentation (video only, audio
+        // and subtitles are separate renditions)
         std::stringstream cmd;
-        cmd << "ffmpeg -i \"" << input_file << "\" ";
+        cmd << "ffmpeg " << trimInputArgs(trim) << "-i \"" << input_file << "\" ";
+        cmd << "-map 0:v:0 -an -sn ";
         
         // Video encoding settings
         cmd << "-c:v libx264 ";
+        cmd << "-threads " << threads << " ";
         cmd << "-b:v " << profile.video_bitrate << " ";
         cmd << "-maxrate " << profile.video_bitrate << " ";
         cmd << "-bufsize " << (profile.video_bitrate * 2) << " ";
-        cmd << "-vf scale=" << profile.width << ":" << profile.height << " ";
+        cmd << "-vf " << cropFilter(geometry) << toneMapFilter(hdr) << "scale=" << profile.width << ":" << profile.height << ",setsar=1 ";
         cmd << "-preset fast ";
         cmd << "-profile:v high ";
         cmd << "-level 4.1 ";
@@ -142,12 +369,6 @@ private:
         cmd << "-keyint_min " << (30 * segment_duration) << " ";
         cmd << "-sc_threshold 0 ";  // Disable scene cut detection
         
-        // Audio encoding settings
-        cmd << "-c:a aac ";
-        cmd << "-b:a " << profile.audio_bitrate << " ";
-        cmd << "-ar 44100 ";
-        cmd << "-ac 2 ";
-        
         // HLS specific settings
         cmd << "-f hls ";
         cmd << "-hls_time " << segment_duration << " ";
@@ -160,21 +381,29 @@ private:
         cmd << "\"" << profile_dir << "/index.m3u8\" ";
         
         // Add overwrite flag and hide banner
-        cmd << "-y -hide_banner -loglevel warning 2>&1";
+        cmd << "-y -hide_banner -loglevel warning";
         
-        std::cout << "  Executing: Segmenting video into HLS format...\n";
+        out << "  Executing: Segmenting video into HLS format...\n";
         
-        // Execute FFmpeg command
-        int result = system(cmd.str().c_str());
+        // Execute FFmpeg command, its output goes into this rung's report
+        std::string ffmpeg_output;
+        int result;
+        {
+            TRACE_SCOPE(options.trace, "ffmpeg encode", "encode", profile.name);
+            result = process.start(cmd.str()) ? process.wait(ffmpeg_output) : -1;
+        }
+        out << ffmpeg_output;
         
         if (result != 0) {
-            std::cerr << "  ❌ FFmpeg failed for profile: " << profile.name << "\n";
+            out << "  ❌ FFmpeg failed for profile: " << profile.name << "\n";
+            report = out.str();
             return false;
         }
         
         // Verify output files exist
         if (!fs::exists(profile_dir + "/index.m3u8")) {
-            std::cerr << "  ❌ Playlist not created for profile: " << profile.name << "\n";
+            out << "  ❌ Playlist not created for profile: " << profile.name << "\n";
+            report = out.str();
             return false;
         }
         
@@ -186,8 +415,49 @@ private:
             }
         }
         
-        std::cout << "  ✅ Created " << segment_count << " segments\n";
+        out << "  ✅ Created " << segment_count << " segments\n";
+        out << "  Cost: " << describeUsage(process.usage()) << "\n";
+        report = out.str();
+        
+        return true;
+    }
+    
+    bool processRenditions(ChildProcess& process, std::string& report) {
+        if (tracks.audio.empty() && tracks.subtitles.empty()) {
+            return true;
+        }
+        
+        std::stringstream out;
+        out << "\nProcessing renditions: " << tracks.audio.size() << " audio, "
+            << tracks.subtitles.size() << " subtitle\n";
+        
+        // Every audio track is encoded once, at the best profile's audio bitrate
+        int audio_bitrate = 0;
+        for (const auto& profile : profiles) {
+            audio_bitrate = std::max(audio_bitrate, profile.audio_bitrate);
+        }
+        
+        std::stringstream cmd;
+        cmd << "ffmpeg " << trimInputArgs(trim) << "-i \"" << input_file << "\" ";
+        cmd << hlsRenditionArgs(tracks, output_dir, segment_duration, audio_bitrate);
+        cmd << "-y -hide_banner -loglevel warning";
+        
+        std::string ffmpeg_output;
+        int result;
+        {
+            TRACE_SCOPE(options.trace, "ffmpeg renditions", "encode");
+            result = process.start(cmd.str()) ? process.wait(ffmpeg_output) : -1;
+        }
+        out << ffmpeg_output;
+        if (result != 0) {
+            out << "  ❌ FFmpeg failed for audio/subtitle renditions\n";
+            report = out.str();
+            return false;
+        }
         
+        out << "  ✅ Renditions created\n";
+        out << "  Cost: " << describeUsage(process.usage()) << "\n";
+        report = out.str();
         return true;
     }
     
@@ -204,10 +474,13 @@ private:
         playlist << "#EXTM3U\n";
         playlist << "#EXT-X-VERSION:3\n\n";
         
+        writeMediaGroups(playlist, tracks);
+        
         // Write stream info for each profile
         for (const auto& profile : profiles) {
             playlist << "#EXT-X-STREAM-INF:BANDWIDTH=" << profile.bandwidth;
             playlist << ",RESOLUTION=" << profile.width << "x" << profile.height;
+            playlist << mediaGroupAttributes(tracks);
             playlist << "\n";
             playlist << profile.folder_name << "/index.m3u8\n\n";
         }
@@ -229,7 +502,7 @@ private:
     }
 };
 
-int convert_hls(const std::string& input_file, const std::string& output_dir) {
+int convert_hls(const std::string& input_file, const std::string& output_dir, const ConvertOptions& options) {
     
     // Check if input file exists
     if (!fs::exists(input_file)) {
@@ -251,7 +524,7 @@ int convert_hls(const std::string& input_file, const std::string& output_dir) {
     std::cout << "Output: " << output_dir << "\n";
     std::cout << "=================================\n\n";
     
-    VideoConverterHLS converter(input_file, output_dir);
+    VideoConverterHLS converter(input_file, output_dir, options);
     
     if (converter.convert()) {
         std::cout << "\n✨ HLS conversion successful!\n";
@@ -2,7 +2,9 @@
 #define CONVERTER_HLS_H
 
 #include <string>
+#include "convert_options.h"
 
-int convert_hls(const std::string& input_file, const std::string& output_directory);
+int convert_hls(const std::string& input_file, const std::string& output_directory,
+                const ConvertOptions& options = ConvertOptions());
 
 #endif // CONVERTER_HLS_H
\ No newline at end of file
@@ -1,9 +1,20 @@
 #include "converter_standard.h"
+#include "loudness.h"
+#include "checksum.h"
+#include "geometry.h"
+#include "crop_detect.h"
+#include "slice_scaler.h"
+#include "tone_map.h"
+#include "pixel_format.h"
+#include "executor.h"
+#include "mux_thread.h"
+#include "trace.h"
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <filesystem>
 #include <cstdint>
+#include <cmath>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -17,12 +28,27 @@ extern "C" {
 
 namespace fs = std::filesystem;
 
+// Source audio is stream-copied when its bitrate is within this fraction of the target
+const double AUDIO_PASSTHROUGH_BITRATE_TOLERANCE = 0.15;
+
+// Output is fitted into this box, never upscaled
+const RungBox OUTPUT_BOX = {1920, 1080, 4000000};
+
+// Smaller loudness corrections are not worth re-encoding audio for
+const double LOUDNESS_GAIN_THRESHOLD_DB = 0.5;
+
+#ifndef AV_PROFILE_AAC_LOW
+#define AV_PROFILE_AAC_LOW FF_PROFILE_AAC_LOW
+#endif
+
 class VideoConverter {
 private:
     std::string input_file;
     std::string output_file;
+    ConvertOptions options;
     AVFormatContext* input_ctx = nullptr;
     AVFormatContext* output_ctx = nullptr;
+    MuxThread* muxer = nullptr;
     
     struct StreamContext {
         AVCodecContext* decoder_ctx = nullptr;
@@ -36,12 +62,22 @@ private:
     
     StreamContext video_stream;
     StreamContext audio_stream;
-    SwsContext* sws_ctx = nullptr;
+    std::unique_ptr<Executor> scale_pool;   // bands of the scaler and tone mapper; outlives them
+    SliceScaler scaler;
+    ToneMapper tone_mapper;
     SwrContext* swr_ctx = nullptr;
+    SourceGeometry source_geometry;
+    RungGeometry output_geometry;
+    HdrInfo hdr_info;
+    bool frames_by_reference = false;   // decoded frames are already encoder-ready
+    bool audio_passthrough = false;
+    std::unique_ptr<LoudnessMeter> loudness_meter;
+    double audio_gain_db = 0.0;
+    FileChecksum output_checksum;
     
 public:
-    VideoConverter(const std::string& in, const std::string& out) 
-        : input_file(in), output_file(out) {}
+    VideoConverter(const std::string& in, const std::string& out, const ConvertOptions& opts) 
+        : input_file(in), output_file(out), options(opts) {}
     
     ~VideoConverter() {
         cleanup();
@@ -53,6 +89,10 @@ public:
             return false;
         }
         
+        if (audio_stream.stream_index >= 0) {
+            setupLoudness();
+        }
+        
         if (!openOutputFile()) {
             std::cerr << "Failed to open output file\n";
             return false;
@@ -83,11 +123,55 @@ public:
             return false;
         }
         
+        if (loudness_meter && !normalizeOutput()) {
+            std::cerr << "Failed to normalize audio loudness\n";
+            return false;
+        }
+        
+        if (!options.manifest_file.empty() &&
+            !writeManifest(options.manifest_file, {output_checksum})) {
+            return false;
+        }
+        
         return true;
     }
     
 private:
+    void setupLoudness() {
+        if (options.loudness_mode == "prescan") {
+            std::cout << "Measuring loudness (audio-only pre-scan)...\n";
+            LoudnessResult measured;
+            if (!measureLoudness(input_file, measured)) {
+                std::cerr << "Warning: Loudness pre-scan failed, audio left unchanged\n";
+                return;
+            }
+            audio_gain_db = loudnessGain(measured, options.target_lufs, options.max_true_peak);
+            std::cout << "Loudness: " << measured.integrated_lufs << " LUFS, true peak: "
+                      << measured.true_peak_dbtp << " dBTP, gain: " << audio_gain_db << " dB\n";
+        } else if (options.loudness_mode == "twopass") {
+            loudness_meter = std::make_unique<LoudnessMeter>(audio_stream.decoder_ctx->sample_rate,
+                                                             &audio_stream.decoder_ctx->ch_layout);
+        }
+    }
+    
+    // Second, audio-only pass for loudness measured during the transcode
+    bool normalizeOutput() {
+        LoudnessResult measured = loudness_meter->result();
+        double gain = loudnessGain(measured, options.target_lufs, options.max_true_peak);
+        std::cout << "Loudness: " << measured.integrated_lufs << " LUFS, true peak: "
+                  << measured.true_peak_dbtp << " dBTP, gain: " << gain << " dB\n";
+        
+        if (std::abs(gain) < LOUDNESS_GAIN_THRESHOLD_DB || audio_stream.stream_index < 0) {
+            return true;
+        }
+        
+        std::cout << "Rewriting audio with loudness gain\n";
+        return remuxWithAudioGain(input_file, output_file, gain, 128000,
+                                  options.manifest_file.empty() ? nullptr : &output_checksum);
+    }
+    
     bool openInputFile() {
+        TRACE_SCOPE(options.trace, "openInputFile", "input");
         int ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
         if (ret < 0) {
             char errbuf[256];
@@ -125,6 +209,29 @@ private:
             return false;
         }
         
+        source_geometry = sourceGeometry(input_ctx, video_stream.input_stream);
+        if (options.crop_detect) {
+            TRACE_SCOPE(options.trace, "detectCrop", "input");
+            std::string error;
+            if (!detectCrop(input_file, source_geometry, error)) {
+                std::cerr << "Warning: Crop detection failed (" << error << "), encoding the full frame\n";
+            }
+            std::cout << "Crop: " << describeCrop(source_geometry) << "\n";
+        }
+        
+        if (options.tone_map) {
+            TRACE_SCOPE(options.trace, "probeHdr", "input");
+            std::string error;
+            if (!probeHdr(input_file, hdr_info, error)) {
+                std::cerr << "Warning: HDR probe failed (" << error << "), treating the source as SDR\n";
+            }
+            std::cout << "Transfer: " << describeTransfer(hdr_info.transfer) << "\n";
+        }
+        
+        output_geometry = planRung(source_geometry, OUTPUT_BOX);
+        std::cout << "Output size: " << output_geometry.width << "x" << output_geometry.height
+                  << " at " << output_geometry.video_bitrate / 1000 << " kbps\n";
+        
         return true;
     }
     
@@ -185,13 +292,34 @@ private:
             return false;
         }
         
-        // Set up Full HD output parameters
-        video_stream.encoder_ctx->width = 1920;
-        video_stream.encoder_ctx->height = 1080;
-        video_stream.encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
-        video_stream.encoder_ctx->bit_rate = 4000000; // 4 Mbps
+        // Frames the scaler would only copy are handed to the encoder as decoded
+        int source_format = hdr_info.hdr() ? AV_PIX_FMT_YUV420P : video_stream.decoder_ctx->pix_fmt;
+        int direct_format = AV_PIX_FMT_NONE;
+        if (source_geometry.visibleWidth() == output_geometry.width &&
+            source_geometry.visibleHeight() == output_geometry.height) {
+            direct_format = negotiatePixelFormat(encoder, source_format, sdrRungFormats());
+        }
+        frames_by_reference = direct_format != AV_PIX_FMT_NONE;
+        
+        // Planned output size, square pixels
+        video_stream.encoder_ctx->width = output_geometry.width;
+        video_stream.encoder_ctx->height = output_geometry.height;
+        video_stream.encoder_ctx->sample_aspect_ratio = AVRational{1, 1};
+        video_stream.encoder_ctx->pix_fmt = frames_by_reference ? static_cast<AVPixelFormat>(direct_format)
+                                                                : AV_PIX_FMT_YUV420P;
+        if (frames_by_reference && source_format == AV_PIX_FMT_YUVJ420P) {
+            video_stream.encoder_ctx->color_range = AVCOL_RANGE_JPEG;
+        }
+        video_stream.encoder_ctx->bit_rate = output_geometry.video_bitrate;
         video_stream.encoder_ctx->gop_size = 250;
         video_stream.encoder_ctx->max_b_frames = 2;
+        if (hdr_info.hdr()) {
+            // Tone mapped pictures are BT.709 whatever the source was
+            video_stream.encoder_ctx->color_primaries = AVCOL_PRI_BT709;
+            video_stream.encoder_ctx->color_trc = AVCOL_TRC_BT709;
+            video_stream.encoder_ctx->colorspace = AVCOL_SPC_BT709;
+            video_stream.encoder_ctx->color_range = AVCOL_RANGE_MPEG;
+        }
         
         // Set framerate and timebase
         AVRational input_framerate = av_guess_frame_rate(input_ctx, video_stream.input_stream, nullptr);
@@ -223,15 +351,22 @@ private:
             return false;
         }
         
-        // Setup scaler for resolution conversion
-        sws_ctx = sws_getContext(
-            video_stream.decoder_ctx->width, video_stream.decoder_ctx->height,
-            video_stream.decoder_ctx->pix_fmt,
-            1920, 1080, AV_PIX_FMT_YUV420P,
-            SWS_BICUBIC, nullptr, nullptr, nullptr
-        );
-        
-        if (!sws_ctx) {
+        // Setup scaler for resolution conversion, banded across the job's threads.
+        // With frames passed by reference it only takes frames whose format
+        // or size changed mid-stream.
+        scale_pool = options.framePool();
+        if (hdr_info.hdr()) {
+            // HDR frames are tone mapped at source size first, the scaler takes 8-bit SDR
+            if (!tone_mapper.init(source_geometry.visibleWidth(), source_geometry.visibleHeight(),
+                                  video_stream.decoder_ctx->pix_fmt, hdr_info, scale_pool.get())) {
+                std::cerr << "Failed to set up tone mapping\n";
+                return false;
+            }
+        }
+        if (!scaler.init(source_geometry.visibleWidth(), source_geometry.visibleHeight(),
+                         source_format,
+                         output_geometry.width, output_geometry.height, video_stream.encoder_ctx->pix_fmt,
+                         SWS_BICUBIC, scale_pool.get())) {
             std::cerr << "Failed to create scaler context\n";
             return false;
         }
@@ -244,6 +379,10 @@ private:
             return true; // No audio stream
         }
         
+        if (canPassthroughAudio()) {
+            return setupAudioPassthrough();
+        }
+        
         const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
         if (!encoder) {
             std::cerr << "AAC encoder not found\n";
@@ -315,9 +454,56 @@ private:
         return true;
     }
     
+    bool canPassthroughAudio() {
+        const AVCodecParameters* par = audio_stream.input_stream->codecpar;
+        AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+        
+        // Loudness has to be measured or corrected on decoded samples
+        if (loudness_meter || std::abs(audio_gain_db) >= LOUDNESS_GAIN_THRESHOLD_DB) {
+            return false;
+        }
+        if (par->codec_id != AV_CODEC_ID_AAC || par->profile != AV_PROFILE_AAC_LOW) {
+            return false;
+        }
+        if (av_channel_layout_compare(&par->ch_layout, &stereo) != 0) {
+            return false;
+        }
+        
+        // Unknown source bitrate cannot be checked against the target
+        if (par->bit_rate <= 0) {
+            return false;
+        }
+        double deviation = std::abs(static_cast<double>(par->bit_rate) - 128000) / 128000;
+        return deviation <= AUDIO_PASSTHROUGH_BITRATE_TOLERANCE;
+    }
+    
+    bool setupAudioPassthrough() {
+        audio_stream.output_stream = avformat_new_stream(output_ctx, nullptr);
+        if (!audio_stream.output_stream) {
+            std::cerr << "Failed to allocate audio output stream\n";
+            return false;
+        }
+        
+        if (avcodec_parameters_copy(audio_stream.output_stream->codecpar, audio_stream.input_stream->codecpar) < 0) {
+            std::cerr << "Failed to copy audio codec parameters\n";
+            return false;
+        }
+        
+        // Let the muxer pick the tag for the output container
+        audio_stream.output_stream->codecpar->codec_tag = 0;
+        audio_stream.output_stream->time_base = audio_stream.input_stream->time_base;
+        audio_passthrough = true;
+        
+        std::cout << "Audio: stream copy (source is AAC-LC stereo at target bitrate)\n";
+        return true;
+    }
+    
     bool writeHeader() {
         if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
-            if (avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            int ret = options.manifest_file.empty()
+                      ? avio_open(&output_ctx->pb, output_file.c_str(), AVIO_FLAG_WRITE)
+                      : openHashedOutput(&output_ctx->pb, output_file);
+            if (ret < 0) {
                 std::cerr << "Could not open output file\n";
                 return false;
             }
@@ -336,10 +522,14 @@ private:
             return false;
         }
         
+        muxer = new MuxThread(output_ctx, options.mux_queue_packets, options.mux_interleave_window,
+                              options.trace, fs::path(output_file).filename().string());
+        muxer->start();
         return true;
     }
     
     bool transcodeStreams() {
+        TRACE_SCOPE(options.trace, "transcode", "job");
         AVPacket* packet = av_packet_alloc();
         AVFrame* frame = av_frame_alloc();
         AVFrame* scaled_frame = nullptr;
@@ -348,9 +538,9 @@ private:
         // Allocate scaled frame for video
         if (video_stream.stream_index >= 0) {
             scaled_frame = av_frame_alloc();
-            scaled_frame->format = AV_PIX_FMT_YUV420P;
-            scaled_frame->width = 1920;
-            scaled_frame->height = 1080;
+            scaled_frame->format = video_stream.encoder_ctx->pix_fmt;
+            scaled_frame->width = output_geometry.width;
+            scaled_frame->height = output_geometry.height;
             av_frame_get_buffer(scaled_frame, 0);
         }
         
@@ -365,6 +555,13 @@ private:
             if (packet->stream_index == video_stream.stream_index) {
                 ctx = &video_stream;
             } else if (packet->stream_index == audio_stream.stream_index) {
+                if (audio_passthrough) {
+                    if (!writePassthroughPacket(packet)) {
+                        std::cerr << "Failed to copy audio packet\n";
+                    }
+                    av_packet_unref(packet);
+                    continue;
+                }
                 ctx = &audio_stream;
             } else {
                 av_packet_unref(packet);
@@ -372,7 +569,11 @@ private:
             }
             
             // Send packet to decoder
-            int ret = avcodec_send_packet(ctx->decoder_ctx, packet);
+            int ret;
+            {
+                TRACE_SCOPE(options.trace, "decode", "decode");
+                ret = avcodec_send_packet(ctx->decoder_ctx, packet);
+            }
             if (ret < 0) {
                 av_packet_unref(packet);
                 continue;
@@ -380,7 +581,10 @@ private:
             
             // Receive frames from decoder
             while (ret >= 0) {
-                ret = avcodec_receive_frame(ctx->decoder_ctx, frame);
+                {
+                    TRACE_SCOPE(options.trace, "receive frame", "decode");
+                    ret = avcodec_receive_frame(ctx->decoder_ctx, frame);
+                }
                 if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                     break;
                 } else if (ret < 0) {
@@ -394,6 +598,14 @@ private:
                         std::cerr << "Failed to process video frame\n";
                     }
                 } else if (packet->stream_index == audio_stream.stream_index) {
+                    if (loudness_meter) {
+                        loudness_meter->addFrame(frame);
+                    }
+                    if (std::abs(audio_gain_db) >= LOUDNESS_GAIN_THRESHOLD_DB &&
+                        av_frame_make_writable(frame) >= 0) {
+                        applyAudioGain(frame, audio_gain_db);
+                    }
+                    
                     // Process audio frame
                     if (!processAudioFrame(frame, resampled_frame)) {
                         std::cerr << "Failed to process audio frame\n";
@@ -425,16 +637,37 @@ private:
     }
     
     bool processVideoFrame(AVFrame* input_frame, AVFrame* output_frame) {
-        // Scale the frame
-        sws_scale(sws_ctx, input_frame->data, input_frame->linesize, 0,
-                 input_frame->height, output_frame->data, output_frame->linesize);
+        TRACE_SCOPE(options.trace, "processVideoFrame", "video");
+        // Bars are cut off by moving the plane pointers, HDR is tone mapped, then the frame is scaled
+        cropFrame(input_frame, source_geometry);
+        const AVFrame* picture = hdr_info.hdr() ? tone_mapper.process(input_frame) : input_frame;
+        if (!picture) {
+            return false;
+        }
+        
+        AVFrame* reference = nullptr;
+        AVFrame* frame_to_encode = output_frame;
+        if (frames_by_reference && picture->width == output_geometry.width &&
+            picture->height == output_geometry.height &&
+            plainPixelFormat(picture->format) == video_stream.encoder_ctx->pix_fmt) {
+            // Encoder-ready as decoded: the encoder takes its own reference, nothing is copied
+            reference = av_frame_clone(picture);
+            if (!reference) {
+                return false;
+            }
+            retagFullRange(reference);
+            frame_to_encode = reference;
+        } else {
+            scaler.scale(picture, output_frame);
+        }
         
         // Set proper PTS for the frame
-        output_frame->pts = video_stream.next_pts;
+        frame_to_encode->pts = video_stream.next_pts;
         video_stream.next_pts++;
         
         // Send frame to encoder
-        int ret = avcodec_send_frame(video_stream.encoder_ctx, output_frame);
+        int ret = avcodec_send_frame(video_stream.encoder_ctx, frame_to_encode);
+        av_frame_free(&reference);
         if (ret < 0) {
             char errbuf[256];
             av_strerror(ret, errbuf, sizeof(errbuf));
@@ -447,6 +680,7 @@ private:
     }
     
     bool processAudioFrame(AVFrame* input_frame, AVFrame* output_frame) {
+        TRACE_SCOPE(options.trace, "processAudioFrame", "audio");
         AVFrame* frame_to_encode = input_frame;
         
         // Resample if needed
@@ -514,21 +748,30 @@ private:
             // Rescale timestamps
             av_packet_rescale_ts(packet, ctx->encoder_ctx->time_base, ctx->output_stream->time_base);
             
-            // Write packet
-            ret = av_interleaved_write_frame(output_ctx, packet);
-            if (ret < 0) {
-                char errbuf[256];
-                av_strerror(ret, errbuf, sizeof(errbuf));
-                std::cerr << "Error writing packet: " << errbuf << "\n";
-            }
-            
-            av_packet_unref(packet);
+            // Handed to the mux thread, which reports write errors
+            muxer->push(packet);
         }
         
         av_packet_free(&packet);
         return true;
     }
     
+    bool writePassthroughPacket(AVPacket* packet) {
+        // Re-encoded audio starts at zero, so copied audio does the same
+        int64_t start_time = audio_stream.input_stream->start_time;
+        if (start_time != AV_NOPTS_VALUE) {
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts -= start_time;
+            if (packet->dts != AV_NOPTS_VALUE) packet->dts -= start_time;
+        }
+        
+        packet->stream_index = audio_stream.output_stream->index;
+        packet->pos = -1;
+        av_packet_rescale_ts(packet, audio_stream.input_stream->time_base, audio_stream.output_stream->time_base);
+        
+        muxer->push(packet);
+        return true;
+    }
+    
     void flushDecoder(StreamContext* ctx, AVFrame* output_frame) {
         if (!ctx->decoder_ctx) return;
         
@@ -542,6 +785,13 @@ private:
             if (ctx == &video_stream && output_frame) {
                 processVideoFrame(frame, output_frame);
             } else if (ctx == &audio_stream && output_frame) {
+                if (loudness_meter) {
+                    loudness_meter->addFrame(frame);
+                }
+                if (std::abs(audio_gain_db) >= LOUDNESS_GAIN_THRESHOLD_DB &&
+                    av_frame_make_writable(frame) >= 0) {
+                    applyAudioGain(frame, audio_gain_db);
+                }
                 processAudioFrame(frame, output_frame);
             }
         }
@@ -551,6 +801,7 @@ private:
     
     void flushEncoder(StreamContext* ctx) {
         if (!ctx->encoder_ctx) return;
+        TRACE_SCOPE(options.trace, "flushEncoder", "encode");
         
         // Send flush signal to encoder
         avcodec_send_frame(ctx->encoder_ctx, nullptr);
@@ -560,7 +811,19 @@ private:
     }
     
     bool writeTrailer() {
+        bool muxed = muxer->finish();
+        MuxStats stats = muxer->stats();
+        std::cout << "Mux queue: peak " << stats.peak_depth << "/" << stats.capacity << " packets, "
+                  << stats.producer_stalls << " encoder stalls\n";
+        if (!muxed) {
+            std::cerr << stats.write_errors << " packets could not be written\n";
+            return false;
+        }
+        
         av_write_trailer(output_ctx);
+        if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+            return closeHashedOutput(&output_ctx->pb, &output_checksum);
+        }
         return true;
     }
     
@@ -577,25 +840,25 @@ private:
         if (audio_stream.encoder_ctx) {
             avcodec_free_context(&audio_stream.encoder_ctx);
         }
-        if (sws_ctx) {
-            sws_freeContext(sws_ctx);
-        }
         if (swr_ctx) {
             swr_free(&swr_ctx);
         }
         if (input_ctx) {
             avformat_close_input(&input_ctx);
         }
+        // The writer still uses the output context until it is joined
+        delete muxer;
+        muxer = nullptr;
         if (output_ctx) {
             if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
-                avio_closep(&output_ctx->pb);
+                closeHashedOutput(&output_ctx->pb, nullptr);
             }
             avformat_free_context(output_ctx);
         }
     }
 };
 
-int convert_standard(const std::string& input_file, const std::string& output_file) {
+int convert_standard(const std::string& input_file, const std::string& output_file, const ConvertOptions& options) {
     // Check if input file exists
     if (!fs::exists(input_file)) {
         std::cerr << "Error: Input file does not exist: " << input_file << "\n";
@@ -609,9 +872,9 @@ int convert_standard(const std::string& input_file, const std::string& output_fi
     }
     
     std::cout << "Converting: " << input_file << " -> " << output << "\n";
-    std::cout << "Output: x264 Full HD (1920x1080)\n";
+    std::cout << "Output: x264, up to Full HD (1920x1080)\n";
     
-    VideoConverter converter(input_file, output);
+    VideoConverter converter(input_file, output, options);
     
     if (converter.convert()) {
         std::cout << "Conversion successful!\n";
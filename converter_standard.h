@@ -2,7 +2,9 @@
 #define CONVERTER_STANDARD_H
 
 #include <string>
+#include "convert_options.h"
 
-int convert_standard(const std::string& input_file, const std::string& output_file);
+int convert_standard(const std::string& input_file, const std::string& output_file,
+                     const ConvertOptions& options = ConvertOptions());
 
 #endif // CONVERTER_STANDARD_H
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include "crop_detect.h"
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/mathematics.h>
+#include <libswscale/swscale.h>
+}
+
+// Frames decoded per title, spread evenly between 5% and 95%
+const int CROP_SAMPLE_FRAMES = 12;
+
+// Rows and columns whose mean luma stays at or below this are bars. Same
+// default as ffmpeg's cropdetect.
+const int BLACK_LUMA_LIMIT = 24;
+
+// Bars thinner than this fraction of the frame are not worth a rescale
+const double MIN_CROP_FRACTION = 0.02;
+
+// Fewer frames with picture content than this and nothing is cropped
+const int MIN_CONTENT_FRAMES = 3;
+
+// Packets read after a seek before the sample is given up
+const int MAX_PACKETS_PER_SAMPLE = 500;
+
+// Sample spacing in frames when the duration is unknown and nothing is seeked
+const int UNSEEKED_SAMPLE_SPACING = 25;
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+
+// Picture area of one frame, inclusive bounds
+struct Bounds {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
+template <typename V>
+static uint64_t lanesSum(const V& v) {
+    uint64_t sum = 0;
+    for (int i = 0; i < 16; i++) {
+        sum += v[i];
+    }
+    return sum;
+}
+
+// Luma sums of every row and column of an 8-bit plane in one pass. Sixteen
+// pixels at a time are widened and added to a row accumulator and to that
+// stripe's column accumulators.
+static void scanLuma(const uint8_t* data, int linesize, int width, int height,
+                     std::vector<uint64_t>& rows, std::vector<uint64_t>& columns) {
+    int vectors = width / 16;
+    std::vector<v16u32> column_acc(vectors, v16u32{});
+    rows.assign(height, 0);
+    columns.assign(width, 0);
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t* line = data + static_cast<ptrdiff_t>(y) * linesize;
+        uint64_t row_sum = 0;
+        v16u16 row_acc = {};
+        for (int i = 0; i < vectors; i++) {
+            v16u8 chunk;
+            memcpy(&chunk, line + i * 16, sizeof(chunk));
+            row_acc += __builtin_convertvector(chunk, v16u16);
+            column_acc[i] += __builtin_convertvector(chunk, v16u32);
+            // 256 additions of 255 are the most a 16-bit lane holds
+            if ((i & 255) == 255) {
+                row_sum += lanesSum(row_acc);
+                row_acc = v16u16{};
+            }
+        }
+        row_sum += lanesSum(row_acc);
+        for (int x = vectors * 16; x < width; x++) {
+            row_sum += line[x];
+            columns[x] += line[x];
+        }
+        rows[y] = row_sum;
+    }
+
+    for (int i = 0; i < vectors; i++) {
+        for (int lane = 0; lane < 16; lane++) {
+            columns[i * 16 + lane] += column_acc[i][lane];
+        }
+    }
+}
+
+// False for frames that are black all over (fades, slates)
+static bool findBounds(const uint8_t* data, int linesize, int width, int height, Bounds& bounds) {
+    std::vector<uint64_t> rows;
+    std::vector<uint64_t> columns;
+    scanLuma(data, linesize, width, height, rows, columns);
+
+    uint64_t row_limit = static_cast<uint64_t>(BLACK_LUMA_LIMIT) * width;
+    uint64_t column_limit = static_cast<uint64_t>(BLACK_LUMA_LIMIT) * height;
+    auto row_lit = [&](uint64_t sum) { return sum > row_limit; };
+    auto column_lit = [&](uint64_t sum) { return sum > column_limit; };
+
+    auto top = std::find_if(rows.begin(), rows.end(), row_lit);
+    if (top == rows.end()) {
+        return false;
+    }
+    auto bottom = std::find_if(rows.rbegin(), rows.rend(), row_lit);
+    auto left = std::find_if(columns.begin(), columns.end(), column_lit);
+    auto right = std::find_if(columns.rbegin(), columns.rend(), column_lit);
+    if (left == columns.end()) {
+        return false;
+    }
+
+    bounds.top = static_cast<int>(top - rows.begin());
+    bounds.bottom = height - 1 - static_cast<int>(bottom - rows.rbegin());
+    bounds.left = static_cast<int>(left - columns.begin());
+    bounds.right = width - 1 - static_cast<int>(right - columns.rbegin());
+    return true;
+}
+
+// Next decoded frame of the stream; at end of file the decoder is drained
+static bool decodeFrame(AVFormatContext* input_ctx, AVCodecContext* decoder_ctx, int stream_index,
+                        AVPacket* packet, AVFrame* frame) {
+    for (int packets = 0; packets < MAX_PACKETS_PER_SAMPLE; packets++) {
+        int ret = avcodec_receive_frame(decoder_ctx, frame);
+        if (ret == 0) {
+            return true;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            return false;
+        }
+
+        ret = av_read_frame(input_ctx, packet);
+        if (ret < 0) {
+            avcodec_send_packet(decoder_ctx, nullptr);
+            continue;
+        }
+        if (packet->stream_index == stream_index) {
+            avcodec_send_packet(decoder_ctx, packet);
+        }
+        av_packet_unref(packet);
+    }
+    return false;
+}
+
+// Widens [begin, end) to even bounds and drops it when the bars are thin
+static void cropAxis(int begin, int end, int size, int& offset, int& length) {
+    begin &= ~1;
+    end = std::min(size, (end + 1) & ~1);
+    if (size - (end - begin) < size * MIN_CROP_FRACTION) {
+        begin = 0;
+        end = size;
+    }
+    offset = begin;
+    length = end - begin;
+}
+
+bool detectCrop(const std::string& input_file, SourceGeometry& geometry, std::string& error) {
+    AVFormatContext* input_ctx = nullptr;
+    int ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
+    if (ret < 0 || avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        error = "cannot open input";
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVStream* stream = nullptr;
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        AVStream* candidate = input_ctx->streams[i];
+        if (candidate->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            !(candidate->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            stream = candidate;
+            break;
+        }
+    }
+
+    const AVCodec* decoder = stream ? avcodec_find_decoder(stream->codecpar->codec_id) : nullptr;
+    AVCodecContext* decoder_ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    if (!decoder_ctx || avcodec_parameters_to_context(decoder_ctx, stream->codecpar) < 0 ||
+        avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
+        error = "cannot open video decoder";
+        avcodec_free_context(&decoder_ctx);
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    AVFrame* gray = av_frame_alloc();
+    SwsContext* sws_ctx = nullptr;
+    int width = geometry.width;
+    int height = geometry.height;
+    gray->format = AV_PIX_FMT_GRAY8;
+    gray->width = width;
+    gray->height = height;
+    av_frame_get_buffer(gray, 32);
+
+    int64_t duration = input_ctx->duration != AV_NOPTS_VALUE ? input_ctx->duration : 0;
+    int64_t start = input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+
+    Bounds picture = {width, height, -1, -1};
+    int content_frames = 0;
+    for (int sample = 0; sample < CROP_SAMPLE_FRAMES; sample++) {
+        if (duration > 0) {
+            int64_t position = start + duration / 20 + duration * 9 / 10 * sample / (CROP_SAMPLE_FRAMES - 1);
+            int64_t timestamp = av_rescale_q(position, AVRational{1, AV_TIME_BASE}, stream->time_base);
+            if (av_seek_frame(input_ctx, stream->index, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+                break;
+            }
+            avcodec_flush_buffers(decoder_ctx);
+        } else {
+            // No duration to spread over: frames a second or so apart from the start
+            for (int skip = 0; sample > 0 && skip < UNSEEKED_SAMPLE_SPACING; skip++) {
+                if (!decodeFrame(input_ctx, decoder_ctx, stream->index, packet, frame)) {
+                    break;
+                }
+                av_frame_unref(frame);
+            }
+        }
+
+        if (!decodeFrame(input_ctx, decoder_ctx, stream->index, packet, frame)) {
+            break;
+        }
+        if (frame->width != width || frame->height != height) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        if (!sws_ctx) {
+            sws_ctx = sws_getContext(width, height, static_cast<AVPixelFormat>(frame->format),
+                                     width, height, AV_PIX_FMT_GRAY8, SWS_POINT, nullptr, nullptr, nullptr);
+            if (!sws_ctx) {
+                av_frame_unref(frame);
+                break;
+            }
+        }
+        sws_scale(sws_ctx, frame->data, frame->linesize, 0, height, gray->data, gray->linesize);
+        av_frame_unref(frame);
+
+        Bounds bounds;
+        if (findBounds(gray->data[0], gray->linesize[0], width, height, bounds)) {
+            picture.left = std::min(picture.left, bounds.left);
+            picture.top = std::min(picture.top, bounds.top);
+            picture.right = std::max(picture.right, bounds.right);
+            picture.bottom = std::max(picture.bottom, bounds.bottom);
+            content_frames++;
+        }
+    }
+
+    sws_freeContext(sws_ctx);
+    av_frame_free(&gray);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+
+    geometry.crop_x = geometry.crop_y = geometry.crop_width = geometry.crop_height = 0;
+    if (content_frames < MIN_CONTENT_FRAMES) {
+        return true;
+    }
+
+    int x, y, crop_width, crop_height;
+    cropAxis(picture.left, picture.right + 1, width, x, crop_width);
+    cropAxis(picture.top, picture.bottom + 1, height, y, crop_height);
+    if (crop_width < width || crop_height < height) {
+        geometry.crop_x = x;
+        geometry.crop_y = y;
+        geometry.crop_width = crop_width;
+        geometry.crop_height = crop_height;
+    }
+    return true;
+}
+
+std::string describeCrop(const SourceGeometry& geometry) {
+    if (!geometry.cropped()) {
+        return "none";
+    }
+    return std::to_string(geometry.crop_width) + "x" + std::to_string(geometry.crop_height) + "+" +
+           std::to_string(geometry.crop_x) + "+" + std::to_string(geometry.crop_y);
+}
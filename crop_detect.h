@@ -0,0 +1,18 @@
+#ifndef CROP_DETECT_H
+#define CROP_DETECT_H
+
+#include <string>
+#include "geometry.h"
+
+// Finds letterbox and pillarbox bars. A handful of frames spread over the
+// title are decoded and their luma rows and columns averaged; the crop is
+// the union of the picture area of every frame that has any, so a dark
+// scene cannot cut into the picture. Bars thinner than 2% of the frame are
+// left alone. Sets the crop in geometry when there is one to apply; returns
+// false only when the input cannot be decoded.
+bool detectCrop(const std::string& input_file, SourceGeometry& geometry, std::string& error);
+
+// "WxH+X+Y", or "none"
+std::string describeCrop(const SourceGeometry& geometry);
+
+#endif // CROP_DETECT_H
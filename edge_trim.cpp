@@ -0,0 +1,392 @@
+#include "edge_trim.h"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+#include <libswscale/swscale.h>
+}
+
+// Seconds decoded at each end of the title
+const double EDGE_SCAN_SECONDS = 120.0;
+
+// 8-bit luma above this is picture: ffmpeg blackdetect's 10% above
+// video-range black
+const int BLACK_PIXEL_LIMIT = 38;
+
+// A frame is black when at least this share of its pixels is
+const double BLACK_PICTURE_RATIO = 0.98;
+
+const double SILENCE_DBFS = -60.0;
+
+// Shorter edges are not worth cutting
+const double MIN_TRIM_SECONDS = 1.0;
+
+// Frames are judged at a quarter of their size
+const int ANALYSIS_SCALE = 4;
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef uint16_t v16u16 __attribute__((vector_size(32)));
+typedef float v4f __attribute__((vector_size(16)));
+
+// Decoders and scratch buffers for both ends of one input
+struct EdgeScanner {
+    AVFormatContext* input_ctx = nullptr;
+    AVStream* video = nullptr;
+    AVStream* audio = nullptr;
+    AVCodecContext* video_ctx = nullptr;
+    AVCodecContext* audio_ctx = nullptr;
+    AVPacket* packet = nullptr;
+    AVFrame* frame = nullptr;
+
+    SwsContext* sws_ctx = nullptr;
+    AVFrame* gray = nullptr;
+    int sws_width = 0;
+    int sws_height = 0;
+    int sws_format = -1;
+
+    double start_time = 0;          // container start, seconds
+    double frame_seconds = 0.04;
+    std::vector<float> scratch;
+
+    ~EdgeScanner() {
+        sws_freeContext(sws_ctx);
+        av_frame_free(&gray);
+        av_frame_free(&frame);
+        av_packet_free(&packet);
+        avcodec_free_context(&video_ctx);
+        avcodec_free_context(&audio_ctx);
+        avformat_close_input(&input_ctx);
+    }
+};
+
+// Content found in a scanned range, seconds from the start of the file
+struct ContentSpan {
+    double first = -1;
+    double last_end = -1;
+
+    bool found() const { return first >= 0; }
+};
+
+static AVCodecContext* openDecoder(AVStream* stream) {
+    const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    AVCodecContext* ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    if (!ctx || avcodec_parameters_to_context(ctx, stream->codecpar) < 0) {
+        avcodec_free_context(&ctx);
+        return nullptr;
+    }
+    ctx->pkt_timebase = stream->time_base;
+    ctx->thread_count = 0;
+    if (avcodec_open2(ctx, decoder, nullptr) < 0) {
+        avcodec_free_context(&ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+// Pixels above the black limit. Sixteen at a time: the comparison gives
+// all-ones lanes, which are masked to 1 and summed in 16-bit lanes per row.
+static uint64_t brightPixels(const uint8_t* data, int linesize, int width, int height) {
+    const v16u8 limit = v16u8{} + BLACK_PIXEL_LIMIT;
+    int vectors = width / 16;
+    uint64_t bright = 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t* line = data + static_cast<ptrdiff_t>(y) * linesize;
+        v16u16 acc = {};
+        for (int i = 0; i < vectors; i++) {
+            v16u8 chunk;
+            memcpy(&chunk, line + i * 16, sizeof(chunk));
+            v16u8 above = reinterpret_cast<v16u8>(chunk > limit) & 1;
+            acc += __builtin_convertvector(above, v16u16);
+        }
+        for (int lane = 0; lane < 16; lane++) {
+            bright += acc[lane];
+        }
+        for (int x = vectors * 16; x < width; x++) {
+            bright += line[x] > BLACK_PIXEL_LIMIT;
+        }
+    }
+    return bright;
+}
+
+static bool isBlack(EdgeScanner& scanner, const AVFrame* frame) {
+    if (!scanner.sws_ctx || frame->width != scanner.sws_width || frame->height != scanner.sws_height ||
+        frame->format != scanner.sws_format) {
+        sws_freeContext(scanner.sws_ctx);
+        av_frame_free(&scanner.gray);
+        scanner.sws_width = frame->width;
+        scanner.sws_height = frame->height;
+        scanner.sws_format = frame->format;
+
+        scanner.gray = av_frame_alloc();
+        scanner.gray->format = AV_PIX_FMT_GRAY8;
+        scanner.gray->width = std::max(frame->width / ANALYSIS_SCALE, 16);
+        scanner.gray->height = std::max(frame->height / ANALYSIS_SCALE, 16);
+        av_frame_get_buffer(scanner.gray, 32);
+        scanner.sws_ctx = sws_getContext(frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+                                         scanner.gray->width, scanner.gray->height, AV_PIX_FMT_GRAY8,
+                                         SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+        if (!scanner.sws_ctx) {
+            return false;
+        }
+    }
+
+    AVFrame* gray = scanner.gray;
+    sws_scale(scanner.sws_ctx, frame->data, frame->linesize, 0, frame->height, gray->data, gray->linesize);
+    uint64_t bright = brightPixels(gray->data[0], gray->linesize[0], gray->width, gray->height);
+    return bright <= (1.0 - BLACK_PICTURE_RATIO) * gray->width * gray->height;
+}
+
+// Sum of squares, four lanes at a time
+static double sumSquares(const float* samples, int count) {
+    v4f acc = {0, 0, 0, 0};
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        v4f v;
+        memcpy(&v, samples + i, sizeof(v));
+        acc += v * v;
+    }
+    double sum = static_cast<double>(acc[0]) + acc[1] + acc[2] + acc[3];
+    for (; i < count; i++) {
+        sum += static_cast<double>(samples[i]) * samples[i];
+    }
+    return sum;
+}
+
+// Audio level in dBFS RMS over every channel of the frame
+static double frameLevel(EdgeScanner& scanner, const AVFrame* frame) {
+    int channels = frame->ch_layout.nb_channels;
+    int nb_samples = frame->nb_samples;
+    if (channels <= 0 || nb_samples <= 0) {
+        return -144.0;
+    }
+
+    AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+    AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    bool planar = av_sample_fmt_is_planar(format);
+    int planes = planar ? channels : 1;
+    int per_plane = planar ? nb_samples : nb_samples * channels;
+
+    double energy = 0;
+    for (int p = 0; p < planes; p++) {
+        const uint8_t* src = frame->extended_data[p];
+        const float* samples = reinterpret_cast<const float*>(src);
+        if (packed != AV_SAMPLE_FMT_FLT) {
+            scanner.scratch.resize(per_plane);
+            float* dst = scanner.scratch.data();
+            switch (packed) {
+                case AV_SAMPLE_FMT_U8:
+                    for (int i = 0; i < per_plane; i++) dst[i] = (src[i] - 128) / 128.0f;
+                    break;
+                case AV_SAMPLE_FMT_S16:
+                    for (int i = 0; i < per_plane; i++) dst[i] = reinterpret_cast<const int16_t*>(src)[i] / 32768.0f;
+                    break;
+                case AV_SAMPLE_FMT_S32:
+                    for (int i = 0; i < per_plane; i++) dst[i] = reinterpret_cast<const int32_t*>(src)[i] / 2147483648.0f;
+                    break;
+                case AV_SAMPLE_FMT_DBL:
+                    for (int i = 0; i < per_plane; i++) dst[i] = static_cast<float>(reinterpret_cast<const double*>(src)[i]);
+                    break;
+                default:
+                    // Unknown formats count as sound, so nothing is cut
+                    return 0.0;
+            }
+            samples = dst;
+        }
+        energy += sumSquares(samples, per_plane);
+    }
+
+    double mean_square = energy / (static_cast<double>(nb_samples) * channels);
+    return mean_square > 0 ? 10.0 * std::log10(mean_square) : -144.0;
+}
+
+static double frameTime(const EdgeScanner& scanner, const AVFrame* frame, const AVStream* stream) {
+    return frame->best_effort_timestamp * av_q2d(stream->time_base) - scanner.start_time;
+}
+
+// Takes every frame the decoder has ready and records the ones with
+// picture or sound inside [from, to)
+static int receiveFrames(EdgeScanner& scanner, AVCodecContext* ctx, AVStream* stream,
+                         double from, double to, ContentSpan& span) {
+    int ret;
+    while ((ret = avcodec_receive_frame(ctx, scanner.frame)) == 0) {
+        AVFrame* frame = scanner.frame;
+        if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            double time = frameTime(scanner, frame, stream);
+            if (time >= from && time < to) {
+                bool content;
+                double length;
+                if (stream == scanner.video) {
+                    content = !isBlack(scanner, frame);
+                    length = scanner.frame_seconds;
+                } else {
+                    content = frameLevel(scanner, frame) >= SILENCE_DBFS;
+                    length = frame->sample_rate > 0 ? static_cast<double>(frame->nb_samples) / frame->sample_rate : 0;
+                }
+                if (content) {
+                    if (!span.found()) {
+                        span.first = time;
+                    }
+                    span.last_end = std::max(span.last_end, time + length);
+                }
+            }
+        }
+        av_frame_unref(frame);
+    }
+    return ret;
+}
+
+// Decodes [from, to) of the title. The head scan stops at the first
+// content; the tail scan runs to the end of the file.
+static void scanRange(EdgeScanner& scanner, double from, double to, bool stop_at_content, ContentSpan& span) {
+    if (from > 0) {
+        int64_t target = static_cast<int64_t>((scanner.start_time + from) * AV_TIME_BASE);
+        av_seek_frame(scanner.input_ctx, -1, target, AVSEEK_FLAG_BACKWARD);
+    }
+    avcodec_flush_buffers(scanner.video_ctx);
+    if (scanner.audio_ctx) {
+        avcodec_flush_buffers(scanner.audio_ctx);
+    }
+
+    bool draining = false;
+    bool video_done = false;
+    bool audio_done = !scanner.audio_ctx;
+    while (!(video_done && audio_done)) {
+        if (!draining) {
+            if (av_read_frame(scanner.input_ctx, scanner.packet) < 0) {
+                draining = true;
+            } else {
+                AVPacket* packet = scanner.packet;
+                AVStream* stream = scanner.input_ctx->streams[packet->stream_index];
+                // Reordered frames may still be due a little past the end
+                if (packet->pts != AV_NOPTS_VALUE &&
+                    packet->pts * av_q2d(stream->time_base) - scanner.start_time > to + 2.0) {
+                    draining = true;
+                } else if (stream == scanner.video) {
+                    avcodec_send_packet(scanner.video_ctx, packet);
+                } else if (stream == scanner.audio) {
+                    avcodec_send_packet(scanner.audio_ctx, packet);
+                }
+                av_packet_unref(packet);
+            }
+            if (draining) {
+                avcodec_send_packet(scanner.video_ctx, nullptr);
+                if (scanner.audio_ctx) {
+                    avcodec_send_packet(scanner.audio_ctx, nullptr);
+                }
+            }
+        }
+
+        int ret = receiveFrames(scanner, scanner.video_ctx, scanner.video, from, to, span);
+        video_done = video_done || (draining && ret == AVERROR_EOF);
+        if (scanner.audio_ctx) {
+            ret = receiveFrames(scanner, scanner.audio_ctx, scanner.audio, from, to, span);
+            audio_done = audio_done || (draining && ret == AVERROR_EOF);
+        }
+
+        if (stop_at_content && span.found()) {
+            return;
+        }
+    }
+}
+
+bool detectEdgeTrim(const std::string& input_file, double duration, EdgeTrim& trim, std::string& error) {
+    trim = EdgeTrim();
+    EdgeScanner scanner;
+
+    if (avformat_open_input(&scanner.input_ctx, input_file.c_str(), nullptr, nullptr) < 0 ||
+        avformat_find_stream_info(scanner.input_ctx, nullptr) < 0) {
+        error = "cannot open input";
+        return false;
+    }
+
+    for (unsigned int i = 0; i < scanner.input_ctx->nb_streams; i++) {
+        AVStream* stream = scanner.input_ctx->streams[i];
+        AVMediaType type = stream->codecpar->codec_type;
+        if (type == AVMEDIA_TYPE_VIDEO && !scanner.video && !(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            scanner.video = stream;
+        } else if (type == AVMEDIA_TYPE_AUDIO && !scanner.audio) {
+            scanner.audio = stream;
+        } else {
+            stream->discard = AVDISCARD_ALL;
+        }
+    }
+
+    scanner.video_ctx = scanner.video ? openDecoder(scanner.video) : nullptr;
+    if (!scanner.video_ctx) {
+        error = "cannot open video decoder";
+        return false;
+    }
+    // Without a working audio decoder only the picture decides
+    scanner.audio_ctx = scanner.audio ? openDecoder(scanner.audio) : nullptr;
+
+    if (scanner.input_ctx->start_time != AV_NOPTS_VALUE) {
+        scanner.start_time = scanner.input_ctx->start_time / static_cast<double>(AV_TIME_BASE);
+    }
+    AVRational rate = av_guess_frame_rate(scanner.input_ctx, scanner.video, nullptr);
+    if (rate.num > 0 && rate.den > 0) {
+        scanner.frame_seconds = av_q2d(av_inv_q(rate));
+    }
+    scanner.packet = av_packet_alloc();
+    scanner.frame = av_frame_alloc();
+
+    ContentSpan head;
+    scanRange(scanner, 0, EDGE_SCAN_SECONDS, true, head);
+    if (head.found() && head.first >= MIN_TRIM_SECONDS) {
+        trim.start = std::floor(head.first * 1000) / 1000;
+    }
+
+    // The tail can only be found when the length is known
+    if (duration > EDGE_SCAN_SECONDS) {
+        ContentSpan tail;
+        scanRange(scanner, duration - EDGE_SCAN_SECONDS, duration + 1, false, tail);
+        if (tail.found() && duration - tail.last_end >= MIN_TRIM_SECONDS) {
+            trim.end = std::ceil(tail.last_end * 1000) / 1000;
+        }
+    }
+
+    // A title that is dead air all over is left alone
+    if (trim.end > 0 && trim.end - trim.start < MIN_TRIM_SECONDS) {
+        trim = EdgeTrim();
+    }
+    return true;
+}
+
+std::string trimInputArgs(const EdgeTrim& trim) {
+    char args[64] = "";
+    int length = 0;
+    if (trim.start > 0) {
+        length += snprintf(args + length, sizeof(args) - length, "-ss %.3f ", trim.start);
+    }
+    if (trim.end > 0) {
+        snprintf(args + length, sizeof(args) - length, "-t %.3f ", trim.end - trim.start);
+    }
+    return args;
+}
+
+std::string formatTimecode(double seconds) {
+    long long millis = std::llround(std::max(seconds, 0.0) * 1000);
+    char timecode[32];
+    snprintf(timecode, sizeof(timecode), "%02lld:%02lld:%02lld.%03lld",
+             millis / 3600000, millis / 60000 % 60, millis / 1000 % 60, millis % 1000);
+    return timecode;
+}
+
+std::string describeTrim(const EdgeTrim& trim) {
+    if (!trim.trimmed()) {
+        return "none";
+    }
+    std::string description = "start " + formatTimecode(trim.start);
+    if (trim.end > 0) {
+        description += ", end " + formatTimecode(trim.end);
+    }
+    return description;
+}
@@ -0,0 +1,31 @@
+#ifndef EDGE_TRIM_H
+#define EDGE_TRIM_H
+
+#include <string>
+
+// Dead air at the edges of a source, in seconds from the start of the file
+struct EdgeTrim {
+    double start = 0;       // programme start, 0 keeps the head
+    double end = 0;         // programme end, 0 keeps the tail
+
+    bool trimmed() const { return start > 0 || end > 0; }
+};
+
+// Finds black slates with silence at the head and tail of a title. The
+// first and last two minutes are decoded; a video frame is black when
+// fewer than 2% of its pixels rise above black level, audio is silent below
+// -60 dBFS RMS. The programme starts with the first picture or sound and
+// ends with the last. Edges shorter than a second are kept. Returns false
+// only when the input cannot be decoded.
+bool detectEdgeTrim(const std::string& input_file, double duration, EdgeTrim& trim, std::string& error);
+
+// ffmpeg input options that skip the trimmed edges, placed before -i
+std::string trimInputArgs(const EdgeTrim& trim);
+
+// "HH:MM:SS.mmm"
+std::string formatTimecode(double seconds);
+
+// "none" or "start 00:00:12.480, end 01:31:02.000"
+std::string describeTrim(const EdgeTrim& trim);
+
+#endif // EDGE_TRIM_H
@@ -0,0 +1,153 @@
+#include "event_loop.h"
+#include "resource_usage.h"
+#include <iostream>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+// How often running child processes are checked for exit
+static const std::chrono::milliseconds CHILD_POLL_INTERVAL(100);
+
+// Coroutine that starts at once and frees itself when it is done
+struct EventLoop::Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+EventLoop::Detached EventLoop::runDetached(EventLoop& loop, Task<void> task) {
+    try {
+        co_await task;
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled error in task: " << e.what() << "\n";
+    } catch (...) {
+        std::cerr << "Unhandled error in task\n";
+    }
+    loop.taskFinished();
+}
+
+void EventLoop::spawn(Task<void> task) {
+    active_tasks++;
+    runDetached(*this, std::move(task));
+}
+
+void EventLoop::post(std::function<void()> callback) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        posted.push_back(std::move(callback));
+    }
+    wake.notify_one();
+}
+
+void EventLoop::addTimer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> handle) {
+    timers.push({deadline, timer_sequence++, handle});
+}
+
+void EventLoop::run() {
+    while (active_tasks > 0) {
+        std::deque<std::function<void()>> ready;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (posted.empty()) {
+                auto now = std::chrono::steady_clock::now();
+                auto until = now + std::chrono::hours(1);
+                if (!timers.empty()) {
+                    until = std::min(until, timers.top().deadline);
+                }
+                if (!children.empty()) {
+                    until = std::min(until, now + CHILD_POLL_INTERVAL);
+                }
+                if (stopping && !timers.empty()) {
+                    until = now;
+                }
+                wake.wait_until(lock, until, [this] { return !posted.empty(); });
+            }
+            ready.swap(posted);
+        }
+        for (auto& callback : ready) {
+            callback();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && (stopping || timers.top().deadline <= now)) {
+            std::coroutine_handle<> handle = timers.top().handle;
+            timers.pop();
+            handle.resume();
+        }
+
+        reapChildren();
+    }
+}
+
+bool EventLoop::ProcessAwaiter::await_ready() {
+    if (loop.stopping) {
+        return true;
+    }
+    // A process group of its own, so shutdown() reaches what the shell
+    // starts as well; set by posix_spawn itself, so there is no race
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    const char* argv[] = {"/bin/sh", "-c", command.c_str(), nullptr};
+    int spawned = posix_spawn(&pid, "/bin/sh", nullptr, &attributes, const_cast<char* const*>(argv), environ);
+    posix_spawnattr_destroy(&attributes);
+    if (spawned != 0) {
+        pid = -1;
+        return true;
+    }
+    started = std::chrono::steady_clock::now();
+    return false;
+}
+
+void EventLoop::ProcessAwaiter::await_suspend(std::coroutine_handle<> awaiter) {
+    loop.children[pid] = {awaiter, &exit_code, usage, started};
+}
+
+void EventLoop::reapChildren() {
+    for (auto it = children.begin(); it != children.end();) {
+        // Checked without reaping first, so the I/O counters of the exited
+        // child can still be read from /proc
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, it->first, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0) {
+            ++it;
+            continue;
+        }
+
+        Child& child = it->second;
+        ResourceUsage usage;
+        if (child.usage) {
+            processIo(it->first, usage.bytes_read, usage.bytes_written);
+        }
+        int status = 0;
+        struct rusage resources;
+        pid_t result = wait4(it->first, &status, 0, &resources);
+        if (child.usage && result > 0) {
+            ResourceUsage reported = childUsage(resources);
+            reported.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - child.started).count();
+            reported.bytes_read = usage.bytes_read;
+            reported.bytes_written = usage.bytes_written;
+            child.usage->add(reported);
+        }
+
+        *child.exit_code = result > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        std::coroutine_handle<> handle = child.handle;
+        it = children.erase(it);
+        handle.resume();
+    }
+}
+
+void EventLoop::shutdown() {
+    stopping = true;
+    for (const auto& child : children) {
+        kill(-child.first, SIGTERM);
+    }
+}
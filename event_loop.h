@@ -0,0 +1,339 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <coroutine>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <queue>
+#include <vector>
+#include <optional>
+#include <exception>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <sys/types.h>
+#include "executor.h"
+
+class EventLoop;
+struct ResourceUsage;
+
+template <typename T>
+class Task;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    // Hands control back to whoever awaited the task
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// Coroutine returning T. It starts when it is first awaited and resumes
+// the awaiting coroutine when it finishes; exceptions propagate to it.
+template <typename T = void>
+class Task {
+public:
+    typedef TaskPromise<T> promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Result of work that is already running, on the executor or as a task
+// started on the loop. Awaiting it suspends until the work is done; the
+// awaiting coroutine is always resumed on the loop thread.
+template <typename T>
+class AsyncResult {
+    typedef std::conditional_t<std::is_void_v<T>, bool, T> Stored;
+
+    struct State {
+        std::mutex mutex;
+        bool done = false;
+        std::optional<Stored> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> waiter;
+    };
+
+public:
+    explicit AsyncResult(EventLoop& loop) : loop(&loop), state(std::make_shared<State>()) {}
+
+    bool await_ready() {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+    bool await_suspend(std::coroutine_handle<> awaiter) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->done) {
+            return false;
+        }
+        state->waiter = awaiter;
+        return true;
+    }
+    T await_resume() {
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*state->value);
+        }
+    }
+
+    // Runs fn and records its result or exception; callable from any thread
+    template <typename Fn>
+    void complete(Fn& fn) {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                fn();
+                state->value = true;
+            } else {
+                state->value = fn();
+            }
+        } catch (...) {
+            state->error = std::current_exception();
+        }
+        finish();
+    }
+
+    void fail(std::exception_ptr error) {
+        state->error = error;
+        finish();
+    }
+
+private:
+    EventLoop* loop;
+    std::shared_ptr<State> state;
+
+    void finish();
+};
+
+// Single-threaded scheduler for the daemon's coroutines. Timers, child
+// processes and executor work suspend the coroutine waiting on them
+// instead of its thread, so one loop drives any number of jobs. Everything
+// but post() must be called on the loop thread.
+class EventLoop {
+public:
+    EventLoop() = default;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Runs until every spawned task has finished
+    void run();
+
+    // Starts a task that nobody awaits. An exception that escapes it is
+    // printed and dropped.
+    void spawn(Task<void> task);
+
+    // Starts a task now; its result is awaited later
+    template <typename T>
+    AsyncResult<T> start(Task<T> task) {
+        AsyncResult<T> result(*this);
+        spawn(completeWith(std::move(task), result));
+        return result;
+    }
+
+    // Queues a callback to run on the loop thread; safe from any thread
+    void post(std::function<void()> callback);
+
+    // Runs fn on the executor. With a token that is cancelled before a
+    // worker gets to it, the await throws TaskCancelled.
+    template <typename Fn>
+    AsyncResult<std::invoke_result_t<Fn>> runOn(Executor& executor, Fn fn,
+                                                TaskPriority priority = TaskPriority::Normal,
+                                                const std::optional<CancellationToken>& token = std::nullopt) {
+        AsyncResult<std::invoke_result_t<Fn>> result(*this);
+        executor.submit([result, fn = std::move(fn), token]() mutable {
+            if (token && token->cancelled()) {
+                result.fail(std::make_exception_ptr(TaskCancelled()));
+                return;
+            }
+            result.complete(fn);
+        }, priority);
+        return result;
+    }
+
+    struct SleepAwaiter {
+        EventLoop& loop;
+        std::chrono::steady_clock::time_point deadline;
+
+        bool await_ready() const { return loop.stopping; }
+        void await_suspend(std::coroutine_handle<> awaiter) { loop.addTimer(deadline, awaiter); }
+        void await_resume() const {}
+    };
+
+    // Suspends for the duration; returns at once after shutdown()
+    SleepAwaiter sleep(std::chrono::steady_clock::duration duration) {
+        return SleepAwaiter{*this, std::chrono::steady_clock::now() + duration};
+    }
+
+    struct ProcessAwaiter {
+        EventLoop& loop;
+        std::string command;
+        ResourceUsage* usage;
+        pid_t pid = -1;
+        int exit_code = -1;
+        std::chrono::steady_clock::time_point started{};
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> awaiter);
+        int await_resume() const { return exit_code; }
+    };
+
+    // Runs a shell command in a process group of its own, with the daemon's
+    // stdout and stderr, and suspends until it exits. Returns its exit code, -1 if it could not be started
+    // or was killed by a signal. With usage, the CPU time, peak RSS and I/O
+    // of the command and everything it ran are added to it.
+    ProcessAwaiter runProcess(const std::string& command, ResourceUsage* usage = nullptr) {
+        return ProcessAwaiter{*this, command, usage};
+    }
+
+    // Wakes every sleeping coroutine, makes later sleeps return at once and
+    // sends SIGTERM to the process groups of the running children, so the
+    // ffmpeg started by each shell stops too
+    void shutdown();
+
+    bool stopped() const { return stopping; }
+
+private:
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t sequence;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const Timer& other) const {
+            return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+        }
+    };
+
+    struct Child {
+        std::coroutine_handle<> handle;
+        int* exit_code;
+        ResourceUsage* usage;
+        std::chrono::steady_clock::time_point started{};
+    };
+
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    uint64_t timer_sequence = 0;
+    std::map<pid_t, Child> children;
+    size_t active_tasks = 0;
+    bool stopping = false;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> posted;
+
+    void addTimer(std::chrono::steady_clock::time_point deadline, std::coroutine_handle<> handle);
+    void reapChildren();
+    void taskFinished() { active_tasks--; }
+
+    template <typename T>
+    static Task<void> completeWith(Task<T> task, AsyncResult<T> result) {
+        try {
+            if constexpr (std::is_void_v<T>) {
+                co_await task;
+                auto done = [] {};
+                result.complete(done);
+            } else {
+                T value = co_await task;
+                auto done = [&value] { return std::move(value); };
+                result.complete(done);
+            }
+        } catch (...) {
+            result.fail(std::current_exception());
+        }
+    }
+
+    struct Detached;
+    static Detached runDetached(EventLoop& loop, Task<void> task);
+};
+
+template <typename T>
+void AsyncResult<T>::finish() {
+    std::coroutine_handle<> waiter;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done = true;
+        waiter = state->waiter;
+    }
+    if (waiter) {
+        loop->post([waiter] { waiter.resume(); });
+    }
+}
+
+#endif // EVENT_LOOP_H
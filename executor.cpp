@@ -0,0 +1,111 @@
+#include "executor.h"
+#include <algorithm>
+
+// The executor and queue the current thread works for, if any
+static thread_local const Executor* current_executor = nullptr;
+static thread_local size_t current_queue = 0;
+
+Executor::Executor(size_t threads) {
+    size_t count = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < count; i++) {
+        queues.emplace_back(new WorkQueue());
+    }
+    for (size_t i = 0; i < count; i++) {
+        workers.emplace_back(&Executor::work, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+Executor& Executor::shared() {
+    static Executor executor(std::max(1u, std::thread::hardware_concurrency()));
+    return executor;
+}
+
+bool Executor::onWorker() const {
+    return current_executor == this;
+}
+
+void Executor::enqueue(Task task, TaskPriority priority) {
+    // Counted first, so a worker that finds the task never sees the count
+    // go below zero; a worker that sees the count early retries
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        queued++;
+    }
+
+    size_t index = onWorker() ? current_queue : next_queue++ % queues.size();
+    {
+        WorkQueue& queue = *queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks[static_cast<int>(priority)].push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+bool Executor::take(size_t self, Task& task) {
+    for (int level = 0; level < TASK_PRIORITY_LEVELS; level++) {
+        {
+            WorkQueue& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks[level].empty()) {
+                task = std::move(own.tasks[level].back());
+                own.tasks[level].pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkQueue& victim = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks[level].empty()) {
+                task = std::move(victim.tasks[level].front());
+                victim.tasks[level].pop_front();
+                queued--;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Executor::runOne() {
+    Task task;
+    if (!take(current_queue, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+void Executor::work(size_t index) {
+    current_executor = this;
+    current_queue = index;
+
+    while (true) {
+        if (runOne()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        if (queued > 0) {
+            // Counted but not pushed yet
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+        wake.wait(lock, [this] { return stopping || queued > 0; });
+    }
+}
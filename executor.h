@@ -0,0 +1,123 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <type_traits>
+
+// Order in which queued tasks are started. Frame bands someone is waiting
+// on go first, background work such as posters and hashing last.
+enum class TaskPriority {
+    High,
+    Normal,
+    Low
+};
+
+const int TASK_PRIORITY_LEVELS = 3;
+
+// Thrown by the future of a task whose token was cancelled before it started
+class TaskCancelled : public std::runtime_error {
+public:
+    TaskCancelled() : std::runtime_error("task cancelled") {}
+};
+
+// Cooperative cancellation. Copies share one flag: the owner cancels, tasks
+// not yet started are skipped and running ones poll cancelled().
+class CancellationToken {
+public:
+    CancellationToken() : state(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { state->store(true); }
+    bool cancelled() const { return state->load(); }
+
+private:
+    std::shared_ptr<std::atomic<bool>> state;
+};
+
+// Work-stealing task executor. Every worker owns a deque per priority:
+// tasks submitted from a worker go to the back of its own deque and are
+// taken back from there, while idle workers steal from the front of the
+// others'. A worker always takes the highest priority task it can find,
+// its own or stolen. Tasks submitted from other threads are dealt out
+// round-robin. The destructor runs everything still queued before joining.
+class Executor {
+public:
+    explicit Executor(size_t threads);
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // One executor per process, with a worker per core, for background
+    // work. Frame bands use ConvertOptions::framePool() instead.
+    static Executor& shared();
+
+    size_t size() const { return workers.size(); }
+
+    template <typename Fn>
+    std::future<std::invoke_result_t<Fn>> submit(Fn fn, TaskPriority priority = TaskPriority::Normal) {
+        typedef std::invoke_result_t<Fn> Result;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+        std::future<Result> result = task->get_future();
+        enqueue([task] { (*task)(); }, priority);
+        return result;
+    }
+
+    // Skipped, with TaskCancelled in the future, if the token is cancelled
+    // before a worker gets to it
+    template <typename Fn>
+    std::future<std::invoke_result_t<Fn>> submit(Fn fn, TaskPriority priority, const CancellationToken& token) {
+        return submit([fn = std::move(fn), token]() mutable {
+            if (token.cancelled()) {
+                throw TaskCancelled();
+            }
+            return fn();
+        }, priority);
+    }
+
+    // Returns the task's result. A worker of this executor keeps running
+    // queued tasks while it waits, so tasks may wait for tasks they submit.
+    template <typename Result>
+    Result wait(std::future<Result>& result) {
+        if (onWorker()) {
+            while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                if (!runOne()) {
+                    result.wait_for(std::chrono::microseconds(100));
+                }
+            }
+        }
+        return result.get();
+    }
+
+private:
+    typedef std::function<void()> Task;
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks[TASK_PRIORITY_LEVELS];
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;     // one per worker
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> queued{0};
+    std::mutex idle_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void enqueue(Task task, TaskPriority priority);
+    bool take(size_t self, Task& task);
+    bool runOne();
+    bool onWorker() const;
+    void work(size_t index);
+};
+
+#endif // EXECUTOR_H
@@ -0,0 +1,88 @@
+#include "geometry.h"
+#include <algorithm>
+#include <cmath>
+#include <set>
+#include <utility>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+SourceGeometry sourceGeometry(AVFormatContext* format, AVStream* stream) {
+    SourceGeometry source;
+    source.width = stream->codecpar->width;
+    source.height = stream->codecpar->height;
+
+    // Container SAR wins over the bitstream one, as in ffmpeg itself
+    AVRational sar = av_guess_sample_aspect_ratio(format, stream, nullptr);
+    if (sar.num > 0 && sar.den > 0) {
+        source.sar_num = sar.num;
+        source.sar_den = sar.den;
+    }
+    return source;
+}
+
+std::string cropFilter(const SourceGeometry& source) {
+    if (!source.cropped()) {
+        return "";
+    }
+    return "crop=" + std::to_string(source.crop_width) + ":" + std::to_string(source.crop_height) + ":" +
+           std::to_string(source.crop_x) + ":" + std::to_string(source.crop_y) + ",";
+}
+
+void cropFrame(AVFrame* frame, const SourceGeometry& source) {
+    if (!source.cropped() || frame->width != source.width || frame->height != source.height) {
+        return;
+    }
+    frame->crop_left = source.crop_x;
+    frame->crop_top = source.crop_y;
+    frame->crop_right = source.width - source.crop_x - source.crop_width;
+    frame->crop_bottom = source.height - source.crop_y - source.crop_height;
+    av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED);
+}
+
+// 4:2:0 chroma needs even sizes on both axes
+static int roundEven(double value) {
+    return std::max(2, static_cast<int>(std::lround(value / 2)) * 2);
+}
+
+RungGeometry planRung(const SourceGeometry& source, const RungBox& box) {
+    RungGeometry rung;
+
+    // Display size of the source in square pixels
+    double display_width = static_cast<double>(source.visibleWidth()) * source.sar_num / source.sar_den;
+    double display_height = source.visibleHeight();
+
+    double scale = std::min({box.width / display_width, box.height / display_height, 1.0});
+    rung.width = std::min(roundEven(display_width * scale), box.width);
+    rung.height = std::min(roundEven(display_height * scale), box.height);
+
+    double pixels = static_cast<double>(rung.width) * rung.height;
+    double box_pixels = static_cast<double>(box.width) * box.height;
+    rung.video_bitrate = static_cast<int>(box.video_bitrate * std::min(pixels / box_pixels, 1.0));
+    return rung;
+}
+
+std::vector<RungGeometry> planLadder(const SourceGeometry& source, const std::vector<RungBox>& boxes) {
+    // Smallest boxes first, so a repeated size is kept at the lowest bitrate
+    std::vector<std::pair<double, int>> order;
+    for (size_t i = 0; i < boxes.size(); i++) {
+        order.push_back({static_cast<double>(boxes[i].width) * boxes[i].height, static_cast<int>(i)});
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<RungGeometry> rungs;
+    std::set<std::pair<int, int>> sizes;
+    for (const auto& entry : order) {
+        RungGeometry rung = planRung(source, boxes[entry.second]);
+        rung.index = entry.second;
+        if (sizes.insert({rung.width, rung.height}).second) {
+            rungs.push_back(rung);
+        }
+    }
+
+    std::sort(rungs.begin(), rungs.end(),
+              [](const RungGeometry& a, const RungGeometry& b) { return a.index < b.index; });
+    return rungs;
+}
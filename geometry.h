@@ -0,0 +1,65 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <vector>
+#include <string>
+
+struct AVFormatContext;
+struct AVStream;
+struct AVFrame;
+
+// Coded picture size and sample aspect ratio of a source video stream
+struct SourceGeometry {
+    int width = 0;
+    int height = 0;
+    int sar_num = 1;        // 1:1 when the stream does not say
+    int sar_den = 1;
+    
+    // Picture area inside black bars, in coded pixels; crop_width 0 keeps
+    // the whole frame
+    int crop_x = 0;
+    int crop_y = 0;
+    int crop_width = 0;
+    int crop_height = 0;
+    
+    bool cropped() const { return crop_width > 0 && crop_height > 0; }
+    int visibleWidth() const { return cropped() ? crop_width : width; }
+    int visibleHeight() const { return cropped() ? crop_height : height; }
+};
+
+// Nominal size and video bitrate of one rung of a ladder
+struct RungBox {
+    int width;
+    int height;
+    int video_bitrate;
+};
+
+// What a rung is actually encoded at. Output pixels are square.
+struct RungGeometry {
+    int index = 0;          // position of the rung in the ladder
+    int width = 0;
+    int height = 0;
+    int video_bitrate = 0;
+};
+
+SourceGeometry sourceGeometry(AVFormatContext* format, AVStream* stream);
+
+// "crop=w:h:x:y," for an ffmpeg filter chain, empty when nothing is cropped
+std::string cropFilter(const SourceGeometry& source);
+
+// Narrows a decoded frame to the crop area without copying. Frames of
+// another size (mid-stream resolution changes) are left alone.
+void cropFrame(AVFrame* frame, const SourceGeometry& source);
+
+// Largest picture inside the box with the display aspect ratio of the
+// source's visible area,
+// never larger than the source itself, both sides even. The bitrate is the
+// box bitrate scaled by the pixels actually encoded.
+RungGeometry planRung(const SourceGeometry& source, const RungBox& box);
+
+// Plans every rung. A rung whose box is bigger than the source would only
+// repeat a smaller rung at a higher bitrate, so it is dropped; the smallest
+// rung is always kept. Rungs are returned in ladder order.
+std::vector<RungGeometry> planLadder(const SourceGeometry& source, const std::vector<RungBox>& boxes);
+
+#endif // GEOMETRY_H
@@ -126,7 +126,7 @@ if [ "$SKIP_DEPS" = false ]; then
     brew update
     
     # Install dependencies
-    brew install cmake pkg-config ffmpeg x264 || true
+    brew install cmake pkg-config ffmpeg x264 curl || true
     
     # For M-series Macs, ensure we're using the correct paths
     if [[ "$ARCH_TYPE" == "arm64" ]]; then
@@ -164,6 +164,7 @@ elif [ -f /etc/debian_version ]; then
         libswresample-dev \
         libavfilter-dev \
         libx264-dev \
+        libcurl4-openssl-dev \
         ffmpeg \
         sshpass
         
@@ -177,6 +178,7 @@ elif [ -f /etc/redhat-release ]; then
         pkgconfig \
         ffmpeg-devel \
         x264-devel \
+        libcurl-devel \
         ffmpeg \
         sshpass
         
@@ -189,13 +191,15 @@ elif [ -f /etc/arch-release ]; then
         cmake \
         ffmpeg \
         x264 \
+        curl \
         sshpass
 else
     print_warning "Unknown distribution. Please install dependencies manually:"
     echo "  - cmake"
-    echo "  - g++ or clang++"
+    echo "  - g++ 10+ or clang++ 14+ (C++20)"
     echo "  - ffmpeg development libraries"
     echo "  - x264 development libraries"
+    echo "  - libcurl development libraries (optional, for S3 destinations)"
 fi
 fi  # End of SKIP_DEPS check
 
@@ -390,6 +394,11 @@ if [ "$INSTALL_MODE" = "daemon" ]; then
         sudo cp radiumvod.conf $CONFIG_DIR/radiumvod.conf.example
         print_info "Example configuration saved to $CONFIG_DIR/radiumvod.conf.example"
     fi
+    if [ ! -f $CONFIG_DIR/vod-template.xml ]; then
+        sudo cp vod-template.xml $CONFIG_DIR/
+        sudo chmod 644 $CONFIG_DIR/vod-template.xml
+        print_info "Metadata template installed to $CONFIG_DIR/vod-template.xml"
+    fi
 else
     # Linux configuration
     if [ ! -f $CONFIG_DIR/radiumvod.conf ]; then
@@ -402,6 +411,11 @@ else
         cp radiumvod.conf $CONFIG_DIR/radiumvod.conf.example
         print_info "Example configuration saved to $CONFIG_DIR/radiumvod.conf.example"
     fi
+    if [ ! -f $CONFIG_DIR/vod-template.xml ]; then
+        cp vod-template.xml $CONFIG_DIR/
+        chmod 644 $CONFIG_DIR/vod-template.xml
+        print_info "Metadata template installed to $CONFIG_DIR/vod-template.xml"
+    fi
 fi
 
 # Step 6: Install service
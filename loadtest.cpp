@@ -0,0 +1,256 @@
+#include "loadtest.h"
+#include "watcher.h"
+#include "synthetic_clip.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Seconds from the drop to each milestone, negative until it is reached
+struct ClipTimes {
+    Clock::time_point dropped;
+    double detected = -1;
+    double encoded = -1;
+    double uploaded = -1;
+    bool failed = false;
+    bool rejected = false;
+    bool finished = false;
+};
+
+// Shared between the drop loop and the observer, which the daemon calls on
+// its loop thread and on upload threads
+struct LoadState {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<std::string, ClipTimes> clips;
+    size_t finished = 0;
+    bool daemon_exited = false;
+
+    void observe(const std::string& filename, WatcherEvent event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = clips.find(filename);
+        if (it == clips.end() || it->second.finished) {
+            return;
+        }
+        ClipTimes& clip = it->second;
+        double since = std::chrono::duration<double>(Clock::now() - clip.dropped).count();
+        switch (event) {
+            case WATCH_DETECTED:
+                clip.detected = since;
+                return;
+            case WATCH_ENCODED:
+                clip.encoded = since;
+                return;
+            case WATCH_UPLOADED:
+                clip.uploaded = since;
+                break;
+            case WATCH_REJECTED:
+                clip.rejected = true;
+                break;
+            case WATCH_FAILED:
+                clip.failed = true;
+                break;
+        }
+        clip.finished = true;
+        finished++;
+        changed.notify_all();
+    }
+};
+
+// Nearest rank
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+void printLatencies(const char* milestone, std::vector<double> seconds) {
+    std::cout << "  " << std::left << std::setw(10) << milestone << std::right;
+    if (seconds.empty()) {
+        std::cout << "       -\n";
+        return;
+    }
+    std::sort(seconds.begin(), seconds.end());
+    std::cout << std::fixed << std::setprecision(1);
+    for (double p : {50.0, 90.0, 99.0}) {
+        std::cout << std::setw(9) << percentile(seconds, p);
+    }
+    std::cout << std::setw(9) << seconds.back() << std::setw(7) << seconds.size() << "\n";
+}
+
+} // namespace
+
+int runLoadTest(const LoadTestOptions& options) {
+    // A directory of its own, so removing it afterwards touches nothing else
+    fs::path base = options.work_dir.empty() ? fs::temp_directory_path() : fs::path(options.work_dir);
+    fs::path work = base / ("radiumvod-loadtest-" + std::to_string(getpid()));
+    fs::path staging = work / "staging";
+    fs::path source = work / "source";
+    fs::path output = work / "hls";
+    fs::path delivered = work / "delivered";
+    std::error_code ec;
+    for (const fs::path& dir : {staging, source, output, delivered}) {
+        fs::create_directories(dir, ec);
+        if (ec) {
+            std::cerr << "Error: Cannot create " << dir << ": " << ec.message() << "\n";
+            return 1;
+        }
+    }
+
+    // Without a config the daemon's defaults apply: three rungs, fast preset
+    std::string config_file = options.config_file;
+    if (config_file.empty() || !fs::exists(config_file)) {
+        std::cout << "No config at '" << config_file << "', using the built-in settings\n";
+        config_file = (work / "loadtest.conf").string();
+        std::ofstream(config_file) << "{}\n";
+    }
+
+    // Clips are made up front, so synthesis never competes with the daemon
+    std::cout << "Synthesizing " << options.clips << " clips of " << options.clip.seconds << " s at "
+              << options.clip.width << "x" << options.clip.height << "\n";
+    std::vector<std::string> names;
+    for (int i = 0; i < options.clips; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "loadtest-%04d.mp4", i);
+        ClipSpec spec = options.clip;
+        spec.seed = static_cast<uint32_t>(i);
+        std::string error;
+        if (!synthesizeClip((staging / name).string(), spec, error)) {
+            std::cerr << "Error: Cannot synthesize " << name << ": " << error << "\n";
+            return 1;
+        }
+        names.push_back(name);
+    }
+
+    LoadState state;
+    WatcherOverrides overrides;
+    overrides.source_dir = source.string();
+    overrides.dest_dir = output.string();
+    overrides.log_file = (work / "daemon.log").string();
+    overrides.rejected_dir = (work / "rejected").string();
+    overrides.metrics_file = (work / "metrics.prom").string();
+    overrides.file_extensions = {".mp4"};
+    overrides.console_log = false;
+    overrides.observer = [&state](const std::string& filename, WatcherEvent event) {
+        state.observe(filename, event);
+    };
+
+    // Stands in for the production destinations; copies, not hard links,
+    // so delivery costs real I/O
+    DestinationConfig destination;
+    destination.name = "loadtest";
+    destination.type = "local";
+    destination.path = delivered.string();
+    overrides.destinations.push_back(destination);
+
+    int daemon_result = 0;
+    std::thread daemon([&] {
+        daemon_result = run_watcher(config_file, overrides);
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.daemon_exited = true;
+        state.changed.notify_all();
+    });
+
+    std::cout << "Dropping " << options.clips << " clips ";
+    if (options.rate > 0) {
+        std::cout << "at " << options.rate << " per minute" << (options.poisson ? ", Poisson arrivals" : "") << "\n";
+    } else {
+        std::cout << "at once\n";
+    }
+
+    // A fixed seed, so Poisson runs are comparable
+    std::mt19937 random(1);
+    std::exponential_distribution<double> gap(options.rate > 0 ? options.rate / 60.0 : 1.0);
+    Clock::time_point started = Clock::now();
+    Clock::time_point next = started;
+    int dropped = 0;
+    for (const std::string& name : names) {
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.changed.wait_until(lock, next, [&state] { return state.daemon_exited; });
+            if (state.daemon_exited) {
+                break;
+            }
+            // Registered before the rename, so a fast scan cannot miss it
+            state.clips[name].dropped = Clock::now();
+        }
+        fs::rename(staging / name, source / name, ec);
+        if (ec) {
+            std::cerr << "Error: Cannot move " << name << " into the source directory: " << ec.message() << "\n";
+            break;
+        }
+        dropped++;
+
+        if (options.rate > 0) {
+            double seconds = options.poisson ? gap(random) : 60.0 / options.rate;
+            next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+        }
+    }
+    Clock::time_point last_drop = Clock::now();
+
+    {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        state.changed.wait_until(lock, last_drop + std::chrono::seconds(options.timeout), [&] {
+            return state.daemon_exited || state.finished >= static_cast<size_t>(dropped);
+        });
+    }
+    stop_watcher();
+    daemon.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - started).count();
+
+    std::vector<double> detected, encoded, uploaded;
+    int rejected = 0, failed = 0, unfinished = 0;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        for (const auto& clip : state.clips) {
+            const ClipTimes& times = clip.second;
+            if (times.detected >= 0) detected.push_back(times.detected);
+            if (times.encoded >= 0) encoded.push_back(times.encoded);
+            if (times.uploaded >= 0) uploaded.push_back(times.uploaded);
+            if (times.rejected) rejected++;
+            if (times.failed) failed++;
+            if (!times.finished) unfinished++;
+        }
+    }
+
+    std::cout << "\nLatency from drop (seconds), " << dropped << " clips in " << std::fixed
+              << std::setprecision(0) << elapsed << " s\n";
+    std::cout << "                  p50      p90      p99      max  clips\n";
+    printLatencies("detected", detected);
+    printLatencies("encoded", encoded);
+    printLatencies("uploaded", uploaded);
+    if (!uploaded.empty()) {
+        std::cout << "Throughput: " << std::setprecision(2) << uploaded.size() * 60.0 / elapsed
+                  << " clips per minute delivered\n";
+    }
+    if (rejected || failed || unfinished) {
+        std::cout << "Rejected: " << rejected << ", failed: " << failed << ", unfinished: " << unfinished << "\n";
+    }
+    if (daemon_result != 0) {
+        std::cerr << "Error: The daemon did not start\n";
+    }
+
+    if (options.keep) {
+        std::cout << "Kept " << work.string() << " (daemon.log, metrics.prom, cost reports under hls/)\n";
+    } else {
+        fs::remove_all(work, ec);
+    }
+
+    return daemon_result == 0 && !rejected && !failed && !unfinished && dropped == options.clips ? 0 : 1;
+}
@@ -0,0 +1,25 @@
+#ifndef LOADTEST_H
+#define LOADTEST_H
+
+#include <string>
+#include "synthetic_clip.h"
+
+struct LoadTestOptions {
+    std::string config_file;    // ladder, encoder and concurrency settings; defaults when missing
+    int clips = 20;
+    double rate = 6;            // clips dropped per minute, 0 drops them all at once
+    bool poisson = false;       // random gaps averaging the rate instead of even ones
+    ClipSpec clip;              // the seed is set per clip
+    std::string work_dir;       // scratch root, a new temporary directory when empty
+    bool keep = false;          // leave the scratch directory and the daemon log behind
+    int timeout = 1800;         // seconds allowed for the last clip after the last drop
+};
+
+// Runs the daemon in-process with scratch source and output directories
+// and a local destination, drops synthetic clips into the source directory
+// at the arrival rate and prints drop-to-detect, drop-to-encoded and
+// drop-to-uploaded latency percentiles. Returns the process exit code:
+// 1 if a clip was rejected, failed or timed out.
+int runLoadTest(const LoadTestOptions& options);
+
+#endif // LOADTEST_H
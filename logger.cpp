@@ -0,0 +1,352 @@
+#include "logger.h"
+#include "ring_buffer.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <cstdio>
+
+namespace fs = std::filesystem;
+
+// Messages one thread can have queued before it starts dropping
+static const size_t LOG_RING_CAPACITY = 4096;
+
+// How long the writer sleeps once every ring is empty, unless woken
+static const std::chrono::milliseconds LOG_FLUSH_INTERVAL(20);
+
+// How long a warning or error waits between attempts on a full ring
+static const std::chrono::microseconds LOG_FULL_RETRY(50);
+
+struct Logger::Record {
+    int64_t time_us = 0;            // system clock, microseconds since the epoch
+    LogLevel level = LogLevel::Info;
+    uint32_t thread = 0;
+    std::string message;
+};
+
+struct Logger::ThreadRing {
+    explicit ThreadRing(uint32_t thread) : thread(thread) {}
+
+    SpscRing<Record> ring{LOG_RING_CAPACITY};
+    uint32_t thread;
+    std::atomic<bool> retired{false};      // its thread has exited
+};
+
+// Hands a thread's ring back to the writer when the thread exits
+struct ThreadRingHolder {
+    std::shared_ptr<Logger::ThreadRing> ring;
+
+    ~ThreadRingHolder() {
+        if (ring) {
+            ring->retired.store(true, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local ThreadRingHolder thread_ring;
+
+bool parseLogLevel(const std::string& name, LogLevel& level) {
+    if (name == "debug") {
+        level = LogLevel::Debug;
+    } else if (name == "info") {
+        level = LogLevel::Info;
+    } else if (name == "warning") {
+        level = LogLevel::Warning;
+    } else if (name == "error") {
+        level = LogLevel::Error;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseLogFormat(const std::string& name, LogFormat& format) {
+    if (name == "text") {
+        format = LogFormat::Text;
+    } else if (name == "json") {
+        format = LogFormat::Json;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info: return "info";
+        case LogLevel::Warning: return "warning";
+        case LogLevel::Error: return "error";
+    }
+    return "info";
+}
+
+// Prefix of text lines, matching the messages the daemon used to write
+static const char* levelPrefix(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG: ";
+        case LogLevel::Info: return "";
+        case LogLevel::Warning: return "WARNING: ";
+        case LogLevel::Error: return "ERROR: ";
+    }
+    return "";
+}
+
+void appendJsonString(std::string& out, const std::string& value) {
+    out += '"';
+    for (char c : value) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    out += '"';
+}
+
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::~Logger() {
+    stop();
+}
+
+bool Logger::start(const LogOptions& log_options) {
+    options = log_options;
+    min_level.store(static_cast<int>(options.level), std::memory_order_relaxed);
+    cached_second = -1;
+
+    bool opened = true;
+    if (!options.file.empty()) {
+        file.open(options.file, std::ios::app);
+        if (file.is_open()) {
+            std::error_code ec;
+            file_size = fs::file_size(options.file, ec);
+            if (ec) {
+                file_size = 0;
+            }
+        } else {
+            opened = false;
+        }
+    }
+
+    stopping = false;
+    writer = std::thread(&Logger::run, this);
+    writer_running.store(true, std::memory_order_release);
+    return opened;
+}
+
+void Logger::stop() {
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    writer_running.store(false, std::memory_order_release);
+    if (file.is_open()) {
+        file.close();
+    }
+}
+
+Logger::ThreadRing& Logger::threadRing() {
+    if (!thread_ring.ring) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        thread_ring.ring = std::make_shared<ThreadRing>(next_thread++);
+        rings.push_back(thread_ring.ring);
+    }
+    return *thread_ring.ring;
+}
+
+void Logger::wakeWriter() {
+    {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        pending = true;
+    }
+    wake.notify_one();
+}
+
+void Logger::write(LogLevel level, std::string message) {
+    Record record;
+    record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.level = level;
+    record.message = std::move(message);
+    SpscRing<Record>& ring = threadRing().ring;
+    while (!ring.tryPush(record)) {
+        // Warnings and errors are the audit trail: wait for the writer
+        // rather than lose them, unless there is no writer to wait for
+        if (level < LogLevel::Warning || !writer_running.load(std::memory_order_acquire)) {
+            dropped_messages.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        wakeWriter();
+        std::this_thread::sleep_for(LOG_FULL_RETRY);
+    }
+    // The first record in an empty ring wakes the writer; later ones find
+    // it awake, since it drains until every ring is empty before sleeping
+    if (ring.size() == 1) {
+        wakeWriter();
+    }
+}
+
+void Logger::run() {
+    std::unique_lock<std::mutex> lock(writer_mutex);
+    while (true) {
+        pending = false;
+        lock.unlock();
+        bool wrote = drain();
+        lock.lock();
+        if (wrote || pending) {
+            continue;
+        }
+        if (stopping) {
+            return;
+        }
+        wake.wait_for(lock, LOG_FLUSH_INTERVAL, [this] { return pending || stopping; });
+    }
+}
+
+bool Logger::drain() {
+    std::vector<std::shared_ptr<ThreadRing>> current;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        current = rings;
+    }
+
+    // Rings are drained one after another, so records are put back in time
+    // order before they are written
+    std::vector<Record> batch;
+    std::vector<std::shared_ptr<ThreadRing>> finished;
+    for (auto& thread : current) {
+        bool retired = thread->retired.load(std::memory_order_acquire);
+        Record record;
+        while (thread->ring.tryPop(record)) {
+            record.thread = thread->thread;
+            batch.push_back(std::move(record));
+        }
+        if (retired) {
+            finished.push_back(thread);
+        }
+    }
+    if (!finished.empty()) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (auto& thread : finished) {
+            rings.erase(std::find(rings.begin(), rings.end(), thread));
+        }
+    }
+
+    uint64_t drops = dropped();
+    if (drops > reported_drops) {
+        Record record;
+        record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.level = LogLevel::Warning;
+        record.message = std::to_string(drops - reported_drops) + " log messages dropped";
+        batch.push_back(std::move(record));
+        reported_drops = drops;
+    }
+
+    if (batch.empty()) {
+        return false;
+    }
+
+    std::stable_sort(batch.begin(), batch.end(), [](const Record& a, const Record& b) {
+        return a.time_us < b.time_us;
+    });
+    for (const auto& record : batch) {
+        emit(record);
+    }
+    if (options.console) {
+        std::cout.flush();
+    }
+    if (file.is_open()) {
+        file.flush();
+    }
+    return true;
+}
+
+const std::string& Logger::stamp(time_t second) {
+    if (second != cached_second) {
+        struct tm local;
+        localtime_r(&second, &local);
+        char text[32];
+        const char* pattern = options.format == LogFormat::Json ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S";
+        strftime(text, sizeof(text), pattern, &local);
+        cached_stamp = text;
+        cached_second = second;
+    }
+    return cached_stamp;
+}
+
+void Logger::emit(const Record& record) {
+    time_t second = static_cast<time_t>(record.time_us / 1000000);
+    std::string line;
+    line.reserve(record.message.size() + 80);
+
+    if (options.format == LogFormat::Json) {
+        char millis[8];
+        snprintf(millis, sizeof(millis), ".%03d", static_cast<int>(record.time_us / 1000 % 1000));
+        line += "{\"time\":\"";
+        line += stamp(second);
+        line += millis;
+        line += "\",\"level\":\"";
+        line += levelName(record.level);
+        line += "\",\"thread\":";
+        line += std::to_string(record.thread);
+        line += ",\"message\":";
+        appendJsonString(line, record.message);
+        line += '}';
+    } else {
+        line += '[';
+        line += stamp(second);
+        line += "] ";
+        line += levelPrefix(record.level);
+        line += record.message;
+    }
+    line += '\n';
+
+    if (options.console) {
+        std::cout << line;
+    }
+    if (file.is_open()) {
+        file << line;
+        file_size += line.size();
+        if (options.max_size > 0 && file_size >= options.max_size) {
+            rotate();
+        }
+    }
+}
+
+// log -> log.1 -> log.2 ... the oldest beyond max_files is removed
+void Logger::rotate() {
+    file.close();
+    std::error_code ec;
+    const std::string& path = options.file;
+    if (options.max_files > 0) {
+        fs::remove(path + "." + std::to_string(options.max_files), ec);
+        for (int i = options.max_files - 1; i >= 1; i--) {
+            fs::rename(path + "." + std::to_string(i), path + "." + std::to_string(i + 1), ec);
+        }
+        fs::rename(path, path + ".1", ec);
+    }
+    file.open(path, std::ios::trunc);
+    file_size = 0;
+    if (!file.is_open()) {
+        std::cerr << "Warning: Cannot reopen log file after rotation: " << path << "\n";
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <cstdint>
+#include <ctime>
+
+// Levels compiled out entirely when below RADIUMVOD_LOG_MIN_LEVEL
+#define RADIUMVOD_LOG_DEBUG 0
+#define RADIUMVOD_LOG_INFO 1
+#define RADIUMVOD_LOG_WARNING 2
+#define RADIUMVOD_LOG_ERROR 3
+
+#ifndef RADIUMVOD_LOG_MIN_LEVEL
+#define RADIUMVOD_LOG_MIN_LEVEL RADIUMVOD_LOG_DEBUG
+#endif
+
+enum class LogLevel {
+    Debug = RADIUMVOD_LOG_DEBUG,
+    Info = RADIUMVOD_LOG_INFO,
+    Warning = RADIUMVOD_LOG_WARNING,
+    Error = RADIUMVOD_LOG_ERROR
+};
+
+enum class LogFormat {
+    Text,
+    Json
+};
+
+struct LogOptions {
+    std::string file;               // empty: console only
+    LogFormat format = LogFormat::Text;
+    LogLevel level = LogLevel::Info;
+    uint64_t max_size = 0;          // bytes before the file is rotated, 0 never
+    int max_files = 5;              // rotated files kept next to the log
+    bool console = true;            // echo to stdout as well
+};
+
+// Appends value as a quoted, escaped JSON string
+void appendJsonString(std::string& out, const std::string& value);
+
+// Returns false for unknown names
+bool parseLogLevel(const std::string& name, LogLevel& level);
+bool parseLogFormat(const std::string& name, LogFormat& format);
+
+// Process-wide asynchronous logger. Every logging thread gets its own ring,
+// so a message costs a clock read and a string move on the caller's side;
+// formatting, file writes, flushing and rotation happen on a background
+// writer thread. A thread that outruns the writer drops debug and info
+// messages rather than wait, and the writer reports how many were lost;
+// warnings and errors wait for room instead. Messages logged before
+// start() are kept until it is called.
+class Logger {
+public:
+    static Logger& instance();
+
+    // Starts the writer. False, with the writer still started on the
+    // console, if the log file cannot be opened.
+    bool start(const LogOptions& options);
+
+    // Writes everything queued and stops the writer
+    void stop();
+
+    bool enabled(LogLevel level) const {
+        return static_cast<int>(level) >= min_level.load(std::memory_order_relaxed);
+    }
+
+    void write(LogLevel level, std::string message);
+
+    // Debug and info messages dropped because a thread's ring was full
+    uint64_t dropped() const { return dropped_messages.load(std::memory_order_relaxed); }
+
+private:
+    struct Record;
+    struct ThreadRing;
+    friend struct ThreadRingHolder;
+
+    Logger() = default;
+    ~Logger();
+
+    std::atomic<int> min_level{static_cast<int>(LogLevel::Info)};
+    std::atomic<uint64_t> dropped_messages{0};
+
+    std::mutex rings_mutex;
+    std::vector<std::shared_ptr<ThreadRing>> rings;
+    uint32_t next_thread = 0;
+
+    LogOptions options;
+    std::ofstream file;
+    uint64_t file_size = 0;
+    std::thread writer;
+    std::mutex writer_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    bool pending = false;           // a ring became non-empty since the last drain
+    std::atomic<bool> writer_running{false};
+    uint64_t reported_drops = 0;
+
+    // Last formatted second, reused until the clock moves on
+    time_t cached_second = -1;
+    std::string cached_stamp;
+
+    ThreadRing& threadRing();
+    void wakeWriter();
+    void run();
+    bool drain();
+    void emit(const Record& record);
+    const std::string& stamp(time_t second);
+    void rotate();
+};
+
+#define RADIUMVOD_LOG(level, number, message)                                       \
+    do {                                                                            \
+        if ((number) >= RADIUMVOD_LOG_MIN_LEVEL && Logger::instance().enabled(level)) { \
+            Logger::instance().write(level, message);                               \
+        }                                                                           \
+    } while (0)
+
+#define LOG_DEBUG(message) RADIUMVOD_LOG(LogLevel::Debug, RADIUMVOD_LOG_DEBUG, message)
+#define LOG_INFO(message) RADIUMVOD_LOG(LogLevel::Info, RADIUMVOD_LOG_INFO, message)
+#define LOG_WARNING(message) RADIUMVOD_LOG(LogLevel::Warning, RADIUMVOD_LOG_WARNING, message)
+#define LOG_ERROR(message) RADIUMVOD_LOG(LogLevel::Error, RADIUMVOD_LOG_ERROR, message)
+
+#endif // LOGGER_H
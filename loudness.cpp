@@ -0,0 +1,694 @@
+#include "loudness.h"
+#include <iostream>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+#include <libswresample/swresample.h>
+}
+
+namespace fs = std::filesystem;
+
+// Blocks quieter than this never count towards integrated loudness
+const double ABSOLUTE_GATE_LUFS = -70.0;
+// Relative gate sits this far below the ungated mean
+const double RELATIVE_GATE_LU = 10.0;
+
+static double energyToLufs(double energy) {
+    if (energy <= 0.0) {
+        return -144.0;
+    }
+    return -0.691 + 10.0 * std::log10(energy);
+}
+
+static float channelWeight(const AVChannelLayout* layout, int index) {
+    switch (av_channel_layout_channel_from_index(layout, index)) {
+        case AV_CHAN_LOW_FREQUENCY:
+        case AV_CHAN_LOW_FREQUENCY_2:
+            return 0.0f;
+        case AV_CHAN_BACK_LEFT:
+        case AV_CHAN_BACK_RIGHT:
+        case AV_CHAN_SIDE_LEFT:
+        case AV_CHAN_SIDE_RIGHT:
+            return 1.41f;
+        default:
+            return 1.0f;
+    }
+}
+
+LoudnessMeter::LoudnessMeter(int rate, const AVChannelLayout* layout)
+    : sample_rate(rate), channels(layout->nb_channels) {
+
+    // BS.1770 stage 1: high shelf modelling the acoustic effect of the head
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = std::tan(M_PI * f0 / sample_rate);
+    double vh = std::pow(10.0, gain / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    stages[0] = {
+        static_cast<float>((vh + vb * k / q + k * k) / a0),
+        static_cast<float>(2.0 * (k * k - vh) / a0),
+        static_cast<float>((vh - vb * k / q + k * k) / a0),
+        static_cast<float>(2.0 * (k * k - 1.0) / a0),
+        static_cast<float>((1.0 - k / q + k * k) / a0)
+    };
+
+    // Stage 2: RLB high-pass
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = std::tan(M_PI * f0 / sample_rate);
+    a0 = 1.0 + k / q + k * k;
+    stages[1] = {
+        1.0f, -2.0f, 1.0f,
+        static_cast<float>(2.0 * (k * k - 1.0) / a0),
+        static_cast<float>((1.0 - k / q + k * k) / a0)
+    };
+
+    groups.resize((channels + 3) / 4);
+    for (int ch = 0; ch < channels; ch++) {
+        groups[ch / 4].weight[ch % 4] = channelWeight(layout, ch);
+    }
+
+    // 48-tap Hann-windowed sinc interpolator split into four phases
+    const int taps = OVERSAMPLE * TAPS_PER_PHASE;
+    for (int p = 0; p < OVERSAMPLE; p++) {
+        double sum = 0.0;
+        for (int j = 0; j < TAPS_PER_PHASE; j++) {
+            int n = j * OVERSAMPLE + p;
+            double t = (n - (taps - 1) / 2.0) / OVERSAMPLE;
+            double sinc = std::fabs(t) < 1e-9 ? 1.0 : std::sin(M_PI * t) / (M_PI * t);
+            double window = 0.5 - 0.5 * std::cos(2.0 * M_PI * (n + 0.5) / taps);
+            phases[p][j] = static_cast<float>(sinc * window);
+            sum += phases[p][j];
+        }
+        for (int j = 0; j < TAPS_PER_PHASE; j++) {
+            phases[p][j] = static_cast<float>(phases[p][j] / sum);
+        }
+    }
+
+    subblock_samples = std::max(1, sample_rate / 10);
+}
+
+void LoudnessMeter::addFrame(const AVFrame* frame) {
+    int nb_samples = frame->nb_samples;
+    if (nb_samples <= 0 || frame->ch_layout.nb_channels != channels) {
+        return;
+    }
+
+    AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+    AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    bool planar = av_sample_fmt_is_planar(format);
+
+    scratch.resize(static_cast<size_t>(channels) * nb_samples);
+    std::vector<const float*> planes(channels);
+
+    for (int ch = 0; ch < channels; ch++) {
+        float* dst = scratch.data() + static_cast<size_t>(ch) * nb_samples;
+        const uint8_t* src = planar ? frame->extended_data[ch] : frame->extended_data[0];
+        int step = planar ? 1 : channels;
+        int offset = planar ? 0 : ch;
+
+        switch (packed) {
+            case AV_SAMPLE_FMT_U8:
+                for (int i = 0; i < nb_samples; i++)
+                    dst[i] = (src[i * step + offset] - 128) / 128.0f;
+                break;
+            case AV_SAMPLE_FMT_S16:
+                for (int i = 0; i < nb_samples; i++)
+                    dst[i] = reinterpret_cast<const int16_t*>(src)[i * step + offset] / 32768.0f;
+                break;
+            case AV_SAMPLE_FMT_S32:
+                for (int i = 0; i < nb_samples; i++)
+                    dst[i] = reinterpret_cast<const int32_t*>(src)[i * step + offset] / 2147483648.0f;
+                break;
+            case AV_SAMPLE_FMT_FLT:
+                for (int i = 0; i < nb_samples; i++)
+                    dst[i] = reinterpret_cast<const float*>(src)[i * step + offset];
+                break;
+            case AV_SAMPLE_FMT_DBL:
+                for (int i = 0; i < nb_samples; i++)
+                    dst[i] = static_cast<float>(reinterpret_cast<const double*>(src)[i * step + offset]);
+                break;
+            default:
+                return;
+        }
+        planes[ch] = dst;
+    }
+
+    processSamples(planes.data(), nb_samples);
+}
+
+void LoudnessMeter::processSamples(const float* const* planes, int nb_samples) {
+    const v4f zero = {0, 0, 0, 0};
+
+    for (int i = 0; i < nb_samples; i++) {
+        for (size_t g = 0; g < groups.size(); g++) {
+            LaneGroup& group = groups[g];
+
+            v4f x = zero;
+            for (int lane = 0; lane < 4; lane++) {
+                int ch = static_cast<int>(g) * 4 + lane;
+                if (ch < channels) {
+                    x[lane] = planes[ch][i];
+                }
+            }
+
+            // K-weighting: two transposed direct form II biquads
+            v4f y = x;
+            for (int s = 0; s < 2; s++) {
+                const Biquad& bq = stages[s];
+                v4f in = y;
+                y = bq.b0 * in + group.z1[s];
+                group.z1[s] = bq.b1 * in - bq.a1 * y + group.z2[s];
+                group.z2[s] = bq.b2 * in - bq.a2 * y;
+            }
+            subblock_energy += group.weight * y * y;
+
+            // True peak: 4x polyphase interpolation of the unweighted signal
+            std::memmove(&group.history[1], &group.history[0], sizeof(v4f) * (TAPS_PER_PHASE - 1));
+            group.history[0] = x;
+            for (int p = 0; p < OVERSAMPLE; p++) {
+                v4f acc = zero;
+                for (int j = 0; j < TAPS_PER_PHASE; j++) {
+                    acc += phases[p][j] * group.history[j];
+                }
+                v4f magnitude = acc < zero ? -acc : acc;
+                group.peak = magnitude > group.peak ? magnitude : group.peak;
+            }
+        }
+
+        if (++subblock_fill == subblock_samples) {
+            double energy = 0.0;
+            for (int lane = 0; lane < 4; lane++) {
+                energy += subblock_energy[lane];
+            }
+            subblocks.push_back(energy / subblock_samples);
+            subblock_energy = zero;
+            subblock_fill = 0;
+
+            // 400 ms gating blocks overlapping by 75%
+            size_t n = subblocks.size();
+            if (n >= 4) {
+                blocks.push_back((subblocks[n - 1] + subblocks[n - 2] + subblocks[n - 3] + subblocks[n - 4]) / 4.0);
+            }
+        }
+    }
+}
+
+LoudnessResult LoudnessMeter::result() const {
+    LoudnessResult result;
+
+    float peak = 0.0f;
+    for (const auto& group : groups) {
+        for (int lane = 0; lane < 4; lane++) {
+            peak = std::max(peak, group.peak[lane]);
+        }
+    }
+    result.true_peak_dbtp = peak > 0.0f ? 20.0 * std::log10(peak) : -144.0;
+
+    double sum = 0.0;
+    size_t count = 0;
+    for (double energy : blocks) {
+        if (energyToLufs(energy) > ABSOLUTE_GATE_LUFS) {
+            sum += energy;
+            count++;
+        }
+    }
+    if (count == 0) {
+        return result;
+    }
+
+    double relative_gate = energyToLufs(sum / count) - RELATIVE_GATE_LU;
+    double gated_sum = 0.0;
+    size_t gated_count = 0;
+    for (double energy : blocks) {
+        double lufs = energyToLufs(energy);
+        if (lufs > ABSOLUTE_GATE_LUFS && lufs > relative_gate) {
+            gated_sum += energy;
+            gated_count++;
+        }
+    }
+
+    if (gated_count > 0) {
+        result.integrated_lufs = energyToLufs(gated_sum / gated_count);
+        result.valid = true;
+    }
+    return result;
+}
+
+double loudnessGain(const LoudnessResult& measured, double target_lufs, double max_true_peak) {
+    if (!measured.valid) {
+        return 0.0;
+    }
+
+    double gain = target_lufs - measured.integrated_lufs;
+    if (measured.true_peak_dbtp + gain > max_true_peak) {
+        gain = max_true_peak - measured.true_peak_dbtp;
+    }
+    return gain;
+}
+
+void applyAudioGain(AVFrame* frame, double gain_db) {
+    float gain = static_cast<float>(std::pow(10.0, gain_db / 20.0));
+    AVSampleFormat format = static_cast<AVSampleFormat>(frame->format);
+    AVSampleFormat packed = av_get_packed_sample_fmt(format);
+    bool planar = av_sample_fmt_is_planar(format);
+    int planes = planar ? frame->ch_layout.nb_channels : 1;
+    int count = planar ? frame->nb_samples : frame->nb_samples * frame->ch_layout.nb_channels;
+
+    for (int p = 0; p < planes; p++) {
+        uint8_t* data = frame->extended_data[p];
+
+        switch (packed) {
+            case AV_SAMPLE_FMT_S16: {
+                int16_t* samples = reinterpret_cast<int16_t*>(data);
+                for (int i = 0; i < count; i++) {
+                    float v = samples[i] * gain;
+                    samples[i] = static_cast<int16_t>(std::clamp(v, -32768.0f, 32767.0f));
+                }
+                break;
+            }
+            case AV_SAMPLE_FMT_S32: {
+                int32_t* samples = reinterpret_cast<int32_t*>(data);
+                for (int i = 0; i < count; i++) {
+                    double v = samples[i] * static_cast<double>(gain);
+                    samples[i] = static_cast<int32_t>(std::clamp(v, -2147483648.0, 2147483647.0));
+                }
+                break;
+            }
+            case AV_SAMPLE_FMT_FLT: {
+                float* samples = reinterpret_cast<float*>(data);
+                for (int i = 0; i < count; i++) {
+                    samples[i] *= gain;
+                }
+                break;
+            }
+            case AV_SAMPLE_FMT_DBL: {
+                double* samples = reinterpret_cast<double*>(data);
+                for (int i = 0; i < count; i++) {
+                    samples[i] *= gain;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+static AVCodecContext* openAudioDecoder(AVStream* stream) {
+    const AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!decoder) {
+        std::cerr << "Failed to find audio decoder\n";
+        return nullptr;
+    }
+
+    AVCodecContext* ctx = avcodec_alloc_context3(decoder);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    if (avcodec_parameters_to_context(ctx, stream->codecpar) < 0) {
+        avcodec_free_context(&ctx);
+        return nullptr;
+    }
+
+    ctx->time_base = stream->time_base;
+
+    if (avcodec_open2(ctx, decoder, nullptr) < 0) {
+        std::cerr << "Failed to open audio decoder\n";
+        avcodec_free_context(&ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+// Opens the input and discards everything but the first audio stream
+static int openAudioOnly(const std::string& input_file, AVFormatContext** input_ctx) {
+    if (avformat_open_input(input_ctx, input_file.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Cannot open input file: " << input_file << "\n";
+        return -1;
+    }
+
+    if (avformat_find_stream_info(*input_ctx, nullptr) < 0) {
+        std::cerr << "Cannot find stream information\n";
+        return -1;
+    }
+
+    int audio_index = -1;
+    for (unsigned int i = 0; i < (*input_ctx)->nb_streams; i++) {
+        AVStream* stream = (*input_ctx)->streams[i];
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audio_index < 0) {
+            audio_index = i;
+        } else {
+            stream->discard = AVDISCARD_ALL;
+        }
+    }
+
+    return audio_index;
+}
+
+bool measureLoudness(const std::string& input_file, LoudnessResult& result) {
+    AVFormatContext* input_ctx = nullptr;
+    int audio_index = openAudioOnly(input_file, &input_ctx);
+    if (audio_index < 0) {
+        if (input_ctx) avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVCodecContext* decoder_ctx = openAudioDecoder(input_ctx->streams[audio_index]);
+    if (!decoder_ctx) {
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    LoudnessMeter meter(decoder_ctx->sample_rate, &decoder_ctx->ch_layout);
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+
+    bool draining = false;
+    while (true) {
+        if (!draining) {
+            if (av_read_frame(input_ctx, packet) < 0) {
+                avcodec_send_packet(decoder_ctx, nullptr);
+                draining = true;
+            } else if (packet->stream_index != audio_index) {
+                av_packet_unref(packet);
+                continue;
+            } else {
+                avcodec_send_packet(decoder_ctx, packet);
+                av_packet_unref(packet);
+            }
+        }
+
+        int ret;
+        while ((ret = avcodec_receive_frame(decoder_ctx, frame)) == 0) {
+            meter.addFrame(frame);
+        }
+        if (draining && ret == AVERROR_EOF) {
+            break;
+        }
+    }
+
+    result = meter.result();
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+
+    return result.valid;
+}
+
+// State for the audio-only rewrite of one output
+struct AudioRewrite {
+    AVFormatContext* source_ctx = nullptr;
+    AVCodecContext* decoder_ctx = nullptr;
+    AVCodecContext* encoder_ctx = nullptr;
+    SwrContext* swr_ctx = nullptr;
+    AVStream* output_stream = nullptr;
+    int source_index = -1;
+    int64_t next_pts = 0;
+    double gain_db = 0.0;
+    bool eof = false;
+    std::deque<AVPacket*> pending;
+};
+
+static void drainAudioEncoder(AudioRewrite& audio) {
+    AVPacket* packet = av_packet_alloc();
+    while (avcodec_receive_packet(audio.encoder_ctx, packet) == 0) {
+        packet->stream_index = audio.output_stream->index;
+        av_packet_rescale_ts(packet, audio.encoder_ctx->time_base, audio.output_stream->time_base);
+        audio.pending.push_back(av_packet_clone(packet));
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+}
+
+static void encodeAudioFrame(AudioRewrite& audio, AVFrame* frame, AVFrame* resampled) {
+    applyAudioGain(frame, audio.gain_db);
+
+    AVFrame* frame_to_encode = frame;
+    if (audio.swr_ctx) {
+        resampled->nb_samples = av_rescale_rnd(
+            swr_get_delay(audio.swr_ctx, audio.decoder_ctx->sample_rate) + frame->nb_samples,
+            audio.encoder_ctx->sample_rate,
+            audio.decoder_ctx->sample_rate,
+            AV_ROUND_UP
+        );
+        av_channel_layout_copy(&resampled->ch_layout, &audio.encoder_ctx->ch_layout);
+        resampled->format = audio.encoder_ctx->sample_fmt;
+        resampled->sample_rate = audio.encoder_ctx->sample_rate;
+        av_frame_get_buffer(resampled, 0);
+
+        if (swr_convert(audio.swr_ctx, resampled->data, resampled->nb_samples,
+                        (const uint8_t**)frame->data, frame->nb_samples) < 0) {
+            av_frame_unref(resampled);
+            return;
+        }
+        frame_to_encode = resampled;
+    }
+
+    frame_to_encode->pts = audio.next_pts;
+    audio.next_pts += frame_to_encode->nb_samples;
+
+    if (avcodec_send_frame(audio.encoder_ctx, frame_to_encode) >= 0) {
+        drainAudioEncoder(audio);
+    }
+    if (frame_to_encode == resampled) {
+        av_frame_unref(resampled);
+    }
+}
+
+// Decodes source audio until at least one encoded packet is pending or input ends
+static void pumpAudio(AudioRewrite& audio, AVPacket* packet, AVFrame* frame, AVFrame* resampled) {
+    while (audio.pending.empty() && !audio.eof) {
+        if (av_read_frame(audio.source_ctx, packet) < 0) {
+            avcodec_send_packet(audio.decoder_ctx, nullptr);
+            while (avcodec_receive_frame(audio.decoder_ctx, frame) == 0) {
+                encodeAudioFrame(audio, frame, resampled);
+            }
+            avcodec_send_frame(audio.encoder_ctx, nullptr);
+            drainAudioEncoder(audio);
+            audio.eof = true;
+            break;
+        }
+
+        if (packet->stream_index == audio.source_index &&
+            avcodec_send_packet(audio.decoder_ctx, packet) >= 0) {
+            while (avcodec_receive_frame(audio.decoder_ctx, frame) == 0) {
+                encodeAudioFrame(audio, frame, resampled);
+            }
+        }
+        av_packet_unref(packet);
+    }
+}
+
+static bool setupAudioRewriteEncoder(AudioRewrite& audio, AVFormatContext* output_ctx, int audio_bitrate) {
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!codec) {
+        std::cerr << "AAC encoder not found\n";
+        return false;
+    }
+
+    audio.output_stream = avformat_new_stream(output_ctx, nullptr);
+    audio.encoder_ctx = avcodec_alloc_context3(codec);
+    if (!audio.output_stream || !audio.encoder_ctx) {
+        return false;
+    }
+
+    audio.encoder_ctx->sample_rate = audio.decoder_ctx->sample_rate;
+    av_channel_layout_copy(&audio.encoder_ctx->ch_layout, &audio.decoder_ctx->ch_layout);
+    audio.encoder_ctx->sample_fmt = codec->sample_fmts[0];
+    audio.encoder_ctx->bit_rate = audio_bitrate;
+    audio.encoder_ctx->time_base = AVRational{1, audio.encoder_ctx->sample_rate};
+    audio.output_stream->time_base = audio.encoder_ctx->time_base;
+
+    if (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+        audio.encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(audio.encoder_ctx, codec, nullptr) < 0) {
+        std::cerr << "Failed to open audio encoder\n";
+        return false;
+    }
+
+    if (avcodec_parameters_from_context(audio.output_stream->codecpar, audio.encoder_ctx) < 0) {
+        return false;
+    }
+
+    if (audio.decoder_ctx->sample_fmt != audio.encoder_ctx->sample_fmt) {
+        if (swr_alloc_set_opts2(&audio.swr_ctx,
+                                &audio.encoder_ctx->ch_layout, audio.encoder_ctx->sample_fmt, audio.encoder_ctx->sample_rate,
+                                &audio.decoder_ctx->ch_layout, audio.decoder_ctx->sample_fmt, audio.decoder_ctx->sample_rate,
+                                0, nullptr) < 0 || swr_init(audio.swr_ctx) < 0) {
+            std::cerr << "Failed to initialize resampler\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool remuxWithAudioGain(const std::string& source_file, const std::string& output_file,
+                        double gain_db, int audio_bitrate, FileChecksum* checksum) {
+    fs::path output_path(output_file);
+    std::string temp_file = (output_path.parent_path() /
+        (output_path.stem().string() + ".loudnorm" + output_path.extension().string())).string();
+
+    AudioRewrite audio;
+    audio.gain_db = gain_db;
+    AVFormatContext* encoded_ctx = nullptr;
+    AVFormatContext* output_ctx = nullptr;
+    AVStream* video_out = nullptr;
+    int video_index = -1;
+    bool success = false;
+
+    AVPacket* packet = av_packet_alloc();
+    AVPacket* audio_packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    AVFrame* resampled = av_frame_alloc();
+
+    do {
+        audio.source_index = openAudioOnly(source_file, &audio.source_ctx);
+        if (audio.source_index < 0) break;
+
+        audio.decoder_ctx = openAudioDecoder(audio.source_ctx->streams[audio.source_index]);
+        if (!audio.decoder_ctx) break;
+
+        if (avformat_open_input(&encoded_ctx, output_file.c_str(), nullptr, nullptr) < 0 ||
+            avformat_find_stream_info(encoded_ctx, nullptr) < 0) {
+            std::cerr << "Cannot open encoded output: " << output_file << "\n";
+            break;
+        }
+
+        avformat_alloc_output_context2(&output_ctx, nullptr, nullptr, temp_file.c_str());
+        if (!output_ctx) break;
+
+        // Video is carried over bit-for-bit; the old audio track is dropped
+        for (unsigned int i = 0; i < encoded_ctx->nb_streams; i++) {
+            AVStream* stream = encoded_ctx->streams[i];
+            if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_index < 0) {
+                video_index = i;
+                video_out = avformat_new_stream(output_ctx, nullptr);
+                if (!video_out || avcodec_parameters_copy(video_out->codecpar, stream->codecpar) < 0) {
+                    video_out = nullptr;
+                    break;
+                }
+                video_out->codecpar->codec_tag = 0;
+                video_out->time_base = stream->time_base;
+            } else {
+                stream->discard = AVDISCARD_ALL;
+            }
+        }
+        if (!video_out) break;
+
+        if (!setupAudioRewriteEncoder(audio, output_ctx, audio_bitrate)) break;
+
+        int open_ret = checksum ? openHashedOutput(&output_ctx->pb, temp_file)
+                                : avio_open(&output_ctx->pb, temp_file.c_str(), AVIO_FLAG_WRITE);
+        if (open_ret < 0) {
+            std::cerr << "Could not open output file: " << temp_file << "\n";
+            break;
+        }
+
+        AVDictionary* opts = nullptr;
+        av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        int ret = avformat_write_header(output_ctx, &opts);
+        av_dict_free(&opts);
+        if (ret < 0) break;
+
+        AVStream* video_in = encoded_ctx->streams[video_index];
+
+        // Merge copied video with freshly encoded audio in timestamp order
+        while (av_read_frame(encoded_ctx, packet) >= 0) {
+            if (packet->stream_index != video_index) {
+                av_packet_unref(packet);
+                continue;
+            }
+
+            av_packet_rescale_ts(packet, video_in->time_base, video_out->time_base);
+            packet->stream_index = video_out->index;
+            packet->pos = -1;
+
+            while (true) {
+                pumpAudio(audio, audio_packet, frame, resampled);
+                if (audio.pending.empty()) break;
+
+                AVPacket* next = audio.pending.front();
+                if (av_compare_ts(next->dts, audio.output_stream->time_base,
+                                  packet->dts, video_out->time_base) > 0) {
+                    break;
+                }
+                audio.pending.pop_front();
+                av_interleaved_write_frame(output_ctx, next);
+                av_packet_free(&next);
+            }
+
+            av_interleaved_write_frame(output_ctx, packet);
+        }
+
+        // Remaining audio after the last video packet
+        while (true) {
+            pumpAudio(audio, audio_packet, frame, resampled);
+            if (audio.pending.empty()) break;
+            AVPacket* next = audio.pending.front();
+            audio.pending.pop_front();
+            av_interleaved_write_frame(output_ctx, next);
+            av_packet_free(&next);
+        }
+
+        av_write_trailer(output_ctx);
+        success = true;
+    } while (false);
+
+    for (auto* pending : audio.pending) {
+        av_packet_free(&pending);
+    }
+    av_frame_free(&resampled);
+    av_frame_free(&frame);
+    av_packet_free(&audio_packet);
+    av_packet_free(&packet);
+    if (audio.swr_ctx) swr_free(&audio.swr_ctx);
+    if (audio.encoder_ctx) avcodec_free_context(&audio.encoder_ctx);
+    if (audio.decoder_ctx) avcodec_free_context(&audio.decoder_ctx);
+    if (audio.source_ctx) avformat_close_input(&audio.source_ctx);
+    if (encoded_ctx) avformat_close_input(&encoded_ctx);
+    if (output_ctx) {
+        if (!closeHashedOutput(&output_ctx->pb, success ? checksum : nullptr)) {
+            success = false;
+        }
+        avformat_free_context(output_ctx);
+    }
+
+    if (!success) {
+        std::error_code ec;
+        fs::remove(temp_file, ec);
+        std::cerr << "Loudness second pass failed for: " << output_file << "\n";
+        return false;
+    }
+
+    std::error_code ec;
+    fs::rename(temp_file, output_file, ec);
+    if (ec) {
+        fs::remove(temp_file, ec);
+        std::cerr << "Loudness second pass cannot replace " << output_file << ": " << ec.message() << "\n";
+        return false;
+    }
+    if (checksum) {
+        checksum->path = output_file;
+    }
+    return true;
+}
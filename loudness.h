@@ -0,0 +1,81 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "checksum.h"
+
+struct AVFrame;
+struct AVChannelLayout;
+
+struct LoudnessResult {
+    double integrated_lufs = -70.0;
+    double true_peak_dbtp = -144.0;
+    bool valid = false;
+};
+
+// EBU R128 / ITU-R BS.1770 meter: K-weighting, 400 ms gated blocks and
+// 4x oversampled true peak. Channels are processed four at a time in SIMD lanes.
+class LoudnessMeter {
+public:
+    LoudnessMeter(int sample_rate, const AVChannelLayout* layout);
+
+    // Accepts decoded audio in any packed or planar sample format
+    void addFrame(const AVFrame* frame);
+
+    LoudnessResult result() const;
+
+private:
+    typedef float v4f __attribute__((vector_size(16)));
+
+    struct Biquad {
+        float b0, b1, b2, a1, a2;
+    };
+
+    struct LaneGroup {
+        v4f weight = {0, 0, 0, 0};
+        v4f z1[2] = {{0, 0, 0, 0}, {0, 0, 0, 0}};
+        v4f z2[2] = {{0, 0, 0, 0}, {0, 0, 0, 0}};
+        v4f history[12] = {};
+        v4f peak = {0, 0, 0, 0};
+    };
+
+    static const int TAPS_PER_PHASE = 12;
+    static const int OVERSAMPLE = 4;
+
+    int sample_rate;
+    int channels;
+    Biquad stages[2];
+    std::vector<LaneGroup> groups;
+    float phases[OVERSAMPLE][TAPS_PER_PHASE];
+
+    // 100 ms sub-blocks; a gating block is four consecutive sub-blocks
+    int subblock_samples;
+    int subblock_fill = 0;
+    v4f subblock_energy = {0, 0, 0, 0};
+    std::vector<double> subblocks;
+    std::vector<double> blocks;
+
+    std::vector<float> scratch;
+
+    void processSamples(const float* const* planes, int nb_samples);
+};
+
+// Gain in dB that brings measured loudness to the target without pushing
+// the true peak above the ceiling
+double loudnessGain(const LoudnessResult& measured, double target_lufs, double max_true_peak);
+
+// Scales decoded samples in place; integer formats are clipped
+void applyAudioGain(AVFrame* frame, double gain_db);
+
+// Audio-only pre-scan: demuxes the input, decodes only the first audio stream
+bool measureLoudness(const std::string& input_file, LoudnessResult& result);
+
+// Second pass: rewrites the audio track of an already encoded output from the
+// source with gain applied; video packets are copied, never decoded. The
+// rewritten file is hashed while it is written when checksum is given.
+bool remuxWithAudioGain(const std::string& source_file, const std::string& output_file,
+                        double gain_db, int audio_bitrate, FileChecksum* checksum = nullptr);
+
+#endif // LOUDNESS_H
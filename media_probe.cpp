@@ -0,0 +1,122 @@
+#include "media_probe.h"
+#include <sstream>
+#include <iomanip>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/error.h>
+}
+
+static std::string errorString(int errnum) {
+    char errbuf[256];
+    av_strerror(errnum, errbuf, sizeof(errbuf));
+    return errbuf;
+}
+
+bool probeMedia(const std::string& input_file, MediaInfo& info, std::string& error) {
+    info = MediaInfo();
+
+    AVFormatContext* input_ctx = avformat_alloc_context();
+    if (!input_ctx) {
+        error = "out of memory";
+        return false;
+    }
+
+    // Streams whose parameters are not in the header are looked at for at
+    // most a few seconds instead of the default analysis window
+    input_ctx->max_analyze_duration = 5 * AV_TIME_BASE;
+
+    int ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
+    if (ret < 0) {
+        error = "cannot open container: " + errorString(ret);
+        return false;
+    }
+
+    ret = avformat_find_stream_info(input_ctx, nullptr);
+    if (ret < 0) {
+        error = "cannot read stream parameters: " + errorString(ret);
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    info.container = input_ctx->iformat->name;
+    info.duration = input_ctx->duration != AV_NOPTS_VALUE ?
+                    input_ctx->duration / static_cast<double>(AV_TIME_BASE) : 0;
+    info.bit_rate = input_ctx->bit_rate;
+
+    AVStream* video = nullptr;
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        AVStream* stream = input_ctx->streams[i];
+        switch (stream->codecpar->codec_type) {
+            case AVMEDIA_TYPE_VIDEO:
+                // Cover art is a video stream too, but not something to encode
+                if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+                    break;
+                }
+                info.video_streams++;
+                if (!video) {
+                    video = stream;
+                }
+                break;
+            case AVMEDIA_TYPE_AUDIO:
+                info.audio_streams++;
+                break;
+            case AVMEDIA_TYPE_SUBTITLE:
+                info.subtitle_streams++;
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool valid = false;
+    if (!video) {
+        error = "no video stream";
+    } else {
+        info.video_codec = avcodec_get_name(video->codecpar->codec_id);
+        info.geometry = sourceGeometry(input_ctx, video);
+        info.transfer = hdrTransfer(video->codecpar->color_trc);
+        AVRational rate = av_guess_frame_rate(input_ctx, video, nullptr);
+        info.frame_rate = rate.den > 0 ? static_cast<double>(rate.num) / rate.den : 0;
+
+        if (!avcodec_find_decoder(video->codecpar->codec_id)) {
+            error = "no decoder for video codec " + info.video_codec;
+        } else if (info.geometry.width <= 0 || info.geometry.height <= 0) {
+            error = "video picture size unknown";
+        } else if (input_ctx->duration != AV_NOPTS_VALUE && info.duration <= 0) {
+            error = "zero length";
+        } else {
+            valid = true;
+        }
+    }
+
+    if (valid) {
+        collectMediaTracks(input_ctx, info.tracks);
+    }
+    avformat_close_input(&input_ctx);
+    return valid;
+}
+
+std::string describeMedia(const MediaInfo& info) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2);
+    ss << info.container << ", " << info.video_codec << " " << info.geometry.width << "x" << info.geometry.height;
+    if (info.geometry.sar_num != info.geometry.sar_den) {
+        ss << " SAR " << info.geometry.sar_num << ":" << info.geometry.sar_den;
+    }
+    ss << " @ " << info.frame_rate << " fps";
+    if (info.transfer != HDR_NONE) {
+        ss << " " << describeTransfer(info.transfer);
+    }
+    ss << std::setprecision(0);
+    if (info.duration > 0) {
+        ss << ", " << info.duration << " s";
+    }
+    if (info.bit_rate > 0) {
+        ss << ", " << info.bit_rate / 1000 << " kbps";
+    }
+    ss << ", streams: " << info.video_streams << " video / " << info.audio_streams << " audio / "
+       << info.subtitle_streams << " subtitle";
+    return ss.str();
+}
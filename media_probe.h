@@ -0,0 +1,34 @@
+#ifndef MEDIA_PROBE_H
+#define MEDIA_PROBE_H
+
+#include <string>
+#include <cstdint>
+#include "media_tracks.h"
+#include "geometry.h"
+#include "tone_map.h"
+
+// What the converter needs to know about a source before it is queued
+struct MediaInfo {
+    std::string container;      // demuxer name, e.g. "mov,mp4,m4a,3gp,3g2,mj2"
+    std::string video_codec;
+    SourceGeometry geometry;    // coded size and sample aspect ratio
+    HdrTransfer transfer = HDR_NONE;
+    double frame_rate = 0;
+    double duration = 0;        // seconds, 0 when the container does not say
+    int64_t bit_rate = 0;       // bits per second, 0 when unknown
+    int video_streams = 0;
+    int audio_streams = 0;
+    int subtitle_streams = 0;
+    MediaTracks tracks;
+};
+
+// Reads the container header and stream parameters, never decoding more
+// than ffmpeg needs to fill them in. Returns false with a reason for inputs
+// the converter would fail on: unreadable or truncated containers, no video
+// stream, a video codec without decoder, unknown picture size or zero length.
+bool probeMedia(const std::string& input_file, MediaInfo& info, std::string& error);
+
+// One-line summary for logs
+std::string describeMedia(const MediaInfo& info);
+
+#endif // MEDIA_PROBE_H
@@ -0,0 +1,454 @@
+#include "media_tracks.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <set>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/dict.h>
+}
+
+const std::string AUDIO_GROUP_ID = "audio";
+const std::string SUBTITLE_GROUP_ID = "subs";
+
+// Written by ffmpeg in each subtitle folder and removed once it is cut
+const std::string SUBTITLE_SOURCE_FILE = "subtitles.vtt";
+
+// Containers mostly carry ISO 639-2 codes, HLS wants the short RFC 5646 form
+static std::string normalizeLanguage(const std::string& code) {
+    static const std::map<std::string, std::string> iso639 = {
+        {"eng", "en"}, {"rus", "ru"}, {"geo", "ka"}, {"kat", "ka"},
+        {"ger", "de"}, {"deu", "de"}, {"fre", "fr"}, {"fra", "fr"},
+        {"spa", "es"}, {"ita", "it"}, {"ukr", "uk"}, {"tur", "tr"},
+        {"arm", "hy"}, {"hye", "hy"}, {"aze", "az"}
+    };
+
+    if (code.empty() || code == "und") {
+        return "";
+    }
+    auto it = iso639.find(code);
+    return it != iso639.end() ? it->second : code;
+}
+
+static std::string streamTag(AVStream* stream, const char* key) {
+    AVDictionaryEntry* entry = av_dict_get(stream->metadata, key, nullptr, 0);
+    return entry ? entry->value : "";
+}
+
+static std::string quoted(const std::string& value) {
+    std::string result = "\"";
+    for (char c : value) {
+        if (c != '"' && c != '\n' && c != '\r') {
+            result += c;
+        }
+    }
+    return result + "\"";
+}
+
+bool probeMediaTracks(const std::string& input_file, MediaTracks& tracks) {
+    AVFormatContext* input_ctx = nullptr;
+    if (avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr) < 0) {
+        std::cerr << "Cannot open input file: " << input_file << "\n";
+        return false;
+    }
+
+    if (avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        std::cerr << "Cannot find stream information\n";
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    collectMediaTracks(input_ctx, tracks);
+    avformat_close_input(&input_ctx);
+    return true;
+}
+
+void collectMediaTracks(AVFormatContext* input_ctx, MediaTracks& tracks) {
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        AVStream* stream = input_ctx->streams[i];
+        std::string language = normalizeLanguage(streamTag(stream, "language"));
+        std::string title = streamTag(stream, "title");
+        bool is_default = stream->disposition & AV_DISPOSITION_DEFAULT;
+
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            AudioTrack track;
+            track.stream_index = i;
+            track.language = language;
+            track.name = !title.empty() ? title : !language.empty() ? language
+                         : "Audio " + std::to_string(tracks.audio.size() + 1);
+            track.channels = stream->codecpar->ch_layout.nb_channels;
+            track.is_default = is_default;
+            track.folder_name = "audio_" + std::to_string(tracks.audio.size());
+            tracks.audio.push_back(track);
+        } else if (stream->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE) {
+            const AVCodecDescriptor* desc = avcodec_descriptor_get(stream->codecpar->codec_id);
+            if (!desc || !(desc->props & AV_CODEC_PROP_TEXT_SUB)) {
+                continue;
+            }
+
+            SubtitleTrack track;
+            track.stream_index = i;
+            track.language = language;
+            track.name = !title.empty() ? title : !language.empty() ? language
+                         : "Subtitles " + std::to_string(tracks.subtitles.size() + 1);
+            track.is_default = is_default;
+            track.folder_name = "subs_" + std::to_string(tracks.subtitles.size());
+            tracks.subtitles.push_back(track);
+        }
+    }
+
+    // Exactly one audio rendition is the default
+    bool has_default = false;
+    for (auto& track : tracks.audio) {
+        track.is_default = track.is_default && !has_default;
+        has_default = has_default || track.is_default;
+    }
+    if (!has_default && !tracks.audio.empty()) {
+        tracks.audio[0].is_default = true;
+    }
+}
+
+std::string hlsRenditionArgs(const MediaTracks& tracks, const std::string& output_dir,
+                             int segment_duration, int audio_bitrate) {
+    std::stringstream args;
+
+    for (const auto& track : tracks.audio) {
+        std::string dir = output_dir + "/" + track.folder_name;
+        args << "-map 0:" << track.stream_index << " ";
+        args << "-c:a aac -b:a " << audio_bitrate << " -ac 2 ";
+        args << "-f hls -hls_time " << segment_duration << " ";
+        args << "-hls_list_size 0 ";
+        args << "-hls_segment_filename \"" << dir << "/segment_%03d.ts\" ";
+        args << "\"" << dir << "/index.m3u8\" ";
+    }
+
+    for (const auto& track : tracks.subtitles) {
+        std::string dir = output_dir + "/" + track.folder_name;
+        args << "-map 0:" << track.stream_index << " ";
+        args << "-c:s webvtt -f webvtt ";
+        args << "\"" << dir << "/" << SUBTITLE_SOURCE_FILE << "\" ";
+    }
+
+    return args.str();
+}
+
+namespace {
+
+struct Cue {
+    double start;
+    double end;
+    std::string text;       // identifier, timing line and payload as written
+};
+
+// "hh:mm:ss.mmm" or "mm:ss.mmm"
+bool parseCueTime(const std::string& text, double& seconds) {
+    double parts[3] = {0, 0, 0};
+    int count = 0;
+    size_t pos = 0;
+    while (count < 3) {
+        size_t colon = text.find(':', pos);
+        std::string part = text.substr(pos, colon == std::string::npos ? std::string::npos : colon - pos);
+        if (part.empty()) {
+            return false;
+        }
+        parts[count++] = std::atof(part.c_str());
+        if (colon == std::string::npos) {
+            break;
+        }
+        pos = colon + 1;
+    }
+    if (count < 2) {
+        return false;
+    }
+    seconds = count == 3 ? parts[0] * 3600 + parts[1] * 60 + parts[2] : parts[0] * 60 + parts[1];
+    return true;
+}
+
+bool readCues(const std::string& path, std::vector<Cue>& cues) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    // Blocks are separated by blank lines; the header block has no timing
+    std::string line;
+    std::vector<std::string> block;
+    auto flush = [&] {
+        for (size_t i = 0; i < block.size(); i++) {
+            size_t arrow = block[i].find("-->");
+            if (arrow == std::string::npos) {
+                continue;
+            }
+            std::istringstream timing(block[i]);
+            std::string from, to, ignored;
+            Cue cue;
+            if ((timing >> from >> ignored >> to) && parseCueTime(from, cue.start) && parseCueTime(to, cue.end)) {
+                for (const auto& text : block) {
+                    cue.text += text + "\n";
+                }
+                cues.push_back(cue);
+            }
+            break;
+        }
+        block.clear();
+    };
+    while (std::getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            flush();
+        } else {
+            block.push_back(line);
+        }
+    }
+    flush();
+    return true;
+}
+
+// Segment durations, the target duration and the first segment of a
+// media playlist written by the hls muxer
+bool readVideoPlaylist(const std::string& path, std::vector<double>& durations, int& target_duration,
+                       std::string& first_segment) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.compare(0, 8, "#EXTINF:") == 0) {
+            durations.push_back(std::atof(line.c_str() + 8));
+        } else if (line.compare(0, 22, "#EXT-X-TARGETDURATION:") == 0) {
+            target_duration = std::atoi(line.c_str() + 22);
+        } else if (!line.empty() && line[0] != '#' && first_segment.empty()) {
+            first_segment = line;
+        }
+    }
+    return !durations.empty() && !first_segment.empty();
+}
+
+// First presentation timestamp of an MPEG-TS file, in 90 kHz ticks
+bool firstTimestamp(const std::string& segment, int64_t& pts) {
+    AVFormatContext* input_ctx = nullptr;
+    if (avformat_open_input(&input_ctx, segment.c_str(), nullptr, nullptr) < 0) {
+        return false;
+    }
+    bool found = false;
+    if (avformat_find_stream_info(input_ctx, nullptr) >= 0) {
+        for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+            AVStream* stream = input_ctx->streams[i];
+            if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && stream->start_time != AV_NOPTS_VALUE) {
+                pts = av_rescale_q(stream->start_time, stream->time_base, AVRational{1, 90000});
+                found = true;
+                break;
+            }
+        }
+    }
+    avformat_close_input(&input_ctx);
+    return found;
+}
+
+// Renamed into place, so the segment hasher never reads half a playlist
+bool replaceFile(const std::filesystem::path& path, const std::string& text) {
+    std::filesystem::path partial = path;
+    partial += ".tmp";
+    std::ofstream file(partial, std::ios::binary | std::ios::trunc);
+    file.write(text.data(), text.size());
+    file.close();
+    std::error_code ec;
+    if (file) {
+        std::filesystem::rename(partial, path, ec);
+    }
+    return file && !ec;
+}
+
+} // namespace
+
+bool segmentSubtitles(const MediaTracks& tracks, const std::string& output_dir,
+                      const std::string& video_playlist, std::string& error) {
+    if (tracks.subtitles.empty()) {
+        return true;
+    }
+
+    namespace fs = std::filesystem;
+    fs::path video_path = fs::path(output_dir) / video_playlist;
+    std::vector<double> durations;
+    int target_duration = 0;
+    std::string first_segment;
+    if (!readVideoPlaylist(video_path.string(), durations, target_duration, first_segment)) {
+        error = "cannot read " + video_path.string();
+        return false;
+    }
+    int64_t mpegts = 0;
+    std::string first_path = (video_path.parent_path() / first_segment).string();
+    if (!firstTimestamp(first_path, mpegts)) {
+        error = "cannot read the first timestamp of " + first_path;
+        return false;
+    }
+    for (double duration : durations) {
+        target_duration = std::max(target_duration, static_cast<int>(std::ceil(duration)));
+    }
+
+    for (const auto& track : tracks.subtitles) {
+        fs::path dir = fs::path(output_dir) / track.folder_name;
+        std::vector<Cue> cues;
+        if (!readCues((dir / SUBTITLE_SOURCE_FILE).string(), cues)) {
+            error = "cannot read " + (dir / SUBTITLE_SOURCE_FILE).string();
+            return false;
+        }
+
+        // Every segment spans the same time as its video segment. A cue is
+        // repeated in each segment it overlaps; cues past the end go in the last.
+        std::ostringstream playlist;
+        playlist << "#EXTM3U\n";
+        playlist << "#EXT-X-VERSION:3\n";
+        playlist << "#EXT-X-TARGETDURATION:" << target_duration << "\n";
+        playlist << "#EXT-X-MEDIA-SEQUENCE:0\n";
+        playlist << "#EXT-X-PLAYLIST-TYPE:VOD\n";
+        double start = 0;
+        for (size_t i = 0; i < durations.size(); i++) {
+            double end = start + durations[i];
+            bool last = i + 1 == durations.size();
+            char name[32];
+            snprintf(name, sizeof(name), "segment_%03zu.vtt", i);
+
+            std::ofstream segment(dir / name, std::ios::binary | std::ios::trunc);
+            segment << "WEBVTT\nX-TIMESTAMP-MAP=MPEGTS:" << mpegts << ",LOCAL:00:00:00.000\n";
+            for (const auto& cue : cues) {
+                if ((cue.end > start || i == 0) && (cue.start < end || last)) {
+                    segment << "\n" << cue.text;
+                }
+            }
+            segment.close();
+            if (!segment) {
+                error = "cannot write " + (dir / name).string();
+                return false;
+            }
+
+            char extinf[48];
+            snprintf(extinf, sizeof(extinf), "#EXTINF:%.6f,\n", durations[i]);
+            playlist << extinf << name << "\n";
+            start = end;
+        }
+        playlist << "#EXT-X-ENDLIST\n";
+
+        if (!replaceFile(dir / "index.m3u8", playlist.str())) {
+            error = "cannot write " + (dir / "index.m3u8").string();
+            return false;
+        }
+        std::error_code ec;
+        fs::remove(dir / SUBTITLE_SOURCE_FILE, ec);
+    }
+    return true;
+}
+
+bool markVodPlaylist(const std::string& playlist, std::string& error) {
+    std::ifstream file(playlist);
+    if (!file.is_open()) {
+        error = "cannot read " + playlist;
+        return false;
+    }
+
+    // Next to the media sequence, where ffmpeg itself puts the tag
+    std::string text;
+    std::string line;
+    bool marked = false;
+    while (std::getline(file, line)) {
+        if (line.rfind("#EXT-X-PLAYLIST-TYPE:", 0) == 0) {
+            return true;
+        }
+        text += line + "\n";
+        if (!marked && line.rfind("#EXT-X-MEDIA-SEQUENCE:", 0) == 0) {
+            text += "#EXT-X-PLAYLIST-TYPE:VOD\n";
+            marked = true;
+        }
+    }
+    file.close();
+    if (!marked) {
+        size_t header = text.find('\n');
+        if (text.rfind("#EXTM3U", 0) != 0 || header == std::string::npos) {
+            error = playlist + " is not a media playlist";
+            return false;
+        }
+        text.insert(header + 1, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+    }
+    if (!replaceFile(playlist, text)) {
+        error = "cannot write " + playlist;
+        return false;
+    }
+    return true;
+}
+
+void writeMediaGroups(std::ostream& playlist, const MediaTracks& tracks) {
+    for (const auto& track : tracks.audio) {
+        playlist << "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=" << quoted(AUDIO_GROUP_ID);
+        if (!track.language.empty()) {
+            playlist << ",LANGUAGE=" << quoted(track.language);
+        }
+        playlist << ",NAME=" << quoted(track.name);
+        playlist << ",DEFAULT=" << (track.is_default ? "YES" : "NO");
+        playlist << ",AUTOSELECT=YES";
+        playlist << ",CHANNELS=\"2\"";
+        playlist << ",URI=" << quoted(track.folder_name + "/index.m3u8") << "\n";
+    }
+
+    for (const auto& track : tracks.subtitles) {
+        playlist << "#EXT-X-MEDIA:TYPE=SUBTITLES,GROUP-ID=" << quoted(SUBTITLE_GROUP_ID);
+        if (!track.language.empty()) {
+            playlist << ",LANGUAGE=" << quoted(track.language);
+        }
+        playlist << ",NAME=" << quoted(track.name);
+        playlist << ",DEFAULT=NO,AUTOSELECT=YES,FORCED=NO";
+        playlist << ",URI=" << quoted(track.folder_name + "/index.m3u8") << "\n";
+    }
+
+    if (!tracks.audio.empty() || !tracks.subtitles.empty()) {
+        playlist << "\n";
+    }
+}
+
+std::string mediaGroupAttributes(const MediaTracks& tracks) {
+    std::string attributes;
+    if (!tracks.audio.empty()) {
+        attributes += ",AUDIO=" + quoted(AUDIO_GROUP_ID);
+    }
+    if (!tracks.subtitles.empty()) {
+        attributes += ",SUBTITLES=" + quoted(SUBTITLE_GROUP_ID);
+    }
+    return attributes;
+}
+
+static std::string joinLanguages(const std::vector<std::string>& languages) {
+    std::set<std::string> seen;
+    std::string result;
+    for (const auto& language : languages) {
+        if (language.empty() || !seen.insert(language).second) {
+            continue;
+        }
+        result += (result.empty() ? "" : ",") + language;
+    }
+    return result;
+}
+
+std::string audioLanguages(const MediaTracks& tracks) {
+    std::vector<std::string> languages;
+    for (const auto& track : tracks.audio) {
+        languages.push_back(track.language);
+    }
+    return joinLanguages(languages);
+}
+
+std::string subtitleLanguages(const MediaTracks& tracks) {
+    std::vector<std::string> languages;
+    for (const auto& track : tracks.subtitles) {
+        languages.push_back(track.language);
+    }
+    return joinLanguages(languages);
+}
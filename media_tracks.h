@@ -0,0 +1,69 @@
+#ifndef MEDIA_TRACKS_H
+#define MEDIA_TRACKS_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+struct AVFormatContext;
+
+struct AudioTrack {
+    int stream_index;       // index in the input container
+    std::string language;   // RFC 5646 tag, empty when unknown
+    std::string name;
+    int channels;
+    bool is_default;
+    std::string folder_name;
+};
+
+struct SubtitleTrack {
+    int stream_index;
+    std::string language;
+    std::string name;
+    bool is_default;
+    std::string folder_name;
+};
+
+struct MediaTracks {
+    std::vector<AudioTrack> audio;
+    std::vector<SubtitleTrack> subtitles;   // text subtitles only
+};
+
+// Reads the container header and lists every audio track and every text
+// subtitle track; bitmap subtitles cannot be converted to WebVTT and are skipped
+bool probeMediaTracks(const std::string& input_file, MediaTracks& tracks);
+
+// Same, for an input that is already open with stream info read
+void collectMediaTracks(AVFormatContext* input_ctx, MediaTracks& tracks);
+
+// ffmpeg output arguments that encode each audio track once into its own
+// HLS rendition and write each subtitle track whole as WebVTT, for
+// segmentSubtitles() to cut once the video is done
+std::string hlsRenditionArgs(const MediaTracks& tracks, const std::string& output_dir,
+                             int segment_duration, int audio_bitrate);
+
+// Cuts every subtitle track at the segment boundaries of a finished video
+// playlist (relative to output_dir) and writes its VOD playlist. Each
+// segment carries the X-TIMESTAMP-MAP of the video's first MPEG-TS
+// timestamp, so cues line up on Apple players. False, with the reason, when
+// a file cannot be read or written.
+bool segmentSubtitles(const MediaTracks& tracks, const std::string& output_dir,
+                      const std::string& video_playlist, std::string& error);
+
+// Adds EXT-X-PLAYLIST-TYPE:VOD to a finished media playlist. ffmpeg is run
+// without -hls_playlist_type vod, which would hold the playlist back until
+// the trailer, so the segment hasher can follow it during the encode.
+// Playlists that already carry a type are left alone.
+bool markVodPlaylist(const std::string& playlist, std::string& error);
+
+// EXT-X-MEDIA entries for the master playlist
+void writeMediaGroups(std::ostream& playlist, const MediaTracks& tracks);
+
+// AUDIO/SUBTITLES attributes appended to every EXT-X-STREAM-INF
+std::string mediaGroupAttributes(const MediaTracks& tracks);
+
+// Comma separated language lists for the ADI metadata
+std::string audioLanguages(const MediaTracks& tracks);
+std::string subtitleLanguages(const MediaTracks& tracks);
+
+#endif // MEDIA_TRACKS_H
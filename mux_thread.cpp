@@ -0,0 +1,82 @@
+#include "mux_thread.h"
+#include "trace.h"
+#include <iostream>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+MuxThread::MuxThread(AVFormatContext* output_ctx, size_t capacity, double interleave_window,
+                     TraceSession* trace, const std::string& label)
+    : output_ctx(output_ctx), queue(capacity, WaitPolicy::Block), trace(trace), label(label) {
+    output_ctx->max_interleave_delta = static_cast<int64_t>(interleave_window * AV_TIME_BASE);
+}
+
+MuxThread::~MuxThread() {
+    finish();
+}
+
+void MuxThread::start() {
+    writer = std::thread(&MuxThread::run, this);
+}
+
+void MuxThread::push(AVPacket* packet) {
+    AVPacket* queued = av_packet_alloc();
+    if (!queued) {
+        write_errors++;
+        return;
+    }
+    av_packet_move_ref(queued, packet);
+    if (!queue.push(queued)) {
+        av_packet_free(&queued);
+        write_errors++;
+        return;
+    }
+
+    size_t queued_now = queue.size();
+    if (queued_now > peak_depth.load(std::memory_order_relaxed)) {
+        peak_depth.store(queued_now, std::memory_order_relaxed);
+    }
+}
+
+void MuxThread::run() {
+    AVPacket* packet = nullptr;
+    while (queue.pop(packet)) {
+        packets++;
+        bytes += packet->size;
+        TRACE_SCOPE(trace, "mux write", "mux", label);
+        int ret = av_interleaved_write_frame(output_ctx, packet);
+        if (ret < 0) {
+            char errbuf[256];
+            av_strerror(ret, errbuf, sizeof(errbuf));
+            std::cerr << "Error writing packet: " << errbuf << "\n";
+            write_errors++;
+        }
+        av_packet_free(&packet);
+    }
+
+    // Whatever libavformat still holds for interleaving
+    if (av_interleaved_write_frame(output_ctx, nullptr) < 0) {
+        write_errors++;
+    }
+}
+
+bool MuxThread::finish() {
+    if (writer.joinable()) {
+        queue.close();
+        writer.join();
+    }
+    return write_errors.load() == 0;
+}
+
+MuxStats MuxThread::stats() const {
+    MuxStats stats;
+    stats.packets = packets.load();
+    stats.bytes = bytes.load();
+    stats.capacity = queue.capacity();
+    stats.peak_depth = peak_depth.load();
+    stats.producer_stalls = queue.producerStalls();
+    stats.write_errors = write_errors.load();
+    return stats;
+}
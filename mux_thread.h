@@ -0,0 +1,71 @@
+#ifndef MUX_THREAD_H
+#define MUX_THREAD_H
+
+#include <atomic>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "ring_buffer.h"
+
+struct AVFormatContext;
+struct AVPacket;
+class TraceSession;
+
+// Counters of one output's writer
+struct MuxStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    size_t capacity = 0;
+    size_t peak_depth = 0;          // most packets queued at once
+    uint64_t producer_stalls = 0;   // pushes that had to wait for room
+    uint64_t write_errors = 0;
+};
+
+// Writes one output's packets on a thread of its own, so muxing and disk
+// I/O never stall the encoder. Packets are handed over through an
+// SpscRing: when the writer falls behind, push() waits, holding the
+// encoder back instead of growing memory. libavformat's interleaving queue
+// is bounded by the interleave window, beyond which it writes out what it
+// holds rather than waiting for a lagging stream.
+class MuxThread {
+public:
+    // Capacity is rounded up to a power of two; the window is in seconds.
+    // With a trace, every write is recorded as a span labelled with the output.
+    MuxThread(AVFormatContext* output_ctx, size_t capacity, double interleave_window,
+              TraceSession* trace = nullptr, const std::string& label = "");
+    ~MuxThread();
+    MuxThread(const MuxThread&) = delete;
+    MuxThread& operator=(const MuxThread&) = delete;
+
+    // The header must already be written
+    void start();
+
+    // Takes the packet's reference and leaves it blank. Only one thread may
+    // push. Waits while the ring is full.
+    void push(AVPacket* packet);
+
+    // Writes everything queued, drains the interleaving queue and joins the
+    // writer. The trailer is left to the caller. False if any write failed.
+    bool finish();
+
+    // Safe from any thread while the writer runs
+    MuxStats stats() const;
+    size_t depth() const { return queue.size(); }
+
+private:
+    AVFormatContext* output_ctx;
+    SpscRing<AVPacket*> queue;
+    std::thread writer;
+    TraceSession* trace;
+    std::string label;
+
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<size_t> peak_depth{0};
+    std::atomic<uint64_t> write_errors{0};
+
+    void run();
+};
+
+#endif // MUX_THREAD_H
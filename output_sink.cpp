@@ -0,0 +1,457 @@
+#include "output_sink.h"
+#include "checksum.h"
+#include "s3_sink.h"
+#include "upload_scheduler.h"
+#include "logger.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// ---------------------------------------------------------------------------
+// Local filesystem
+
+class LocalSink : public OutputSink {
+public:
+    using OutputSink::OutputSink;
+
+    bool putFiles(const std::vector<SinkFile>& files) override {
+        bool success = true;
+        for (const auto& file : files) {
+            fs::path target = fs::path(config.path) / file.remote_path;
+            std::error_code ec;
+            fs::create_directories(target.parent_path(), ec);
+
+            if (config.mode == "hardlink") {
+                fs::remove(target, ec);
+                fs::create_hard_link(file.local_path, target, ec);
+                if (!ec) {
+                    bytes_sent += file.size;
+                    continue;
+                }
+                // Different filesystem, fall back to a copy
+            }
+
+            // Copy next to the target and rename, so readers never see a partial file
+            fs::path partial = target.string() + ".part";
+            fs::copy_file(file.local_path, partial, fs::copy_options::overwrite_existing, ec);
+            if (!ec) {
+                fs::rename(partial, target, ec);
+            }
+            if (!ec) {
+                bytes_sent += file.size;
+            }
+            if (ec) {
+                std::cerr << "Cannot copy " << file.local_path << " to " << target << ": " << ec.message() << "\n";
+                fs::remove(partial, ec);
+                success = false;
+            }
+        }
+        return success;
+    }
+
+    std::map<std::string, uint64_t> remoteSizes(const std::vector<std::string>& remote_paths) override {
+        std::map<std::string, uint64_t> sizes;
+        for (const auto& remote_path : remote_paths) {
+            std::error_code ec;
+            uintmax_t size = fs::file_size(fs::path(config.path) / remote_path, ec);
+            if (!ec) {
+                sizes[remote_path] = size;
+            }
+        }
+        return sizes;
+    }
+
+    bool readFile(const std::string& remote_path, std::string& contents) override {
+        std::ifstream file(fs::path(config.path) / remote_path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// SFTP through the OpenSSH client, password via sshpass
+
+// Upper bound of one sftp session under a bandwidth limit, so a large title
+// does not hold the shared bucket for its whole transfer
+const uint64_t SFTP_SESSION_BYTES = 64ull * 1024 * 1024;
+
+class SFTPSink : public OutputSink {
+public:
+    using OutputSink::OutputSink;
+
+    bool putFiles(const std::vector<SinkFile>& files) override {
+        std::set<std::string> created_dirs;
+        bool success = true;
+
+        // Sessions of at most SFTP_SESSION_BYTES, each paid for before it
+        // starts: sftp can only be paced with -l, so the shared bucket
+        // holds every other transfer back until this one's bytes are covered
+        size_t first = 0;
+        while (first < files.size()) {
+            std::stringstream commands;
+            uint64_t bytes = 0;
+            size_t last = first;
+            while (last < files.size() && (last == first || bytes + files[last].size <= SFTP_SESSION_BYTES)) {
+                const SinkFile& file = files[last++];
+                // Parents first, -mkdir ignores directories that already exist
+                std::vector<std::string> parents;
+                for (fs::path dir = fs::path(file.remote_path).parent_path(); !dir.empty(); dir = dir.parent_path()) {
+                    parents.push_back(dir.generic_string());
+                }
+                for (auto it = parents.rbegin(); it != parents.rend(); ++it) {
+                    if (created_dirs.insert(*it).second) {
+                        commands << "-mkdir \"" << *it << "\"\n";
+                    }
+                }
+                commands << "put \"" << file.local_path << "\" \"" << file.remote_path << "\"\n";
+                bytes += file.size;
+            }
+            first = last;
+
+            if (throttle) {
+                throttle->acquire(bytes);
+            }
+            if (runBatch(commands.str()) != 0) {
+                success = false;
+            }
+            bytes_sent += bytes;
+        }
+        return success;
+    }
+
+    // Sizes from "ls -l" of the directories holding the files
+    std::map<std::string, uint64_t> remoteSizes(const std::vector<std::string>& remote_paths) override {
+        std::set<std::string> wanted(remote_paths.begin(), remote_paths.end());
+        std::set<std::string> listings;
+        for (const auto& file : remote_paths) {
+            size_t slash = file.rfind('/');
+            listings.insert(slash == std::string::npos ? file : file.substr(0, slash));
+        }
+
+        std::stringstream commands;
+        for (const auto& listing : listings) {
+            commands << "-ls -l \"" << listing << "\"\n";
+        }
+        std::string output;
+        runBatch(commands.str(), &output);
+
+        // -rw-r--r--  1 user  group  1234 Jan  1 12:00 dir/name
+        std::map<std::string, uint64_t> sizes;
+        std::istringstream lines(output);
+        std::string line;
+        std::string current_listing;
+        while (std::getline(lines, line)) {
+            if (line.compare(0, 5, "sftp>") == 0) {
+                size_t quote = line.find('"');
+                current_listing = quote == std::string::npos ? "" :
+                    line.substr(quote + 1, line.rfind('"') - quote - 1);
+                continue;
+            }
+            if (line.empty() || line[0] != '-') {
+                continue;
+            }
+
+            std::istringstream fields(line);
+            std::string perms, links, user, group, month, day, time, name;
+            uint64_t size = 0;
+            if (!(fields >> perms >> links >> user >> group >> size >> month >> day >> time)) {
+                continue;
+            }
+            std::getline(fields >> std::ws, name);
+
+            // Older servers print bare names for directory listings
+            if (wanted.count(name) == 0 && !current_listing.empty()) {
+                name = current_listing + "/" + fs::path(name).filename().string();
+            }
+            if (wanted.count(name)) {
+                sizes[name] = size;
+            }
+        }
+        return sizes;
+    }
+
+    bool readFile(const std::string& remote_path, std::string& contents) override {
+        std::string local_copy = "/tmp/sftp_get_" + std::to_string(getpid()) + "_" +
+                                 std::to_string(batch_counter++) + ".tmp";
+        std::string output;
+        runBatch("-get \"" + remote_path + "\" \"" + local_copy + "\"\n", &output);
+
+        std::ifstream file(local_copy, std::ios::binary);
+        bool found = file.is_open();
+        if (found) {
+            contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        std::error_code ec;
+        fs::remove(local_copy, ec);
+        return found;
+    }
+
+private:
+    int batch_counter = 0;
+
+    // Runs one sftp batch session; output, when requested, holds everything sftp printed
+    int runBatch(const std::string& commands, std::string* output = nullptr) {
+        std::string batch_file = "/tmp/sftp_batch_" + std::to_string(getpid()) + "_" +
+                                 std::to_string(batch_counter++) + ".txt";
+        std::ofstream batch(batch_file);
+
+        // Navigate to remote path first
+        if (!config.remote_path.empty() && config.remote_path != "/") {
+            batch << "cd " << config.remote_path << "\n";
+        }
+        batch << commands;
+        batch.close();
+
+        // Build SFTP command (connect without path in URL)
+        std::stringstream cmd;
+        cmd << "sshpass -p '" << config.password << "' ";
+        cmd << "sftp -oBatchMode=no -oStrictHostKeyChecking=no ";
+        cmd << "-P " << config.port << " ";
+        if (throttle && throttle->rate() > 0) {
+            cmd << "-l " << std::max<uint64_t>(throttle->rate() * 8 / 1000, 1) << " ";
+        }
+        cmd << config.username << "@" << config.host << " ";
+        cmd << "< " << batch_file << " 2>&1";
+
+        int result = -1;
+        if (output) {
+            FILE* pipe = popen(cmd.str().c_str(), "r");
+            if (pipe) {
+                char buffer[4096];
+                while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
+                    *output += buffer;
+                }
+                result = pclose(pipe);
+            }
+        } else {
+            result = system(cmd.str().c_str());
+        }
+
+        std::error_code ec;
+        fs::remove(batch_file, ec);
+        return result;
+    }
+};
+
+// ---------------------------------------------------------------------------
+
+std::unique_ptr<OutputSink> createSink(const DestinationConfig& config, std::string& error) {
+    if (config.type == "local") {
+        if (config.path.empty()) {
+            error = "local destination needs a path";
+            return nullptr;
+        }
+        return std::unique_ptr<OutputSink>(new LocalSink(config));
+    }
+
+    if (config.type == "sftp") {
+        if (config.host.empty() || config.username.empty()) {
+            error = "sftp destination needs host and username";
+            return nullptr;
+        }
+        if (system("which sshpass > /dev/null 2>&1") != 0) {
+            error = "sshpass is not installed (sudo apt-get install sshpass)";
+            return nullptr;
+        }
+        return std::unique_ptr<OutputSink>(new SFTPSink(config));
+    }
+
+    if (config.type == "s3") {
+        if (config.endpoint.empty() || config.bucket.empty() ||
+            config.access_key.empty() || config.secret_key.empty()) {
+            error = "s3 destination needs endpoint, bucket, access_key and secret_key";
+            return nullptr;
+        }
+#ifdef RADIUMVOD_HAVE_S3
+        return createS3Sink(config);
+#else
+        error = "radiumvod was built without libcurl, s3 destinations are unavailable";
+        return nullptr;
+#endif
+    }
+
+    error = "unknown destination type '" + config.type + "'";
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Manifest-driven sync
+
+static std::string remotePath(const std::string& remote_name, const std::string& relative) {
+    if (relative == "vod-" + remote_name + ".xml") {
+        return relative;
+    }
+    return remote_name + "/" + relative;
+}
+
+static std::string readLocalManifest(const fs::path& local_dir) {
+    std::ifstream file(local_dir / MANIFEST_FILE, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+static std::vector<FileChecksum> localManifest(const fs::path& local_dir) {
+    std::vector<FileChecksum> files;
+    fs::path manifest_path = local_dir / MANIFEST_FILE;
+    if (readManifest(manifest_path.string(), files)) {
+        return files;
+    }
+
+    // Titles converted before manifests existed are hashed once here
+    LOG_INFO("No manifest in " + local_dir.string() + ", hashing files");
+    files.clear();
+    for (const auto& entry : fs::recursive_directory_iterator(local_dir)) {
+        if (!entry.is_regular_file() || entry.path().filename() == MANIFEST_FILE) {
+            continue;
+        }
+        FileChecksum checksum;
+        if (hashFile(entry.path().string(), checksum)) {
+            files.push_back(checksum);
+        }
+    }
+    writeManifest(manifest_path.string(), files);
+
+    files.clear();
+    readManifest(manifest_path.string(), files);
+    return files;
+}
+
+// Sends files and checks their remote sizes; remote is updated with what arrived
+static bool transferVerified(OutputSink& sink, const fs::path& local_dir, const std::string& remote_name,
+                             const std::vector<const FileChecksum*>& files,
+                             std::map<std::string, FileChecksum>& remote) {
+    if (files.empty()) {
+        return true;
+    }
+
+    std::vector<SinkFile> transfers;
+    std::vector<std::string> remote_paths;
+    for (const auto* file : files) {
+        SinkFile transfer;
+        transfer.local_path = (local_dir / file->path).string();
+        transfer.remote_path = remotePath(remote_name, file->path);
+        transfer.size = file->size;
+        transfers.push_back(transfer);
+        remote_paths.push_back(transfer.remote_path);
+    }
+    sink.putFiles(transfers);
+
+    std::map<std::string, uint64_t> sizes = sink.remoteSizes(remote_paths);
+    size_t arrived = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        auto it = sizes.find(remote_paths[i]);
+        if (it != sizes.end() && it->second == files[i]->size) {
+            remote[files[i]->path] = *files[i];
+            arrived++;
+        } else {
+            remote.erase(files[i]->path);
+        }
+    }
+
+    if (arrived < files.size()) {
+        LOG_INFO(sink.describe() + ": " + std::to_string(files.size() - arrived) +
+            " files missing or short on the remote side");
+        return false;
+    }
+    return true;
+}
+
+bool syncTitle(OutputSink& sink, const fs::path& local_dir, const std::string& remote_name,
+               const RetryWait& wait_retry) {
+    const DestinationConfig& config = sink.destination();
+    std::string manifest_remote = remote_name + "/" + MANIFEST_FILE;
+
+    std::vector<FileChecksum> local = localManifest(local_dir);
+
+    // Missing remote manifest means nothing is known to be there yet
+    std::map<std::string, FileChecksum> remote;
+    std::string remote_text;
+    std::vector<FileChecksum> remote_files;
+    if (sink.readFile(manifest_remote, remote_text) && parseManifest(remote_text, remote_files)) {
+        for (const auto& file : remote_files) {
+            remote[file.path] = file;
+        }
+        LOG_INFO(sink.describe() + ": remote manifest lists " + std::to_string(remote.size()) + " files");
+    }
+
+    for (int attempt = 1; attempt <= config.retry_attempts; attempt++) {
+        std::vector<const FileChecksum*> pending;
+        uint64_t pending_bytes = 0;
+        for (const auto& file : local) {
+            auto it = remote.find(file.path);
+            if (it == remote.end() || it->second.size != file.size || it->second.xxh3 != file.xxh3) {
+                pending.push_back(&file);
+                pending_bytes += file.size;
+            }
+        }
+
+        LOG_INFO(sink.describe() + " attempt " + std::to_string(attempt) + "/" +
+            std::to_string(config.retry_attempts) + ": " + std::to_string(pending.size()) +
+            " of " + std::to_string(local.size()) + " files, " + std::to_string(pending_bytes) + " bytes");
+
+        // Media first; the ADI XML only once all media is verified, so the
+        // origin never ingests a partial title even when sinks upload in parallel
+        auto split = std::stable_partition(pending.begin(), pending.end(), [&](const FileChecksum* file) {
+            return file->path != "vod-" + remote_name + ".xml";
+        });
+        std::vector<const FileChecksum*> media(pending.begin(), split);
+        std::vector<const FileChecksum*> adi(split, pending.end());
+
+        // Playlists are small and what players ask for first
+        std::stable_partition(media.begin(), media.end(), [](const FileChecksum* file) {
+            return fs::path(file->path).extension() == ".m3u8";
+        });
+
+        // A backfill of a title that is already complete costs one manifest read
+        if (pending.empty() && remote_text == readLocalManifest(local_dir)) {
+            LOG_INFO(sink.describe() + ": already up to date");
+            return true;
+        }
+
+        bool verified = transferVerified(sink, local_dir, remote_name, media, remote) &&
+                        transferVerified(sink, local_dir, remote_name, adi, remote);
+
+        if (verified) {
+            SinkFile manifest;
+            manifest.local_path = (local_dir / MANIFEST_FILE).string();
+            manifest.remote_path = manifest_remote;
+            std::error_code ec;
+            manifest.size = fs::file_size(manifest.local_path, ec);
+
+            if (!ec && sink.putFiles({manifest})) {
+                std::map<std::string, uint64_t> sizes = sink.remoteSizes({manifest_remote});
+                auto it = sizes.find(manifest_remote);
+                if (it != sizes.end() && it->second == manifest.size) {
+                    LOG_INFO(sink.describe() + ": upload successful");
+                    return true;
+                }
+            }
+            LOG_WARNING(sink.describe() + ": manifest upload failed (attempt " + std::to_string(attempt) + ")");
+        }
+
+        if (attempt < config.retry_attempts) {
+            std::chrono::seconds delay(config.retry_delay);
+            if (!wait_retry) {
+                std::this_thread::sleep_for(delay);
+            } else if (!wait_retry(delay)) {
+                LOG_WARNING(sink.describe() + ": retries abandoned at shutdown");
+                return false;
+            }
+        }
+    }
+
+    LOG_ERROR(sink.describe() + ": upload failed after all retry attempts");
+    return false;
+}
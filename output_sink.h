@@ -0,0 +1,98 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+
+class TokenBucket;
+
+// Per-title list of every delivered file with its size and checksums
+const std::string MANIFEST_FILE = "manifest.txt";
+
+// One entry of the "destinations" array in radiumvod.conf
+struct DestinationConfig {
+    std::string name;
+    std::string type;           // "local", "sftp" or "s3"
+    bool enabled = true;
+    int retry_attempts = 3;
+    int retry_delay = 5;
+    int max_concurrent = 1;     // titles uploaded at the same time
+
+    // local
+    std::string path;
+    std::string mode = "copy";  // "copy" or "hardlink"
+
+    // sftp
+    std::string host;
+    int port = 22;
+    std::string username;
+    std::string password;
+    std::string remote_path;
+
+    // s3
+    std::string endpoint;       // http(s)://host[:port], path-style addressing
+    std::string bucket;
+    std::string region = "us-east-1";
+    std::string access_key;
+    std::string secret_key;
+    std::string prefix;
+    int part_size_mb = 16;
+    int parallel_uploads = 4;
+};
+
+struct SinkFile {
+    std::string local_path;
+    std::string remote_path;    // relative to the destination root, '/' separated
+    uint64_t size = 0;
+};
+
+// Storage behind a destination. Transfers are best effort; syncTitle checks
+// what actually arrived through remoteSizes.
+class OutputSink {
+public:
+    explicit OutputSink(const DestinationConfig& config) : config(config) {}
+    virtual ~OutputSink() {}
+
+    const DestinationConfig& destination() const { return config; }
+    std::string describe() const { return config.name + " (" + config.type + ")"; }
+
+    // Shared bandwidth limit for remote transfers; local copies are not shaped
+    void setThrottle(TokenBucket* bucket) { throttle = bucket; }
+
+    // Payload bytes handed to the destination so far
+    uint64_t bytesSent() const { return bytes_sent; }
+
+    virtual bool putFiles(const std::vector<SinkFile>& files) = 0;
+
+    // Sizes of the remote paths that exist; missing ones are left out
+    virtual std::map<std::string, uint64_t> remoteSizes(const std::vector<std::string>& remote_paths) = 0;
+
+    virtual bool readFile(const std::string& remote_path, std::string& contents) = 0;
+
+protected:
+    DestinationConfig config;
+    TokenBucket* throttle = nullptr;
+    std::atomic<uint64_t> bytes_sent{0};
+};
+
+// Returns nullptr and sets error for unknown types or missing tools/libraries
+std::unique_ptr<OutputSink> createSink(const DestinationConfig& config, std::string& error);
+
+// Manifest-driven delivery of one title directory: only files missing or
+// different on the remote side are sent, sizes are verified after every
+// transfer and the remote manifest is replaced last, so it only ever lists
+// verified files. The ADI XML goes to the destination root, everything else
+// under remote_name. Between attempts it calls wait_retry with the retry
+// delay, which returns false to give up (at shutdown); without one it sleeps.
+typedef std::function<bool(std::chrono::seconds)> RetryWait;
+bool syncTitle(OutputSink& sink, const std::filesystem::path& local_dir,
+               const std::string& remote_name, const RetryWait& wait_retry = nullptr);
+
+#endif // OUTPUT_SINK_H
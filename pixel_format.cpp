@@ -0,0 +1,44 @@
+#include "pixel_format.h"
+#include <algorithm>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+std::vector<int> sdrRungFormats() {
+    return {AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12};
+}
+
+std::vector<int> hdr10RungFormats() {
+    return {AV_PIX_FMT_YUV420P10};
+}
+
+int plainPixelFormat(int format) {
+    return format == AV_PIX_FMT_YUVJ420P ? AV_PIX_FMT_YUV420P : format;
+}
+
+int negotiatePixelFormat(const AVCodec* encoder, int src_format, const std::vector<int>& rung_formats) {
+    int format = plainPixelFormat(src_format);
+    if (std::find(rung_formats.begin(), rung_formats.end(), format) == rung_formats.end()) {
+        return AV_PIX_FMT_NONE;
+    }
+    // Encoders that do not list their formats are taken at their word for the rung's first
+    if (!encoder->pix_fmts) {
+        return format == rung_formats.front() ? format : AV_PIX_FMT_NONE;
+    }
+    for (const AVPixelFormat* supported = encoder->pix_fmts; *supported != AV_PIX_FMT_NONE; supported++) {
+        if (*supported == format) {
+            return format;
+        }
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+void retagFullRange(AVFrame* frame) {
+    if (frame->format == AV_PIX_FMT_YUVJ420P) {
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->color_range = AVCOL_RANGE_JPEG;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <vector>
+
+struct AVCodec;
+struct AVFrame;
+
+// Formats (AVPixelFormat values) a rung may be encoded in without changing
+// its profile: 8-bit 4:2:0 for the H.264 rungs, 10-bit 4:2:0 for HDR10
+std::vector<int> sdrRungFormats();
+std::vector<int> hdr10RungFormats();
+
+// Format the encoder is opened with so decoded frames of src_format can be
+// handed to it by reference, with no conversion pass. The deprecated
+// full-range J formats match their plain twin. AV_PIX_FMT_NONE when the
+// rung or the encoder does not take the source format, and frames have to
+// go through the scaler.
+int negotiatePixelFormat(const AVCodec* encoder, int src_format, const std::vector<int>& rung_formats);
+
+// Turns a J-format frame into its plain twin tagged full range; a change of
+// metadata only, the pixels are untouched
+void retagFullRange(AVFrame* frame);
+
+// Plain twin of a J format, the format itself otherwise
+int plainPixelFormat(int format);
+
+#endif // PIXEL_FORMAT_H
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <sstream>
 #include <filesystem>
 #include <getopt.h>
 #include <unistd.h>
@@ -10,6 +15,9 @@
 #include "converter_abr.h"
 #include "converter_hls.h"
 #include "watcher.h"
+#include "bench.h"
+#include "loadtest.h"
+#include "trace.h"
 
 namespace fs = std::filesystem;
 
@@ -22,6 +30,8 @@ enum Command {
     CMD_NONE,
     CMD_DAEMON,
     CMD_CONVERT,
+    CMD_BENCH,
+    CMD_LOADTEST,
     CMD_VERSION,
     CMD_HELP
 };
@@ -39,6 +49,33 @@ enum ConvertProfile {
     PROFILE_ALL
 };
 
+// Long-only options
+enum LongOption {
+    OPT_TARGET_LUFS = 1000,
+    OPT_MANIFEST,
+    OPT_NO_CROP,
+    OPT_NO_TRIM,
+    OPT_NO_TONEMAP,
+    OPT_HDR10,
+    OPT_MUX_WINDOW,
+    OPT_TRACE,
+    OPT_ITEMS,
+    OPT_CAPACITY,
+    OPT_CLIPS,
+    OPT_RATE,
+    OPT_POISSON,
+    OPT_CLIP_SECONDS,
+    OPT_CLIP_SIZE,
+    OPT_WORK_DIR,
+    OPT_KEEP,
+    OPT_TIMEOUT,
+    OPT_RUNS,
+    OPT_BASELINE,
+    OPT_SAVE,
+    OPT_THRESHOLD,
+    OPT_PIPELINES
+};
+
 struct Options {
     Command command = CMD_NONE;
     std::string config_file = "/etc/radiumvod/radiumvod.conf";
@@ -46,6 +83,14 @@ struct Options {
     std::string output_file;
     ConvertFormat format = FORMAT_H264;
     ConvertProfile profile = PROFILE_HIGH;
+    ConvertOptions convert;
+    std::string trace_file;
+    std::string bench_target;
+    size_t bench_items = 2000000;
+    size_t bench_capacity = 1024;
+    PipelineBenchOptions pipeline_bench;
+    LoadTestOptions loadtest;
+    ClipSpec clip;
     bool verbose = false;
 };
 
@@ -60,6 +105,9 @@ void printUsage() {
     std::cout << "Commands:\n";
     std::cout << "  daemon                      Run as daemon service\n";
     std::cout << "  convert                     Convert video file\n";
+    std::cout << "  bench queue                 Measure the hand-off cost of the stage queues\n";
+    std::cout << "  bench pipeline              Time the conversion pipelines, optionally against a baseline\n";
+    std::cout << "  loadtest                    Drop synthetic clips on the daemon and measure latencies\n";
     std::cout << "  version                     Show version information\n";
     std::cout << "  help                        Show this help message\n\n";
     std::cout << "Daemon Options:\n";
@@ -69,12 +117,46 @@ void printUsage() {
     std::cout << "  -o, --output <file>         Output file/directory (required)\n";
     std::cout << "  -f, --format <format>       Output format: h264, h265, hls (default: h264)\n";
     std::cout << "  -p, --profile <profile>     Quality profile: high, medium, low, all (default: high)\n";
+    std::cout << "  -l, --loudness <mode>       Loudness normalization: off, prescan, twopass (default: off)\n";
+    std::cout << "      --target-lufs <lufs>    Loudness target (default: -23)\n";
+    std::cout << "      --manifest <file>       Write size, XXH3, MD5 and SHA-256 of every output\n";
+    std::cout << "  -t, --threads <n>           Encoder threads, split across HLS rungs (default: all cores)\n";
+    std::cout << "      --no-crop               Keep black bars instead of cropping them\n";
+    std::cout << "      --no-trim               Keep black, silent slates at head and tail (HLS)\n";
+    std::cout << "      --no-tonemap            Encode HDR sources without mapping them to SDR\n";
+    std::cout << "      --hdr10                 Add an HDR10 HEVC rung for PQ sources (h264)\n";
+    std::cout << "      --mux-window <seconds>  Interleave window of each output (h264, default: 2)\n";
+    std::cout << "      --trace <file>          Write a Chrome trace of the conversion (open in Perfetto)\n";
     std::cout << "  -v, --verbose               Verbose output\n\n";
+    std::cout << "Bench Options:\n";
+    std::cout << "      --items <n>             Items handed over per run (default: 2000000)\n";
+    std::cout << "      --capacity <n>          Queue capacity (default: 1024)\n";
+    std::cout << "  -i, --input <file>          Pipeline input (default: a synthetic clip)\n";
+    std::cout << "      --pipelines <list>      Comma-separated: standard, abr, hls (default: all three)\n";
+    std::cout << "      --runs <n>              Runs of each pipeline (default: 5)\n";
+    std::cout << "      --baseline <file>       Compare against a saved run; exit 2 on a regression\n";
+    std::cout << "      --save <file>           Save this run as a baseline\n";
+    std::cout << "      --threshold <percent>   Change that counts as a regression (default: 5)\n";
+    std::cout << "  -v, --verbose               Show the conversion output\n\n";
+    std::cout << "Synthetic Clip Options (bench pipeline, loadtest):\n";
+    std::cout << "      --clip-seconds <s>      Length of each clip (default: 10)\n";
+    std::cout << "      --clip-size <WxH>       Picture size of the clips (default: 1280x720)\n\n";
+    std::cout << "Loadtest Options:\n";
+    std::cout << "  -c, --config <file>         Daemon config to test; paths and destinations are replaced\n";
+    std::cout << "      --clips <n>             Clips dropped (default: 20)\n";
+    std::cout << "      --rate <n>              Clips per minute, 0 drops them all at once (default: 6)\n";
+    std::cout << "      --poisson               Random arrivals averaging the rate\n";
+    std::cout << "      --work-dir <dir>        Where the scratch directory is made (default: system temp)\n";
+    std::cout << "      --keep                  Keep the scratch directory, daemon log and cost reports\n";
+    std::cout << "      --timeout <s>           Wait for the last clip after the last drop (default: 1800)\n\n";
     std::cout << "Examples:\n";
     std::cout << "  " << PROGRAM_NAME << " daemon -c /etc/radiumvod/radiumvod.conf\n";
     std::cout << "  " << PROGRAM_NAME << " convert -i input.mp4 -o output.mp4 -f h264 -p high\n";
     std::cout << "  " << PROGRAM_NAME << " convert -i input.mp4 -o output_dir -f hls -p all\n";
-    std::cout << "  " << PROGRAM_NAME << " convert -i input.mp4 -o output -f h264 -p all\n\n";
+    std::cout << "  " << PROGRAM_NAME << " convert -i input.mp4 -o output -f h264 -p all\n";
+    std::cout << "  " << PROGRAM_NAME << " bench queue --items 5000000\n";
+    std::cout << "  " << PROGRAM_NAME << " bench pipeline --runs 10 --baseline bench-main.json\n";
+    std::cout << "  " << PROGRAM_NAME << " loadtest -c /etc/radiumvod/radiumvod.conf --clips 50 --rate 0\n\n";
     std::cout << "System Service:\n";
     std::cout << "  sudo systemctl start radiumvod    # Start daemon\n";
     std::cout << "  sudo systemctl stop radiumvod     # Stop daemon\n";
@@ -88,6 +170,14 @@ ConvertFormat parseFormat(const std::string& format) {
     return FORMAT_H264; // default
 }
 
+std::string parseLoudnessMode(const std::string& mode) {
+    if (mode == "prescan" || mode == "twopass") return mode;
+    if (mode != "off") {
+        std::cerr << "Warning: Unknown loudness mode '" << mode << "', normalization disabled\n";
+    }
+    return "off";
+}
+
 ConvertProfile parseProfile(const std::string& profile) {
     if (profile == "medium") return PROFILE_MEDIUM;
     if (profile == "low") return PROFILE_LOW;
@@ -117,6 +207,16 @@ Options parseOptions(int argc, char* argv[]) {
         opts.command = CMD_DAEMON;
     } else if (cmd == "convert") {
         opts.command = CMD_CONVERT;
+    } else if (cmd == "bench") {
+        opts.command = CMD_BENCH;
+        if (argc < 3 || argv[2][0] == '-') {
+            std::cerr << "Error: bench needs a target: queue, pipeline\n";
+            opts.command = CMD_NONE;
+            return opts;
+        }
+        opts.bench_target = argv[2];
+    } else if (cmd == "loadtest") {
+        opts.command = CMD_LOADTEST;
     } else if (cmd == "version" || cmd == "--version" || cmd == "-v") {
         opts.command = CMD_VERSION;
         return opts;
@@ -142,6 +242,31 @@ Options parseOptions(int argc, char* argv[]) {
         {"output", required_argument, 0, 'o'},
         {"format", required_argument, 0, 'f'},
         {"profile", required_argument, 0, 'p'},
+        {"loudness", required_argument, 0, 'l'},
+        {"target-lufs", required_argument, 0, OPT_TARGET_LUFS},
+        {"manifest", required_argument, 0, OPT_MANIFEST},
+        {"threads", required_argument, 0, 't'},
+        {"no-crop", no_argument, 0, OPT_NO_CROP},
+        {"no-trim", no_argument, 0, OPT_NO_TRIM},
+        {"no-tonemap", no_argument, 0, OPT_NO_TONEMAP},
+        {"hdr10", no_argument, 0, OPT_HDR10},
+        {"mux-window", required_argument, 0, OPT_MUX_WINDOW},
+        {"trace", required_argument, 0, OPT_TRACE},
+        {"items", required_argument, 0, OPT_ITEMS},
+        {"capacity", required_argument, 0, OPT_CAPACITY},
+        {"clips", required_argument, 0, OPT_CLIPS},
+        {"rate", required_argument, 0, OPT_RATE},
+        {"poisson", no_argument, 0, OPT_POISSON},
+        {"clip-seconds", required_argument, 0, OPT_CLIP_SECONDS},
+        {"clip-size", required_argument, 0, OPT_CLIP_SIZE},
+        {"work-dir", required_argument, 0, OPT_WORK_DIR},
+        {"keep", no_argument, 0, OPT_KEEP},
+        {"timeout", required_argument, 0, OPT_TIMEOUT},
+        {"runs", required_argument, 0, OPT_RUNS},
+        {"baseline", required_argument, 0, OPT_BASELINE},
+        {"save", required_argument, 0, OPT_SAVE},
+        {"threshold", required_argument, 0, OPT_THRESHOLD},
+        {"pipelines", required_argument, 0, OPT_PIPELINES},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -149,9 +274,9 @@ Options parseOptions(int argc, char* argv[]) {
     
     int opt_index = 0;
     int c;
-    optind = 2; // Start after the command
+    optind = opts.command == CMD_BENCH ? 3 : 2; // Start after the command
     
-    while ((c = getopt_long(argc, argv, "c:i:o:f:p:vh", long_options, &opt_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "c:i:o:f:p:l:t:vh", long_options, &opt_index)) != -1) {
         switch (c) {
             case 'c':
                 opts.config_file = optarg;
@@ -168,6 +293,95 @@ Options parseOptions(int argc, char* argv[]) {
             case 'p':
                 opts.profile = parseProfile(optarg);
                 break;
+            case 'l':
+                opts.convert.loudness_mode = parseLoudnessMode(optarg);
+                break;
+            case OPT_TARGET_LUFS:
+                opts.convert.target_lufs = std::atof(optarg);
+                break;
+            case OPT_MANIFEST:
+                opts.convert.manifest_file = optarg;
+                break;
+            case 't':
+                opts.convert.threads = std::max(0, std::atoi(optarg));
+                break;
+            case OPT_NO_CROP:
+                opts.convert.crop_detect = false;
+                break;
+            case OPT_NO_TRIM:
+                opts.convert.trim_edges = false;
+                break;
+            case OPT_NO_TONEMAP:
+                opts.convert.tone_map = false;
+                break;
+            case OPT_HDR10:
+                opts.convert.hdr10_rung = true;
+                break;
+            case OPT_MUX_WINDOW:
+                opts.convert.mux_interleave_window = std::max(0.0, std::atof(optarg));
+                break;
+            case OPT_TRACE:
+                opts.trace_file = optarg;
+                break;
+            case OPT_ITEMS:
+                opts.bench_items = std::max(1L, std::atol(optarg));
+                break;
+            case OPT_CAPACITY:
+                opts.bench_capacity = std::max(2L, std::atol(optarg));
+                break;
+            case OPT_CLIPS:
+                opts.loadtest.clips = std::max(1, std::atoi(optarg));
+                break;
+            case OPT_RATE:
+                opts.loadtest.rate = std::max(0.0, std::atof(optarg));
+                break;
+            case OPT_POISSON:
+                opts.loadtest.poisson = true;
+                break;
+            case OPT_CLIP_SECONDS:
+                opts.clip.seconds = std::max(1.0, std::atof(optarg));
+                break;
+            case OPT_CLIP_SIZE:
+                if (sscanf(optarg, "%dx%d", &opts.clip.width, &opts.clip.height) != 2 ||
+                    opts.clip.width < 16 || opts.clip.height < 16 ||
+                    opts.clip.width % 2 || opts.clip.height % 2) {
+                    std::cerr << "Error: --clip-size needs an even WxH, such as 1280x720\n";
+                    opts.command = CMD_NONE;
+                    return opts;
+                }
+                break;
+            case OPT_WORK_DIR:
+                opts.loadtest.work_dir = optarg;
+                break;
+            case OPT_KEEP:
+                opts.loadtest.keep = true;
+                break;
+            case OPT_TIMEOUT:
+                opts.loadtest.timeout = std::max(1, std::atoi(optarg));
+                break;
+            case OPT_RUNS:
+                opts.pipeline_bench.runs = std::max(1, std::atoi(optarg));
+                break;
+            case OPT_BASELINE:
+                opts.pipeline_bench.baseline = optarg;
+                break;
+            case OPT_SAVE:
+                opts.pipeline_bench.save = optarg;
+                break;
+            case OPT_THRESHOLD:
+                opts.pipeline_bench.threshold = std::max(0.0, std::atof(optarg));
+                break;
+            case OPT_PIPELINES: {
+                opts.pipeline_bench.pipelines.clear();
+                std::stringstream list(optarg);
+                std::string pipeline;
+                while (std::getline(list, pipeline, ',')) {
+                    if (!pipeline.empty()) {
+                        opts.pipeline_bench.pipelines.push_back(pipeline);
+                    }
+                }
+                break;
+            }
             case 'v':
                 opts.verbose = true;
                 break;
@@ -199,6 +413,32 @@ int runDaemon(const Options& opts) {
     return run_watcher(opts.config_file);
 }
 
+int convertFile(const Options& opts, const ConvertOptions& convert) {
+    // Execute conversion based on format
+    switch (opts.format) {
+        case FORMAT_HLS:
+            return convert_hls(opts.input_file, opts.output_file, convert);
+            
+        case FORMAT_H265:
+            std::cerr << "H.265 encoding not yet implemented\n";
+            return 1;
+            
+        case FORMAT_H264:
+        default:
+            if (opts.profile == PROFILE_ALL || 
+                opts.profile == PROFILE_HIGH || 
+                opts.profile == PROFILE_MEDIUM || 
+                opts.profile == PROFILE_LOW) {
+                
+                std::string profile_str = profileToString(opts.profile);
+                return convert_abr(opts.input_file, opts.output_file, profile_str, convert);
+            }
+            break;
+    }
+    
+    return 0;
+}
+
 int runConvert(const Options& opts) {
     // Validate required options
     if (opts.input_file.empty()) {
@@ -224,32 +464,51 @@ int runConvert(const Options& opts) {
         std::cout << "Output:  " << opts.output_file << "\n";
         std::cout << "Format:  " << (opts.format == FORMAT_HLS ? "HLS" : 
                                        opts.format == FORMAT_H265 ? "H.265" : "H.264") << "\n";
-        std::cout << "Profile: " << profileToString(opts.profile) << "\n\n";
+        std::cout << "Profile: " << profileToString(opts.profile) << "\n";
+        std::cout << "Loudness: " << opts.convert.loudness_mode << "\n\n";
     }
     
-    // Execute conversion based on format
-    switch (opts.format) {
-        case FORMAT_HLS:
-            return convert_hls(opts.input_file, opts.output_file);
-            
-        case FORMAT_H265:
-            std::cerr << "H.265 encoding not yet implemented\n";
-            return 1;
-            
-        case FORMAT_H264:
-        default:
-            if (opts.profile == PROFILE_ALL || 
-                opts.profile == PROFILE_HIGH || 
-                opts.profile == PROFILE_MEDIUM || 
-                opts.profile == PROFILE_LOW) {
-                
-                std::string profile_str = profileToString(opts.profile);
-                return convert_abr(opts.input_file, opts.output_file, profile_str);
-            }
-            break;
+    // Spans are collected while the converter runs and written at the end
+    ConvertOptions convert = opts.convert;
+    std::unique_ptr<TraceSession> trace;
+    if (!opts.trace_file.empty()) {
+        trace.reset(new TraceSession(fs::path(opts.input_file).filename().string()));
+        convert.trace = trace.get();
     }
     
-    return 0;
+    int result = convertFile(opts, convert);
+    
+    if (trace) {
+        std::string error;
+        if (trace->write(opts.trace_file, error)) {
+            std::cout << "Trace: " << opts.trace_file << " (" << trace->spanCount() << " spans)\n";
+        } else {
+            std::cerr << "Warning: Cannot write trace: " << error << "\n";
+        }
+    }
+    return result;
+}
+
+int runBench(const Options& opts) {
+    if (opts.bench_target == "queue") {
+        return runQueueBenchmark(opts.bench_items, opts.bench_capacity);
+    }
+    if (opts.bench_target == "pipeline") {
+        PipelineBenchOptions options = opts.pipeline_bench;
+        options.input = opts.input_file;
+        options.clip = opts.clip;
+        options.verbose = opts.verbose;
+        return runPipelineBenchmark(options);
+    }
+    std::cerr << "Error: Unknown bench target '" << opts.bench_target << "'\n";
+    return 1;
+}
+
+int runLoadTestCommand(const Options& opts) {
+    LoadTestOptions options = opts.loadtest;
+    options.config_file = opts.config_file;
+    options.clip = opts.clip;
+    return runLoadTest(options);
 }
 
 int main(int argc, char* argv[]) {
@@ -270,6 +529,12 @@ int main(int argc, char* argv[]) {
         case CMD_CONVERT:
             return runConvert(opts);
             
+        case CMD_BENCH:
+            return runBench(opts);
+            
+        case CMD_LOADTEST:
+            return runLoadTestCommand(opts);
+            
         case CMD_NONE:
         default:
             printUsage();
@@ -0,0 +1,253 @@
+#include "resource_usage.h"
+#include "logger.h"
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sys/resource.h>
+
+// Reads rchar and wchar from a /proc io file
+static bool readIoFile(const char* path, uint64_t& bytes_read, uint64_t& bytes_written) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[128];
+    int found = 0;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long long value = 0;
+        if (sscanf(line, "rchar: %llu", &value) == 1) {
+            bytes_read = value;
+            found++;
+        } else if (sscanf(line, "wchar: %llu", &value) == 1) {
+            bytes_written = value;
+            found++;
+        }
+    }
+    fclose(file);
+    return found == 2;
+}
+
+static double seconds(const struct timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+void ResourceUsage::add(const ResourceUsage& other) {
+    wall_seconds += other.wall_seconds;
+    user_seconds += other.user_seconds;
+    system_seconds += other.system_seconds;
+    peak_rss = std::max(peak_rss, other.peak_rss);
+    bytes_read += other.bytes_read;
+    bytes_written += other.bytes_written;
+}
+
+std::string describeUsage(const ResourceUsage& usage) {
+    char peak[48] = "";
+    if (usage.peak_rss > 0) {
+        snprintf(peak, sizeof(peak), ", %.0f MB peak", usage.peak_rss / 1048576.0);
+    }
+    char text[160];
+    snprintf(text, sizeof(text), "%.1f s CPU in %.1f s%s, %.1f MB read, %.1f MB written",
+             usage.cpuSeconds(), usage.wall_seconds, peak, usage.bytes_read / 1048576.0,
+             usage.bytes_written / 1048576.0);
+    return text;
+}
+
+ResourceUsage threadUsage() {
+    ResourceUsage usage;
+    struct rusage thread;
+    if (getrusage(RUSAGE_THREAD, &thread) == 0) {
+        usage.user_seconds = seconds(thread.ru_utime);
+        usage.system_seconds = seconds(thread.ru_stime);
+    }
+    readIoFile("/proc/thread-self/io", usage.bytes_read, usage.bytes_written);
+    return usage;
+}
+
+ResourceUsage childUsage(const struct rusage& usage) {
+    ResourceUsage result;
+    result.user_seconds = seconds(usage.ru_utime);
+    result.system_seconds = seconds(usage.ru_stime);
+    result.peak_rss = static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+    return result;
+}
+
+bool processIo(pid_t pid, uint64_t& bytes_read, uint64_t& bytes_written) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", static_cast<int>(pid));
+    return readIoFile(path, bytes_read, bytes_written);
+}
+
+ThreadMeter::ThreadMeter() : start(threadUsage()), started(std::chrono::steady_clock::now()) {}
+
+ResourceUsage ThreadMeter::stop() const {
+    ResourceUsage now = threadUsage();
+    ResourceUsage usage;
+    usage.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    usage.user_seconds = now.user_seconds - start.user_seconds;
+    usage.system_seconds = now.system_seconds - start.system_seconds;
+    usage.bytes_read = now.bytes_read - start.bytes_read;
+    usage.bytes_written = now.bytes_written - start.bytes_written;
+    return usage;
+}
+
+void JobCost::add(const std::string& stage, const ResourceUsage& usage) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!stage_usage.count(stage)) {
+        order.push_back(stage);
+    }
+    stage_usage[stage].add(usage);
+}
+
+void JobCost::addRung(const std::string& rung, const RungCost& cost) {
+    std::lock_guard<std::mutex> lock(mutex);
+    RungCost& total = rungs[rung];
+    total.bytes_written += cost.bytes_written;
+    total.files += cost.files;
+}
+
+ResourceUsage JobCost::total() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ResourceUsage total;
+    for (const auto& stage : stage_usage) {
+        total.add(stage.second);
+    }
+    return total;
+}
+
+std::map<std::string, ResourceUsage> JobCost::stages() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stage_usage;
+}
+
+// peak_rss_bytes is only written for stages that measured one
+static void appendUsage(std::string& out, const ResourceUsage& usage) {
+    char peak[48] = "";
+    if (usage.peak_rss > 0) {
+        snprintf(peak, sizeof(peak), "\"peak_rss_bytes\": %llu, ", static_cast<unsigned long long>(usage.peak_rss));
+    }
+    char text[320];
+    snprintf(text, sizeof(text),
+             "{\"wall_seconds\": %.3f, \"cpu_seconds\": %.3f, \"user_seconds\": %.3f, \"system_seconds\": %.3f, "
+             "%s\"bytes_read\": %llu, \"bytes_written\": %llu}",
+             usage.wall_seconds, usage.cpuSeconds(), usage.user_seconds, usage.system_seconds, peak,
+             static_cast<unsigned long long>(usage.bytes_read), static_cast<unsigned long long>(usage.bytes_written));
+    out += text;
+}
+
+std::string JobCost::json(const std::string& title, double elapsed_seconds, double duration_seconds,
+                          uint64_t source_bytes) {
+    ResourceUsage sum = total();
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string out = "{\n  \"title\": ";
+    appendJsonString(out, title);
+    char text[256];
+    snprintf(text, sizeof(text),
+             ",\n  \"elapsed_seconds\": %.3f,\n  \"duration_seconds\": %.3f,\n  \"source_bytes\": %llu,\n"
+             "  \"cpu_seconds_per_minute\": %.3f,\n  \"total\": ",
+             elapsed_seconds, duration_seconds, static_cast<unsigned long long>(source_bytes),
+             duration_seconds > 0 ? sum.cpuSeconds() * 60 / duration_seconds : 0.0);
+    out += text;
+    appendUsage(out, sum);
+
+    out += ",\n  \"stages\": {";
+    for (size_t i = 0; i < order.size(); i++) {
+        out += i == 0 ? "\n    " : ",\n    ";
+        appendJsonString(out, order[i]);
+        out += ": ";
+        appendUsage(out, stage_usage[order[i]]);
+    }
+    out += "\n  },\n  \"rungs\": {";
+    bool first = true;
+    for (const auto& rung : rungs) {
+        out += first ? "\n    " : ",\n    ";
+        first = false;
+        appendJsonString(out, rung.first);
+        snprintf(text, sizeof(text), ": {\"bytes_written\": %llu, \"files\": %llu}",
+                 static_cast<unsigned long long>(rung.second.bytes_written),
+                 static_cast<unsigned long long>(rung.second.files));
+        out += text;
+    }
+    out += "\n  }\n}\n";
+    return out;
+}
+
+void CostMetrics::addJob(JobCost& cost, bool succeeded, double duration_seconds, uint64_t output_bytes) {
+    (succeeded ? jobs_succeeded : jobs_failed)++;
+    if (succeeded) {
+        programme_seconds += duration_seconds;
+        this->output_bytes += output_bytes;
+    }
+    last_peak_rss = 0;
+    for (const auto& stage : cost.stages()) {
+        stages[stage.first].add(stage.second);
+        last_peak_rss = std::max(last_peak_rss, stage.second.peak_rss);
+    }
+}
+
+// One sample per stage of a family
+static void appendFamily(std::string& out, const char* name, const char* type, const char* help,
+                         const std::map<std::string, ResourceUsage>& stages,
+                         double (*value)(const ResourceUsage&)) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    char text[256];
+    for (const auto& stage : stages) {
+        snprintf(text, sizeof(text), "%s{stage=\"%s\"} %.15g\n", name, stage.first.c_str(), value(stage.second));
+        out += text;
+    }
+}
+
+std::string CostMetrics::text() const {
+    char text[1024];
+    snprintf(text, sizeof(text),
+             "# HELP radiumvod_jobs_total Titles converted, by result\n"
+             "# TYPE radiumvod_jobs_total counter\n"
+             "radiumvod_jobs_total{result=\"succeeded\"} %llu\n"
+             "radiumvod_jobs_total{result=\"failed\"} %llu\n"
+             "# HELP radiumvod_programme_seconds_total Programme time of the converted titles\n"
+             "# TYPE radiumvod_programme_seconds_total counter\n"
+             "radiumvod_programme_seconds_total %.3f\n"
+             "# HELP radiumvod_output_bytes_total Bytes in the manifests of the converted titles\n"
+             "# TYPE radiumvod_output_bytes_total counter\n"
+             "radiumvod_output_bytes_total %llu\n"
+             "# HELP radiumvod_last_job_peak_rss_bytes Largest peak RSS of a child process of the last job\n"
+             "# TYPE radiumvod_last_job_peak_rss_bytes gauge\n"
+             "radiumvod_last_job_peak_rss_bytes %llu\n",
+             static_cast<unsigned long long>(jobs_succeeded), static_cast<unsigned long long>(jobs_failed),
+             programme_seconds, static_cast<unsigned long long>(output_bytes),
+             static_cast<unsigned long long>(last_peak_rss));
+    std::string out = text;
+
+    appendFamily(out, "radiumvod_stage_cpu_seconds_total", "counter", "User and system CPU time by job stage",
+                 stages, [](const ResourceUsage& usage) { return usage.cpuSeconds(); });
+    appendFamily(out, "radiumvod_stage_wall_seconds_total", "counter", "Wall time by job stage",
+                 stages, [](const ResourceUsage& usage) { return usage.wall_seconds; });
+    appendFamily(out, "radiumvod_stage_read_bytes_total", "counter", "Bytes read by job stage",
+                 stages, [](const ResourceUsage& usage) { return static_cast<double>(usage.bytes_read); });
+    appendFamily(out, "radiumvod_stage_written_bytes_total", "counter", "Bytes written by job stage",
+                 stages, [](const ResourceUsage& usage) { return static_cast<double>(usage.bytes_written); });
+    return out;
+}
+
+bool CostMetrics::write(const std::string& path, std::string& error) const {
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        if (!file.is_open()) {
+            error = "cannot create " + temp;
+            return false;
+        }
+        file << text();
+        if (!file.good()) {
+            error = "cannot write " + temp;
+            return false;
+        }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+        error = "cannot rename " + temp + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
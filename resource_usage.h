@@ -0,0 +1,110 @@
+#ifndef RESOURCE_USAGE_H
+#define RESOURCE_USAGE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+
+struct rusage;
+
+// What a stage of a job cost. Bytes are counted at the read() and write()
+// calls, so page cache hits are included. Peak RSS is only known for stages
+// run in a child process; in-process stages leave it at 0.
+struct ResourceUsage {
+    double wall_seconds = 0;
+    double user_seconds = 0;
+    double system_seconds = 0;
+    uint64_t peak_rss = 0;          // bytes, 0 when not measured
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+
+    double cpuSeconds() const { return user_seconds + system_seconds; }
+
+    // Sums everything but the peak, which is the larger of the two
+    void add(const ResourceUsage& other);
+};
+
+// "12.4 s CPU in 3.1 s, 210 MB peak, 48.0 MB read, 12.5 MB written"; the
+// peak is left out when it was not measured
+std::string describeUsage(const ResourceUsage& usage);
+
+// CPU time and I/O of the calling thread so far. No peak RSS: the process's
+// is its lifetime high-water mark, which says nothing about one stage.
+ResourceUsage threadUsage();
+
+// Usage a reaped child reported through wait4(), with its own peak RSS;
+// I/O is not included
+ResourceUsage childUsage(const struct rusage& usage);
+
+// I/O counters of a process that has not been reaped yet, zombies included.
+// Includes the children it has reaped. False if /proc cannot be read.
+bool processIo(pid_t pid, uint64_t& bytes_read, uint64_t& bytes_written);
+
+// Measures the calling thread from construction to stop(). Reads a few
+// counters at both ends, so it is cheap enough for every stage of a job.
+class ThreadMeter {
+public:
+    ThreadMeter();
+    ResourceUsage stop() const;
+
+private:
+    ResourceUsage start;
+    std::chrono::steady_clock::time_point started;
+};
+
+// Output of one rung or rendition
+struct RungCost {
+    uint64_t bytes_written = 0;
+    uint64_t files = 0;
+};
+
+// Resources of one title, by stage. Stages may be added from any thread;
+// a stage that runs more than once (one per poster) is summed.
+class JobCost {
+public:
+    void add(const std::string& stage, const ResourceUsage& usage);
+    void addRung(const std::string& rung, const RungCost& cost);
+
+    ResourceUsage total();
+    std::map<std::string, ResourceUsage> stages();
+
+    // JSON report. Elapsed is the job's wall time, as stages overlap; the
+    // programme duration gives the CPU seconds per programme minute.
+    std::string json(const std::string& title, double elapsed_seconds, double duration_seconds,
+                     uint64_t source_bytes);
+
+private:
+    std::mutex mutex;
+    std::map<std::string, ResourceUsage> stage_usage;
+    std::map<std::string, RungCost> rungs;
+    std::vector<std::string> order;     // stages in the order they were first added
+};
+
+// Running totals over every job since the daemon started, in the Prometheus
+// text format, for node_exporter's textfile collector or any scraper that
+// reads a file. Not thread safe; the daemon adds jobs from its loop thread.
+class CostMetrics {
+public:
+    // Failed jobs count too, their work was done all the same
+    void addJob(JobCost& cost, bool succeeded, double duration_seconds, uint64_t output_bytes);
+
+    std::string text() const;
+
+    // Written to a temporary file and renamed over path, so a scrape never
+    // sees half a file. False, with the reason, on I/O errors.
+    bool write(const std::string& path, std::string& error) const;
+
+private:
+    uint64_t jobs_succeeded = 0;
+    uint64_t jobs_failed = 0;
+    double programme_seconds = 0;
+    uint64_t output_bytes = 0;
+    std::map<std::string, ResourceUsage> stages;
+    uint64_t last_peak_rss = 0;
+};
+
+#endif // RESOURCE_USAGE_H
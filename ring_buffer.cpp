@@ -0,0 +1,14 @@
+#include "ring_buffer.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+void releaseRingItem(AVFrame*& frame) {
+    av_frame_free(&frame);
+}
+
+void releaseRingItem(AVPacket*& packet) {
+    av_packet_free(&packet);
+}
@@ -0,0 +1,354 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+struct AVFrame;
+struct AVPacket;
+
+// Bounded queues that carry frames and packets between pipeline stages.
+// SpscRing links one producer thread to one consumer thread; MpmcRing lets
+// several stages feed one (or several) others. Both hold at most their
+// capacity, rounded up to a power of two, so a slow stage holds back the
+// ones in front of it instead of growing memory.
+//
+// Blocking push() and pop() spin briefly before they wait. Under Block
+// the thread then parks on a condition variable; under Spin it keeps
+// yielding, which trades a core for the lowest hand-off latency. close()
+// ends the stream: pushes fail from then on, pops return what is still
+// queued and then fail. Items left in a destroyed ring are released with
+// releaseRingItem(), which frees AVFrame and AVPacket references.
+
+enum class WaitPolicy {
+    Block,
+    Spin
+};
+
+// Size of the line the producer and consumer sides are kept apart by
+const size_t RING_CACHE_LINE = 64;
+
+// Polls before a waiting thread parks or starts yielding
+const int RING_SPIN_LIMIT = 256;
+
+template <typename T>
+inline void releaseRingItem(T&) {}
+void releaseRingItem(AVFrame*& frame);
+void releaseRingItem(AVPacket*& packet);
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Where threads wait for one side of a ring. The fences pair a waiter's
+// registration with a notifier's state change, so either the notifier sees
+// the sleeper or the sleeper's check sees the change.
+class RingParking {
+public:
+    template <typename Ready>
+    void wait(Ready ready, WaitPolicy policy) {
+        for (int i = 0; i < RING_SPIN_LIMIT; i++) {
+            if (ready()) {
+                return;
+            }
+            cpuRelax();
+        }
+        if (policy == WaitPolicy::Spin) {
+            while (!ready()) {
+                std::this_thread::yield();
+            }
+            return;
+        }
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake_up.wait(lock, ready);
+        }
+        sleepers.fetch_sub(1);
+    }
+
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake_up.notify_all();
+        }
+    }
+
+private:
+    std::atomic<int> sleepers{0};
+    std::mutex mutex;
+    std::condition_variable wake_up;
+};
+
+inline size_t ringCapacity(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity, WaitPolicy policy = WaitPolicy::Block)
+        : slots(ringCapacity(capacity)), mask(slots.size() - 1), policy(policy) {}
+
+    ~SpscRing() {
+        T item;
+        while (tryPop(item)) {
+            releaseRingItem(item);
+        }
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // Producer side. Moves the item in and returns true, or leaves it
+    // alone when the ring is full or closed.
+    bool tryPush(T& item) {
+        if (closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position - cached_head == slots.size()) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (position - cached_head == slots.size()) {
+                return false;
+            }
+        }
+        slots[position & mask] = std::move(item);
+        tail.store(position + 1, std::memory_order_release);
+        not_empty.notify();
+        return true;
+    }
+
+    // Waits for room. False, with the item untouched, once the ring is closed.
+    bool push(T& item) {
+        while (!tryPush(item)) {
+            if (closed.load(std::memory_order_acquire)) {
+                return false;
+            }
+            stalls.fetch_add(1, std::memory_order_relaxed);
+            not_full.wait([this] {
+                return tail.load(std::memory_order_relaxed) - head.load() < slots.size() || closed.load();
+            }, policy);
+        }
+        return true;
+    }
+
+    // Consumer side
+    bool tryPop(T& item) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (position == cached_tail) {
+                return false;
+            }
+        }
+        item = std::move(slots[position & mask]);
+        head.store(position + 1, std::memory_order_release);
+        not_full.notify();
+        return true;
+    }
+
+    // Waits for an item. False once the ring is closed and drained.
+    bool pop(T& item) {
+        while (!tryPop(item)) {
+            if (closed.load() && head.load(std::memory_order_relaxed) == tail.load()) {
+                return false;
+            }
+            not_empty.wait([this] {
+                return head.load(std::memory_order_relaxed) != tail.load() || closed.load();
+            }, policy);
+        }
+        return true;
+    }
+
+    void close() {
+        closed.store(true);
+        not_empty.notify();
+        not_full.notify();
+    }
+
+    bool isClosed() const { return closed.load(); }
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return tail.load() - head.load(); }
+
+    // Blocking pushes that found the ring full
+    uint64_t producerStalls() const { return stalls.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+    WaitPolicy policy;
+
+    // Producer line: its index and its last view of the consumer's
+    alignas(RING_CACHE_LINE) std::atomic<size_t> tail{0};
+    size_t cached_head = 0;
+    std::atomic<uint64_t> stalls{0};
+
+    // Consumer line
+    alignas(RING_CACHE_LINE) std::atomic<size_t> head{0};
+    size_t cached_tail = 0;
+
+    alignas(RING_CACHE_LINE) std::atomic<bool> closed{false};
+    RingParking not_empty;
+    RingParking not_full;
+};
+
+// Bounded multi-producer, multi-consumer ring: every cell carries a
+// sequence number that says whether it is free for the producer or ready
+// for the consumer holding that position, so claiming a position is one
+// compare-and-swap and no lock is taken.
+template <typename T>
+class MpmcRing {
+public:
+    explicit MpmcRing(size_t capacity, WaitPolicy policy = WaitPolicy::Block)
+        : cell_count(ringCapacity(capacity)), mask(cell_count - 1), cells(new Cell[cell_count]), policy(policy) {
+        for (size_t i = 0; i < cell_count; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~MpmcRing() {
+        T item;
+        while (tryPop(item)) {
+            releaseRingItem(item);
+        }
+    }
+
+    MpmcRing(const MpmcRing&) = delete;
+    MpmcRing& operator=(const MpmcRing&) = delete;
+
+    bool tryPush(T& item) {
+        if (closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (lag == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (lag < 0) {
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(item);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        not_empty.notify();
+        return true;
+    }
+
+    bool push(T& item) {
+        while (!tryPush(item)) {
+            if (closed.load(std::memory_order_acquire)) {
+                return false;
+            }
+            stalls.fetch_add(1, std::memory_order_relaxed);
+            not_full.wait([this] { return !full() || closed.load(); }, policy);
+        }
+        return true;
+    }
+
+    bool tryPop(T& item) {
+        size_t position = dequeue_position.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t lag = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (lag == 0) {
+                if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (lag < 0) {
+                return false;
+            } else {
+                position = dequeue_position.load(std::memory_order_relaxed);
+            }
+        }
+        item = std::move(cell->value);
+        cell->sequence.store(position + cell_count, std::memory_order_release);
+        not_full.notify();
+        return true;
+    }
+
+    bool pop(T& item) {
+        while (!tryPop(item)) {
+            if (closed.load() && empty()) {
+                return false;
+            }
+            not_empty.wait([this] { return !empty() || closed.load(); }, policy);
+        }
+        return true;
+    }
+
+    void close() {
+        closed.store(true);
+        not_empty.notify();
+        not_full.notify();
+    }
+
+    bool isClosed() const { return closed.load(); }
+    size_t capacity() const { return cell_count; }
+
+    // Claimed positions; a push or pop in flight counts as done
+    size_t size() const {
+        size_t enqueued = enqueue_position.load();
+        size_t dequeued = dequeue_position.load();
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    uint64_t producerStalls() const { return stalls.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    size_t cell_count;
+    size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    WaitPolicy policy;
+
+    alignas(RING_CACHE_LINE) std::atomic<size_t> enqueue_position{0};
+    alignas(RING_CACHE_LINE) std::atomic<size_t> dequeue_position{0};
+    alignas(RING_CACHE_LINE) std::atomic<bool> closed{false};
+    std::atomic<uint64_t> stalls{0};
+    RingParking not_empty;
+    RingParking not_full;
+
+    // The cell a push or pop would take next is still owned by the other side
+    bool full() const {
+        size_t position = enqueue_position.load();
+        return cells[position & mask].sequence.load() != position;
+    }
+
+    bool empty() const {
+        size_t position = dequeue_position.load();
+        return cells[position & mask].sequence.load() != position + 1;
+    }
+};
+
+#endif // RING_BUFFER_H
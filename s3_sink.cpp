@@ -0,0 +1,528 @@
+#include "s3_sink.h"
+#include "upload_scheduler.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+
+#include <curl/curl.h>
+
+extern "C" {
+#include <libavutil/sha.h>
+#include <libavutil/hmac.h>
+#include <libavutil/mem.h>
+}
+
+namespace {
+
+const char* UNSIGNED_PAYLOAD = "UNSIGNED-PAYLOAD";
+const uint64_t MIN_PART_SIZE = 5ull * 1024 * 1024;   // S3 minimum for all parts but the last
+
+std::string toHex(const uint8_t* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for (size_t i = 0; i < len; i++) {
+        hex[i * 2] = digits[data[i] >> 4];
+        hex[i * 2 + 1] = digits[data[i] & 0x0f];
+    }
+    return hex;
+}
+
+std::string sha256Hex(const std::string& data) {
+    AVSHA* sha = av_sha_alloc();
+    uint8_t digest[32];
+    av_sha_init(sha, 256);
+    av_sha_update(sha, reinterpret_cast<const uint8_t*>(data.data()), data.size());
+    av_sha_final(sha, digest);
+    av_free(sha);
+    return toHex(digest, sizeof(digest));
+}
+
+std::string hmacSha256(const std::string& key, const std::string& data) {
+    AVHMAC* hmac = av_hmac_alloc(AV_HMAC_SHA256);
+    uint8_t digest[32];
+    av_hmac_calc(hmac, reinterpret_cast<const uint8_t*>(data.data()), data.size(),
+                 reinterpret_cast<const uint8_t*>(key.data()), key.size(), digest, sizeof(digest));
+    av_hmac_free(hmac);
+    return std::string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+// RFC 3986 percent-encoding as SigV4 expects it; '/' survives in object keys
+std::string uriEncode(const std::string& value, bool keep_slash) {
+    std::string encoded;
+    char escape[4];
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (keep_slash && c == '/')) {
+            encoded += static_cast<char>(c);
+        } else {
+            snprintf(escape, sizeof(escape), "%%%02X", c);
+            encoded += escape;
+        }
+    }
+    return encoded;
+}
+
+std::string xmlValue(const std::string& xml, const std::string& tag) {
+    std::string open = "<" + tag + ">";
+    size_t start = xml.find(open);
+    if (start == std::string::npos) {
+        return "";
+    }
+    start += open.size();
+    size_t end = xml.find("</" + tag + ">", start);
+    return end == std::string::npos ? "" : xml.substr(start, end - start);
+}
+
+std::string contentType(const std::string& key) {
+    size_t dot = key.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : key.substr(dot);
+    if (ext == ".m3u8") return "application/vnd.apple.mpegurl";
+    if (ext == ".ts") return "video/mp2t";
+    if (ext == ".mp4" || ext == ".m4s") return "video/mp4";
+    if (ext == ".vtt") return "text/vtt";
+    if (ext == ".xml") return "application/xml";
+    if (ext == ".jpg" || ext == ".jpeg") return "image/jpeg";
+    if (ext == ".png") return "image/png";
+    if (ext == ".txt") return "text/plain";
+    return "application/octet-stream";
+}
+
+struct Response {
+    CURLcode result = CURLE_OK;
+    long status = 0;
+    std::string body;
+    std::string etag;
+    int64_t content_length = -1;
+};
+
+// Request body: a byte range of a local file, or a string
+struct Body {
+    std::string path;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    const std::string* data = nullptr;
+};
+
+struct FileRange {
+    FILE* file;
+    uint64_t remaining;
+    TokenBucket* throttle;
+    std::atomic<uint64_t>* sent;
+};
+
+size_t readRange(char* buffer, size_t size, size_t nitems, void* userdata) {
+    FileRange* range = static_cast<FileRange*>(userdata);
+    size_t wanted = std::min<uint64_t>(size * nitems, range->remaining);
+    if (range->throttle && wanted > 0) {
+        range->throttle->acquire(wanted);
+    }
+    size_t got = fread(buffer, 1, wanted, range->file);
+    range->remaining -= got;
+    *range->sent += got;
+    return got;
+}
+
+size_t writeBody(char* data, size_t size, size_t nmemb, void* userdata) {
+    static_cast<Response*>(userdata)->body.append(data, size * nmemb);
+    return size * nmemb;
+}
+
+size_t writeHeader(char* data, size_t size, size_t nitems, void* userdata) {
+    Response* response = static_cast<Response*>(userdata);
+    std::string line(data, size * nitems);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+        if (name == "etag") {
+            response->etag = value;
+        } else if (name == "content-length") {
+            // Runs inside curl, so a bad value is ignored rather than thrown;
+            // the object then counts as missing and is sent again
+            char* end = nullptr;
+            errno = 0;
+            long long length = strtoll(value.c_str(), &end, 10);
+            if (!value.empty() && isdigit(static_cast<unsigned char>(value[0])) && *end == '\0' && errno == 0) {
+                response->content_length = length;
+            }
+        }
+    }
+    return size * nitems;
+}
+
+class S3Sink : public OutputSink {
+public:
+    explicit S3Sink(const DestinationConfig& config) : OutputSink(config) {
+        endpoint = config.endpoint;
+        while (!endpoint.empty() && endpoint.back() == '/') {
+            endpoint.pop_back();
+        }
+        size_t scheme = endpoint.find("://");
+        host = scheme == std::string::npos ? endpoint : endpoint.substr(scheme + 3);
+        host = host.substr(0, host.find('/'));
+
+        prefix = config.prefix;
+        prefix.erase(0, prefix.find_first_not_of('/'));
+        while (!prefix.empty() && prefix.back() == '/') {
+            prefix.pop_back();
+        }
+
+        part_size = std::max<uint64_t>(static_cast<uint64_t>(config.part_size_mb) * 1024 * 1024, MIN_PART_SIZE);
+        handles.resize(std::max(config.parallel_uploads, 1), nullptr);
+        for (auto& handle : handles) {
+            handle = curl_easy_init();
+        }
+    }
+
+    ~S3Sink() override {
+        for (auto* handle : handles) {
+            curl_easy_cleanup(handle);
+        }
+    }
+
+    bool putFiles(const std::vector<SinkFile>& files) override {
+        // One task per small file or per part of a multipart upload
+        struct Upload {
+            const SinkFile* file;
+            std::string key;
+            std::string upload_id;
+            size_t first_task = 0;
+            size_t task_count = 0;
+        };
+        struct Task {
+            size_t upload;
+            int part_number;        // 0 for a single PUT
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        std::vector<Upload> uploads;
+        std::vector<Task> tasks;
+        bool success = true;
+
+        for (const auto& file : files) {
+            Upload upload;
+            upload.file = &file;
+            upload.key = objectKey(file.remote_path);
+            upload.first_task = tasks.size();
+
+            if (file.size <= part_size) {
+                tasks.push_back({uploads.size(), 0, 0, file.size});
+            } else {
+                Response response;
+                std::string empty;
+                Body body;
+                body.data = &empty;
+                if (!request(handles[0], "POST", upload.key, {{"uploads", ""}}, body, response)) {
+                    std::cerr << "S3 multipart initiate failed for " << upload.key << ": " << errorText(response) << "\n";
+                    success = false;
+                    continue;
+                }
+                upload.upload_id = xmlValue(response.body, "UploadId");
+                if (upload.upload_id.empty()) {
+                    // Parts without an id would be plain PUTs of the whole key
+                    std::cerr << "S3 multipart initiate for " << upload.key << " returned no UploadId\n";
+                    success = false;
+                    continue;
+                }
+                int part_number = 1;
+                for (uint64_t offset = 0; offset < file.size; offset += part_size) {
+                    tasks.push_back({uploads.size(), part_number++, offset, std::min(part_size, file.size - offset)});
+                }
+            }
+            upload.task_count = tasks.size() - upload.first_task;
+            uploads.push_back(upload);
+        }
+
+        // Each slot is written by exactly one worker
+        std::vector<char> task_ok(tasks.size(), 0);
+        std::vector<std::string> task_etag(tasks.size());
+
+        parallelFor(tasks.size(), [&](CURL* curl, size_t index) {
+            const Task& task = tasks[index];
+            const Upload& upload = uploads[task.upload];
+
+            Body body;
+            body.path = upload.file->local_path;
+            body.offset = task.offset;
+            body.length = task.length;
+
+            std::map<std::string, std::string> query;
+            if (task.part_number > 0) {
+                query["partNumber"] = std::to_string(task.part_number);
+                query["uploadId"] = upload.upload_id;
+            }
+
+            Response response;
+            if (request(curl, "PUT", upload.key, query, body, response)) {
+                task_ok[index] = 1;
+                task_etag[index] = response.etag;
+            } else {
+                std::cerr << "S3 PUT failed for " << upload.key;
+                if (task.part_number > 0) {
+                    std::cerr << " part " << task.part_number;
+                }
+                std::cerr << ": " << errorText(response) << "\n";
+            }
+        });
+
+        for (const auto& upload : uploads) {
+            bool parts_ok = true;
+            for (size_t i = 0; i < upload.task_count; i++) {
+                parts_ok = parts_ok && task_ok[upload.first_task + i];
+            }
+
+            if (upload.upload_id.empty()) {
+                success = success && parts_ok;
+                continue;
+            }
+
+            std::map<std::string, std::string> query = {{"uploadId", upload.upload_id}};
+            Response response;
+
+            if (!parts_ok) {
+                // Drop the stored parts, a retry starts a fresh upload
+                std::string empty;
+                Body body;
+                body.data = &empty;
+                request(handles[0], "DELETE", upload.key, query, body, response);
+                success = false;
+                continue;
+            }
+
+            std::stringstream complete;
+            complete << "<CompleteMultipartUpload>";
+            for (size_t i = 0; i < upload.task_count; i++) {
+                complete << "<Part><PartNumber>" << tasks[upload.first_task + i].part_number
+                         << "</PartNumber><ETag>" << task_etag[upload.first_task + i] << "</ETag></Part>";
+            }
+            complete << "</CompleteMultipartUpload>";
+            std::string xml = complete.str();
+
+            Body body;
+            body.data = &xml;
+            // A 200 response can still carry an error document
+            if (!request(handles[0], "POST", upload.key, query, body, response) ||
+                response.body.find("<Error>") != std::string::npos) {
+                std::cerr << "S3 multipart complete failed for " << upload.key << ": " << errorText(response) << "\n";
+                success = false;
+            }
+        }
+
+        return success;
+    }
+
+    std::map<std::string, uint64_t> remoteSizes(const std::vector<std::string>& remote_paths) override {
+        std::vector<int64_t> sizes(remote_paths.size(), -1);
+
+        parallelFor(remote_paths.size(), [&](CURL* curl, size_t index) {
+            std::string empty;
+            Body body;
+            body.data = &empty;
+            Response response;
+            if (request(curl, "HEAD", objectKey(remote_paths[index]), {}, body, response)) {
+                sizes[index] = response.content_length;
+            }
+        });
+
+        std::map<std::string, uint64_t> result;
+        for (size_t i = 0; i < remote_paths.size(); i++) {
+            if (sizes[i] >= 0) {
+                result[remote_paths[i]] = sizes[i];
+            }
+        }
+        return result;
+    }
+
+    bool readFile(const std::string& remote_path, std::string& contents) override {
+        std::string empty;
+        Body body;
+        body.data = &empty;
+        Response response;
+        if (!request(handles[0], "GET", objectKey(remote_path), {}, body, response)) {
+            return false;
+        }
+        contents.swap(response.body);
+        return true;
+    }
+
+private:
+    std::string endpoint;
+    std::string host;
+    std::string prefix;
+    uint64_t part_size;
+    std::vector<CURL*> handles;     // one per worker, connections are kept alive
+
+    std::string objectKey(const std::string& remote_path) const {
+        return prefix.empty() ? remote_path : prefix + "/" + remote_path;
+    }
+
+    static std::string errorText(const Response& response) {
+        if (response.result != CURLE_OK) {
+            return curl_easy_strerror(response.result);
+        }
+        std::string message = xmlValue(response.body, "Code");
+        return "HTTP " + std::to_string(response.status) + (message.empty() ? "" : " " + message);
+    }
+
+    // Runs fn(handle, index) for every index on up to handles.size() threads
+    template <typename Fn>
+    void parallelFor(size_t count, Fn fn) {
+        std::atomic<size_t> next{0};
+        auto worker = [&](CURL* curl) {
+            for (size_t index = next++; index < count; index = next++) {
+                fn(curl, index);
+            }
+        };
+
+        size_t thread_count = std::min(handles.size(), count);
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; i++) {
+            threads.emplace_back(worker, handles[i]);
+        }
+        worker(handles[0]);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Signed request with retries on transport errors, 5xx and 429.
+    // Returns true for 2xx responses.
+    bool request(CURL* curl, const std::string& method, const std::string& key,
+                 const std::map<std::string, std::string>& query, const Body& body, Response& response) {
+        std::string canonical_uri = "/" + uriEncode(config.bucket, false) + "/" + uriEncode(key, true);
+
+        // Sorted by key, which std::map already is
+        std::string canonical_query;
+        for (const auto& param : query) {
+            if (!canonical_query.empty()) {
+                canonical_query += "&";
+            }
+            canonical_query += uriEncode(param.first, false) + "=" + uriEncode(param.second, false);
+        }
+        std::string url = endpoint + canonical_uri + (canonical_query.empty() ? "" : "?" + canonical_query);
+
+        // File bodies are streamed unsigned, small in-memory bodies are hashed
+        std::string payload_hash = body.data ? sha256Hex(*body.data) : UNSIGNED_PAYLOAD;
+
+        int attempts = std::max(config.retry_attempts, 1);
+        for (int attempt = 1; attempt <= attempts; attempt++) {
+            response = Response();
+
+            char amz_date[17];
+            char date_stamp[9];
+            time_t now = time(nullptr);
+            struct tm utc;
+            gmtime_r(&now, &utc);
+            strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &utc);
+            strftime(date_stamp, sizeof(date_stamp), "%Y%m%d", &utc);
+
+            std::string signed_headers = "host;x-amz-content-sha256;x-amz-date";
+            std::string canonical_request = method + "\n" + canonical_uri + "\n" + canonical_query + "\n" +
+                "host:" + host + "\n" +
+                "x-amz-content-sha256:" + payload_hash + "\n" +
+                "x-amz-date:" + amz_date + "\n\n" +
+                signed_headers + "\n" + payload_hash;
+
+            std::string scope = std::string(date_stamp) + "/" + config.region + "/s3/aws4_request";
+            std::string string_to_sign = std::string("AWS4-HMAC-SHA256\n") + amz_date + "\n" + scope + "\n" +
+                                         sha256Hex(canonical_request);
+
+            std::string signing_key = hmacSha256("AWS4" + config.secret_key, date_stamp);
+            signing_key = hmacSha256(signing_key, config.region);
+            signing_key = hmacSha256(signing_key, "s3");
+            signing_key = hmacSha256(signing_key, "aws4_request");
+            std::string signature = hmacSha256(signing_key, string_to_sign);
+            signature = toHex(reinterpret_cast<const uint8_t*>(signature.data()), signature.size());
+
+            struct curl_slist* headers = nullptr;
+            headers = curl_slist_append(headers, ("Host: " + host).c_str());
+            headers = curl_slist_append(headers, ("x-amz-content-sha256: " + payload_hash).c_str());
+            headers = curl_slist_append(headers, ("x-amz-date: " + std::string(amz_date)).c_str());
+            headers = curl_slist_append(headers, ("Authorization: AWS4-HMAC-SHA256 Credential=" + config.access_key +
+                "/" + scope + ", SignedHeaders=" + signed_headers + ", Signature=" + signature).c_str());
+            // No 100-continue round trip per part
+            headers = curl_slist_append(headers, "Expect:");
+            if (method == "PUT") {
+                headers = curl_slist_append(headers, ("Content-Type: " + contentType(key)).c_str());
+            }
+
+            // Reset keeps the connection cache of the handle
+            curl_easy_reset(curl);
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+            curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBody);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeHeader);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+
+            FileRange range = {nullptr, 0, throttle, &bytes_sent};
+            if (method == "PUT" && !body.data) {
+                range.file = fopen(body.path.c_str(), "rb");
+                if (!range.file || fseeko(range.file, body.offset, SEEK_SET) != 0) {
+                    std::cerr << "Cannot read " << body.path << "\n";
+                    if (range.file) {
+                        fclose(range.file);
+                    }
+                    curl_slist_free_all(headers);
+                    return false;
+                }
+                range.remaining = body.length;
+                curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+                curl_easy_setopt(curl, CURLOPT_READFUNCTION, readRange);
+                curl_easy_setopt(curl, CURLOPT_READDATA, &range);
+                curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(body.length));
+            } else if (method == "POST") {
+                curl_easy_setopt(curl, CURLOPT_POST, 1L);
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.data->c_str());
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.data->size()));
+            } else if (method == "HEAD") {
+                curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+            } else if (method != "GET") {
+                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+            }
+
+            response.result = curl_easy_perform(curl);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+
+            if (range.file) {
+                fclose(range.file);
+            }
+            curl_slist_free_all(headers);
+
+            bool transient = response.result != CURLE_OK || response.status >= 500 || response.status == 429;
+            if (!transient) {
+                return response.status >= 200 && response.status < 300;
+            }
+            if (attempt < attempts) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(250 << std::min(attempt, 6)));
+            }
+        }
+        return false;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<OutputSink> createS3Sink(const DestinationConfig& config) {
+    static std::once_flag curl_init;
+    std::call_once(curl_init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+    return std::unique_ptr<OutputSink>(new S3Sink(config));
+}
@@ -0,0 +1,12 @@
+#ifndef S3_SINK_H
+#define S3_SINK_H
+
+#include "output_sink.h"
+
+// S3-compatible object store (AWS, MinIO, Ceph RGW, ...) over libcurl with
+// SigV4 signing and path-style addressing. Files larger than part_size_mb go
+// through multipart upload; parts and small files are sent on
+// parallel_uploads connections that stay open between titles.
+std::unique_ptr<OutputSink> createS3Sink(const DestinationConfig& config);
+
+#endif // S3_SINK_H
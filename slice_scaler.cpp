@@ -0,0 +1,92 @@
+#include "slice_scaler.h"
+#include "executor.h"
+#include <algorithm>
+#include <future>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+// Source pixels per band; smaller frames are not worth the hand-off
+const int SLICE_MIN_SOURCE_PIXELS = 1 << 20;
+
+SliceScaler::~SliceScaler() {
+    for (auto& band : slices) {
+        sws_freeContext(band.context);
+    }
+}
+
+bool SliceScaler::init(int src_width, int src_height, int src_format,
+                       int dst_width, int dst_height, int dst_format,
+                       int flags, Executor* pool) {
+    this->pool = pool;
+
+    int count = 1;
+    if (pool) {
+        int by_size = static_cast<int>(static_cast<int64_t>(src_width) * src_height / SLICE_MIN_SOURCE_PIXELS);
+        count = std::max(1, std::min(by_size, static_cast<int>(pool->size())));
+    }
+
+    for (int i = 0; i < count; i++) {
+        SwsContext* context = sws_getContext(src_width, src_height, static_cast<AVPixelFormat>(src_format),
+                                             dst_width, dst_height, static_cast<AVPixelFormat>(dst_format),
+                                             flags, nullptr, nullptr, nullptr);
+        if (!context) {
+            return false;
+        }
+        slices.push_back({context, 0, dst_height});
+    }
+
+    if (count > 1) {
+        // Band heights rounded up to the alignment; the last band takes the rest
+        int alignment = std::max<int>(sws_receive_slice_alignment(slices[0].context), 1);
+        int rows = (dst_height + count - 1) / count;
+        rows = (rows + alignment - 1) / alignment * alignment;
+
+        int start = 0;
+        size_t used = 0;
+        for (; used < slices.size() && start < dst_height; used++) {
+            slices[used].start = start;
+            slices[used].height = std::min(rows, dst_height - start);
+            start += slices[used].height;
+        }
+        for (size_t i = used; i < slices.size(); i++) {
+            sws_freeContext(slices[i].context);
+        }
+        slices.resize(used);
+    }
+    return true;
+}
+
+bool SliceScaler::scaleBand(const Band& band, const AVFrame* src, AVFrame* dst) {
+    if (sws_frame_start(band.context, dst, src) < 0) {
+        return false;
+    }
+    int ret = sws_send_slice(band.context, 0, src->height);
+    if (ret >= 0) {
+        ret = sws_receive_slice(band.context, band.start, band.height);
+    }
+    sws_frame_end(band.context);
+    return ret >= 0;
+}
+
+bool SliceScaler::scale(const AVFrame* src, AVFrame* dst) {
+    if (slices.size() == 1) {
+        return sws_scale(slices[0].context, src->data, src->linesize, 0, src->height,
+                         dst->data, dst->linesize) > 0;
+    }
+
+    // The caller's thread takes the first band while the pool runs the rest
+    std::vector<std::future<bool>> pending;
+    for (size_t i = 1; i < slices.size(); i++) {
+        const Band& band = slices[i];
+        pending.push_back(pool->submit([this, &band, src, dst] { return scaleBand(band, src, dst); }, TaskPriority::High));
+    }
+    bool success = scaleBand(slices[0], src, dst);
+    for (auto& result : pending) {
+        success = pool->wait(result) && success;
+    }
+    return success;
+}
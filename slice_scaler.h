@@ -0,0 +1,48 @@
+#ifndef SLICE_SCALER_H
+#define SLICE_SCALER_H
+
+#include <vector>
+#include <cstddef>
+
+struct SwsContext;
+struct AVFrame;
+class Executor;
+
+// sws_scale split into horizontal output bands that run concurrently on a
+// shared pool. Every band has its own SwsContext and is handed the whole
+// source, so the vertical filter taps read across band seams exactly as a
+// single pass would and the output is bit-identical. Bands start on the
+// scaler's slice alignment.
+class SliceScaler {
+public:
+    SliceScaler() = default;
+    ~SliceScaler();
+    SliceScaler(const SliceScaler&) = delete;
+    SliceScaler& operator=(const SliceScaler&) = delete;
+
+    // Formats are AVPixelFormat values. One band per megapixel of source,
+    // at most one per pool thread. Without a pool the frame is scaled in one
+    // call on the caller's thread.
+    bool init(int src_width, int src_height, int src_format,
+              int dst_width, int dst_height, int dst_format,
+              int flags, Executor* pool);
+
+    // dst buffers must already be allocated
+    bool scale(const AVFrame* src, AVFrame* dst);
+
+    size_t bands() const { return slices.size(); }
+
+private:
+    struct Band {
+        SwsContext* context;
+        int start;
+        int height;
+    };
+
+    std::vector<Band> slices;
+    Executor* pool = nullptr;
+
+    bool scaleBand(const Band& band, const AVFrame* src, AVFrame* dst);
+};
+
+#endif // SLICE_SCALER_H
@@ -0,0 +1,255 @@
+#include "synthetic_clip.h"
+#include <cmath>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/channel_layout.h>
+}
+
+namespace {
+
+const int CLIP_SAMPLE_RATE = 48000;
+
+// Owns everything opened for one clip
+struct ClipWriter {
+    AVFormatContext* output = nullptr;
+    AVCodecContext* video = nullptr;
+    AVCodecContext* audio = nullptr;
+    AVStream* video_stream = nullptr;
+    AVStream* audio_stream = nullptr;
+    AVFrame* picture = nullptr;
+    AVFrame* samples = nullptr;
+    AVPacket* packet = nullptr;
+
+    ~ClipWriter() {
+        av_packet_free(&packet);
+        av_frame_free(&samples);
+        av_frame_free(&picture);
+        avcodec_free_context(&audio);
+        avcodec_free_context(&video);
+        if (output) {
+            if (output->pb) {
+                avio_closep(&output->pb);
+            }
+            avformat_free_context(output);
+        }
+    }
+
+    // Writes every packet the encoder has ready; a null frame flushes it
+    bool encode(AVCodecContext* encoder, AVStream* stream, AVFrame* frame) {
+        if (avcodec_send_frame(encoder, frame) < 0) {
+            return false;
+        }
+        while (true) {
+            int ret = avcodec_receive_packet(encoder, packet);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                return true;
+            }
+            if (ret < 0) {
+                return false;
+            }
+            av_packet_rescale_ts(packet, encoder->time_base, stream->time_base);
+            packet->stream_index = stream->index;
+            if (av_interleaved_write_frame(output, packet) < 0) {
+                return false;
+            }
+        }
+    }
+};
+
+bool openVideo(ClipWriter& clip, const ClipSpec& spec, std::string& error) {
+    const AVCodec* encoder = avcodec_find_encoder_by_name("libx264");
+    if (!encoder) {
+        encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    if (!encoder) {
+        error = "no H.264 or MPEG-4 encoder";
+        return false;
+    }
+
+    clip.video_stream = avformat_new_stream(clip.output, nullptr);
+    clip.video = avcodec_alloc_context3(encoder);
+    if (!clip.video_stream || !clip.video) {
+        error = "cannot allocate the video encoder";
+        return false;
+    }
+
+    clip.video->width = spec.width;
+    clip.video->height = spec.height;
+    clip.video->sample_aspect_ratio = AVRational{1, 1};
+    clip.video->pix_fmt = AV_PIX_FMT_YUV420P;
+    clip.video->framerate = AVRational{spec.fps, 1};
+    clip.video->time_base = AVRational{1, spec.fps};
+    clip.video->gop_size = spec.fps * 2;
+    clip.video->bit_rate = static_cast<int64_t>(spec.width) * spec.height * 4;
+    clip.video_stream->time_base = clip.video->time_base;
+    av_opt_set(clip.video->priv_data, "preset", "ultrafast", 0);
+    if (clip.output->oformat->flags & AVFMT_GLOBALHEADER) {
+        clip.video->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(clip.video, encoder, nullptr) < 0 ||
+        avcodec_parameters_from_context(clip.video_stream->codecpar, clip.video) < 0) {
+        error = std::string("cannot open the ") + encoder->name + " encoder";
+        return false;
+    }
+
+    clip.picture = av_frame_alloc();
+    if (!clip.picture) {
+        error = "cannot allocate a picture";
+        return false;
+    }
+    clip.picture->format = clip.video->pix_fmt;
+    clip.picture->width = spec.width;
+    clip.picture->height = spec.height;
+    if (av_frame_get_buffer(clip.picture, 0) < 0) {
+        error = "cannot allocate a picture";
+        return false;
+    }
+    return true;
+}
+
+bool openAudio(ClipWriter& clip, std::string& error) {
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (!encoder) {
+        error = "AAC encoder not found";
+        return false;
+    }
+
+    clip.audio_stream = avformat_new_stream(clip.output, nullptr);
+    clip.audio = avcodec_alloc_context3(encoder);
+    if (!clip.audio_stream || !clip.audio) {
+        error = "cannot allocate the audio encoder";
+        return false;
+    }
+
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+    clip.audio->ch_layout = stereo;
+    clip.audio->sample_rate = CLIP_SAMPLE_RATE;
+    clip.audio->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    clip.audio->bit_rate = 128000;
+    clip.audio->time_base = AVRational{1, CLIP_SAMPLE_RATE};
+    clip.audio_stream->time_base = clip.audio->time_base;
+    if (clip.output->oformat->flags & AVFMT_GLOBALHEADER) {
+        clip.audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(clip.audio, encoder, nullptr) < 0 ||
+        avcodec_parameters_from_context(clip.audio_stream->codecpar, clip.audio) < 0) {
+        error = "cannot open the AAC encoder";
+        return false;
+    }
+
+    clip.samples = av_frame_alloc();
+    if (!clip.samples) {
+        error = "cannot allocate an audio frame";
+        return false;
+    }
+    clip.samples->format = clip.audio->sample_fmt;
+    clip.samples->ch_layout = clip.audio->ch_layout;
+    clip.samples->sample_rate = CLIP_SAMPLE_RATE;
+    clip.samples->nb_samples = clip.audio->frame_size > 0 ? clip.audio->frame_size : 1024;
+    if (av_frame_get_buffer(clip.samples, 0) < 0) {
+        error = "cannot allocate an audio frame";
+        return false;
+    }
+    return true;
+}
+
+// Diagonal gradient drifting a few levels per frame; luma stays well above
+// black on almost every pixel
+void drawPicture(AVFrame* picture, int64_t index, uint32_t seed) {
+    int shift = static_cast<int>(index * 3 + seed * 37);
+    for (int y = 0; y < picture->height; y++) {
+        uint8_t* row = picture->data[0] + y * picture->linesize[0];
+        for (int x = 0; x < picture->width; x++) {
+            row[x] = static_cast<uint8_t>(48 + ((x + y + shift) & 0x7f) * 3 / 2);
+        }
+    }
+    for (int y = 0; y < picture->height / 2; y++) {
+        uint8_t* u = picture->data[1] + y * picture->linesize[1];
+        uint8_t* v = picture->data[2] + y * picture->linesize[2];
+        for (int x = 0; x < picture->width / 2; x++) {
+            u[x] = static_cast<uint8_t>(64 + ((x + shift) & 0x7f));
+            v[x] = static_cast<uint8_t>(64 + ((y + seed * 11) & 0x7f));
+        }
+    }
+}
+
+void drawTone(AVFrame* samples, int64_t first_sample, double pitch) {
+    for (int ch = 0; ch < samples->ch_layout.nb_channels; ch++) {
+        float* data = reinterpret_cast<float*>(samples->data[ch]);
+        for (int i = 0; i < samples->nb_samples; i++) {
+            double t = static_cast<double>(first_sample + i) / CLIP_SAMPLE_RATE;
+            data[i] = static_cast<float>(0.25 * std::sin(2 * M_PI * pitch * t));
+        }
+    }
+}
+
+} // namespace
+
+bool synthesizeClip(const std::string& path, const ClipSpec& spec, std::string& error) {
+    ClipWriter clip;
+    avformat_alloc_output_context2(&clip.output, nullptr, nullptr, path.c_str());
+    if (!clip.output) {
+        error = "cannot create " + path;
+        return false;
+    }
+    if (!openVideo(clip, spec, error) || !openAudio(clip, error)) {
+        return false;
+    }
+
+    clip.packet = av_packet_alloc();
+    if (!clip.packet) {
+        error = "cannot allocate a packet";
+        return false;
+    }
+    if (avio_open(&clip.output->pb, path.c_str(), AVIO_FLAG_WRITE) < 0 ||
+        avformat_write_header(clip.output, nullptr) < 0) {
+        error = "cannot write " + path;
+        return false;
+    }
+
+    // Audio is encoded up to the end of each picture, so the muxer gets
+    // both streams in time order
+    int64_t frames = static_cast<int64_t>(spec.seconds * spec.fps);
+    double pitch = 330.0 + (spec.seed % 12) * 40.0;
+    int64_t sample = 0;
+    for (int64_t i = 0; i < frames; i++) {
+        if (av_frame_make_writable(clip.picture) < 0) {
+            error = "cannot write a picture";
+            return false;
+        }
+        drawPicture(clip.picture, i, spec.seed);
+        clip.picture->pts = i;
+        if (!clip.encode(clip.video, clip.video_stream, clip.picture)) {
+            error = "video encoding failed";
+            return false;
+        }
+
+        int64_t audio_end = (i + 1) * CLIP_SAMPLE_RATE / spec.fps;
+        while (sample < audio_end) {
+            if (av_frame_make_writable(clip.samples) < 0) {
+                error = "cannot write an audio frame";
+                return false;
+            }
+            drawTone(clip.samples, sample, pitch);
+            clip.samples->pts = sample;
+            if (!clip.encode(clip.audio, clip.audio_stream, clip.samples)) {
+                error = "audio encoding failed";
+                return false;
+            }
+            sample += clip.samples->nb_samples;
+        }
+    }
+
+    if (!clip.encode(clip.video, clip.video_stream, nullptr) ||
+        !clip.encode(clip.audio, clip.audio_stream, nullptr) ||
+        av_write_trailer(clip.output) < 0) {
+        error = "cannot finish " + path;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef SYNTHETIC_CLIP_H
+#define SYNTHETIC_CLIP_H
+
+#include <string>
+#include <cstdint>
+
+struct ClipSpec {
+    double seconds = 10;
+    int width = 1280;
+    int height = 720;
+    int fps = 25;
+    uint32_t seed = 0;          // varies the pattern and the pitch
+};
+
+// Encodes an H.264/AAC test clip in-process: a moving colour gradient over
+// the whole frame and a steady tone, so probing accepts it and neither crop
+// detection nor edge trimming cuts anything. Falls back to MPEG-4 Part 2
+// without libx264. The container follows the extension.
+bool synthesizeClip(const std::string& path, const ClipSpec& spec, std::string& error);
+
+#endif // SYNTHETIC_CLIP_H
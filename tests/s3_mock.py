@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""S3 stand-in for s3_sink_test.
+
+Serves path-style PUT, GET, HEAD, DELETE and the multipart calls from memory
+and recomputes the SigV4 signature of every request (access key AK, secret
+SK). The first attempt at part 2 of each multipart upload is answered with
+503 SlowDown, so the retry path runs. During the noupload step the
+initiate reply carries no UploadId. Runs every step of the driver and
+checks what arrived:
+
+    s3_mock.py <s3_sink_test binary> <work dir>
+"""
+
+import hashlib
+import hmac
+import http.server
+import os
+import re
+import subprocess
+import sys
+import threading
+import urllib.parse
+import uuid
+
+SECRET = "SK"
+BUCKET = "vod"
+PREFIX = "in"
+
+
+def sign(key, message):
+    return hmac.new(key, message.encode(), hashlib.sha256).digest()
+
+
+def uri_encode(text, keep_slash):
+    return urllib.parse.quote(text, safe="-_.~" + ("/" if keep_slash else ""))
+
+
+class Store:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.objects = {}
+        self.uploads = {}
+        self.failed_parts = set()
+        self.fault = None
+        self.requests = []      # (method, key, query, status)
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    store = None
+
+    def log_message(self, *args):
+        pass
+
+    def signature_matches(self, url):
+        auth = self.headers.get("Authorization", "")
+        fields = dict(part.strip().split("=", 1) for part in auth.replace("AWS4-HMAC-SHA256 ", "").split(","))
+        query = sorted(urllib.parse.parse_qsl(url.query, keep_blank_values=True))
+        canonical_query = "&".join(uri_encode(k, False) + "=" + uri_encode(v, False) for k, v in query)
+        signed = fields["SignedHeaders"]
+        headers = "".join(h + ":" + self.headers[h].strip() + "\n" for h in signed.split(";"))
+        canonical = "\n".join([self.command, uri_encode(urllib.parse.unquote(url.path), True), canonical_query,
+                               headers, signed, self.headers["x-amz-content-sha256"]])
+        _, date, region, service, terminator = fields["Credential"].split("/")
+        to_sign = "\n".join(["AWS4-HMAC-SHA256", self.headers["x-amz-date"],
+                             "/".join([date, region, service, terminator]),
+                             hashlib.sha256(canonical.encode()).hexdigest()])
+        key = sign(sign(sign(sign(("AWS4" + SECRET).encode(), date), region), service), terminator)
+        expected = hmac.new(key, to_sign.encode(), hashlib.sha256).hexdigest()
+        return hmac.compare_digest(expected, fields["Signature"])
+
+    def reply(self, status, body=b"", headers=None, length=None):
+        self.send_response(status)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body) if length is None else length))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(body)
+        return status
+
+    def handle_request(self):
+        url = urllib.parse.urlsplit(self.path)
+        key = urllib.parse.unquote(url.path)
+        query = dict(urllib.parse.parse_qsl(url.query, keep_blank_values=True))
+        data = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        status = self.serve(key, query, data)
+        with self.store.lock:
+            self.store.requests.append((self.command, key, query, status))
+
+    def serve(self, key, query, data):
+        store = self.store
+        if not self.signature_matches(urllib.parse.urlsplit(self.path)):
+            return self.reply(403, b"<Error><Code>SignatureDoesNotMatch</Code></Error>")
+
+        if self.command == "PUT" and "partNumber" in query:
+            upload = query["uploadId"]
+            with store.lock:
+                if query["partNumber"] == "2" and upload not in store.failed_parts:
+                    store.failed_parts.add(upload)
+                    return self.reply(503, b"<Error><Code>SlowDown</Code></Error>")
+                store.uploads[upload][int(query["partNumber"])] = data
+            return self.reply(200, headers={"ETag": '"%s"' % hashlib.md5(data).hexdigest()})
+        if self.command == "PUT":
+            with store.lock:
+                store.objects[key] = data
+            return self.reply(200, headers={"ETag": '"%s"' % hashlib.md5(data).hexdigest()})
+        if self.command == "POST" and "uploads" in query:
+            upload = uuid.uuid4().hex
+            with store.lock:
+                store.uploads[upload] = {}
+            body = "<InitiateMultipartUploadResult><UploadId>%s</UploadId></InitiateMultipartUploadResult>" % upload
+            if store.fault == "noupload":
+                body = "<InitiateMultipartUploadResult></InitiateMultipartUploadResult>"
+            return self.reply(200, body.encode())
+        if self.command == "POST":
+            # The completion body is signed, not sent unsigned like parts
+            if hashlib.sha256(data).hexdigest() != self.headers["x-amz-content-sha256"]:
+                return self.reply(400, b"<Error><Code>XAmzContentSHA256Mismatch</Code></Error>")
+            numbers = [int(n) for n in re.findall(rb"<PartNumber>(\d+)</PartNumber>", data)]
+            with store.lock:
+                parts = store.uploads.pop(query["uploadId"])
+                if numbers != sorted(parts):
+                    return self.reply(400, b"<Error><Code>InvalidPart</Code></Error>")
+                store.objects[key] = b"".join(parts[n] for n in numbers)
+            return self.reply(200, b"<CompleteMultipartUploadResult/>")
+        if self.command == "DELETE":
+            with store.lock:
+                store.uploads.pop(query.get("uploadId"), None)
+            return self.reply(204)
+
+        with store.lock:
+            data = store.objects.get(key)
+        if data is None:
+            return self.reply(404, b"<Error><Code>NoSuchKey</Code></Error>" if self.command == "GET" else b"")
+        if self.command == "HEAD":
+            return self.reply(200, length=len(data))
+        return self.reply(200, data)
+
+    do_GET = do_PUT = do_POST = do_HEAD = do_DELETE = handle_request
+
+
+class Server(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+
+def remote_key(relative):
+    if relative == "vod-movie.xml":
+        return "/%s/%s/%s" % (BUCKET, PREFIX, relative)
+    return "/%s/%s/movie/%s" % (BUCKET, PREFIX, relative)
+
+
+def local_files(title):
+    files = {}
+    for root, _, names in os.walk(title):
+        for name in names:
+            path = os.path.join(root, name)
+            with open(path, "rb") as f:
+                files[os.path.relpath(path, title)] = f.read()
+    return files
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        return 2
+    driver, work = sys.argv[1], sys.argv[2]
+    os.makedirs(work, exist_ok=True)
+    title = os.path.join(work, "movie")
+
+    store = Store()
+    Handler.store = store
+    server = Server(("127.0.0.1", 0), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    endpoint = "http://127.0.0.1:%d" % server.server_address[1]
+
+    failures = []
+
+    def expect(condition, message):
+        if not condition:
+            failures.append(message)
+            print("FAIL: " + message)
+
+    def run(step):
+        with store.lock:
+            store.requests.clear()
+        result = subprocess.run([driver, endpoint, work, step])
+        expect(result.returncode == 0, "%s: driver exited with %d" % (step, result.returncode))
+        with store.lock:
+            return list(store.requests)
+
+    def writes(requests):
+        return sorted({key for method, key, _, status in requests if method in ("PUT", "POST") and status == 200})
+
+    def stored_matches():
+        with store.lock:
+            objects = dict(store.objects)
+        for relative, data in local_files(title).items():
+            expect(objects.get(remote_key(relative)) == data, "%s differs on the remote side" % relative)
+
+    requests = run("upload")
+    expect(all(status != 403 for _, _, _, status in requests), "upload: a signature was rejected")
+    expect(any(method == "POST" and "uploads" in query for method, _, query, _ in requests),
+           "upload: big.mp4 was not sent as a multipart upload")
+    expect(any(status == 503 for _, _, _, status in requests), "upload: the injected 503 was not hit")
+    retried = [q for m, _, q, s in requests if m == "PUT" and q.get("partNumber") == "2" and s == 200]
+    expect(len(retried) == 1, "upload: part 2 was not retried after the 503")
+    stored_matches()
+
+    requests = run("resync")
+    expect(writes(requests) == [], "resync: sent %s" % writes(requests))
+
+    requests = run("delta")
+    wanted = sorted([remote_key("stream_0/index.m3u8"), remote_key("manifest.txt")])
+    expect(writes(requests) == wanted, "delta: sent %s, wanted %s" % (writes(requests), wanted))
+    stored_matches()
+
+    requests = run("badkey")
+    expect(any(status == 403 for _, _, _, status in requests), "badkey: the bad signature was accepted")
+
+    store.fault = "noupload"
+    requests = run("noupload")
+    big = remote_key("stream_0/big.mp4")
+    expect(not any(m == "PUT" and k == big for m, k, _, _ in requests),
+           "noupload: big.mp4 was sent without an upload id")
+    store.fault = None
+
+    server.shutdown()
+    print("s3 sink: %s" % ("FAILED" if failures else "all steps passed"))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,72 @@
+// Drives syncTitle through the S3 sink against the stand-in server in
+// s3_mock.py, which runs every step and checks what reached it:
+//
+//   s3_sink_test <endpoint> <work dir> <step>
+//
+// upload   builds the title and sends it (multipart for the 12 MiB file)
+// resync   sends it again, which must transfer nothing
+// delta    changes one playlist, which must be the only media sent
+// badkey   signs with the wrong secret, which must fail
+// noupload changes the big file while initiate returns no UploadId, which
+//          must fail the file without sending any of it
+#include "output_sink.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+namespace fs = std::filesystem;
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        std::cerr << "Usage: s3_sink_test <endpoint> <work dir> <upload|resync|delta|badkey|noupload>\n";
+        return 2;
+    }
+    std::string step = argv[3];
+    fs::path title = fs::path(argv[2]) / "movie";
+
+    if (step == "upload") {
+        fs::remove_all(title);
+        fs::create_directories(title / "stream_0");
+        std::ofstream(title / "stream_0" / "index.m3u8") << "#EXTM3U\n";
+        std::ofstream big(title / "stream_0" / "big.mp4", std::ios::binary);
+        for (int i = 0; i < 12 * 1024 * 1024 + 77; i++) {
+            big.put(static_cast<char>(i * 7));
+        }
+        big.close();
+        std::ofstream(title / "vod-movie.xml") << "<ADI/>\n";
+        std::ofstream(title / "poster 1.jpg") << "jpg";
+    } else if (step == "delta") {
+        std::ofstream(title / "stream_0" / "index.m3u8") << "#EXTM3U\n#EXT-X-ENDLIST\n";
+        fs::remove(title / MANIFEST_FILE);
+    } else if (step == "noupload") {
+        std::ofstream big(title / "stream_0" / "big.mp4", std::ios::binary | std::ios::app);
+        big << "more";
+        big.close();
+        fs::remove(title / MANIFEST_FILE);
+    }
+    bool should_fail = step == "badkey" || step == "noupload";
+
+    DestinationConfig config;
+    config.name = "mock";
+    config.type = "s3";
+    config.endpoint = argv[1];
+    config.bucket = "vod";
+    config.access_key = "AK";
+    config.secret_key = step == "badkey" ? "wrong" : "SK";
+    config.prefix = "/in/";
+    config.part_size_mb = 5;
+    config.retry_attempts = should_fail ? 1 : 3;
+    config.retry_delay = 0;
+
+    std::string error;
+    std::unique_ptr<OutputSink> sink = createSink(config, error);
+    if (!sink) {
+        std::cerr << "Cannot create the sink: " << error << "\n";
+        return 1;
+    }
+
+    bool delivered = syncTitle(*sink, title, "movie");
+    std::cout << step << ": " << (delivered ? "delivered" : "not delivered") << ", " << sink->bytesSent()
+              << " bytes sent\n";
+    return delivered != should_fail ? 0 : 1;
+}
@@ -0,0 +1,414 @@
+#include "tone_map.h"
+#include "executor.h"
+#include <algorithm>
+#include <future>
+#include <sstream>
+#include <cmath>
+#include <cstdint>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/mastering_display_metadata.h>
+#include <libswscale/swscale.h>
+}
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+// Entries in the linearization and re-encoding tables
+const int TONE_MAP_LUT_SIZE = 4096;
+
+// Linear 1.0 in nits, the same nominal level as zscale's npl=100 in the
+// filter chain, so both paths produce the same picture
+const double REFERENCE_WHITE_NITS = 100.0;
+
+// Display peak the HLG system gamma is applied for
+const double HLG_PEAK_NITS = 1000.0;
+
+// Source pixels per band. Tone mapping costs far more per pixel than
+// scaling, so bands are smaller than the scaler's.
+const int TONE_MAP_BAND_PIXELS = 1 << 18;
+
+// Packets read before the first frame is given up on
+const int MAX_PROBE_PACKETS = 500;
+
+HdrTransfer hdrTransfer(int color_trc) {
+    switch (color_trc) {
+        case AVCOL_TRC_SMPTE2084:
+            return HDR_PQ;
+        case AVCOL_TRC_ARIB_STD_B67:
+            return HDR_HLG;
+        default:
+            return HDR_NONE;
+    }
+}
+
+const char* describeTransfer(HdrTransfer transfer) {
+    switch (transfer) {
+        case HDR_PQ:
+            return "HDR10 (PQ)";
+        case HDR_HLG:
+            return "HLG";
+        default:
+            return "SDR";
+    }
+}
+
+// SMPTE ST 2084 EOTF, code value to nits
+static double pqToNits(double value) {
+    const double m1 = 2610.0 / 16384;
+    const double m2 = 2523.0 / 4096 * 128;
+    const double c1 = 3424.0 / 4096;
+    const double c2 = 2413.0 / 4096 * 32;
+    const double c3 = 2392.0 / 4096 * 32;
+
+    double e = std::pow(value, 1 / m2);
+    double linear = std::max(e - c1, 0.0) / (c2 - c3 * e);
+    return std::pow(linear, 1 / m1) * 10000;
+}
+
+// ARIB STD-B67 inverse OETF followed by the system gamma of a 1000 nit
+// display. The gamma is applied per component rather than on luminance.
+static double hlgToNits(double value) {
+    const double a = 0.17883277;
+    const double b = 1 - 4 * a;
+    const double c = 0.5 - a * std::log(4 * a);
+
+    double scene = value <= 0.5 ? value * value / 3 : (std::exp((value - c) / a) + b) / 12;
+    return HLG_PEAK_NITS * std::pow(scene, 1.2);
+}
+
+// BT.709 OETF
+static double bt709Encode(double linear) {
+    return linear < 0.018 ? 4.5 * linear : 1.099 * std::pow(linear, 0.45) - 0.099;
+}
+
+static v4f splat(float value) {
+    return v4f{value, value, value, value};
+}
+
+static v4f maxLanes(v4f a, v4f b) {
+    return a > b ? a : b;
+}
+
+// Table entry nearest to each lane, inputs clamped to [0, 1]
+static v4f lookup(const float* table, v4f x) {
+    x = maxLanes(x, splat(0));
+    x = x < splat(1) ? x : splat(1);
+    v4i index = __builtin_convertvector(x * splat(TONE_MAP_LUT_SIZE - 1) + splat(0.5f), v4i);
+    return v4f{table[index[0]], table[index[1]], table[index[2]], table[index[3]]};
+}
+
+// Hable's filmic curve, without the white point division
+static v4f hable(v4f x) {
+    const float A = 0.15f, B = 0.50f, C = 0.10f, D = 0.20f, E = 0.02f, F = 0.30f;
+    return (x * (A * x + splat(C * B)) + splat(D * E)) / (x * (A * x + splat(B)) + splat(D * F)) - splat(E / F);
+}
+
+static v4i roundLanes(v4f x) {
+    return __builtin_convertvector(x + splat(0.5f), v4i);
+}
+
+bool probeHdr(const std::string& input_file, HdrInfo& info, std::string& error) {
+    AVFormatContext* input_ctx = nullptr;
+    int ret = avformat_open_input(&input_ctx, input_file.c_str(), nullptr, nullptr);
+    if (ret < 0 || avformat_find_stream_info(input_ctx, nullptr) < 0) {
+        error = "cannot open input";
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVStream* stream = nullptr;
+    for (unsigned int i = 0; i < input_ctx->nb_streams; i++) {
+        AVStream* candidate = input_ctx->streams[i];
+        if (candidate->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+            !(candidate->disposition & AV_DISPOSITION_ATTACHED_PIC)) {
+            stream = candidate;
+            break;
+        }
+    }
+
+    const AVCodec* decoder = stream ? avcodec_find_decoder(stream->codecpar->codec_id) : nullptr;
+    AVCodecContext* decoder_ctx = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+    if (!decoder_ctx || avcodec_parameters_to_context(decoder_ctx, stream->codecpar) < 0 ||
+        avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
+        error = "cannot open video decoder";
+        avcodec_free_context(&decoder_ctx);
+        avformat_close_input(&input_ctx);
+        return false;
+    }
+
+    AVPacket* packet = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    bool decoded = false;
+    for (int packets = 0; packets < MAX_PROBE_PACKETS && !decoded; packets++) {
+        ret = avcodec_receive_frame(decoder_ctx, frame);
+        if (ret == 0) {
+            decoded = true;
+            break;
+        }
+        if (ret != AVERROR(EAGAIN)) {
+            break;
+        }
+        if (av_read_frame(input_ctx, packet) < 0) {
+            avcodec_send_packet(decoder_ctx, nullptr);
+            continue;
+        }
+        if (packet->stream_index == stream->index) {
+            avcodec_send_packet(decoder_ctx, packet);
+        }
+        av_packet_unref(packet);
+    }
+
+    info = HdrInfo();
+    if (decoded) {
+        int color_trc = frame->color_trc != AVCOL_TRC_UNSPECIFIED ? frame->color_trc : stream->codecpar->color_trc;
+        info.transfer = hdrTransfer(color_trc);
+
+        AVFrameSideData* side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA);
+        if (side_data) {
+            const AVMasteringDisplayMetadata* mastering =
+                reinterpret_cast<const AVMasteringDisplayMetadata*>(side_data->data);
+            if (mastering->has_luminance && av_q2d(mastering->max_luminance) > 0) {
+                info.peak_nits = av_q2d(mastering->max_luminance);
+            }
+            if (mastering->has_primaries && mastering->has_luminance) {
+                // x265 wants green, blue, red, white point in 0.00002 and luminance in 0.0001 nit units
+                auto chroma = [](AVRational value) { return std::lround(av_q2d(value) * 50000); };
+                auto luma = [](AVRational value) { return std::lround(av_q2d(value) * 10000); };
+                std::ostringstream ss;
+                ss << "G(" << chroma(mastering->display_primaries[1][0]) << "," << chroma(mastering->display_primaries[1][1]) << ")"
+                   << "B(" << chroma(mastering->display_primaries[2][0]) << "," << chroma(mastering->display_primaries[2][1]) << ")"
+                   << "R(" << chroma(mastering->display_primaries[0][0]) << "," << chroma(mastering->display_primaries[0][1]) << ")"
+                   << "WP(" << chroma(mastering->white_point[0]) << "," << chroma(mastering->white_point[1]) << ")"
+                   << "L(" << luma(mastering->max_luminance) << "," << luma(mastering->min_luminance) << ")";
+                info.master_display = ss.str();
+            }
+        }
+
+        side_data = av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL);
+        if (side_data) {
+            const AVContentLightMetadata* light = reinterpret_cast<const AVContentLightMetadata*>(side_data->data);
+            info.max_cll = light->MaxCLL;
+            info.max_fall = light->MaxFALL;
+            // The brightest pixel actually in the title beats the mastering display's capability
+            if (light->MaxCLL > 0) {
+                info.peak_nits = light->MaxCLL;
+            }
+        }
+
+        if (info.transfer == HDR_HLG) {
+            info.peak_nits = HLG_PEAK_NITS;
+        }
+    }
+
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+
+    if (!decoded) {
+        error = "no video frame decoded";
+        return false;
+    }
+    return true;
+}
+
+std::string toneMapFilter(const HdrInfo& info) {
+    if (!info.hdr()) {
+        return "";
+    }
+    std::ostringstream ss;
+    ss << "zscale=t=linear:npl=" << REFERENCE_WHITE_NITS << ",format=gbrpf32le,zscale=p=bt709,"
+       << "tonemap=tonemap=hable:desat=0:peak=" << info.peak_nits / REFERENCE_WHITE_NITS << ","
+       << "zscale=t=bt709:m=bt709:r=tv,format=yuv420p,";
+    return ss.str();
+}
+
+ToneMapper::~ToneMapper() {
+    sws_freeContext(convert_ctx);
+    av_frame_free(&converted);
+    av_frame_free(&output);
+}
+
+bool ToneMapper::init(int width, int height, int src_format, const HdrInfo& info, Executor* pool) {
+    this->width = width;
+    this->height = height;
+    this->pool = pool;
+
+    eotf.resize(TONE_MAP_LUT_SIZE);
+    oetf.resize(TONE_MAP_LUT_SIZE);
+    for (int i = 0; i < TONE_MAP_LUT_SIZE; i++) {
+        double value = static_cast<double>(i) / (TONE_MAP_LUT_SIZE - 1);
+        double nits = info.transfer == HDR_HLG ? hlgToNits(value) : pqToNits(value);
+        eotf[i] = static_cast<float>(nits / REFERENCE_WHITE_NITS);
+        oetf[i] = static_cast<float>(bt709Encode(value));
+    }
+    peak = static_cast<float>(std::max(info.peak_nits / REFERENCE_WHITE_NITS, 1.0));
+
+    if (src_format != AV_PIX_FMT_YUV420P10LE && src_format != AV_PIX_FMT_P010LE) {
+        convert_ctx = sws_getContext(width, height, static_cast<AVPixelFormat>(src_format),
+                                     width, height, AV_PIX_FMT_YUV420P10LE, SWS_POINT, nullptr, nullptr, nullptr);
+        converted = av_frame_alloc();
+        if (!convert_ctx || !converted) {
+            return false;
+        }
+        converted->format = AV_PIX_FMT_YUV420P10LE;
+        converted->width = width;
+        converted->height = height;
+        if (av_frame_get_buffer(converted, 32) < 0) {
+            return false;
+        }
+    }
+
+    output = av_frame_alloc();
+    if (!output) {
+        return false;
+    }
+    output->format = AV_PIX_FMT_YUV420P;
+    output->width = width;
+    output->height = height;
+    output->color_range = AVCOL_RANGE_MPEG;
+    output->color_primaries = AVCOL_PRI_BT709;
+    output->color_trc = AVCOL_TRC_BT709;
+    output->colorspace = AVCOL_SPC_BT709;
+    return av_frame_get_buffer(output, 32) >= 0;
+}
+
+// Chroma rows [first, last) with their two luma rows each. Lanes are four
+// horizontally adjacent 2x2 blocks; each block's four pixels go through in
+// turn and their Cb and Cr are averaged into the block's chroma sample.
+void ToneMapper::mapRows(const AVFrame* src, int first, int last) const {
+    bool semi_planar = src->format == AV_PIX_FMT_P010LE;
+    int shift = semi_planar ? 6 : 0;
+    bool full_range = src->color_range == AVCOL_RANGE_JPEG;
+    v4f luma_offset = splat(full_range ? 0.0f : 64.0f);
+    v4f luma_scale = splat(1.0f / (full_range ? 1023 : 876));
+    v4f chroma_scale = splat(1.0f / (full_range ? 1023 : 896));
+    v4f hable_scale = splat(1.0f) / hable(splat(peak));
+    int chroma_width = (width + 1) / 2;
+
+    for (int cy = first; cy < last; cy++) {
+        const uint16_t* luma[2];
+        uint8_t* luma_out[2];
+        for (int dy = 0; dy < 2; dy++) {
+            int y = std::min(cy * 2 + dy, height - 1);
+            luma[dy] = reinterpret_cast<const uint16_t*>(src->data[0] + static_cast<ptrdiff_t>(y) * src->linesize[0]);
+            luma_out[dy] = cy * 2 + dy < height ? output->data[0] + static_cast<ptrdiff_t>(y) * output->linesize[0] : nullptr;
+        }
+        const uint16_t* cb_row = reinterpret_cast<const uint16_t*>(src->data[1] + static_cast<ptrdiff_t>(cy) * src->linesize[1]);
+        const uint16_t* cr_row = semi_planar ? cb_row + 1 :
+            reinterpret_cast<const uint16_t*>(src->data[2] + static_cast<ptrdiff_t>(cy) * src->linesize[2]);
+        int chroma_step = semi_planar ? 2 : 1;
+        uint8_t* cb_out = output->data[1] + static_cast<ptrdiff_t>(cy) * output->linesize[1];
+        uint8_t* cr_out = output->data[2] + static_cast<ptrdiff_t>(cy) * output->linesize[2];
+
+        for (int cx = 0; cx < chroma_width; cx += 4) {
+            // Past the right edge the lanes repeat the last block and are not stored
+            int lanes = std::min(4, chroma_width - cx);
+            v4f cb, cr;
+            for (int i = 0; i < 4; i++) {
+                int c = (cx + std::min(i, lanes - 1)) * chroma_step;
+                cb[i] = static_cast<float>(cb_row[c] >> shift);
+                cr[i] = static_cast<float>(cr_row[c] >> shift);
+            }
+            cb = (cb - splat(512)) * chroma_scale;
+            cr = (cr - splat(512)) * chroma_scale;
+
+            // BT.2020 non-constant luminance Y'CbCr to R'G'B'
+            v4f r_chroma = splat(1.4746f) * cr;
+            v4f g_chroma = splat(-0.16455f) * cb - splat(0.57135f) * cr;
+            v4f b_chroma = splat(1.8814f) * cb;
+
+            v4f cb_sum = {};
+            v4f cr_sum = {};
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    v4f y;
+                    for (int i = 0; i < 4; i++) {
+                        int x = std::min(2 * (cx + std::min(i, lanes - 1)) + dx, width - 1);
+                        y[i] = static_cast<float>(luma[dy][x] >> shift);
+                    }
+                    y = (y - luma_offset) * luma_scale;
+
+                    v4f r = lookup(eotf.data(), y + r_chroma);
+                    v4f g = lookup(eotf.data(), y + g_chroma);
+                    v4f b = lookup(eotf.data(), y + b_chroma);
+
+                    // BT.2020 to BT.709 primaries in linear light
+                    v4f r709 = splat(1.6605f) * r - splat(0.5876f) * g - splat(0.0728f) * b;
+                    v4f g709 = splat(-0.1246f) * r + splat(1.1329f) * g - splat(0.0083f) * b;
+                    v4f b709 = splat(-0.0182f) * r - splat(0.1006f) * g + splat(1.1187f) * b;
+
+                    // The curve runs on the brightest component and all three are scaled alike, keeping hue
+                    v4f signal = maxLanes(maxLanes(maxLanes(r709, g709), b709), splat(1e-6f));
+                    v4f gain = hable(signal) * hable_scale / signal;
+
+                    v4f r_out = lookup(oetf.data(), r709 * gain);
+                    v4f g_out = lookup(oetf.data(), g709 * gain);
+                    v4f b_out = lookup(oetf.data(), b709 * gain);
+
+                    v4f y_out = splat(0.2126f) * r_out + splat(0.7152f) * g_out + splat(0.0722f) * b_out;
+                    cb_sum += b_out - y_out;
+                    cr_sum += r_out - y_out;
+
+                    if (luma_out[dy]) {
+                        v4i code = roundLanes(splat(16) + splat(219) * y_out);
+                        for (int i = 0; i < lanes; i++) {
+                            int x = 2 * (cx + i) + dx;
+                            if (x < width) {
+                                luma_out[dy][x] = static_cast<uint8_t>(code[i]);
+                            }
+                        }
+                    }
+                }
+            }
+
+            v4i cb_code = roundLanes(splat(128) + splat(224.0f / (4 * 1.8556f)) * cb_sum);
+            v4i cr_code = roundLanes(splat(128) + splat(224.0f / (4 * 1.5748f)) * cr_sum);
+            for (int i = 0; i < lanes; i++) {
+                cb_out[cx + i] = static_cast<uint8_t>(cb_code[i]);
+                cr_out[cx + i] = static_cast<uint8_t>(cr_code[i]);
+            }
+        }
+    }
+}
+
+AVFrame* ToneMapper::process(const AVFrame* frame) {
+    const AVFrame* src = frame;
+    if (convert_ctx) {
+        sws_scale(convert_ctx, frame->data, frame->linesize, 0, height, converted->data, converted->linesize);
+        converted->color_range = frame->color_range;
+        src = converted;
+    }
+
+    // An encoder may still hold the previous picture by reference
+    if (av_frame_make_writable(output) < 0) {
+        return nullptr;
+    }
+    
+    int chroma_height = (height + 1) / 2;
+    int count = 1;
+    if (pool) {
+        int by_size = static_cast<int>(static_cast<int64_t>(width) * height / TONE_MAP_BAND_PIXELS);
+        count = std::max(1, std::min({by_size, static_cast<int>(pool->size()), chroma_height}));
+    }
+    int rows = (chroma_height + count - 1) / count;
+
+    // The caller's thread takes the first band while the pool runs the rest
+    std::vector<std::future<void>> pending;
+    for (int start = rows; start < chroma_height; start += rows) {
+        int end = std::min(start + rows, chroma_height);
+        pending.push_back(pool->submit([this, src, start, end] { mapRows(src, start, end); }, TaskPriority::High));
+    }
+    mapRows(src, 0, std::min(rows, chroma_height));
+    for (auto& result : pending) {
+        pool->wait(result);
+    }
+
+    output->pts = frame->pts;
+    return output;
+}
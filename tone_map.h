@@ -0,0 +1,78 @@
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+#include <string>
+#include <vector>
+
+struct AVFrame;
+struct SwsContext;
+class Executor;
+
+// Transfer characteristics that need tone mapping for SDR rungs
+enum HdrTransfer {
+    HDR_NONE,
+    HDR_PQ,         // SMPTE ST 2084, as used by HDR10
+    HDR_HLG         // ARIB STD-B67
+};
+
+// Light levels of an HDR source
+struct HdrInfo {
+    HdrTransfer transfer = HDR_NONE;
+    double peak_nits = 1000;        // brightest level kept, 1000 when the source does not say
+    std::string master_display;     // x265 master-display string, empty when unknown
+    unsigned max_cll = 0;           // content light level, 0 when unknown
+    unsigned max_fall = 0;
+
+    bool hdr() const { return transfer != HDR_NONE; }
+};
+
+// Maps an AVColorTransferCharacteristic value
+HdrTransfer hdrTransfer(int color_trc);
+
+// "SDR", "HDR10 (PQ)" or "HLG"
+const char* describeTransfer(HdrTransfer transfer);
+
+// Decodes the first video frame and reads its transfer, mastering display
+// and content light level. Returns false only when the input cannot be
+// decoded; SDR sources come back with transfer HDR_NONE.
+bool probeHdr(const std::string& input_file, HdrInfo& info, std::string& error);
+
+// ffmpeg filter chain with the same tone curve as ToneMapper, ending in a
+// comma so a scale can follow. Empty for SDR. Needs ffmpeg built with zimg.
+std::string toneMapFilter(const HdrInfo& info);
+
+// HDR10 and HLG to 8-bit BT.709 4:2:0. Pixels are linearized through a
+// lookup table, converted to BT.709 primaries, tone mapped with the Hable
+// curve on their brightest component and re-encoded with the BT.709 OETF
+// from a second table. Four 2x2 chroma blocks go through the vector lanes
+// together. Row bands run on the pool.
+class ToneMapper {
+public:
+    ToneMapper() = default;
+    ~ToneMapper();
+    ToneMapper(const ToneMapper&) = delete;
+    ToneMapper& operator=(const ToneMapper&) = delete;
+
+    // src_format is an AVPixelFormat. 10-bit 4:2:0, planar or P010, is read
+    // as is; other formats are converted to it first.
+    bool init(int width, int height, int src_format, const HdrInfo& info, Executor* pool);
+
+    // The returned frame belongs to the mapper and is overwritten by the next
+    // call unless someone holds a reference to it. Null when out of memory.
+    AVFrame* process(const AVFrame* frame);
+
+private:
+    int width = 0;
+    int height = 0;
+    std::vector<float> eotf;
+    std::vector<float> oetf;
+    float peak = 1;
+    SwsContext* convert_ctx = nullptr;
+    AVFrame* converted = nullptr;
+    AVFrame* output = nullptr;
+    Executor* pool = nullptr;
+
+    void mapRows(const AVFrame* src, int first, int last) const;
+};
+
+#endif // TONE_MAP_H
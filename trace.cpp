@@ -0,0 +1,206 @@
+#include "trace.h"
+#include "logger.h"
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+TraceSession::TraceSession(const std::string& title, TraceLevel level)
+    : title(title), trace_level(level), origin(std::chrono::steady_clock::now()) {}
+
+int64_t TraceSession::now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+uint32_t TraceSession::threadId() {
+    static std::atomic<uint32_t> next_thread{1};
+    static thread_local uint32_t thread = next_thread++;
+    return thread;
+}
+
+int64_t TraceSession::threadCpu() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+bool TraceSession::records(const char* category) const {
+    if (trace_level == TRACE_ALL) {
+        return true;
+    }
+    for (const char* frame_category : {"decode", "video", "audio", "mux"}) {
+        if (strcmp(category, frame_category) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TraceSession::record(const char* name, const char* category, int64_t start, int64_t end,
+                          uint32_t thread, std::string detail, int64_t cpu) {
+    Shard& shard = shards[thread % TRACE_SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.spans.push_back({name, category, start, end - start, thread, 0, cpu, std::move(detail)});
+}
+
+void TraceSession::recordAsync(const char* name, const char* category, int64_t start, int64_t end,
+                               std::string detail) {
+    uint32_t thread = threadId();
+    Shard& shard = shards[thread % TRACE_SHARDS];
+    uint64_t id = next_async_id++;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.spans.push_back({name, category, start, end - start, thread, id, -1, std::move(detail)});
+}
+
+size_t TraceSession::spanCount() {
+    size_t count = 0;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        count += shard.spans.size();
+    }
+    return count;
+}
+
+std::map<std::string, double> TraceSession::stageSeconds() {
+    std::map<std::string, double> seconds;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& span : shard.spans) {
+            seconds[span.name] += span.duration / 1e6;
+        }
+    }
+    return seconds;
+}
+
+std::map<std::string, double> TraceSession::stageCpuSeconds() {
+    std::map<std::string, double> seconds;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (const auto& span : shard.spans) {
+            if (span.cpu >= 0) {
+                seconds[span.name] += span.cpu / 1e6;
+            }
+        }
+    }
+    return seconds;
+}
+
+bool TraceSession::write(const std::string& path, std::string& error) {
+    std::vector<Span> spans;
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        spans.insert(spans.end(), shard.spans.begin(), shard.spans.end());
+    }
+    std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) { return a.start < b.start; });
+
+    std::ofstream file(path, std::ios::trunc);
+    if (!file.is_open()) {
+        error = "cannot create " + path;
+        return false;
+    }
+
+    std::string text = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    text += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":";
+    appendJsonString(text, title);
+    text += "}}";
+    for (const auto& span : spans) {
+        text += ",\n{\"name\":\"";
+        text += span.name;
+        text += "\",\"cat\":\"";
+        text += span.category;
+        if (span.async_id) {
+            // A begin and an end event sharing an id; each id gets a track
+            text += "\",\"ph\":\"b\",\"id\":";
+            text += std::to_string(span.async_id);
+        } else {
+            text += "\",\"ph\":\"X\"";
+        }
+        text += ",\"pid\":1,\"tid\":";
+        text += std::to_string(span.thread);
+        text += ",\"ts\":";
+        text += std::to_string(span.start);
+        if (!span.async_id) {
+            text += ",\"dur\":";
+            text += std::to_string(span.duration);
+        }
+        if (!span.detail.empty()) {
+            text += ",\"args\":{\"detail\":";
+            appendJsonString(text, span.detail);
+            text += '}';
+        }
+        text += '}';
+        if (span.async_id) {
+            text += ",\n{\"name\":\"";
+            text += span.name;
+            text += "\",\"cat\":\"";
+            text += span.category;
+            text += "\",\"ph\":\"e\",\"id\":";
+            text += std::to_string(span.async_id);
+            text += ",\"pid\":1,\"tid\":";
+            text += std::to_string(span.thread);
+            text += ",\"ts\":";
+            text += std::to_string(span.start + span.duration);
+            text += '}';
+        }
+
+        if (text.size() > (1 << 20)) {
+            file << text;
+            text.clear();
+        }
+    }
+    text += "\n]}\n";
+    file << text;
+
+    if (!file.good()) {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+TraceSpan::TraceSpan(TraceSession* session, const char* name, const char* category)
+    : session(session), name(name), category(category) {
+    if (session && !session->records(category)) {
+        this->session = nullptr;
+    }
+    if (this->session) {
+        start = this->session->now();
+        thread = TraceSession::threadId();
+        if (this->session->level() == TRACE_STAGES) {
+            cpu_start = TraceSession::threadCpu();
+        }
+    }
+}
+
+TraceSpan::TraceSpan(TraceSession* session, const char* name, const char* category, const std::string& detail)
+    : TraceSpan(session, name, category) {
+    if (this->session) {
+        this->detail = detail;
+    }
+}
+
+TraceSpan::TraceSpan(TraceAsync, TraceSession* session, const char* name, const char* category)
+    : TraceSpan(session, name, category) {
+    // A coroutine may resume on another thread, so its CPU is not measured
+    async = true;
+    cpu_start = -1;
+}
+
+TraceSpan::TraceSpan(TraceAsync, TraceSession* session, const char* name, const char* category,
+                     const std::string& detail)
+    : TraceSpan(session, name, category, detail) {
+    async = true;
+    cpu_start = -1;
+}
+
+TraceSpan::~TraceSpan() {
+    if (!session) {
+        return;
+    }
+    if (async) {
+        session->recordAsync(name, category, start, session->now(), std::move(detail));
+    } else {
+        int64_t cpu = cpu_start >= 0 ? TraceSession::threadCpu() - cpu_start : -1;
+        session->record(name, category, start, session->now(), thread, std::move(detail), cpu);
+    }
+}
@@ -0,0 +1,131 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Spans are spread over this many buffers by thread, so threads recording
+// at the same time rarely share a lock
+const int TRACE_SHARDS = 16;
+
+enum TraceLevel {
+    TRACE_ALL,      // every span, down to single packets and frames
+    TRACE_STAGES    // only the stages, each with its thread's CPU time; the
+                    // per-packet and per-frame categories (decode, video,
+                    // audio, mux) are skipped without reading the clock
+};
+
+// Timeline of one job, written in the Chrome trace event format that
+// Perfetto and chrome://tracing open. Spans may be recorded from any
+// thread; each keeps the thread it started on. Spans on one thread must
+// nest, so stages that overlap on a thread, such as coroutines suspended
+// on the event loop, are recorded as async spans on tracks of their own.
+class TraceSession {
+public:
+    // The title names the job in the viewer
+    explicit TraceSession(const std::string& title, TraceLevel level = TRACE_ALL);
+    TraceSession(const TraceSession&) = delete;
+    TraceSession& operator=(const TraceSession&) = delete;
+
+    // Microseconds since the session started
+    int64_t now() const;
+
+    // Small number of the calling thread, stable for its lifetime
+    static uint32_t threadId();
+
+    // CPU time of the calling thread in microseconds
+    static int64_t threadCpu();
+
+    TraceLevel level() const { return trace_level; }
+
+    // False for the per-frame categories at TRACE_STAGES
+    bool records(const char* category) const;
+
+    // Names must be string literals; the detail is shown with the span
+    // cpu is the thread's CPU time in the span, -1 when it was not measured
+    void record(const char* name, const char* category, int64_t start, int64_t end,
+                uint32_t thread, std::string detail, int64_t cpu = -1);
+    void recordAsync(const char* name, const char* category, int64_t start, int64_t end, std::string detail);
+
+    size_t spanCount();
+
+    // Seconds spent in the spans of each name, summed over threads
+    std::map<std::string, double> stageSeconds();
+
+    // CPU seconds of the threads in the spans of each name, for the names
+    // whose spans were measured. Work a stage hands to other threads or to
+    // child processes is not included.
+    std::map<std::string, double> stageCpuSeconds();
+
+    // Writes every span recorded so far. False, with the reason, on I/O errors.
+    bool write(const std::string& path, std::string& error);
+
+private:
+    struct Span {
+        const char* name;
+        const char* category;
+        int64_t start;
+        int64_t duration;
+        uint32_t thread;
+        uint64_t async_id;      // 0 for spans tied to their thread
+        int64_t cpu;
+        std::string detail;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::vector<Span> spans;
+    };
+
+    std::string title;
+    TraceLevel trace_level;
+    std::chrono::steady_clock::time_point origin;
+    Shard shards[TRACE_SHARDS];
+    std::atomic<uint64_t> next_async_id{1};
+};
+
+// Selects the async constructors of TraceSpan
+struct TraceAsync {};
+const TraceAsync TRACE_ASYNC{};
+
+// Records the time from construction to destruction. Does nothing, not
+// even read the clock, when the session is null.
+class TraceSpan {
+public:
+    TraceSpan(TraceSession* session, const char* name, const char* category = "job");
+    TraceSpan(TraceSession* session, const char* name, const char* category, const std::string& detail);
+    TraceSpan(TraceAsync, TraceSession* session, const char* name, const char* category = "job");
+    TraceSpan(TraceAsync, TraceSession* session, const char* name, const char* category, const std::string& detail);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    TraceSession* session;
+    const char* name;
+    const char* category;
+    int64_t start = 0;
+    uint32_t thread = 0;
+    int64_t cpu_start = -1;
+    bool async = false;
+    std::string detail;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Span over the rest of the enclosing scope
+#define TRACE_SCOPE(session, ...) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(session, __VA_ARGS__)
+
+// The same for a coroutine, which may suspend while other spans open and
+// close on its thread
+#define TRACE_ASYNC_SCOPE(session, ...) \
+    TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(TRACE_ASYNC, session, __VA_ARGS__)
+
+#endif // TRACE_H
@@ -199,6 +199,12 @@ if [ -f "radiumvod.conf" ]; then
     fi
 fi
 
+if [ -f "vod-template.xml" ] && [ ! -f /etc/radiumvod/vod-template.xml ]; then
+    print_info "Installing metadata template..."
+    cp vod-template.xml /etc/radiumvod/
+    chown radiumvod:radiumvod /etc/radiumvod/vod-template.xml 2>/dev/null || true
+fi
+
 # Ensure SSH directory exists for SFTP
 if [ -d /var/lib/radiumvod ]; then
     if [ ! -d /var/lib/radiumvod/.ssh ]; then
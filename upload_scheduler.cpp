@@ -0,0 +1,246 @@
+#include "upload_scheduler.h"
+#include "logger.h"
+#include "trace.h"
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+namespace fs = std::filesystem;
+
+// ---------------------------------------------------------------------------
+// TokenBucket
+
+void TokenBucket::setRate(uint64_t rate) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes_per_second = rate;
+    // A quarter second of burst keeps 64 KiB sender chunks flowing smoothly
+    burst = std::max<double>(rate / 4.0, 256 * 1024);
+    tokens = burst;
+    last_refill = std::chrono::steady_clock::now();
+}
+
+void TokenBucket::refill() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - last_refill).count();
+    last_refill = now;
+    tokens = std::min(burst, tokens + elapsed * bytes_per_second);
+}
+
+void TokenBucket::acquire(uint64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (bytes_per_second > 0) {
+        refill();
+        if (tokens >= 0) {
+            tokens -= bytes;
+            return;
+        }
+        double wait = -tokens / bytes_per_second;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        lock.lock();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// UploadScheduler
+
+static std::string formatRate(uint64_t bytes, double seconds) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << bytes / 1048576.0 << " MB in " << seconds << " s ("
+       << (seconds > 0 ? bytes * 8 / seconds / 1e6 : 0.0) << " Mbit/s)";
+    return ss.str();
+}
+
+UploadScheduler::~UploadScheduler() {
+    stop();
+}
+
+bool UploadScheduler::addDestination(const DestinationConfig& config, std::string& error) {
+    std::unique_ptr<Destination> destination(new Destination());
+    destination->config = config;
+    destination->stats.name = config.name;
+
+    // Sinks are not shared between threads, every worker gets its own
+    int workers = std::max(config.max_concurrent, 1);
+    for (int i = 0; i < workers; i++) {
+        std::unique_ptr<OutputSink> sink = createSink(config, error);
+        if (!sink) {
+            return false;
+        }
+        sink->setThrottle(&bandwidth);
+        destination->sinks.push_back(std::move(sink));
+    }
+
+    destinations.push_back(std::move(destination));
+    return true;
+}
+
+void UploadScheduler::setBandwidthLimit(uint64_t bytes_per_second) {
+    bandwidth.setRate(bytes_per_second);
+}
+
+std::vector<std::string> UploadScheduler::describeDestinations() const {
+    std::vector<std::string> descriptions;
+    for (const auto& destination : destinations) {
+        descriptions.push_back(destination->sinks.front()->describe() + ", " +
+                               std::to_string(destination->sinks.size()) + " concurrent");
+    }
+    return descriptions;
+}
+
+void UploadScheduler::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) {
+        return;
+    }
+    running = true;
+    for (auto& destination : destinations) {
+        for (auto& sink : destination->sinks) {
+            destination->workers.emplace_back(&UploadScheduler::work, this,
+                                              std::ref(*destination), std::ref(*sink));
+        }
+    }
+}
+
+void UploadScheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        running = false;
+    }
+    wake.notify_all();
+
+    std::vector<std::shared_ptr<Title>> dropped;
+    for (auto& destination : destinations) {
+        for (auto& worker : destination->workers) {
+            worker.join();
+        }
+        destination->workers.clear();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!destination->queue.empty()) {
+            LOG_WARNING(destination->config.name + ": " + std::to_string(destination->queue.size()) +
+                " queued uploads dropped at shutdown");
+        }
+        while (!destination->queue.empty()) {
+            dropped.push_back(destination->queue.top().title);
+            destination->queue.pop();
+        }
+    }
+
+    // A dropped title was not delivered; its completion runs once the other
+    // destinations are done with it too, as for a failed upload
+    for (const auto& title : dropped) {
+        title->delivered = false;
+        if (--title->remaining == 0 && title->done) {
+            title->done(false);
+        }
+    }
+}
+
+void UploadScheduler::submit(const fs::path& local_dir, const std::string& remote_name,
+                             UploadPriority priority, const Completion& done,
+                             std::shared_ptr<TraceSession> trace) {
+    std::shared_ptr<Title> title = std::make_shared<Title>();
+    title->local_dir = local_dir;
+    title->remote_name = remote_name;
+    title->done = done;
+    title->trace = std::move(trace);
+    title->remaining = static_cast<int>(destinations.size());
+
+    if (destinations.empty()) {
+        if (done) {
+            done(true);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t order = sequence++;
+        for (auto& destination : destinations) {
+            destination->queue.push({title, priority, order});
+        }
+    }
+    wake.notify_all();
+}
+
+std::vector<DestinationStats> UploadScheduler::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<DestinationStats> result;
+    auto now = std::chrono::steady_clock::now();
+    for (const auto& destination : destinations) {
+        DestinationStats stats = destination->stats;
+        if (destination->active > 0) {
+            stats.active_seconds += std::chrono::duration<double>(now - destination->active_since).count();
+        }
+        stats.queued = destination->queue.size();
+        result.push_back(stats);
+    }
+    return result;
+}
+
+bool UploadScheduler::waitRetry(std::chrono::seconds delay) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return !wake.wait_for(lock, delay, [this] { return !running; });
+}
+
+void UploadScheduler::work(Destination& destination, OutputSink& sink) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return !running || !destination.queue.empty(); });
+            if (!running) {
+                return;
+            }
+            job = destination.queue.top();
+            destination.queue.pop();
+            if (destination.active++ == 0) {
+                destination.active_since = std::chrono::steady_clock::now();
+            }
+        }
+
+        const Title& title = *job.title;
+        LOG_INFO("Starting upload: " + title.local_dir.string() + " -> " + sink.describe() +
+            (job.priority == UPLOAD_BACKFILL ? " (backfill)" : ""));
+
+        uint64_t bytes_before = sink.bytesSent();
+        auto started = std::chrono::steady_clock::now();
+        bool delivered;
+        {
+            TRACE_SCOPE(title.trace.get(), "upload", "upload", sink.describe());
+            delivered = syncTitle(sink, title.local_dir, title.remote_name,
+                                  [this](std::chrono::seconds delay) { return waitRetry(delay); });
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        uint64_t bytes = sink.bytesSent() - bytes_before;
+
+        DestinationStats totals;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto now = std::chrono::steady_clock::now();
+            if (--destination.active == 0) {
+                destination.stats.active_seconds +=
+                    std::chrono::duration<double>(now - destination.active_since).count();
+            }
+            destination.stats.bytes += bytes;
+            destination.stats.titles += delivered ? 1 : 0;
+            destination.stats.failures += delivered ? 0 : 1;
+            totals = destination.stats;
+        }
+
+        LOG_INFO(sink.describe() + ": " + title.remote_name + " " + formatRate(bytes, seconds) +
+            "; total " + std::to_string(totals.titles) + " titles, " +
+            formatRate(totals.bytes, totals.active_seconds));
+
+        if (!delivered) {
+            job.title->delivered = false;
+        }
+        if (--job.title->remaining == 0 && title.done) {
+            title.done(job.title->delivered);
+        }
+    }
+}
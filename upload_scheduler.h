@@ -0,0 +1,133 @@
+#ifndef UPLOAD_SCHEDULER_H
+#define UPLOAD_SCHEDULER_H
+
+#include "output_sink.h"
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class TraceSession;
+
+// Shared bandwidth limit. Callers take tokens before sending and may drive
+// the balance negative; later callers wait until it has been paid back, so
+// large requests never deadlock and the long-term rate stays at the limit.
+class TokenBucket {
+public:
+    // 0 disables the limit
+    void setRate(uint64_t bytes_per_second);
+    uint64_t rate() const { return bytes_per_second; }
+
+    // Blocks until the balance is non-negative, then takes bytes
+    void acquire(uint64_t bytes);
+
+private:
+    std::mutex mutex;
+    std::atomic<uint64_t> bytes_per_second{0};
+    double tokens = 0;
+    double burst = 0;
+    std::chrono::steady_clock::time_point last_refill;
+
+    void refill();
+};
+
+enum UploadPriority {
+    UPLOAD_NEW = 0,         // freshly converted titles
+    UPLOAD_BACKFILL = 1     // titles left over from earlier runs
+};
+
+struct DestinationStats {
+    std::string name;
+    uint64_t titles = 0;
+    uint64_t failures = 0;
+    uint64_t bytes = 0;
+    double active_seconds = 0;  // wall time with at least one upload running
+    size_t queued = 0;
+};
+
+// Delivers titles to every destination in the background. Each destination
+// runs max_concurrent workers with their own sink; queued titles are taken
+// by priority, then in submission order. All sinks share one TokenBucket.
+class UploadScheduler {
+public:
+    // Called once per title after every destination finished it
+    typedef std::function<void(bool delivered)> Completion;
+
+    ~UploadScheduler();
+
+    bool addDestination(const DestinationConfig& config, std::string& error);
+    void setBandwidthLimit(uint64_t bytes_per_second);
+    bool empty() const { return destinations.empty(); }
+
+    void start();
+
+    // Finishes the transfers in progress without retrying them. Queued
+    // titles are dropped and completed as not delivered.
+    void stop();
+
+    // With a trace, every destination's upload is recorded as a span
+    void submit(const std::filesystem::path& local_dir, const std::string& remote_name,
+                UploadPriority priority, const Completion& done,
+                std::shared_ptr<TraceSession> trace = nullptr);
+
+    std::vector<DestinationStats> stats();
+    std::vector<std::string> describeDestinations() const;
+
+private:
+    struct Title {
+        std::filesystem::path local_dir;
+        std::string remote_name;
+        Completion done;
+        std::shared_ptr<TraceSession> trace;
+        std::atomic<int> remaining{0};
+        std::atomic<bool> delivered{true};
+    };
+
+    struct Job {
+        std::shared_ptr<Title> title;
+        UploadPriority priority;
+        uint64_t sequence;
+    };
+
+    // std::priority_queue puts the "largest" first
+    struct JobOrder {
+        bool operator()(const Job& a, const Job& b) const {
+            if (a.priority != b.priority) {
+                return a.priority > b.priority;
+            }
+            return a.sequence > b.sequence;
+        }
+    };
+
+    struct Destination {
+        DestinationConfig config;
+        std::vector<std::unique_ptr<OutputSink>> sinks;     // one per worker
+        std::priority_queue<Job, std::vector<Job>, JobOrder> queue;
+        std::vector<std::thread> workers;
+        DestinationStats stats;
+        int active = 0;
+        std::chrono::steady_clock::time_point active_since;
+    };
+
+    TokenBucket bandwidth;
+    std::vector<std::unique_ptr<Destination>> destinations;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false;
+    uint64_t sequence = 0;
+
+    void work(Destination& destination, OutputSink& sink);
+
+    // Sleeps for a retry delay; false as soon as stop() is called
+    bool waitRetry(std::chrono::seconds delay);
+};
+
+#endif // UPLOAD_SCHEDULER_H
@@ -2,7 +2,42 @@
 #define WATCHER_H
 
 #include <string>
+#include <vector>
+#include <functional>
+#include "output_sink.h"
+
+// Where a source file is in the daemon's lifecycle
+enum WatcherEvent {
+    WATCH_DETECTED,     // seen by a scan
+    WATCH_REJECTED,     // failed the probe
+    WATCH_ENCODED,      // HLS, XML and manifest written
+    WATCH_FAILED,       // conversion or delivery failed
+    WATCH_UPLOADED      // every destination verified it
+};
+
+// Called on the daemon's loop thread, and on upload threads for deliveries
+typedef std::function<void(const std::string& filename, WatcherEvent event)> WatcherObserver;
+
+// Put over the config file's settings by tools that run the daemon, so a
+// production config can run against scratch directories. Every path is
+// replaced; an empty one turns its feature off.
+struct WatcherOverrides {
+    std::string source_dir;
+    std::string dest_dir;
+    std::string log_file;
+    std::string rejected_dir;
+    std::string trace_dir;
+    std::string metrics_file;
+    std::vector<std::string> file_extensions;
+    std::vector<DestinationConfig> destinations;
+    bool console_log = true;
+    WatcherObserver observer;
+};
 
 int run_watcher(const std::string& config_file);
+int run_watcher(const std::string& config_file, const WatcherOverrides& overrides);
+
+// Shuts a running watcher down as SIGTERM would; callable from any thread
+void stop_watcher();
 
-#endif // WATCHER_H
\ No newline at end of file
+#endif // WATCHER_H
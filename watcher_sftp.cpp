@@ -1,4 +1,20 @@
 #include "watcher.h"
+#include "media_tracks.h"
+#include "media_probe.h"
+#include "geometry.h"
+#include "crop_detect.h"
+#include "tone_map.h"
+#include "edge_trim.h"
+#include "xml_template.h"
+#include "checksum.h"
+#include "output_sink.h"
+#include "upload_scheduler.h"
+#include "executor.h"
+#include "event_loop.h"
+#include "logger.h"
+#include "trace.h"
+#include "resource_usage.h"
+#include "vod_template.h"
 #include <iostream>
 #include <string>
 #include <vector>
@@ -15,16 +31,21 @@
 #include <numeric>
 #include <signal.h>
 #include <regex>
+#include <mutex>
 #include <random>
+#include <cstdio>
+#include <cstdlib>
 
 namespace fs = std::filesystem;
 
-// Global flag for graceful shutdown
+// Global flag for graceful shutdown; queued tasks are dropped through the token
 volatile bool g_running = true;
+CancellationToken g_shutdown;
 
 void signalHandler(int signum) {
     std::cout << "\nReceived signal " << signum << ". Shutting down gracefully...\n";
     g_running = false;
+    g_shutdown.cancel();
 }
 
 class Config {
@@ -37,9 +58,21 @@ public:
     bool delete_source = false;
     bool create_subdirs = true;
     std::string log_file;
+    std::string log_format = "text";    // "text" or "json", one object per line
+    std::string log_verbosity = "info"; // debug, info, warning or error
+    int log_max_size_mb = 0;            // rotate the log file at this size, 0 never
+    int log_max_files = 5;              // rotated log files kept
+    std::string rejected_dir;           // broken inputs are moved here when set
+    std::string queue_order = "fifo";   // "fifo" or "shortest_first"
+    int concurrent_jobs = 1;            // titles converted at the same time
+    std::string trace_dir;              // a Chrome trace per job is written here when set
+    std::string metrics_file;           // job cost totals in the Prometheus text format when set
     
     // HLS settings
     int segment_duration = 10;
+    bool crop_detect = true;            // leave black bars out of every rung
+    bool trim_edges = true;             // cut black, silent slates off head and tail
+    bool tone_map = true;               // map HDR10 and HLG sources to SDR BT.709
     
     struct Profile {
         std::string name;
@@ -59,17 +92,14 @@ public:
     int threads = 0;
     std::string log_level = "warning";
     
-    // SFTP settings
-    bool sftp_enabled = false;
-    std::string sftp_host;
-    int sftp_port = 22;
-    std::string sftp_username;
-    std::string sftp_password;
-    std::string sftp_remote_path;
-    bool sftp_delete_source_after_upload = false;
-    bool sftp_delete_local_after_upload = false;
-    int sftp_retry_attempts = 3;
-    int sftp_retry_delay = 5;
+    // Delivery settings
+    std::vector<DestinationConfig> destinations;
+    bool delete_source_after_upload = false;
+    bool delete_local_after_upload = false;
+    int bandwidth_limit_mbps = 0;
+    
+    // Metadata settings
+    std::string template_file;
     
     bool loadFromFile(const std::string& filename) {
         std::ifstream file(filename);
@@ -88,6 +118,15 @@ public:
         delete_source = parseBool(content, "delete_source_after_conversion");
         create_subdirs = parseBool(content, "create_subdirectories", true);
         log_file = parseString(content, "log_file");
+        log_format = parseString(content, "log_format", "text");
+        log_verbosity = parseString(content, "log_verbosity", "info");
+        log_max_size_mb = parseInt(content, "log_max_size_mb", 0);
+        log_max_files = parseInt(content, "log_max_files", 5);
+        rejected_dir = parseString(content, "rejected_directory");
+        queue_order = parseString(content, "queue_order", "fifo");
+        concurrent_jobs = std::max(1, parseInt(content, "concurrent_jobs", 1));
+        trace_dir = parseString(content, "trace_directory");
+        metrics_file = parseString(content, "metrics_file");
         
         // Parse file extensions
         size_t ext_start = content.find("\"file_extensions\"");
@@ -107,6 +146,9 @@ public:
         
         // Parse HLS settings
         segment_duration = parseInt(content, "segment_duration", 10);
+        crop_detect = parseBool(content, "crop_detect", true);
+        trim_edges = parseBool(content, "trim_edges", true);
+        tone_map = parseBool(content, "tone_map", true);
         
         // Parse profiles
         parseProfiles(content);
@@ -118,17 +160,15 @@ public:
         threads = parseInt(content, "threads", 0);
         log_level = parseString(content, "log_level", "warning");
         
-        // Parse SFTP settings
-        sftp_enabled = parseBool(content, "enabled", false);
-        sftp_host = parseString(content, "host");
-        sftp_port = parseInt(content, "port", 22);
-        sftp_username = parseString(content, "username");
-        sftp_password = parseString(content, "password");
-        sftp_remote_path = parseString(content, "remote_path");
-        sftp_delete_source_after_upload = parseBool(content, "delete_source_after_upload", false);
-        sftp_delete_local_after_upload = parseBool(content, "delete_local_after_upload", false);
-        sftp_retry_attempts = parseInt(content, "retry_attempts", 3);
-        sftp_retry_delay = parseInt(content, "retry_delay_seconds", 5);
+        // Parse delivery settings
+        parseDestinations(content);
+        delete_source_after_upload = parseBool(content, "delete_source_after_upload", false);
+        delete_local_after_upload = parseBool(content, "delete_local_after_upload", false);
+        bandwidth_limit_mbps = parseInt(content, "bandwidth_limit_mbps", 0);
+        
+        // Parse metadata settings, the template defaults to the config directory
+        fs::path default_template = fs::path(filename).parent_path() / "vod-template.xml";
+        template_file = parseString(content, "template_file", default_template.string());
         
         return true;
     }
@@ -201,37 +241,134 @@ private:
             }
         }
     }
+    
+    void parseDestinations(const std::string& json) {
+        destinations.clear();
+        
+        size_t destinations_start = json.find("\"destinations\"");
+        if (destinations_start != std::string::npos) {
+            size_t array_start = json.find("[", destinations_start);
+            size_t array_end = json.find("]", array_start);
+            if (array_start == std::string::npos || array_end == std::string::npos) {
+                return;
+            }
+            
+            std::string destinations_json = json.substr(array_start, array_end - array_start + 1);
+            std::regex destination_regex(R"(\{[^}]+\})");
+            std::sregex_iterator it(destinations_json.begin(), destinations_json.end(), destination_regex);
+            std::sregex_iterator end;
+            
+            for (; it != end; ++it) {
+                std::string destination_str = it->str();
+                DestinationConfig d;
+                d.type = parseString(destination_str, "type");
+                d.name = parseString(destination_str, "name", d.type);
+                d.enabled = parseBool(destination_str, "enabled", true);
+                d.retry_attempts = parseInt(destination_str, "retry_attempts", 3);
+                d.retry_delay = parseInt(destination_str, "retry_delay_seconds", 5);
+                d.max_concurrent = parseInt(destination_str, "max_concurrent", 1);
+                
+                d.path = parseString(destination_str, "path");
+                d.mode = parseString(destination_str, "mode", "copy");
+                
+                d.host = parseString(destination_str, "host");
+                d.port = parseInt(destination_str, "port", 22);
+                d.username = parseString(destination_str, "username");
+                d.password = parseString(destination_str, "password");
+                d.remote_path = parseString(destination_str, "remote_path");
+                
+                d.endpoint = parseString(destination_str, "endpoint");
+                d.bucket = parseString(destination_str, "bucket");
+                d.region = parseString(destination_str, "region", "us-east-1");
+                d.access_key = parseString(destination_str, "access_key");
+                d.secret_key = parseString(destination_str, "secret_key");
+                d.prefix = parseString(destination_str, "prefix");
+                d.part_size_mb = parseInt(destination_str, "part_size_mb", 16);
+                d.parallel_uploads = parseInt(destination_str, "parallel_uploads", 4);
+                
+                if (!d.type.empty() && d.enabled) {
+                    destinations.push_back(d);
+                }
+            }
+            return;
+        }
+        
+        // Older configs have a single "sftp" block
+        size_t sftp_start = json.find("\"sftp\"");
+        if (sftp_start == std::string::npos) {
+            return;
+        }
+        size_t block_start = json.find("{", sftp_start);
+        size_t block_end = json.find("}", block_start);
+        if (block_start == std::string::npos || block_end == std::string::npos) {
+            return;
+        }
+        std::string sftp = json.substr(block_start, block_end - block_start + 1);
+        if (!parseBool(sftp, "enabled", false)) {
+            return;
+        }
+        
+        DestinationConfig d;
+        d.name = "sftp";
+        d.type = "sftp";
+        d.host = parseString(sftp, "host");
+        d.port = parseInt(sftp, "port", 22);
+        d.username = parseString(sftp, "username");
+        d.password = parseString(sftp, "password");
+        d.remote_path = parseString(sftp, "remote_path");
+        d.retry_attempts = parseInt(sftp, "retry_attempts", 3);
+        d.retry_delay = parseInt(sftp, "retry_delay_seconds", 5);
+        destinations.push_back(d);
+    }
 };
 
 class HLSWatcherSFTP {
 private:
+    // A source file that passed probing and waits for conversion
+    struct ConversionJob {
+        fs::path source;
+        std::string filename;
+        std::string basename;
+        MediaInfo info;
+        EdgeTrim trim;          // found when the job is taken
+        HdrInfo hdr;            // light levels of HDR sources, for the tone curve
+        uint64_t sequence;      // detection order
+        std::shared_ptr<TraceSession> trace;    // null unless trace_directory is set
+        int64_t queued_at = 0;  // trace time the job was queued
+        std::shared_ptr<JobCost> cost = std::make_shared<JobCost>();   // CPU, memory and I/O by stage
+        std::chrono::steady_clock::time_point detected;
+        uint64_t source_bytes = 0;
+    };
+    
+    // What a probe task found out about a new file
+    struct ProbeResult {
+        ConversionJob job;
+        bool valid = false;
+        bool crop_detected = true;
+        std::string error;
+    };
+    
     Config config;
+    EventLoop loop;
+    Executor& executor = Executor::shared();
     std::set<std::string> processed_files;
-    std::ofstream log_stream;
+    std::vector<ConversionJob> queue;
+    std::set<std::string> queued_files;
+    std::set<std::string> admitting;        // waiting out the stability check or the probe
+    int active_jobs = 0;
+    std::map<std::string, fs::file_time_type> rejected_files;  // skipped until modified
+    uint64_t job_sequence = 0;
+    XmlTemplate vod_template;
+    std::map<std::string, std::string> pending_uploads;    // title -> source file
+    std::mutex pending_mutex;
+    UploadScheduler uploads;
+    CostMetrics metrics;
+    WatcherObserver observer;
+    bool console_log = true;
     
-    void log(const std::string& message) {
-        auto now = std::chrono::system_clock::now();
-        auto time_t = std::chrono::system_clock::to_time_t(now);
-        
-        std::stringstream ss;
-        ss << "[" << std::put_time(std::localtime(&time_t), "%Y-%m-%d %H:%M:%S") << "] " << message;
-        
-        std::cout << ss.str() << std::endl;
-        
-        if (log_stream.is_open()) {
-            log_stream << ss.str() << std::endl;
-            log_stream.flush();
-        }
-    }
-    
-    bool isFileStable(const fs::path& path) {
-        try {
-            auto size1 = fs::file_size(path);
-            std::this_thread::sleep_for(std::chrono::seconds(2));
-            auto size2 = fs::file_size(path);
-            return size1 == size2;
-        } catch (...) {
-            return false;
+    void notify(const std::string& filename, WatcherEvent event) {
+        if (observer) {
+            observer(filename, event);
         }
     }
     
@@ -248,9 +385,9 @@ private:
     }
     
     std::string generateUniqueID(const std::string& prefix, int length = 16) {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<> dis(0, 9);
+        // The metadata is rendered on executor threads
+        static thread_local std::mt19937 gen(std::random_device{}());
+        std::uniform_int_distribution<> dis(0, 9);
         
         std::stringstream id;
         id << prefix;
@@ -260,356 +397,792 @@ private:
         return id.str();
     }
     
-    bool generatePosters(const fs::path& input_file, const fs::path& output_dir, const std::string& basename) {
-        log("Generating posters from video: " + input_file.string());
-        
-        // Generate poster at 10% and 30% of video duration
-        std::string poster1 = (output_dir / (basename + "-poster1.jpg")).string();
-        std::string poster2 = (output_dir / (basename + "-poster2.jpg")).string();
-        
-        // Get video duration
-        std::stringstream duration_cmd;
-        duration_cmd << "ffprobe -v error -show_entries format=duration -of default=noprint_wrappers=1:nokey=1 \"" 
-                     << input_file.string() << "\" 2>/dev/null";
-        
-        FILE* pipe = popen(duration_cmd.str().c_str(), "r");
-        if (!pipe) {
-            log("ERROR: Failed to get video duration");
-            return false;
+    // Encodes a poster and hashes it. The checksum's path is empty when
+    // the poster could not be made.
+    Task<FileChecksum> makePoster(std::string command, std::string poster, std::string name, CancellationToken cancel,
+                                  std::shared_ptr<TraceSession> trace, std::shared_ptr<JobCost> cost) {
+        if (cancel.cancelled()) {
+            co_return FileChecksum();
         }
-        
-        char buffer[128];
-        std::string duration_str;
-        while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-            duration_str += buffer;
+        TRACE_ASYNC_SCOPE(trace.get(), "poster", "poster", name);
+        ResourceUsage usage;
+        int result = co_await loop.runProcess(command, &usage);
+        cost->add("posters", usage);
+        if (result != 0) {
+            LOG_ERROR("Failed to generate " + name);
+            co_return FileChecksum();
         }
-        pclose(pipe);
+        co_return co_await loop.runOn(executor, [poster, cost] {
+            ThreadMeter meter;
+            FileChecksum checksum;
+            hashFile(poster, checksum);
+            cost->add("posters", meter.stop());
+            return checksum;
+        }, TaskPriority::Low);
+    }
+    
+    // Starts posters at 10% and 30% of the programme, so they are encoded
+    // alongside the HLS rungs
+    std::vector<AsyncResult<FileChecksum>> startPosters(const ConversionJob& job, const fs::path& output_dir,
+                                                        const CancellationToken& cancel) {
+        LOG_INFO("Generating posters from video: " + job.source.string());
         
-        float duration = 10.0f; // default
-        try {
-            duration = std::stof(duration_str);
-        } catch (...) {
-            log("WARNING: Could not parse video duration, using default positions");
+        // Duration and geometry come from the probe at enqueue time;
+        // positions are within the programme, after trimming
+        double duration = job.info.duration;
+        if (job.trim.end > 0) {
+            duration = job.trim.end;
         }
-        
-        // Generate poster 1 at 10% of video
-        float pos1 = duration * 0.1f;
-        std::stringstream cmd1;
-        cmd1 << "ffmpeg -ss " << pos1 << " -i \"" << input_file.string() << "\" ";
-        cmd1 << "-vf \"scale=1280:720:force_original_aspect_ratio=decrease,pad=1280:720:(ow-iw)/2:(oh-ih)/2\" ";
-        cmd1 << "-vframes 1 -q:v 2 -loglevel error \"" << poster1 << "\"";
-        
-        if (system(cmd1.str().c_str()) != 0) {
-            log("ERROR: Failed to generate poster1");
-            return false;
+        duration -= job.trim.start;
+        if (duration <= 0) {
+            LOG_WARNING("Video duration unknown, using default positions");
+            duration = 10.0;
         }
         
-        // Generate poster 2 at 30% of video
-        float pos2 = duration * 0.3f;
-        std::stringstream cmd2;
-        cmd2 << "ffmpeg -ss " << pos2 << " -i \"" << input_file.string() << "\" ";
-        cmd2 << "-vf \"scale=1280:720:force_original_aspect_ratio=decrease,pad=1280:720:(ow-iw)/2:(oh-ih)/2\" ";
-        cmd2 << "-vframes 1 -q:v 2 -loglevel error \"" << poster2 << "\"";
+        // Up to 1280x720 in the source's display aspect, without bars
+        RungGeometry size = planRung(job.info.geometry, {1280, 720, 0});
+        std::string scale = "-vf " + cropFilter(job.info.geometry) + toneMapFilter(job.hdr) + "scale=" + std::to_string(size.width) + ":" + std::to_string(size.height) + ",setsar=1 ";
         
-        if (system(cmd2.str().c_str()) != 0) {
-            log("ERROR: Failed to generate poster2");
-            return false;
+        std::vector<AsyncResult<FileChecksum>> posters;
+        const float positions[] = {0.1f, 0.3f};
+        for (int i = 0; i < 2; i++) {
+            std::string name = "poster" + std::to_string(i + 1);
+            std::string poster = (output_dir / (job.basename + "-" + name + ".jpg")).string();
+            
+            std::stringstream cmd;
+            cmd << "ffmpeg -ss " << job.trim.start + duration * positions[i] << " -i \"" << job.source.string() << "\" ";
+            cmd << scale;
+            cmd << "-vframes 1 -q:v 2 -loglevel error \"" << poster << "\"";
+            
+            posters.push_back(loop.start(makePoster(cmd.str(), poster, name, cancel, job.trace, job.cost)));
         }
-        
-        log("Posters generated successfully");
-        return true;
+        return posters;
     }
     
-    bool generateVODXML(const fs::path& output_dir, const std::string& basename, const std::string& title = "") {
-        log("Generating VOD XML metadata: " + basename);
-        
-        // Generate unique IDs
-        std::string prod_id = generateUniqueID("PROD", 19);
-        std::string asset_id = generateUniqueID("ASST", 19);
-        std::string poster_id = generateUniqueID("ASST", 19);
+    // Sums #EXTINF durations of a media playlist
+    double playlistDuration(const fs::path& playlist_path) {
+        std::ifstream playlist(playlist_path);
+        std::string line;
+        double duration = 0.0;
+        while (std::getline(playlist, line)) {
+            if (line.compare(0, 8, "#EXTINF:") == 0) {
+                duration += std::strtod(line.c_str() + 8, nullptr);
+            }
+        }
+        return duration;
+    }
+    
+    const FileChecksum* findChecksum(const std::vector<FileChecksum>& checksums, const fs::path& path) {
+        for (const auto& checksum : checksums) {
+            if (checksum.path == path.string()) {
+                return &checksum;
+            }
+        }
+        return nullptr;
+    }
+    
+    // Renders the ADI metadata and appends its own checksum to checksums
+    bool generateVODXML(const fs::path& output_dir, const std::string& basename, const MediaTracks& tracks,
+                        const std::vector<Config::Profile>& profiles, const EdgeTrim& trim,
+                        std::vector<FileChecksum>& checksums, const std::string& title = "") {
+        LOG_INFO("Generating VOD XML metadata: " + basename);
         
         // Get current date
         auto now = std::chrono::system_clock::now();
         auto time_t = std::chrono::system_clock::to_time_t(now);
+        struct tm local;
         std::stringstream date_stream;
-        date_stream << std::put_time(std::localtime(&time_t), "%Y-%m-%d");
+        date_stream << std::put_time(localtime_r(&time_t, &local), "%Y-%m-%d");
         std::string current_date = date_stream.str();
         
         // Calculate end date (5 years from now)
         auto end_time = now + std::chrono::hours(24 * 365 * 5);
         auto end_time_t = std::chrono::system_clock::to_time_t(end_time);
         std::stringstream end_date_stream;
-        end_date_stream << std::put_time(std::localtime(&end_time_t), "%Y-%m-%dT23:59:59");
+        end_date_stream << std::put_time(localtime_r(&end_time_t, &local), "%Y-%m-%dT23:59:59");
         std::string end_date = end_date_stream.str();
         
-        // Use basename as title if not provided
-        std::string video_title = title.empty() ? basename : title;
+        // The best rung describes the title
+        const Config::Profile* top = nullptr;
+        for (const auto& profile : profiles) {
+            if (!top || profile.bandwidth > top->bandwidth) {
+                top = &profile;
+            }
+        }
+        
+        int run_time = 0;
+        std::string resolution;
+        int bit_rate = 0;
+        if (top) {
+            run_time = static_cast<int>(playlistDuration(output_dir / top->folder_name / "index.m3u8") + 0.5);
+            resolution = std::to_string(top->width) + "x" + std::to_string(top->height);
+            bit_rate = top->bandwidth / 1000;
+        }
+        char run_time_str[16];
+        snprintf(run_time_str, sizeof(run_time_str), "%02d:%02d:%02d",
+                 run_time / 3600, (run_time / 60) % 60, run_time % 60);
+        
+        std::string languages = audioLanguages(tracks);
+        std::string poster_name = basename + "-poster1.jpg";
+        const FileChecksum* content = findChecksum(checksums, output_dir / "playlist.m3u8");
+        const FileChecksum* poster = findChecksum(checksums, output_dir / poster_name);
+        
+        uint64_t content_size = 0;
+        for (const auto& checksum : checksums) {
+            content_size += checksum.size;
+        }
+        
+        std::map<std::string, std::string> values = {
+            {"package_id", generateUniqueID("PROD", 19)},
+            {"asset_id", generateUniqueID("ASST", 19)},
+            {"poster_id", generateUniqueID("ASST", 19)},
+            {"title", title.empty() ? basename : title},
+            {"basename", basename},
+            {"creation_date", current_date},
+            {"license_start", current_date},
+            {"license_end", end_date},
+            {"year", current_date.substr(0, 4)},
+            {"languages", languages.empty() ? "ka" : languages},
+            {"subtitle_languages", subtitleLanguages(tracks)},
+            {"bit_rate", std::to_string(bit_rate)},
+            {"run_time", run_time_str},
+            {"duration", std::to_string(run_time)},
+            {"resolution", resolution},
+            {"content_size", std::to_string(content_size)},
+            {"content", basename + "/playlist.m3u8"},
+            {"content_checksum", content ? content->md5 : ""},
+            {"poster", basename + "/" + poster_name},
+            {"poster_size", poster ? std::to_string(poster->size) : "0"},
+            {"poster_checksum", poster ? poster->md5 : ""},
+            {"trim_start", formatTimecode(trim.start)},
+            {"trim_end", trim.end > 0 ? formatTimecode(trim.end) : ""}
+        };
+        
+        std::string xml_buffer;
+        vod_template.render(values, xml_buffer);
         
         // Create XML file
         fs::path xml_path = output_dir / ("vod-" + basename + ".xml");
-        std::ofstream xml(xml_path);
+        std::ofstream xml(xml_path, std::ios::binary);
         
         if (!xml.is_open()) {
-            log("ERROR: Cannot create VOD XML file");
+            LOG_ERROR("Cannot create VOD XML file");
             return false;
         }
         
-        xml << "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
-        xml << "<ADI>\n";
-        xml << "  <Metadata>\n";
-        xml << "    <AMS Asset_Class=\"package\" Asset_ID=\"" << prod_id << "\" ";
-        xml << "Asset_Name=\"" << video_title << " HD\" ";
-        xml << "Creation_Date=\"" << current_date << "\" ";
-        xml << "Description=\"" << video_title << " HD Package\" ";
-        xml << "Provider=\"000600\" Verb=\"\" Version_Major=\"1\" Version_Minor=\"0\" />\n";
-        xml << "  </Metadata>\n";
-        xml << "  <Asset>\n";
-        xml << "    <Metadata>\n";
-        xml << "      <AMS Asset_Class=\"title\" Asset_ID=\"" << prod_id << "\" ";
-        xml << "Asset_Name=\"" << video_title << " HD Title\" ";
-        xml << "Creation_Date=\"" << current_date << "\" ";
-        xml << "Description=\"" << video_title << " HD Title\" ";
-        xml << "Provider=\"000600\" Verb=\"\" Version_Major=\"1\" Version_Minor=\"0\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Type\" Value=\"title\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Year\" Value=\"2024\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Category\" Value=\"Videoshop/ომი\" />\n";
-        xml << "      <App_Data App=\"MOD\" Language=\"en\" Name=\"Genre\" Value=\"General\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Licensing_Window_Start\" Value=\"" << current_date << "\"/>\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Licensing_Window_End\" Value=\"" << end_date << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Country_of_Origin\" Value=\"1\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Preview_Period\" Value=\"300\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Suggested_Price\" Value=\"0\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Is_Series\" Value=\"N\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Rating\" Value=\"General\" />\n";
-        xml << "      <App_Data App=\"MOD\" Language=\"en\" Name=\"Title\" Value=\"" << video_title << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Language=\"ka\" Name=\"Title\" Value=\"" << video_title << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Language=\"ru\" Name=\"Title\" Value=\"" << video_title << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Language=\"en\" Name=\"Summary_Medium\" Value=\"" << video_title << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Summary_Medium\" Language=\"ka\" Value=\"" << video_title << "\" />\n";
-        xml << "      <App_Data App=\"MOD\" Name=\"Summary_Medium\" Language=\"ru\" Value=\"" << video_title << "\" />\n";
-        xml << "    </Metadata>\n";
-        xml << "    <Asset>\n";
-        xml << "      <Metadata>\n";
-        xml << "        <AMS Asset_Class=\"movie\" Asset_ID=\"" << asset_id << "\" ";
-        xml << "Asset_Name=\"" << video_title << " HD Content\" ";
-        xml << "Creation_Date=\"" << current_date << "\" ";
-        xml << "Description=\"" << video_title << " HD Content\" ";
-        xml << "Provider=\"000600\" Verb=\"\" Version_Major=\"1\" Version_Minor=\"0\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Encryption\" Value=\"N\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Type\" Value=\"movie\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"HDContent\" Value=\"Y\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Languages\" Value=\"ka\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Subtitle_Languages\" Value=\"\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Bit_Rate\" Value=\"3500\" />\n";
-        xml << "        <App_Data Value=\"WEBTV\" Name=\"Domain\" App=\"MOD\"/>\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Encoder_Mode\" Value=\"3\"/>\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"MimeType\" Value=\"HLS\"/>\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"IsPreview\" Value=\"Y\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"PreviewDuration\" Value=\"300\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"PreviewStartTime\" Value=\"0\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Video_Codec_Type\" Value=\"2\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Audio_Codec_Type\" Value=\"AAC\" />\n";
-        xml << "      </Metadata>\n";
-        xml << "      <Content Value=\"" << basename << "/playlist.m3u8\" />\n";
-        xml << "    </Asset>\n";
-        xml << "    <Asset>\n";
-        xml << "      <Metadata>\n";
-        xml << "        <AMS Asset_Class=\"box cover\" Asset_ID=\"" << poster_id << "\" ";
-        xml << "Asset_Name=\"" << video_title << " HD Poster\" ";
-        xml << "Creation_Date=\"" << current_date << "\" ";
-        xml << "Description=\"" << video_title << " HD Poster\" ";
-        xml << "Provider=\"000600\" Verb=\"\" Version_Major=\"1\" Version_Minor=\"0\" />\n";
-        xml << "        <App_Data App=\"MOD\" Name=\"Type\" Value=\"poster\" />\n";
-        xml << "      </Metadata>\n";
-        xml << "      <Content Value=\"" << basename << "/" << basename << "-poster1.jpg\" />\n";
-        xml << "    </Asset>\n";
-        xml << "  </Asset>\n";
-        xml << "</ADI>\n";
-        
+        xml.write(xml_buffer.data(), xml_buffer.size());
         xml.close();
-        log("VOD XML generated: " + xml_path.string());
+        if (!xml) {
+            LOG_ERROR("Cannot write VOD XML file");
+            return false;
+        }
+        
+        FileChecksum xml_checksum;
+        hashBuffer(xml_buffer, xml_checksum);
+        xml_checksum.path = xml_path.string();
+        checksums.push_back(xml_checksum);
+        
+        LOG_INFO("VOD XML generated: " + xml_path.string());
         return true;
     }
     
-    bool convertToHLS(const fs::path& input_file, const fs::path& output_dir) {
-        log("Starting HLS conversion: " + input_file.string());
+    // The configured ladder fitted to one source: no upscaling, display
+    // aspect kept, bitrates follow the pixels actually encoded
+    std::vector<Config::Profile> planProfiles(const SourceGeometry& source) {
+        std::vector<RungBox> boxes;
+        for (const auto& profile : config.profiles) {
+            boxes.push_back({profile.width, profile.height, profile.video_bitrate});
+        }
+        
+        std::vector<Config::Profile> planned;
+        for (const RungGeometry& rung : planLadder(source, boxes)) {
+            Config::Profile profile = config.profiles[rung.index];
+            profile.bandwidth -= profile.video_bitrate - rung.video_bitrate;
+            profile.width = rung.width;
+            profile.height = rung.height;
+            profile.video_bitrate = rung.video_bitrate;
+            planned.push_back(profile);
+        }
+        
+        if (planned.size() < config.profiles.size()) {
+            LOG_INFO("Picture is " + std::to_string(source.visibleWidth()) + "x" + std::to_string(source.visibleHeight()) +
+                ", encoding " + std::to_string(planned.size()) + " of " +
+                std::to_string(config.profiles.size()) + " profiles");
+        }
+        return planned;
+    }
+    
+    Task<bool> convertToHLS(const ConversionJob& job, fs::path output_dir) {
+        const fs::path& input_file = job.source;
+        LOG_INFO("Starting HLS conversion: " + input_file.string());
         
         // Create output directory
         fs::create_directories(output_dir);
         
-        std::string basename = input_file.stem().string();
+        std::string basename = job.basename;
+        const MediaTracks& tracks = job.info.tracks;
+        LOG_INFO("Audio tracks: " + std::to_string(tracks.audio.size()) +
+            ", subtitle tracks: " + std::to_string(tracks.subtitles.size()));
+        std::vector<Config::Profile> profiles = planProfiles(job.info.geometry);
         
-        for (const auto& profile : config.profiles) {
+        // One ffmpeg run decodes the input once and feeds every video rung
+        // plus the shared audio and subtitle renditions
+        std::stringstream cmd;
+        cmd << "ffmpeg -loglevel " << config.log_level << " " << trimInputArgs(job.trim);
+        cmd << "-i \"" << input_file.string() << "\" ";
+        
+        int audio_bitrate = 0;
+        for (const auto& profile : profiles) {
             fs::path profile_dir = output_dir / profile.folder_name;
             fs::create_directories(profile_dir);
+            audio_bitrate = std::max(audio_bitrate, profile.audio_bitrate);
             
-            std::stringstream cmd;
-            cmd << "ffmpeg -i \"" << input_file.string() << "\" ";
+            cmd << "-map 0:v:0 ";
             cmd << "-c:v libx264 -preset " << config.preset << " ";
             cmd << "-profile:v " << config.h264_profile << " ";
             cmd << "-level:v " << config.h264_level << " ";
-            cmd << "-vf \"scale=" << profile.width << ":" << profile.height << ":force_original_aspect_ratio=decrease,pad=" 
-                << profile.width << ":" << profile.height << ":(ow-iw)/2:(oh-ih)/2\" ";
+            cmd << "-vf " << cropFilter(job.info.geometry) << toneMapFilter(job.hdr) << "scale=" << profile.width << ":" << profile.height
+                << ",setsar=1 ";
             cmd << "-b:v " << profile.video_bitrate << " ";
             cmd << "-maxrate " << static_cast<int>(profile.video_bitrate * 1.1) << " ";
             cmd << "-bufsize " << profile.video_bitrate * 2 << " ";
-            cmd << "-c:a aac -b:a " << profile.audio_bitrate << " -ac 2 ";
-            cmd << "-f hls -hls_time " << config.segment_duration << " ";
-            cmd << "-hls_playlist_type vod ";
-            cmd << "-hls_segment_filename \"" << profile_dir.string() << "/segment_%03d.ts\" ";
-            cmd << "-loglevel " << config.log_level << " ";
             if (config.threads > 0) {
                 cmd << "-threads " << config.threads << " ";
             }
-            cmd << "\"" << (profile_dir / "index.m3u8").string() << "\"";
-            
-            log("Converting profile: " + profile.name);
+            cmd << "-f hls -hls_time " << config.segment_duration << " ";
+            cmd << "-hls_list_size 0 ";
+            cmd << "-hls_segment_filename \"" << profile_dir.string() << "/segment_%03d.ts\" ";
+            cmd << "\"" << (profile_dir / "index.m3u8").string() << "\" ";
             
-            int result = system(cmd.str().c_str());
-            if (result != 0) {
-                log("ERROR: Failed to convert profile " + profile.name);
-                return false;
-            }
+            LOG_INFO("Adding profile: " + profile.name + " " + std::to_string(profile.width) + "x" +
+                std::to_string(profile.height) + " at " + std::to_string(profile.video_bitrate / 1000) + " kbps");
         }
         
-        // Create master playlist
-        fs::path playlist_path = output_dir / "playlist.m3u8";
-        std::ofstream playlist(playlist_path);
+        for (const auto& track : tracks.audio) {
+            fs::create_directories(output_dir / track.folder_name);
+        }
+        for (const auto& track : tracks.subtitles) {
+            fs::create_directories(output_dir / track.folder_name);
+        }
+        cmd << hlsRenditionArgs(tracks, output_dir.string(), config.segment_duration, audio_bitrate);
         
-        if (!playlist.is_open()) {
-            log("ERROR: Cannot create master playlist");
-            return false;
+        // Segments are hashed as soon as a playlist lists them, while ffmpeg
+        // is still encoding and the data is still in the page cache. That
+        // needs the playlists written after every segment, so they are only
+        // marked VOD once ffmpeg is done.
+        SegmentHasher segment_hasher(output_dir.string(), &executor);
+        std::vector<std::string> media_playlists;
+        for (const auto& profile : profiles) {
+            media_playlists.push_back(profile.folder_name + "/index.m3u8");
+        }
+        for (const auto& track : tracks.audio) {
+            media_playlists.push_back(track.folder_name + "/index.m3u8");
+        }
+        for (const auto& playlist : media_playlists) {
+            segment_hasher.addPlaylist(playlist);
+        }
+        for (const auto& track : tracks.subtitles) {
+            segment_hasher.addPlaylist(track.folder_name + "/index.m3u8");
+        }
+        segment_hasher.start();
+        
+        CancellationToken cancel_posters;
+        std::vector<AsyncResult<FileChecksum>> posters = startPosters(job, output_dir, cancel_posters);
+        
+        TraceSession* trace = job.trace.get();
+        int result;
+        {
+            TRACE_ASYNC_SCOPE(trace, "ffmpeg encode", "encode", std::to_string(profiles.size()) + " rungs");
+            ResourceUsage usage;
+            result = co_await loop.runProcess(cmd.str(), &usage);
+            job.cost->add("encode", usage);
         }
+        if (result == 0) {
+            // Subtitles are cut against the first rung's segments once they
+            // are all written
+            std::string playlist_error;
+            bool finished = co_await loop.runOn(executor, [&] {
+                segment_hasher.stop();
+                for (const auto& playlist : media_playlists) {
+                    if (!markVodPlaylist((output_dir / playlist).string(), playlist_error)) {
+                        return false;
+                    }
+                }
+                if (tracks.subtitles.empty()) {
+                    return true;
+                }
+                TRACE_SCOPE(trace, "subtitle segments", "output");
+                return segmentSubtitles(tracks, output_dir.string(), media_playlists.front(), playlist_error);
+            });
+            if (!finished) {
+                LOG_ERROR("Cannot finish the playlists of " + basename + ": " + playlist_error);
+                result = 1;
+            }
+        }
+        std::vector<FileChecksum> checksums = co_await loop.runOn(executor, [&segment_hasher, trace, &job] {
+            TRACE_SCOPE(trace, "segment hashing", "output");
+            ThreadMeter meter;
+            std::vector<FileChecksum> files = segment_hasher.finish();
+            ResourceUsage usage = segment_hasher.usage();
+            usage.wall_seconds = meter.stop().wall_seconds;
+            job.cost->add("segment hashing", usage);
+            return files;
+        });
+        LOG_INFO("Hashed " + std::to_string(segment_hasher.hashedEarly()) + " segments of " + basename +
+                 " while ffmpeg ran, read " + std::to_string(segment_hasher.hashedLate()) + " back afterwards");
+        
+        // One ffmpeg encodes every rung, so its CPU time cannot be split by
+        // rung; what each rung and rendition wrote can
+        for (const auto& checksum : checksums) {
+            fs::path relative = fs::path(checksum.path).lexically_relative(output_dir);
+            if (std::distance(relative.begin(), relative.end()) > 1) {
+                job.cost->addRung(relative.begin()->string(), {checksum.size, 1});
+            }
+        }
+        if (result != 0) {
+            LOG_ERROR("HLS conversion failed for " + input_file.string());
+            cancel_posters.cancel();
+            for (auto& poster : posters) {
+                co_await poster;
+            }
+            recordCost(job, output_dir, false, 0);
+            co_return false;
+        }
+        
+        // Create master playlist, hashed from memory before it is written
+        fs::path playlist_path = output_dir / "playlist.m3u8";
+        std::ostringstream playlist;
         
         playlist << "#EXTM3U\n";
         playlist << "#EXT-X-VERSION:3\n\n";
         
-        for (const auto& profile : config.profiles) {
+        writeMediaGroups(playlist, tracks);
+        
+        for (const auto& profile : profiles) {
             playlist << "#EXT-X-STREAM-INF:BANDWIDTH=" << profile.bandwidth;
             playlist << ",RESOLUTION=" << profile.width << "x" << profile.height;
+            playlist << mediaGroupAttributes(tracks);
             playlist << "\n";
             playlist << profile.folder_name << "/index.m3u8\n\n";
         }
         
-        playlist.close();
+        std::string master = playlist.str();
+        std::ofstream playlist_file(playlist_path, std::ios::binary);
+        playlist_file.write(master.data(), master.size());
+        playlist_file.close();
+        if (!playlist_file) {
+            LOG_ERROR("Cannot create master playlist");
+            for (auto& poster : posters) {
+                co_await poster;
+            }
+            recordCost(job, output_dir, false, 0);
+            co_return false;
+        }
+        
+        FileChecksum master_checksum;
+        hashBuffer(master, master_checksum);
+        master_checksum.path = playlist_path.string();
+        checksums.push_back(master_checksum);
         
-        // Generate posters from the input video
-        if (!generatePosters(input_file, output_dir, basename)) {
-            log("WARNING: Failed to generate posters, continuing anyway");
+        // Posters were encoded and hashed while the rungs encoded
+        bool posters_made = true;
+        for (auto& poster : posters) {
+            FileChecksum poster_checksum = co_await poster;
+            if (poster_checksum.path.empty()) {
+                posters_made = false;
+            } else {
+                checksums.push_back(poster_checksum);
+            }
+        }
+        if (posters_made) {
+            LOG_INFO("Posters generated successfully");
+        } else {
+            LOG_WARNING("Failed to generate posters, continuing anyway");
         }
         
-        // Generate VOD XML metadata
-        if (!generateVODXML(output_dir, basename)) {
-            log("WARNING: Failed to generate VOD XML, continuing anyway");
+        // VOD XML metadata and the manifest are rendered and written on the executor
+        co_await loop.runOn(executor, [&] {
+            TRACE_SCOPE(trace, "vod xml", "output");
+            ThreadMeter meter;
+            if (!generateVODXML(output_dir, basename, tracks, profiles, job.trim, checksums)) {
+                LOG_WARNING("Failed to generate VOD XML, continuing anyway");
+            }
+            if (!writeManifest((output_dir / MANIFEST_FILE).string(), checksums)) {
+                LOG_WARNING("Failed to write checksum manifest");
+            }
+            job.cost->add("vod xml", meter.stop());
+        });
+        
+        // The cost report sits next to the VOD XML but is not in the
+        // manifest, so it stays here and is never delivered
+        uint64_t output_bytes = 0;
+        for (const auto& checksum : checksums) {
+            output_bytes += checksum.size;
         }
+        recordCost(job, output_dir, true, output_bytes);
         
-        log("HLS conversion completed: " + output_dir.string());
-        return true;
+        LOG_INFO("HLS conversion completed: " + output_dir.string());
+        co_return true;
     }
     
-    bool uploadToSFTP(const fs::path& local_dir, const std::string& remote_name) {
-        if (!config.sftp_enabled) {
-            return true;
+    Task<void> watchSources() {
+        while (g_running) {
+            try {
+                scanSourceDirectory();
+            } catch (const std::exception& e) {
+                LOG_ERROR(e.what());
+            }
+            co_await loop.sleep(std::chrono::seconds(config.watch_interval));
         }
-        
-        log("Starting SFTP upload: " + local_dir.string() + " -> " + config.sftp_remote_path + "/" + remote_name);
-        
-        // Check if sshpass is installed
-        if (system("which sshpass > /dev/null 2>&1") != 0) {
-            log("ERROR: sshpass is not installed. Please install it manually:");
-            log("  sudo apt-get install sshpass");
-            return false;
+    }
+    
+    // The signal handler only sets a flag. Once it is set, sleeping
+    // coroutines wake and running encoders are stopped.
+    Task<void> watchShutdown() {
+        while (g_running) {
+            co_await loop.sleep(std::chrono::milliseconds(250));
         }
-        
-        for (int attempt = 1; attempt <= config.sftp_retry_attempts; attempt++) {
-            // Create batch file for SFTP commands
-            std::string batch_file = "/tmp/sftp_batch_" + std::to_string(std::time(nullptr)) + ".txt";
-            std::ofstream batch(batch_file);
+        loop.shutdown();
+    }
+    
+    // Hands every new file to an admitFile coroutine of its own, so a slow
+    // probe never holds up the scan or the jobs that are running
+    void scanSourceDirectory() {
+        for (const auto& entry : fs::directory_iterator(config.source_dir)) {
+            if (!g_running) break;
             
-            // Navigate to remote path first
-            if (!config.sftp_remote_path.empty() && config.sftp_remote_path != "/") {
-                batch << "cd " << config.sftp_remote_path << "\n";
+            if (!fs::is_regular_file(entry) || !hasValidExtension(entry.path())) {
+                continue;
             }
             
-            // Create directory for media files first
-            batch << "-mkdir " << remote_name << "\n";  // Use -mkdir to ignore error if exists
-            
-            // Upload XML file to root of remote_path (stay in remote_path root)
-            fs::path xml_file = local_dir / ("vod-" + remote_name + ".xml");
-            if (fs::exists(xml_file)) {
-                batch << "put \"" << xml_file.string() << "\" \"vod-" << remote_name << ".xml\"\n";
+            std::string filename = entry.path().filename().string();
+            if (processed_files.count(filename) || queued_files.count(filename) || admitting.count(filename)) {
+                continue;
             }
             
-            // Now change to media directory for other files
-            batch << "cd " << remote_name << "\n";
-            
-            // Track directories we've already created
-            std::set<std::string> created_dirs;
+            std::error_code ec;
+            fs::file_time_type modified = fs::last_write_time(entry.path(), ec);
+            auto rejected = rejected_files.find(filename);
+            if (rejected != rejected_files.end() && rejected->second == modified) {
+                continue;
+            }
             
-            // Upload all files and directories except XML
-            for (const auto& entry : fs::recursive_directory_iterator(local_dir)) {
-                if (fs::is_regular_file(entry)) {
-                    std::string filename = entry.path().filename().string();
-                    // Skip the XML file as it's already uploaded to root
-                    if (filename.find("vod-") == 0 && filename.find(".xml") != std::string::npos) {
-                        continue;
-                    }
-                    
-                    fs::path rel_path = fs::relative(entry.path(), local_dir);
-                    fs::path remote_file_dir = rel_path.parent_path();
-                    
-                    // Only create directory if we haven't created it yet
-                    if (!remote_file_dir.empty() && remote_file_dir != ".") {
-                        std::string dir_str = remote_file_dir.string();
-                        if (created_dirs.find(dir_str) == created_dirs.end()) {
-                            batch << "-mkdir " << dir_str << "\n";
-                            created_dirs.insert(dir_str);
-                        }
-                    }
-                    
-                    batch << "put \"" << entry.path().string() << "\" \"" 
-                          << rel_path.string() << "\"\n";
+            LOG_INFO("New file detected: " + filename);
+            notify(filename, WATCH_DETECTED);
+            admitting.insert(filename);
+            loop.spawn(admitFile(entry.path(), modified, job_sequence++));
+        }
+    }
+    
+    // Waits until the file stopped growing, then probes it on the executor
+    // and queues it, or rejects it before any encoder starts. A file that is
+    // still being written is picked up again by a later scan.
+    Task<void> admitFile(fs::path path, fs::file_time_type modified, uint64_t sequence) {
+        std::string filename = path.filename().string();
+        
+        std::shared_ptr<TraceSession> trace;
+        if (!config.trace_dir.empty()) {
+            trace = std::make_shared<TraceSession>(filename);
+        }
+        
+        auto detected = std::chrono::steady_clock::now();
+        std::error_code ec;
+        uintmax_t size = fs::file_size(path, ec);
+        {
+            TRACE_ASYNC_SCOPE(trace.get(), "stability wait", "admission");
+            co_await loop.sleep(std::chrono::seconds(2));
+        }
+        std::error_code ec_after;
+        uintmax_t size_after = fs::file_size(path, ec_after);
+        if (ec || ec_after || size != size_after) {
+            LOG_DEBUG("File is still being written: " + filename);
+            admitting.erase(filename);
+            co_return;
+        }
+        
+        ProbeResult probe;
+        try {
+            probe = co_await loop.runOn(executor, [this, path, trace = trace.get()] {
+                ProbeResult probe;
+                probe.job.source = path;
+                probe.job.filename = path.filename().string();
+                probe.job.basename = path.stem().string();
+                {
+                    TRACE_SCOPE(trace, "probeMedia", "admission");
+                    ThreadMeter meter;
+                    probe.valid = probeMedia(path.string(), probe.job.info, probe.error);
+                    probe.job.cost->add("probe", meter.stop());
+                }
+                if (probe.valid && config.crop_detect) {
+                    TRACE_SCOPE(trace, "detectCrop", "admission");
+                    ThreadMeter meter;
+                    probe.crop_detected = detectCrop(path.string(), probe.job.info.geometry, probe.error);
+                    probe.job.cost->add("crop detect", meter.stop());
                 }
+                return probe;
+            }, TaskPriority::High, g_shutdown);
+        } catch (const TaskCancelled&) {
+            admitting.erase(filename);
+            co_return;
+        }
+        admitting.erase(filename);
+        
+        if (!probe.valid) {
+            rejectFile(path, modified, probe.error);
+            co_return;
+        }
+        
+        ConversionJob& job = probe.job;
+        if (!probe.crop_detected) {
+            LOG_WARNING("Crop detection failed for " + filename + " (" + probe.error + "), keeping the full frame");
+        }
+        
+        job.sequence = sequence;
+        job.detected = detected;
+        job.source_bytes = size;
+        job.trace = trace;
+        if (trace) {
+            job.queued_at = trace->now();
+        }
+        LOG_INFO("Queued " + filename + ": " + describeMedia(job.info) + ", crop " + describeCrop(job.info.geometry));
+        queued_files.insert(filename);
+        queue.push_back(job);
+        dispatchJobs();
+    }
+    
+    void rejectFile(const fs::path& path, fs::file_time_type modified, const std::string& reason) {
+        std::string filename = path.filename().string();
+        LOG_ERROR("Rejected " + filename + ": " + reason);
+        notify(filename, WATCH_REJECTED);
+        
+        if (!config.rejected_dir.empty()) {
+            std::error_code ec;
+            fs::create_directories(config.rejected_dir, ec);
+            fs::rename(path, fs::path(config.rejected_dir) / filename, ec);
+            if (!ec) {
+                LOG_INFO("Moved " + filename + " to " + config.rejected_dir);
+                return;
             }
-            
-            batch.close();
-            
-            // Build SFTP command (connect without path in URL)
-            std::stringstream cmd;
-            cmd << "sshpass -p '" << config.sftp_password << "' ";
-            cmd << "sftp -oBatchMode=no -oStrictHostKeyChecking=no ";
-            cmd << "-P " << config.sftp_port << " ";
-            cmd << config.sftp_username << "@" << config.sftp_host << " ";
-            cmd << "< " << batch_file << " 2>&1";
-            
-            log("SFTP upload attempt " + std::to_string(attempt) + "/" + 
-                std::to_string(config.sftp_retry_attempts));
-            
-            int result = system(cmd.str().c_str());
-            
-            // Clean up batch file
-            fs::remove(batch_file);
-            
-            if (result == 0) {
-                log("SFTP upload successful");
-                return true;
-            } else {
-                log("SFTP upload failed (attempt " + std::to_string(attempt) + ")");
-                if (attempt < config.sftp_retry_attempts) {
-                    std::this_thread::sleep_for(std::chrono::seconds(config.sftp_retry_delay));
+            LOG_WARNING("Cannot move " + filename + " to " + config.rejected_dir + ": " + ec.message());
+        }
+        
+        // Probed again only once the file changes
+        rejected_files[filename] = modified;
+    }
+    
+    // fifo converts in detection order; shortest_first takes the shortest
+    // title, so short clips are not stuck behind a feature film
+    ConversionJob takeNextJob() {
+        auto next = queue.begin();
+        if (config.queue_order == "shortest_first") {
+            next = std::min_element(queue.begin(), queue.end(), [](const ConversionJob& a, const ConversionJob& b) {
+                if (a.info.duration != b.info.duration) {
+                    return a.info.duration < b.info.duration;
                 }
+                return a.sequence < b.sequence;
+            });
+        }
+        
+        ConversionJob job = *next;
+        queue.erase(next);
+        queued_files.erase(job.filename);
+        return job;
+    }
+    
+    // Starts queued jobs while fewer than concurrent_jobs are converting
+    void dispatchJobs() {
+        while (g_running && active_jobs < config.concurrent_jobs && !queue.empty()) {
+            active_jobs++;
+            loop.spawn(runJob(takeNextJob()));
+        }
+    }
+    
+    Task<void> runJob(ConversionJob job) {
+        try {
+            co_await processJob(job);
+        } catch (const std::exception& e) {
+            LOG_ERROR(job.filename + ": " + e.what());
+            notify(job.filename, WATCH_FAILED);
+        }
+        active_jobs--;
+        dispatchJobs();
+    }
+    
+    Task<void> processJob(ConversionJob& job) {
+        TraceSession* trace = job.trace.get();
+        if (trace) {
+            trace->recordAsync("queued", "job", job.queued_at, trace->now(), "");
+        }
+        
+        if (!fs::exists(job.source)) {
+            LOG_INFO("Source file disappeared before conversion: " + job.filename);
+            co_return;
+        }
+        
+        // The edge scan decodes the first and last minutes, so it runs here
+        // rather than when the file is queued. The HDR peak is read from the
+        // first frame's side data. Both run side by side on the executor.
+        std::optional<AsyncResult<bool>> trim_scan;
+        std::string trim_error;
+        if (config.trim_edges) {
+            trim_scan = loop.runOn(executor, [&] {
+                TRACE_SCOPE(trace, "detectEdgeTrim", "job");
+                ThreadMeter meter;
+                bool found = detectEdgeTrim(job.source.string(), job.info.duration, job.trim, trim_error);
+                job.cost->add("edge trim", meter.stop());
+                return found;
+            });
+        }
+        std::optional<AsyncResult<bool>> hdr_probe;
+        std::string hdr_error;
+        if (config.tone_map && job.info.transfer != HDR_NONE) {
+            hdr_probe = loop.runOn(executor, [&] {
+                TRACE_SCOPE(trace, "probeHdr", "job");
+                ThreadMeter meter;
+                bool found = probeHdr(job.source.string(), job.hdr, hdr_error);
+                job.cost->add("hdr probe", meter.stop());
+                return found;
+            });
+        }
+        
+        if (trim_scan) {
+            if (co_await *trim_scan) {
+                LOG_INFO("Edge trim for " + job.filename + ": " + describeTrim(job.trim));
+            } else {
+                LOG_WARNING("Edge trim detection failed for " + job.filename + " (" + trim_error + "), keeping the full length");
+            }
+        }
+        if (hdr_probe) {
+            if (!co_await *hdr_probe) {
+                LOG_WARNING("HDR probe failed for " + job.filename + " (" + hdr_error + "), tone mapping for a 1000 nit peak");
+                job.hdr.transfer = job.info.transfer;
             }
+            LOG_INFO("Tone mapping " + job.filename + ": " + describeTransfer(job.hdr.transfer) + ", peak " +
+                std::to_string(static_cast<int>(job.hdr.peak_nits)) + " nits");
         }
         
-        log("ERROR: SFTP upload failed after all retry attempts");
-        return false;
+        fs::path output_dir = fs::path(config.dest_dir) / job.basename;
+        
+        if (!co_await convertToHLS(job, output_dir)) {
+            writeTrace(job.basename, job.trace);
+            notify(job.filename, WATCH_FAILED);
+            co_return;
+        }
+        notify(job.filename, WATCH_ENCODED);
+        
+        processed_files.insert(job.filename);
+        saveProcessedFiles();
+        
+        // Upload in the background while other files convert; the trace
+        // is written once every destination has the title
+        if (!uploads.empty()) {
+            queueUpload(job.basename, job.source, UPLOAD_NEW, job.trace);
+            co_return;
+        }
+        writeTrace(job.basename, job.trace);
+        
+        // Delete source file if configured (no delivery targets)
+        if (config.delete_source) {
+            fs::remove(job.source);
+            LOG_INFO("Deleted source file: " + job.filename);
+        }
+    }
+    
+    // Logs what the job cost, writes cost-<basename>.json next to the VOD
+    // XML when it succeeded and adds it to the metrics file
+    void recordCost(const ConversionJob& job, const fs::path& output_dir, bool succeeded, uint64_t output_bytes) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - job.detected).count();
+        double duration = (job.trim.end > 0 ? job.trim.end : job.info.duration) - job.trim.start;
+        LOG_INFO("Cost of " + job.basename + ": " + describeUsage(job.cost->total()));
+        
+        if (succeeded) {
+            fs::path report_path = output_dir / ("cost-" + job.basename + ".json");
+            std::ofstream report(report_path, std::ios::trunc);
+            report << job.cost->json(job.basename, elapsed, duration, job.source_bytes);
+            report.close();
+            if (!report) {
+                LOG_WARNING("Cannot write cost report " + report_path.string());
+            }
+        }
+        
+        metrics.addJob(*job.cost, succeeded, duration, output_bytes);
+        if (!config.metrics_file.empty()) {
+            std::string error;
+            if (!metrics.write(config.metrics_file, error)) {
+                LOG_WARNING("Cannot write metrics: " + error);
+            }
+        }
+    }
+    
+    void writeTrace(const std::string& basename, const std::shared_ptr<TraceSession>& trace) {
+        if (!trace) {
+            return;
+        }
+        std::error_code ec;
+        fs::create_directories(config.trace_dir, ec);
+        std::string path = (fs::path(config.trace_dir) / (basename + ".trace.json")).string();
+        std::string error;
+        if (trace->write(path, error)) {
+            LOG_INFO("Trace written: " + path);
+        } else {
+            LOG_WARNING("Cannot write trace for " + basename + ": " + error);
+        }
+    }
+    
+    // Hands the title to the upload scheduler. It stays in .pending_uploads
+    // until every destination verified it, so an interrupted or failed upload
+    // is picked up again as backfill at the next start.
+    void queueUpload(const std::string& basename, const fs::path& source, UploadPriority priority,
+                     std::shared_ptr<TraceSession> trace = nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending_uploads[basename] = source.string();
+            savePendingUploads();
+        }
+        
+        fs::path output_dir = fs::path(config.dest_dir) / basename;
+        uploads.submit(output_dir, basename, priority, [this, basename, source, output_dir, trace](bool delivered) {
+            writeTrace(basename, trace);
+            notify(source.filename().string(), delivered ? WATCH_UPLOADED : WATCH_FAILED);
+            if (!delivered) {
+                LOG_INFO("Upload of " + basename + " incomplete, will retry at next start");
+                return;
+            }
+            
+            std::error_code ec;
+            // Delete source file if configured and upload successful
+            if (config.delete_source_after_upload && !source.empty() && fs::remove(source, ec)) {
+                LOG_INFO("Deleted source file: " + source.filename().string());
+            }
+            
+            // Delete local HLS files if configured and upload successful
+            if (config.delete_local_after_upload && fs::remove_all(output_dir, ec) > 0) {
+                LOG_INFO("Deleted local HLS directory: " + output_dir.string());
+            }
+            
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending_uploads.erase(basename);
+            savePendingUploads();
+        }, trace);
     }
     
 public:
-    bool initialize(const std::string& config_file) {
+    bool initialize(const std::string& config_file, const WatcherOverrides* overrides = nullptr) {
         if (!config.loadFromFile(config_file)) {
             return false;
         }
+        if (overrides) {
+            config.source_dir = overrides->source_dir;
+            config.dest_dir = overrides->dest_dir;
+            config.log_file = overrides->log_file;
+            config.rejected_dir = overrides->rejected_dir;
+            config.trace_dir = overrides->trace_dir;
+            config.metrics_file = overrides->metrics_file;
+            config.file_extensions = overrides->file_extensions;
+            config.destinations = overrides->destinations;
+            console_log = overrides->console_log;
+            observer = overrides->observer;
+        }
         
         // Validate directories
         if (!fs::exists(config.source_dir)) {
@@ -620,13 +1193,43 @@ public:
         // Create destination directory if it doesn't exist
         fs::create_directories(config.dest_dir);
         
-        // Open log file if specified
-        if (!config.log_file.empty()) {
-            log_stream.open(config.log_file, std::ios::app);
-            if (!log_stream.is_open()) {
-                std::cerr << "Warning: Cannot open log file: " << config.log_file << "\n";
+        if (config.queue_order != "fifo" && config.queue_order != "shortest_first") {
+            std::cerr << "Warning: Unknown queue_order '" << config.queue_order << "', using fifo\n";
+            config.queue_order = "fifo";
+        }
+        
+        // Start the log writer, with the log file if specified
+        LogOptions log_options;
+        log_options.file = config.log_file;
+        log_options.max_size = static_cast<uint64_t>(std::max(0, config.log_max_size_mb)) * 1048576;
+        log_options.max_files = config.log_max_files;
+        log_options.console = console_log;
+        if (!parseLogFormat(config.log_format, log_options.format)) {
+            std::cerr << "Warning: Unknown log_format '" << config.log_format << "', using text\n";
+        }
+        if (!parseLogLevel(config.log_verbosity, log_options.level)) {
+            std::cerr << "Warning: Unknown log_verbosity '" << config.log_verbosity << "', using info\n";
+        }
+        if (!Logger::instance().start(log_options)) {
+            std::cerr << "Warning: Cannot open log file: " << config.log_file << "\n";
+        }
+        
+        // Compile the metadata template once, falling back to the built-in one
+        if (!vod_template.load(config.template_file)) {
+            std::cerr << "Warning: Cannot load metadata template: " << config.template_file
+                      << ", using built-in template\n";
+            vod_template.compile(DEFAULT_VOD_TEMPLATE);
+        }
+        
+        // Set up delivery targets
+        for (const auto& destination : config.destinations) {
+            std::string error;
+            if (!uploads.addDestination(destination, error)) {
+                std::cerr << "Error: Destination " << destination.name << ": " << error << "\n";
+                return false;
             }
         }
+        uploads.setBandwidthLimit(static_cast<uint64_t>(config.bandwidth_limit_mbps) * 1000000 / 8);
         
         // Load previously processed files
         std::string processed_file = config.dest_dir + "/.processed_files";
@@ -638,86 +1241,71 @@ public:
             }
         }
         
+        // Load titles whose upload did not finish
+        std::ifstream pu(config.dest_dir + "/.pending_uploads");
+        std::string line;
+        while (std::getline(pu, line)) {
+            size_t tab = line.find('\t');
+            pending_uploads[line.substr(0, tab)] = tab == std::string::npos ? "" : line.substr(tab + 1);
+        }
+        
         return true;
     }
     
     void run() {
-        log("HLS Watcher with SFTP started");
-        log("Source: " + config.source_dir);
-        log("Destination: " + config.dest_dir);
-        log("SFTP Enabled: " + std::string(config.sftp_enabled ? "YES" : "NO"));
-        if (config.sftp_enabled) {
-            log("SFTP: " + config.sftp_username + "@" + config.sftp_host + ":" + 
-                std::to_string(config.sftp_port) + config.sftp_remote_path);
-        } else {
-            log("SFTP is disabled in configuration");
+        LOG_INFO("HLS Watcher started");
+        LOG_INFO("Source: " + config.source_dir);
+        LOG_INFO("Destination: " + config.dest_dir);
+        if (uploads.empty()) {
+            LOG_INFO("No delivery targets configured");
+        }
+        for (const auto& destination : uploads.describeDestinations()) {
+            LOG_INFO("Delivery target: " + destination);
         }
-        log("Watching for: " + std::accumulate(config.file_extensions.begin(), 
+        if (config.bandwidth_limit_mbps > 0) {
+            LOG_INFO("Upload bandwidth limit: " + std::to_string(config.bandwidth_limit_mbps) + " Mbit/s");
+        }
+        LOG_INFO("Queue order: " + config.queue_order + ", " + std::to_string(config.concurrent_jobs) + " concurrent jobs");
+        LOG_INFO("Watching for: " + std::accumulate(config.file_extensions.begin(), 
             config.file_extensions.end(), std::string(),
             [](const std::string& a, const std::string& b) {
                 return a.empty() ? b : a + ", " + b;
             }));
         
-        while (g_running) {
-            try {
-                for (const auto& entry : fs::directory_iterator(config.source_dir)) {
-                    if (!g_running) break;
-                    
-                    if (fs::is_regular_file(entry) && hasValidExtension(entry.path())) {
-                        std::string filename = entry.path().filename().string();
-                        
-                        if (processed_files.find(filename) == processed_files.end()) {
-                            log("New file detected: " + filename);
-                            
-                            if (!isFileStable(entry.path())) {
-                                log("File is still being written: " + filename);
-                                continue;
-                            }
-                            
-                            std::string basename = entry.path().stem().string();
-                            fs::path output_dir = fs::path(config.dest_dir) / basename;
-                            
-                            if (convertToHLS(entry.path(), output_dir)) {
-                                processed_files.insert(filename);
-                                saveProcessedFiles();
-                                
-                                // SFTP upload if enabled
-                                bool upload_success = true;
-                                if (config.sftp_enabled) {
-                                    upload_success = uploadToSFTP(output_dir, basename);
-                                }
-                                
-                                // Delete source file if configured and upload successful
-                                if (upload_success && config.sftp_delete_source_after_upload && config.sftp_enabled) {
-                                    fs::remove(entry.path());
-                                    log("Deleted source file: " + filename);
-                                }
-                                
-                                // Delete local HLS files if configured and upload successful
-                                if (upload_success && config.sftp_delete_local_after_upload && config.sftp_enabled) {
-                                    fs::remove_all(output_dir);
-                                    log("Deleted local HLS directory: " + output_dir.string());
-                                }
-                                
-                                // Delete source file if configured (non-SFTP mode)
-                                if (config.delete_source && !config.sftp_enabled) {
-                                    fs::remove(entry.path());
-                                    log("Deleted source file: " + filename);
-                                }
-                            }
-                        }
-                    }
+        // Leftovers from earlier runs go behind anything converted from now on
+        if (!uploads.empty()) {
+            uploads.start();
+            std::map<std::string, std::string> backfill;
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                backfill = pending_uploads;
+            }
+            for (const auto& title : backfill) {
+                if (fs::exists(fs::path(config.dest_dir) / title.first)) {
+                    queueUpload(title.first, title.second, UPLOAD_BACKFILL);
                 }
-            } catch (const std::exception& e) {
-                log("ERROR: " + std::string(e.what()));
             }
-            
-            if (g_running) {
-                std::this_thread::sleep_for(std::chrono::seconds(config.watch_interval));
+            if (!backfill.empty()) {
+                LOG_INFO("Queued " + std::to_string(backfill.size()) + " unfinished uploads for backfill");
             }
         }
         
-        log("HLS Watcher stopped");
+        // Returns once the scanner, the admissions and the jobs have all
+        // wound down after a signal
+        loop.spawn(watchSources());
+        loop.spawn(watchShutdown());
+        loop.run();
+        
+        // Uploads in flight are finished; queued ones complete as not delivered
+        // and stay in .pending_uploads
+        uploads.stop();
+        for (const auto& stats : uploads.stats()) {
+            LOG_INFO("Upload totals for " + stats.name + ": " + std::to_string(stats.titles) + " titles, " +
+                std::to_string(stats.failures) + " failed, " + std::to_string(stats.bytes / 1048576) + " MB");
+        }
+        
+        LOG_INFO("HLS Watcher stopped");
+        Logger::instance().stop();
     }
     
 private:
@@ -728,19 +1316,40 @@ private:
             pf << file << "\n";
         }
     }
+    
+    // Caller holds pending_mutex
+    void savePendingUploads() {
+        std::ofstream pu(config.dest_dir + "/.pending_uploads");
+        for (const auto& title : pending_uploads) {
+            pu << title.first << "\t" << title.second << "\n";
+        }
+    }
 };
 
-int run_watcher(const std::string& config_file) {
+static int runWatcher(const std::string& config_file, const WatcherOverrides* overrides) {
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
     
     HLSWatcherSFTP watcher;
     
-    if (!watcher.initialize(config_file)) {
+    if (!watcher.initialize(config_file, overrides)) {
         return 1;
     }
     
     watcher.run();
     return 0;
+}
+
+int run_watcher(const std::string& config_file) {
+    return runWatcher(config_file, nullptr);
+}
+
+int run_watcher(const std::string& config_file, const WatcherOverrides& overrides) {
+    return runWatcher(config_file, &overrides);
+}
+
+void stop_watcher() {
+    g_running = false;
+    g_shutdown.cancel();
 }
\ No newline at end of file
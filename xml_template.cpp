@@ -0,0 +1,126 @@
+#include "xml_template.h"
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+static std::string stripComments(const std::string& source) {
+    std::string result;
+    result.reserve(source.size());
+
+    size_t pos = 0;
+    while (pos < source.size()) {
+        size_t start = source.find("<!--", pos);
+        if (start == std::string::npos) {
+            result.append(source, pos, std::string::npos);
+            break;
+        }
+        result.append(source, pos, start - pos);
+        size_t end = source.find("-->", start + 4);
+        pos = end == std::string::npos ? source.size() : end + 3;
+    }
+
+    // Drop the lines that only held comments
+    std::string compact;
+    compact.reserve(result.size());
+    size_t line_start = 0;
+    while (line_start < result.size()) {
+        size_t line_end = result.find('\n', line_start);
+        if (line_end == std::string::npos) {
+            line_end = result.size();
+        }
+        bool blank = std::all_of(result.begin() + line_start, result.begin() + line_end,
+                                 [](char c) { return c == ' ' || c == '\t' || c == '\r'; });
+        if (!blank) {
+            compact.append(result, line_start, line_end - line_start);
+            compact += '\n';
+        }
+        line_start = line_end + 1;
+    }
+    return compact;
+}
+
+static void appendEscaped(std::string& out, const std::string& value) {
+    for (char c : value) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '"': out += "&quot;"; break;
+            case '\'': out += "&apos;"; break;
+            default: out += c; break;
+        }
+    }
+}
+
+bool XmlTemplate::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string source((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+    compile(source);
+    return !slices.empty();
+}
+
+void XmlTemplate::compile(const std::string& source) {
+    slices.clear();
+    names.clear();
+    literal_size = 0;
+
+    std::string text = stripComments(source);
+    size_t pos = 0;
+
+    while (pos < text.size()) {
+        size_t open = text.find("{{", pos);
+        size_t close = open == std::string::npos ? std::string::npos : text.find("}}", open + 2);
+        if (close == std::string::npos) {
+            slices.push_back({text.substr(pos), -1});
+            literal_size += text.size() - pos;
+            break;
+        }
+
+        if (open > pos) {
+            slices.push_back({text.substr(pos, open - pos), -1});
+            literal_size += open - pos;
+        }
+
+        std::string name = text.substr(open + 2, close - open - 2);
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+
+        auto it = std::find(names.begin(), names.end(), name);
+        int index = static_cast<int>(it - names.begin());
+        if (it == names.end()) {
+            names.push_back(name);
+        }
+        slices.push_back({"", index});
+
+        pos = close + 2;
+    }
+}
+
+void XmlTemplate::render(const std::map<std::string, std::string>& values, std::string& out) const {
+    // Resolve each distinct placeholder once, not once per occurrence
+    std::vector<const std::string*> resolved(names.size(), nullptr);
+    size_t value_size = 0;
+    for (size_t i = 0; i < names.size(); i++) {
+        auto it = values.find(names[i]);
+        if (it != values.end()) {
+            resolved[i] = &it->second;
+            value_size += it->second.size();
+        }
+    }
+
+    out.clear();
+    out.reserve(literal_size + value_size * 4);
+
+    for (const auto& slice : slices) {
+        if (slice.placeholder < 0) {
+            out += slice.literal;
+        } else if (resolved[slice.placeholder]) {
+            appendEscaped(out, *resolved[slice.placeholder]);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef XML_TEMPLATE_H
+#define XML_TEMPLATE_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+// Metadata template compiled once into literal and {{placeholder}} slices.
+// XML comments and blank lines are dropped at compile time; placeholder
+// values are XML-escaped at render time.
+class XmlTemplate {
+public:
+    bool load(const std::string& path);
+    void compile(const std::string& source);
+
+    // Renders into out, reusing its capacity between titles. Placeholders
+    // without a value render empty.
+    void render(const std::map<std::string, std::string>& values, std::string& out) const;
+
+    bool empty() const { return slices.empty(); }
+    const std::vector<std::string>& placeholders() const { return names; }
+
+private:
+    struct Slice {
+        std::string literal;
+        int placeholder;    // index into names, -1 for a literal slice
+    };
+
+    std::vector<Slice> slices;
+    std::vector<std::string> names;
+    size_t literal_size = 0;
+};
+
+#endif // XML_TEMPLATE_H